@@ -0,0 +1,431 @@
+/*
+* 空闲长连接测试：建立大量连接，各发送一个请求后保持空闲，读取服务器进程的 RSS 计算每个连接占用的内存
+* 对 SSE 订阅路径可选地发布一个事件，测量扇出到全部订阅者所需的时间
+*
+* 用法：idleconn [-n 连接数] [-c 同时建立的连接数] [-P 服务器pid] [-b 每连接字节预算]
+*                [-e] [-w 保持秒数] [-s 场景名] http[s]://host:port/path
+*
+* 本机测试时源地址轮流使用 127.0.0.x，避免单个源地址的临时端口耗尽
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define CONNS_PER_SOURCE 10000 // 每个源地址使用的连接数（临时端口约28000个，上一轮的 TIME_WAIT 仍会占用一部分）
+#define STALL_TIMEOUT 30000    // 建立阶段连续无进展的超时(ms)
+
+enum conn_state
+{
+    C_CONNECTING,
+    C_HANDSHAKE,
+    C_HEADERS, // 已发送请求，等待响应头
+    C_IDLE,
+    C_CLOSED
+};
+
+struct conn
+{
+    int fd;
+    unsigned char state;
+    unsigned char got_event;
+    unsigned short hdr_match; // 已匹配的 "\r\n\r\n" 字节数
+    SSL *ssl;
+};
+
+static struct conn *conns;
+static int nconns = 10000, parallel = 1000, hold = 0, publish = 0, server_pid = 0;
+static long budget = 0;
+static const char *scenario = "idle";
+static char host[256], path[1024], token[64];
+static int port, use_tls;
+static struct sockaddr_in server_addr;
+static SSL_CTX *ssl_ctx;
+static int epfd;
+static int established, closed_count, errors, pending, events_received;
+static double last_progress;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* 读取进程的常驻内存(KB) */
+static long read_rss_kb(int pid)
+{
+    char file[64], line[256];
+    long kb = -1;
+    snprintf(file, sizeof(file), "/proc/%d/status", pid);
+    FILE *fp = fopen(file, "r");
+    if (fp == NULL)
+        return -1;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (!strncmp(line, "VmRSS:", 6))
+            kb = atol(line + 6);
+    }
+    fclose(fp);
+    return kb;
+}
+
+static int parse_url(const char *url)
+{
+    const char *p = url;
+    if (!strncmp(p, "http://", 7))
+        p += 7, port = 80;
+    else if (!strncmp(p, "https://", 8))
+        p += 8, port = 443, use_tls = 1;
+    else
+        return -1;
+    const char *slash = strchr(p, '/');
+    size_t hostport = slash ? (size_t)(slash - p) : strlen(p);
+    if (hostport >= sizeof(host))
+        return -1;
+    memcpy(host, p, hostport);
+    host[hostport] = '\0';
+    char *colon = strchr(host, ':');
+    if (colon)
+    {
+        *colon = '\0';
+        port = atoi(colon + 1);
+    }
+    snprintf(path, sizeof(path), "%s", slash ? slash : "/");
+    struct addrinfo hints = {0}, *res;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0)
+        return -1;
+    server_addr = *(struct sockaddr_in *)res->ai_addr;
+    server_addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+static void conn_close(struct conn *c, int error)
+{
+    if (c->state == C_CLOSED)
+        return;
+    if (c->state != C_IDLE)
+        pending--;
+    else
+        closed_count++;
+    errors += error;
+    if (c->ssl)
+        SSL_free(c->ssl);
+    c->ssl = NULL;
+    close(c->fd);
+    c->state = C_CLOSED;
+}
+
+static void conn_want(int i, uint32_t events)
+{
+    struct epoll_event ev = {events, {.u32 = i}};
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conns[i].fd, &ev);
+}
+
+static void conn_open(int i)
+{
+    struct conn *c = &conns[i];
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    c->state = C_CONNECTING;
+    pending++;
+    if (c->fd < 0)
+    {
+        c->state = C_CLOSED;
+        pending--;
+        errors++;
+        return;
+    }
+    if ((ntohl(server_addr.sin_addr.s_addr) >> 24) == 127) // 回环地址：分散源地址
+    {
+        struct sockaddr_in src = {0};
+        src.sin_family = AF_INET;
+        src.sin_addr.s_addr = htonl(0x7f000001 + i / CONNS_PER_SOURCE);
+        int one = 1;
+        setsockopt(c->fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one)); // 端口推迟到 connect 时按四元组分配
+        bind(c->fd, (struct sockaddr *)&src, sizeof(src));
+    }
+    struct epoll_event ev = {EPOLLOUT | EPOLLIN, {.u32 = i}};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS)
+        conn_close(c, 1);
+}
+
+static void conn_send_request(int i)
+{
+    struct conn *c = &conns[i];
+    char req[1400];
+    int n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s:%d\r\n\r\n", path, host, port);
+    if ((c->ssl ? SSL_write(c->ssl, req, n) : write(c->fd, req, n)) != n) // 请求很短，一次写入
+    {
+        conn_close(c, 1);
+        return;
+    }
+    c->state = C_HEADERS;
+    conn_want(i, EPOLLIN);
+}
+
+static void conn_handshake(int i)
+{
+    struct conn *c = &conns[i];
+    int r = SSL_do_handshake(c->ssl);
+    if (r == 1)
+    {
+        conn_send_request(i);
+        return;
+    }
+    switch (SSL_get_error(c->ssl, r))
+    {
+    case SSL_ERROR_WANT_READ:
+        conn_want(i, EPOLLIN);
+        break;
+    case SSL_ERROR_WANT_WRITE:
+        conn_want(i, EPOLLOUT);
+        break;
+    default:
+        ERR_clear_error();
+        conn_close(c, 1);
+    }
+}
+
+/* 读取可用数据：返回字节数，0 表示连接关闭，-1 表示暂无数据 */
+static ssize_t conn_read(struct conn *c, char *buf, size_t len)
+{
+    if (c->ssl == NULL)
+    {
+        ssize_t n = read(c->fd, buf, len);
+        return n < 0 && (errno == EAGAIN || errno == EINTR) ? -1 : n < 0 ? 0 : n;
+    }
+    int n = SSL_read(c->ssl, buf, len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(c->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        return -1;
+    ERR_clear_error();
+    return 0;
+}
+
+static void conn_event(int i, uint32_t events)
+{
+    static char buf[65536];
+    struct conn *c = &conns[i];
+    if (c->state == C_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err)
+        {
+            conn_close(c, 1);
+            return;
+        }
+        if (!use_tls)
+        {
+            conn_send_request(i);
+            return;
+        }
+        c->ssl = SSL_new(ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_connect_state(c->ssl);
+        c->state = C_HANDSHAKE;
+    }
+    if (c->state == C_HANDSHAKE)
+    {
+        conn_handshake(i);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        return;
+    for (;;)
+    {
+        ssize_t n = conn_read(c, buf, sizeof(buf));
+        if (n < 0)
+            return;
+        if (n == 0)
+        {
+            conn_close(c, c->state != C_IDLE);
+            return;
+        }
+        ssize_t pos = 0;
+        if (c->state == C_HEADERS)
+        {
+            static const char end[] = "\r\n\r\n";
+            if (c->hdr_match == 0 && n >= 12 && memcmp(buf, "HTTP/1.1 200", 12))
+            {
+                conn_close(c, 1);
+                return;
+            }
+            while (pos < n && c->hdr_match < 4)
+            {
+                c->hdr_match = buf[pos] == end[c->hdr_match] ? c->hdr_match + 1 : buf[pos] == '\r';
+                pos++;
+            }
+            if (c->hdr_match == 4)
+            {
+                c->state = C_IDLE;
+                pending--;
+                established++;
+                last_progress = now_ms();
+            }
+        }
+        // 其余响应数据（正文、SSE 心跳）直接丢弃
+        if (c->state == C_IDLE && token[0] && !c->got_event && memmem(buf + pos, n - pos, token, strlen(token)))
+        {
+            c->got_event = 1;
+            events_received++;
+        }
+    }
+}
+
+static void poll_once(int timeout_ms)
+{
+    struct epoll_event events[1024];
+    int n = epoll_wait(epfd, events, 1024, timeout_ms);
+    for (int i = 0; i < n; i++)
+        conn_event(events[i].data.u32, events[i].events);
+}
+
+/* 以普通 HTTP 请求向同一路径发布事件 */
+static int publish_event(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        return -1;
+    char req[2048];
+    int n = snprintf(req, sizeof(req), "POST %s HTTP/1.1\r\nHost: %s:%d\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n%s",
+                     path, host, port, strlen(token), token);
+    int ok = write(fd, req, n) == n && read(fd, req, sizeof(req)) > 12 && !memcmp(req + 9, "204", 3);
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:P:b:ew:s:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            nconns = atoi(optarg);
+            break;
+        case 'c':
+            parallel = atoi(optarg);
+            break;
+        case 'P':
+            server_pid = atoi(optarg);
+            break;
+        case 'b':
+            budget = atol(optarg);
+            break;
+        case 'e':
+            publish = 1;
+            break;
+        case 'w':
+            hold = atoi(optarg);
+            break;
+        case 's':
+            scenario = optarg;
+            break;
+        default:
+            goto usage;
+        }
+    }
+    if (optind >= argc || parse_url(argv[optind]) < 0 || (publish && use_tls))
+    {
+    usage:
+        fprintf(stderr, "usage: %s [-n conns] [-c parallel] [-P server_pid] [-b bytes_per_conn_budget] [-e] [-w hold_s] [-s scenario] http[s]://host:port/path\n"
+                        "  -e publishes an event over plain http and waits for every subscriber to receive it\n",
+                argv[0]);
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        if ((rlim_t)nconns + 64 > rl.rlim_cur)
+            fprintf(stderr, "warning: RLIMIT_NOFILE %llu is below %d connections\n", (unsigned long long)rl.rlim_cur, nconns);
+    }
+    if (use_tls)
+    {
+        ssl_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ssl_ctx, SSL_VERIFY_NONE, NULL);
+        SSL_CTX_set_mode(ssl_ctx, SSL_MODE_RELEASE_BUFFERS); // 客户端同样持有大量空闲连接
+    }
+
+    conns = calloc(nconns, sizeof(struct conn));
+    epfd = epoll_create1(0);
+    long rss0 = server_pid ? read_rss_kb(server_pid) : -1;
+    double t0 = now_ms();
+    last_progress = t0;
+    int next = 0;
+    while (next < nconns || pending > 0)
+    {
+        while (next < nconns && pending < parallel)
+            conn_open(next++);
+        poll_once(100);
+        if (now_ms() - last_progress > STALL_TIMEOUT)
+        {
+            fprintf(stderr, "no progress for %d ms, %d connections pending\n", STALL_TIMEOUT, pending);
+            break;
+        }
+    }
+    double connect_ms = now_ms() - t0;
+    for (int i = 0; i < 10; i++) // 等待服务器处理完积压的事件
+        poll_once(100);
+    long rss1 = server_pid ? read_rss_kb(server_pid) : -1;
+    long per_conn = rss0 >= 0 && rss1 >= 0 && established > 0 ? (rss1 - rss0) * 1024 / established : -1;
+    printf("established %d/%d in %.0f ms, errors %d\n", established, nconns, connect_ms, errors);
+    if (per_conn >= 0)
+        printf("server rss %ld KB -> %ld KB, %ld bytes per connection\n", rss0, rss1, per_conn);
+
+    double fanout_ms = -1;
+    if (publish)
+    {
+        snprintf(token, sizeof(token), "idleconn-%d-%ld", (int)getpid(), (long)time(NULL));
+        double t1 = now_ms();
+        if (publish_event() < 0)
+        {
+            fprintf(stderr, "publish failed\n");
+            errors++;
+        }
+        while (events_received < established - closed_count && now_ms() - t1 < 30000)
+            poll_once(100);
+        fanout_ms = now_ms() - t1;
+        printf("event delivered to %d/%d subscribers in %.1f ms\n", events_received, established - closed_count, fanout_ms);
+    }
+
+    double t2 = now_ms();
+    while (now_ms() - t2 < hold * 1000.0) // 保持空闲，期间只读取心跳
+        poll_once(1000);
+    int alive = established - closed_count;
+    if (hold)
+        printf("after %d s idle: %d connections alive\n", hold, alive);
+
+    printf("RESULT scenario=%s conns=%d established=%d alive=%d rss_kb=%ld bytes_per_conn=%ld fanout_ms=%.1f errors=%d\n",
+           scenario, nconns, established, alive, rss1, per_conn, fanout_ms, errors);
+    int failed = errors > 0 || established < nconns || alive < established || (publish && events_received < alive) ||
+                 (budget > 0 && per_conn > budget);
+    if (budget > 0 && per_conn > budget)
+        fprintf(stderr, "memory budget exceeded: %ld > %ld bytes per connection\n", per_conn, budget);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,730 @@
+/*
+* HTTP/HTTPS 压力测试工具
+* 多线程 + epoll，每个线程维护一组连接，支持持久连接、管线化(pipelining)与TLS，
+* 统计吞吐量及 p50/p90/p99/p999 延迟。
+*
+* 用法：loadgen [选项] URL
+*   -c 连接数      并发连接数（默认 16）
+*   -t 线程数      工作线程数（默认 2）
+*   -d 秒数        测试时长（默认 10）
+*   -P 深度        每个连接的管线化深度（默认 1）
+*   -K             关闭持久连接，每个请求新建连接（HTTPS 下即握手风暴）
+*   -F             使用 TCP Fast Open 建立连接（TCP_FASTOPEN_CONNECT，需 net.ipv4.tcp_fastopen 包含 1）
+*   -m 方法        请求方法（默认 GET，指定 -b 时为 POST）
+*   -b 文件        请求体文件
+*   -H 首部        附加请求首部，可重复，如 -H "Content-Type: application/json"
+*   -s 名称        场景名称，输出在结果行中
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define MAX_PIPELINE 64
+#define MAX_LINE 8192
+#define READ_BUF_SIZE 65536
+#define HIST_SIZE (128 + 40 * 64) // 对数-线性直方图，相对误差 < 1/64
+
+enum conn_state
+{
+    CONN_CONNECTING,
+    CONN_HANDSHAKE,
+    CONN_ACTIVE,
+};
+
+enum parse_state
+{
+    P_STATUS,     // 状态行
+    P_HEADER,     // 首部行
+    P_BODY,       // 定长数据（Content-Length 或当前块）
+    P_BODY_EOF,   // 无长度，读到连接关闭为止
+    P_CHUNK_SIZE, // 块大小行
+    P_CHUNK_CRLF, // 块尾的 CRLF
+    P_TRAILER,    // 末块之后的尾部首部
+};
+
+struct worker;
+
+struct conn
+{
+    int fd;
+    SSL *ssl;
+    enum conn_state state;
+    struct worker *w;
+    int want_write; // 是否已注册 EPOLLOUT
+
+    int to_write;     // 待写出的请求数
+    size_t write_off; // 当前请求已写出字节数
+    uint64_t sent_at[MAX_PIPELINE];
+    int sent_head, inflight; // 已发出未响应的请求（环形队列）
+
+    enum parse_state pstate;
+    char line[MAX_LINE];
+    size_t line_len;
+    long long remaining;
+    long long content_length;
+    int chunked, close_after, status;
+};
+
+struct worker
+{
+    pthread_t tid;
+    int epfd;
+    int nconns;
+    struct conn *conns;
+    uint64_t requests, bytes, connects;
+    uint64_t err_connect, err_io, err_status;
+    uint64_t hist[HIST_SIZE];
+    uint64_t max_us;
+};
+
+/* 全局参数 */
+static struct
+{
+    char host[256], port[16], path[2048];
+    int tls, connections, threads, duration, pipeline, keepalive, fastopen;
+    const char *method, *body_file, *scenario;
+    char *headers;
+    char *req;
+    size_t req_len;
+    struct addrinfo *addr;
+    SSL_CTX *ssl_ctx;
+    uint64_t deadline;
+} opt;
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* 延迟(us) -> 直方图下标 */
+static int hist_index(uint64_t us)
+{
+    if (us < 128)
+        return (int)us;
+    int e = 63 - __builtin_clzll(us);
+    int idx = 128 + (e - 7) * 64 + (int)((us >> (e - 6)) - 64);
+    return idx < HIST_SIZE ? idx : HIST_SIZE - 1;
+}
+
+/* 直方图下标 -> 该桶的下界(us) */
+static uint64_t hist_value(int idx)
+{
+    if (idx < 128)
+        return idx;
+    int e = (idx - 128) / 64 + 7;
+    return (uint64_t)((idx - 128) % 64 + 64) << (e - 6);
+}
+
+static uint64_t hist_percentile(const uint64_t *hist, uint64_t total, double pct)
+{
+    uint64_t target = (uint64_t)(total * pct / 100.0), seen = 0;
+    if (total == 0)
+        return 0;
+    for (int i = 0; i < HIST_SIZE; i++)
+    {
+        seen += hist[i];
+        if (seen > target)
+            return hist_value(i);
+    }
+    return hist_value(HIST_SIZE - 1);
+}
+
+static void conn_open(struct conn *c);
+
+static void conn_set_events(struct conn *c, int want_write)
+{
+    struct epoll_event ev = {.events = EPOLLIN | (want_write ? EPOLLOUT : 0), .data.ptr = c};
+    if (want_write != c->want_write)
+    {
+        epoll_ctl(c->w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->want_write = want_write;
+    }
+}
+
+/* 关闭连接，测试未结束时立即重连 */
+static void conn_close(struct conn *c, int reconnect)
+{
+    if (c->ssl)
+    {
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+    }
+    if (c->fd >= 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+    if (reconnect && now_us() < opt.deadline)
+        conn_open(c);
+}
+
+static void conn_enqueue(struct conn *c)
+{
+    c->sent_at[(c->sent_head + c->inflight) % MAX_PIPELINE] = now_us();
+    c->inflight++;
+    c->to_write++;
+}
+
+static ssize_t conn_read(struct conn *c, char *buf, size_t len)
+{
+    if (!c->ssl)
+        return read(c->fd, buf, len);
+    int n = SSL_read(c->ssl, buf, (int)len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(c->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (err == SSL_ERROR_ZERO_RETURN)
+        return 0;
+    errno = EIO;
+    return -1;
+}
+
+static ssize_t conn_write(struct conn *c, const char *buf, size_t len)
+{
+    if (!c->ssl)
+        return write(c->fd, buf, len);
+    int n = SSL_write(c->ssl, buf, (int)len);
+    if (n > 0)
+        return n;
+    int err = SSL_get_error(c->ssl, n);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    errno = EIO;
+    return -1;
+}
+
+/* 尽量写出排队的请求 */
+static int conn_flush(struct conn *c)
+{
+    while (c->to_write > 0)
+    {
+        ssize_t n = conn_write(c, opt.req + c->write_off, opt.req_len - c->write_off);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+                break;
+            return -1;
+        }
+        c->write_off += n;
+        if (c->write_off == opt.req_len)
+        {
+            c->write_off = 0;
+            c->to_write--;
+        }
+    }
+    conn_set_events(c, c->to_write > 0);
+    return 0;
+}
+
+/* 一个响应接收完毕 */
+static void conn_response_done(struct conn *c)
+{
+    struct worker *w = c->w;
+    uint64_t lat = now_us() - c->sent_at[c->sent_head];
+    c->sent_head = (c->sent_head + 1) % MAX_PIPELINE;
+    c->inflight--;
+    w->requests++;
+    w->hist[hist_index(lat)]++;
+    if (lat > w->max_us)
+        w->max_us = lat;
+    if (c->status < 200 || c->status >= 400)
+        w->err_status++;
+    c->pstate = P_STATUS;
+    c->line_len = 0;
+}
+
+/* 处理一行（不含行尾 CRLF），返回 -1 表示协议错误 */
+static int conn_line(struct conn *c, char *line)
+{
+    switch (c->pstate)
+    {
+    case P_STATUS:
+        if (strncmp(line, "HTTP/1.", 7) || strlen(line) < 12)
+            return -1;
+        c->status = atoi(line + 9);
+        c->content_length = -1;
+        c->chunked = 0;
+        c->close_after = !opt.keepalive || line[7] == '0';
+        c->pstate = P_HEADER;
+        break;
+    case P_HEADER:
+        if (*line == '\0') // 首部结束
+        {
+            if (c->status == 204 || c->status == 304 || c->status / 100 == 1)
+                conn_response_done(c);
+            else if (c->chunked)
+                c->pstate = P_CHUNK_SIZE;
+            else if (c->content_length == 0)
+                conn_response_done(c);
+            else if (c->content_length > 0)
+            {
+                c->remaining = c->content_length;
+                c->pstate = P_BODY;
+            }
+            else
+            {
+                c->close_after = 1;
+                c->pstate = P_BODY_EOF;
+            }
+        }
+        else if (!strncasecmp(line, "Content-Length:", 15))
+            c->content_length = atoll(line + 15);
+        else if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line + 18, "chunked"))
+            c->chunked = 1;
+        else if (!strncasecmp(line, "Connection:", 11) && strstr(line + 11, "close"))
+            c->close_after = 1;
+        break;
+    case P_CHUNK_SIZE:
+        c->remaining = strtoll(line, NULL, 16);
+        c->pstate = c->remaining ? P_BODY : P_TRAILER;
+        break;
+    case P_CHUNK_CRLF:
+        c->pstate = P_CHUNK_SIZE;
+        break;
+    case P_TRAILER:
+        if (*line == '\0')
+            conn_response_done(c);
+        break;
+    default:
+        break;
+    }
+    return 0;
+}
+
+/* 解析收到的数据，返回完成的响应数，-1 表示出错 */
+static int conn_parse(struct conn *c, const char *data, size_t n)
+{
+    int done = 0;
+    uint64_t before = c->w->requests;
+    while (n > 0)
+    {
+        if (c->pstate == P_BODY || c->pstate == P_BODY_EOF)
+        {
+            size_t take = n;
+            if (c->pstate == P_BODY && (long long)take > c->remaining)
+                take = (size_t)c->remaining;
+            data += take;
+            n -= take;
+            if (c->pstate == P_BODY && (c->remaining -= take) == 0)
+            {
+                if (c->chunked)
+                    c->pstate = P_CHUNK_CRLF;
+                else
+                    conn_response_done(c);
+            }
+            continue;
+        }
+        const char *nl = memchr(data, '\n', n);
+        size_t take = nl ? (size_t)(nl - data) + 1 : n;
+        if (c->line_len + take >= MAX_LINE)
+            return -1;
+        memcpy(c->line + c->line_len, data, take);
+        c->line_len += take;
+        data += take;
+        n -= take;
+        if (nl)
+        {
+            c->line_len--; // 去掉 \n
+            if (c->line_len && c->line[c->line_len - 1] == '\r')
+                c->line_len--;
+            c->line[c->line_len] = '\0';
+            c->line_len = 0;
+            if (conn_line(c, c->line) < 0)
+                return -1;
+        }
+    }
+    done = (int)(c->w->requests - before);
+    return done;
+}
+
+/* 连接就绪（TCP 或 TLS 握手完成）后发出首批请求 */
+static void conn_ready(struct conn *c)
+{
+    c->state = CONN_ACTIVE;
+    c->w->connects++;
+    for (int i = 0; i < opt.pipeline; i++)
+        conn_enqueue(c);
+    if (conn_flush(c) < 0)
+    {
+        c->w->err_io++;
+        conn_close(c, 1);
+    }
+}
+
+static void conn_handshake(struct conn *c)
+{
+    int n = SSL_do_handshake(c->ssl);
+    if (n == 1)
+    {
+        conn_ready(c);
+        return;
+    }
+    int err = SSL_get_error(c->ssl, n);
+    if (err == SSL_ERROR_WANT_READ)
+        conn_set_events(c, 0);
+    else if (err == SSL_ERROR_WANT_WRITE)
+        conn_set_events(c, 1);
+    else
+    {
+        c->w->err_connect++;
+        conn_close(c, 1);
+    }
+}
+
+static void conn_open(struct conn *c)
+{
+    c->fd = socket(opt.addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (opt.fastopen) // connect 立即返回，第一次写入的数据随 SYN 发出（已有服务器的 cookie 时）
+        setsockopt(c->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+    c->state = CONN_CONNECTING;
+    c->to_write = c->inflight = c->sent_head = 0;
+    c->write_off = c->line_len = 0;
+    c->pstate = P_STATUS;
+    c->want_write = 1;
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    epoll_ctl(c->w->epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    if (connect(c->fd, opt.addr->ai_addr, opt.addr->ai_addrlen) < 0 && errno != EINPROGRESS)
+    {
+        c->w->err_connect++;
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void conn_event(struct conn *c, uint32_t events)
+{
+    struct worker *w = c->w;
+    if (c->state == CONN_CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err || (events & (EPOLLERR | EPOLLHUP)))
+        {
+            w->err_connect++;
+            conn_close(c, 0);
+            usleep(1000); // 避免对拒绝连接的端口空转
+            conn_close(c, 1);
+            return;
+        }
+        if (!opt.tls)
+        {
+            conn_ready(c);
+            return;
+        }
+        c->ssl = SSL_new(opt.ssl_ctx);
+        SSL_set_fd(c->ssl, c->fd);
+        SSL_set_tlsext_host_name(c->ssl, opt.host);
+        SSL_set_connect_state(c->ssl);
+        c->state = CONN_HANDSHAKE;
+    }
+    if (c->state == CONN_HANDSHAKE)
+    {
+        conn_handshake(c);
+        return;
+    }
+
+    if (events & EPOLLIN)
+    {
+        char buf[READ_BUF_SIZE];
+        for (;;)
+        {
+            ssize_t n = conn_read(c, buf, sizeof(buf));
+            if (n > 0)
+            {
+                w->bytes += n;
+                int done = conn_parse(c, buf, n);
+                if (done < 0)
+                {
+                    w->err_io++;
+                    conn_close(c, 1);
+                    return;
+                }
+                if (done > 0 && c->close_after)
+                {
+                    conn_close(c, 1);
+                    return;
+                }
+                for (int i = 0; i < done; i++)
+                    if (now_us() < opt.deadline)
+                        conn_enqueue(c);
+                continue;
+            }
+            if (n < 0 && errno == EAGAIN)
+                break;
+            // 对端关闭：无长度的响应以此结束
+            if (n == 0 && c->pstate == P_BODY_EOF)
+                conn_response_done(c);
+            else if (c->inflight > 0)
+                w->err_io++;
+            conn_close(c, 1);
+            return;
+        }
+    }
+    if (conn_flush(c) < 0)
+    {
+        w->err_io++;
+        conn_close(c, 1);
+    }
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    struct epoll_event events[256];
+    w->epfd = epoll_create1(0);
+    for (int i = 0; i < w->nconns; i++)
+    {
+        w->conns[i].w = w;
+        w->conns[i].fd = -1;
+        conn_open(&w->conns[i]);
+    }
+    while (now_us() < opt.deadline)
+    {
+        int n = epoll_wait(w->epfd, events, 256, 100);
+        for (int i = 0; i < n; i++)
+            conn_event((struct conn *)events[i].data.ptr, events[i].events);
+    }
+    for (int i = 0; i < w->nconns; i++)
+        conn_close(&w->conns[i], 0);
+    close(w->epfd);
+    return NULL;
+}
+
+/* 解析 http[s]://host[:port]/path */
+static int parse_url(const char *url)
+{
+    const char *p;
+    if (!strncmp(url, "https://", 8))
+    {
+        opt.tls = 1;
+        p = url + 8;
+    }
+    else if (!strncmp(url, "http://", 7))
+        p = url + 7;
+    else
+        return -1;
+    const char *slash = strchr(p, '/');
+    size_t hostlen = slash ? (size_t)(slash - p) : strlen(p);
+    if (hostlen == 0 || hostlen >= sizeof(opt.host))
+        return -1;
+    memcpy(opt.host, p, hostlen);
+    opt.host[hostlen] = '\0';
+    snprintf(opt.path, sizeof(opt.path), "%s", slash ? slash : "/");
+    char *colon = strrchr(opt.host, ':');
+    if (colon)
+    {
+        *colon = '\0';
+        snprintf(opt.port, sizeof(opt.port), "%s", colon + 1);
+    }
+    else
+        snprintf(opt.port, sizeof(opt.port), "%s", opt.tls ? "443" : "80");
+    return 0;
+}
+
+/* 预先拼好请求报文，每次发送同一份 */
+static int build_request(void)
+{
+    char *body = NULL;
+    size_t body_len = 0;
+    if (opt.body_file)
+    {
+        FILE *fp = fopen(opt.body_file, "rb");
+        if (fp == NULL)
+        {
+            perror(opt.body_file);
+            return -1;
+        }
+        fseek(fp, 0, SEEK_END);
+        body_len = ftell(fp);
+        fseek(fp, 0, SEEK_SET);
+        body = malloc(body_len + 1);
+        if (fread(body, 1, body_len, fp) != body_len)
+        {
+            fclose(fp);
+            return -1;
+        }
+        fclose(fp);
+    }
+    size_t cap = 4096 + strlen(opt.path) + (opt.headers ? strlen(opt.headers) : 0) + body_len;
+    opt.req = malloc(cap);
+    int n = snprintf(opt.req, cap, "%s %s HTTP/1.1\r\nHost: %s:%s\r\nUser-Agent: loadgen\r\n%s%s",
+                     opt.method, opt.path, opt.host, opt.port, opt.headers ? opt.headers : "",
+                     opt.keepalive ? "" : "Connection: close\r\n");
+    if (body)
+        n += snprintf(opt.req + n, cap - n, "Content-Length: %zu\r\n", body_len);
+    n += snprintf(opt.req + n, cap - n, "\r\n");
+    if (body)
+    {
+        memcpy(opt.req + n, body, body_len);
+        n += body_len;
+        free(body);
+    }
+    opt.req_len = n;
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-c conns] [-t threads] [-d seconds] [-P depth] [-K] [-F] [-m method] "
+                    "[-b body_file] [-H header]... [-s scenario] URL\n",
+            prog);
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    opt.connections = 16;
+    opt.threads = 2;
+    opt.duration = 10;
+    opt.pipeline = 1;
+    opt.keepalive = 1;
+    opt.scenario = "default";
+    int c;
+    while ((c = getopt(argc, argv, "c:t:d:P:KFm:b:H:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            opt.connections = atoi(optarg);
+            break;
+        case 't':
+            opt.threads = atoi(optarg);
+            break;
+        case 'd':
+            opt.duration = atoi(optarg);
+            break;
+        case 'P':
+            opt.pipeline = atoi(optarg);
+            break;
+        case 'K':
+            opt.keepalive = 0;
+            break;
+        case 'F':
+            opt.fastopen = 1;
+            break;
+        case 'm':
+            opt.method = optarg;
+            break;
+        case 'b':
+            opt.body_file = optarg;
+            break;
+        case 'H':
+        {
+            size_t old = opt.headers ? strlen(opt.headers) : 0;
+            opt.headers = realloc(opt.headers, old + strlen(optarg) + 3);
+            sprintf(opt.headers + old, "%s\r\n", optarg);
+            break;
+        }
+        case 's':
+            opt.scenario = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || parse_url(argv[optind]) < 0)
+        usage(argv[0]);
+    if (opt.pipeline < 1 || opt.pipeline > MAX_PIPELINE)
+        opt.pipeline = opt.pipeline < 1 ? 1 : MAX_PIPELINE;
+    if (!opt.keepalive)
+        opt.pipeline = 1;
+    if (opt.threads < 1)
+        opt.threads = 1;
+    if (opt.connections < opt.threads)
+        opt.connections = opt.threads;
+    if (opt.method == NULL)
+        opt.method = opt.body_file ? "POST" : "GET";
+    if (build_request() < 0)
+        return 1;
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int rc = getaddrinfo(opt.host, opt.port, &hints, &opt.addr);
+    if (rc != 0)
+    {
+        fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(rc));
+        return 1;
+    }
+    if (opt.tls)
+    {
+        opt.ssl_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(opt.ssl_ctx, SSL_VERIFY_NONE, NULL); // 自签名证书
+        SSL_CTX_set_mode(opt.ssl_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+        SSL_CTX_set_session_cache_mode(opt.ssl_ctx, SSL_SESS_CACHE_OFF); // 每次都是完整握手
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    struct worker *workers = calloc(opt.threads, sizeof(struct worker));
+    uint64_t start = now_us();
+    opt.deadline = start + (uint64_t)opt.duration * 1000000;
+    for (int i = 0; i < opt.threads; i++)
+    {
+        workers[i].nconns = opt.connections / opt.threads + (i < opt.connections % opt.threads);
+        workers[i].conns = calloc(workers[i].nconns, sizeof(struct conn));
+        pthread_create(&workers[i].tid, NULL, worker_run, &workers[i]);
+    }
+
+    // 汇总
+    static uint64_t hist[HIST_SIZE];
+    uint64_t requests = 0, bytes = 0, connects = 0, err_connect = 0, err_io = 0, err_status = 0, max_us = 0;
+    for (int i = 0; i < opt.threads; i++)
+    {
+        pthread_join(workers[i].tid, NULL);
+        requests += workers[i].requests;
+        bytes += workers[i].bytes;
+        connects += workers[i].connects;
+        err_connect += workers[i].err_connect;
+        err_io += workers[i].err_io;
+        err_status += workers[i].err_status;
+        if (workers[i].max_us > max_us)
+            max_us = workers[i].max_us;
+        for (int j = 0; j < HIST_SIZE; j++)
+            hist[j] += workers[i].hist[j];
+    }
+    double secs = (now_us() - start) / 1e6;
+    printf("scenario %s: %s %s://%s:%s%s\n", opt.scenario, opt.method, opt.tls ? "https" : "http", opt.host, opt.port, opt.path);
+    printf("  threads %d, connections %d, pipeline %d, keep-alive %s, duration %.1fs\n",
+           opt.threads, opt.connections, opt.pipeline, opt.keepalive ? "on" : "off", secs);
+    printf("  requests    %llu (%.1f req/s), %.2f MB/s\n", (unsigned long long)requests, requests / secs, bytes / secs / 1e6);
+    printf("  connections %llu (%.1f conn/s)\n", (unsigned long long)connects, connects / secs);
+    printf("  errors      connect %llu, io %llu, status %llu\n",
+           (unsigned long long)err_connect, (unsigned long long)err_io, (unsigned long long)err_status);
+    printf("  latency(us) p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+           (unsigned long long)hist_percentile(hist, requests, 50), (unsigned long long)hist_percentile(hist, requests, 90),
+           (unsigned long long)hist_percentile(hist, requests, 99), (unsigned long long)hist_percentile(hist, requests, 99.9),
+           (unsigned long long)max_us);
+    // 便于脚本解析的单行结果
+    printf("RESULT scenario=%s rps=%.1f mbps=%.2f cps=%.1f p50_us=%llu p99_us=%llu p999_us=%llu errors=%llu\n",
+           opt.scenario, requests / secs, bytes / secs / 1e6, connects / secs,
+           (unsigned long long)hist_percentile(hist, requests, 50), (unsigned long long)hist_percentile(hist, requests, 99),
+           (unsigned long long)hist_percentile(hist, requests, 99.9),
+           (unsigned long long)(err_connect + err_io + err_status));
+    return (requests == 0 || err_connect + err_io + err_status > 0) ? 1 : 0;
+}
@@ -0,0 +1,326 @@
+/*
+* 服务器热点函数微基准
+* 链接 libserver.a（server.c 以 -DSERVER_NO_MAIN 编译），逐个测量每次调用的周期数与内存分配次数
+*
+* 用法：microbench [-n 每轮迭代次数] [-r 轮数] [名称过滤]
+*/
+#include "../server.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define DEFAULT_ITERS 20000
+#define DEFAULT_ROUNDS 15
+
+/* 通过覆盖 malloc 系列函数统计分配次数（可执行文件中的定义优先于 libc 与 libevent 中的引用） */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static __thread int counting;
+static __thread uint64_t alloc_count, alloc_bytes;
+
+void *malloc(size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += nmemb * size;
+    }
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (counting)
+    {
+        alloc_count++;
+        alloc_bytes += size;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+static inline uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec; // 无周期计数器时退化为纳秒
+#endif
+}
+
+static volatile uintptr_t sink; // 防止结果被优化掉
+
+/* ---- 被测用例 ---- */
+
+static void bench_content_type_html(void *arg)
+{
+    sink += (uintptr_t)get_content_type("www/index.html");
+}
+
+static void bench_content_type_last(void *arg)
+{
+    sink += (uintptr_t)get_content_type("doc/manual.PS"); // 表中最后一项，大小写不同
+}
+
+static void bench_content_type_unknown(void *arg)
+{
+    sink += (uintptr_t)get_content_type("upload/archive.tar.zst");
+}
+
+static void bench_uri_simple(void *arg)
+{
+    char path[512];
+    struct evkeyvalq query;
+    if (parse_request_uri("/index.html", path, sizeof(path), &query) == 0)
+        evhttp_clear_headers(&query);
+    sink += path[0];
+}
+
+static void bench_uri_query(void *arg)
+{
+    char path[512];
+    struct evkeyvalq query;
+    if (parse_request_uri("/docs/guide/?q=hello%20world&page=2&sort=desc&lang=zh-CN", path, sizeof(path), &query) == 0)
+        evhttp_clear_headers(&query);
+    sink += path[0];
+}
+
+static void bench_uri_reject(void *arg)
+{
+    char path[512];
+    struct evkeyvalq query;
+    sink += parse_request_uri("/static/../../etc/passwd", path, sizeof(path), &query);
+}
+
+struct multipart_body
+{
+    char *data;
+    size_t len;
+};
+
+static void bench_multipart(void *arg)
+{
+    struct multipart_body *body = (struct multipart_body *)arg;
+    char filename[256];
+    const char *data;
+    size_t data_len;
+    if (multipart_parse(body->data, body->len, filename, sizeof(filename), &data, &data_len) == 0)
+        sink += data_len;
+}
+
+static void bench_file_headers(void *arg)
+{
+    struct stat *st = (struct stat *)arg;
+    struct evkeyvalq headers;
+    TAILQ_INIT(&headers);
+    add_file_headers(&headers, "www/index.html", st);
+    evhttp_clear_headers(&headers);
+}
+
+/* 从请求体中取出 num 字段，请求体分布在多个 evbuffer 数据块中 */
+static void bench_json_extract(void *arg)
+{
+    char num[JSON_VALUE_MAX];
+    struct json_field fields[] = {{"num", num, sizeof(num)}};
+    if (json_extract((struct evbuffer *)arg, fields, 1) == 0)
+        sink += fields[0].len;
+}
+
+static struct evbuffer *make_json(size_t pad)
+{
+    struct evbuffer *buf = evbuffer_new();
+    evbuffer_add_printf(buf, "{\"note\": \"");
+    for (size_t i = 0; i < pad; i += 4096) // 每次追加形成独立的数据块
+    {
+        char chunk[4096];
+        size_t n = pad - i < sizeof(chunk) ? pad - i : sizeof(chunk);
+        for (size_t j = 0; j < n; j++)
+            chunk[j] = 'a' + (i + j) % 26;
+        evbuffer_add(buf, chunk, n);
+    }
+    evbuffer_add_printf(buf, "\", \"tags\": [1, 2.5, true, null], \"num\": \"1234567\"}");
+    return buf;
+}
+
+/* 构造与浏览器表单一致的上传请求体 */
+static struct multipart_body *make_multipart(size_t payload)
+{
+    const char *boundary = "----WebKitFormBoundaryX3oHqL7nG2bYvT8a";
+    struct multipart_body *body = malloc(sizeof(*body));
+    body->data = malloc(payload + 512);
+    int n = sprintf(body->data, "--%s\r\nContent-Disposition: form-data; name=\"fileToUpload\"; filename=\"test.txt\"\r\n"
+                                "Content-Type: text/plain\r\n\r\n",
+                    boundary);
+    for (size_t i = 0; i < payload; i++)
+        body->data[n + i] = 'a' + i % 26;
+    n += payload;
+    n += sprintf(body->data + n, "\r\n--%s--\r\n", boundary);
+    body->len = n;
+    return body;
+}
+
+/* 解析整个请求头，只得到切片，不分配 */
+static void bench_parse_head(void *arg)
+{
+    struct http_head h;
+    const char *req = (const char *)arg;
+    sink += http_parse_head(req, strlen(req), &h) + h.nfields;
+}
+
+/* 作为对照：evhttp 解析后以 evkeyvalq 保存首部，每个首部三次分配 */
+static void bench_parse_headers_evkeyvalq(void *arg)
+{
+    struct http_head h;
+    struct evkeyvalq headers;
+    const char *req = (const char *)arg;
+    TAILQ_INIT(&headers);
+    http_parse_head(req, strlen(req), &h);
+    for (int i = 0; i < h.nfields; i++)
+    {
+        char name[256], value[1024];
+        snprintf(name, sizeof(name), "%.*s", h.names[i].len, req + h.names[i].off);
+        snprintf(value, sizeof(value), "%.*s", h.values[i].len, req + h.values[i].off);
+        evhttp_add_header(&headers, name, value);
+    }
+    evhttp_clear_headers(&headers);
+}
+
+static const char *req_get = "GET /index.html HTTP/1.1\r\nHost: 127.0.0.1:8000\r\nUser-Agent: curl/7.88.1\r\nAccept: */*\r\n\r\n";
+static const char *req_browser =
+    "GET /docs/guide/index.html?lang=zh-CN HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"118\", \"Google Chrome\";v=\"118\", \"Not=A?Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/118.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Referer: https://www.example.com/docs/\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; _ga=GA1.1.123456789.1700000000\r\n"
+    "If-Modified-Since: Mon, 13 Nov 2023 08:00:00 GMT\r\n\r\n";
+
+struct bench_case
+{
+    const char *name;
+    void (*fn)(void *);
+    void *arg;
+    int iters_div; // 较慢的用例减少迭代次数
+};
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 运行一个用例：耗时取多轮中位数，分配次数为单次调用的统计 */
+static void run_case(struct bench_case *bc, int iters, int rounds)
+{
+    uint64_t *cyc = malloc(rounds * sizeof(uint64_t)), *ns = malloc(rounds * sizeof(uint64_t));
+    iters /= bc->iters_div;
+    if (iters < 1)
+        iters = 1;
+    for (int i = 0; i < iters / 10 + 1; i++) // 预热
+        bc->fn(bc->arg);
+
+    alloc_count = alloc_bytes = 0;
+    counting = 1;
+    bc->fn(bc->arg);
+    counting = 0;
+    uint64_t allocs = alloc_count, bytes = alloc_bytes;
+
+    for (int r = 0; r < rounds; r++)
+    {
+        uint64_t t0 = now_ns(), c0 = cycles();
+        for (int i = 0; i < iters; i++)
+            bc->fn(bc->arg);
+        cyc[r] = cycles() - c0;
+        ns[r] = now_ns() - t0;
+    }
+    qsort(cyc, rounds, sizeof(uint64_t), cmp_u64);
+    qsort(ns, rounds, sizeof(uint64_t), cmp_u64);
+    printf("%-24s %12.1f %10.1f %8llu %10llu\n", bc->name, (double)cyc[rounds / 2] / iters,
+           (double)ns[rounds / 2] / iters, (unsigned long long)allocs, (unsigned long long)bytes);
+    free(cyc);
+    free(ns);
+}
+
+int main(int argc, char **argv)
+{
+    int iters = DEFAULT_ITERS, rounds = DEFAULT_ROUNDS, c;
+    while ((c = getopt(argc, argv, "n:r:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            iters = atoi(optarg);
+            break;
+        case 'r':
+            rounds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations] [-r rounds] [filter]\n", argv[0]);
+            return 2;
+        }
+    }
+    const char *filter = optind < argc ? argv[optind] : NULL;
+
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_size = 4452;
+    st.st_mtime = 1600000000;
+
+    struct bench_case cases[] = {
+        {"content_type/html", bench_content_type_html, NULL, 1},
+        {"content_type/last", bench_content_type_last, NULL, 1},
+        {"content_type/unknown", bench_content_type_unknown, NULL, 1},
+        {"uri/simple", bench_uri_simple, NULL, 1},
+        {"uri/query", bench_uri_query, NULL, 1},
+        {"uri/reject", bench_uri_reject, NULL, 1},
+        {"multipart/1k", bench_multipart, make_multipart(1024), 1},
+        {"multipart/64k", bench_multipart, make_multipart(64 * 1024), 16},
+        {"multipart/1m", bench_multipart, make_multipart(1024 * 1024), 256},
+        {"headers/file", bench_file_headers, &st, 1},
+        {"json/small", bench_json_extract, make_json(16), 1},
+        {"json/64k", bench_json_extract, make_json(64 * 1024), 16},
+        {"http/parse_get", bench_parse_head, (void *)req_get, 1},
+        {"http/parse_browser", bench_parse_head, (void *)req_browser, 1},
+        {"http/evkeyvalq_browser", bench_parse_headers_evkeyvalq, (void *)req_browser, 1},
+    };
+
+    printf("%-24s %12s %10s %8s %10s\n", "benchmark", "cycles/call", "ns/call", "allocs", "bytes");
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+    {
+        if (filter == NULL || strstr(cases[i].name, filter))
+            run_case(&cases[i], iters, rounds);
+    }
+    return 0;
+}
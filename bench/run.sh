@@ -0,0 +1,194 @@
+#!/bin/bash
+# 端到端压力测试：在本机启动服务器，依次运行各场景并汇总吞吐量与延迟
+#
+# 环境变量：
+#   BENCH_DURATION     每个场景的时长(s)，默认 10
+#   BENCH_CONNECTIONS  并发连接数，默认 64
+#   BENCH_THREADS      压测线程数，默认 4
+#   BENCH_SCENARIOS    只运行指定场景，空格分隔
+#   BENCH_IDLE_CONNECTIONS  idle-http/idle-https 场景的空闲连接数，默认 100000（受 RLIMIT_NOFILE 限制）
+#   BENCH_IDLE_HTTP_BUDGET / BENCH_IDLE_HTTPS_BUDGET  每个空闲连接的服务器内存预算(字节)，默认 4096 / 20480
+#   BENCH_SSE_SUBSCRIBERS  sse-idle 场景的订阅连接数，默认同 BENCH_IDLE_CONNECTIONS
+#   BENCH_SSE_BUDGET   sse-idle 场景每个连接的内存预算(字节)，默认 4096
+#   BENCH_EXTERNAL=1   不启动服务器，直接压测已运行在 HTTP_PORT/HTTPS_PORT 上的实例
+
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${BENCH_DURATION:-10}
+CONNS=${BENCH_CONNECTIONS:-64}
+THREADS=${BENCH_THREADS:-4}
+export HTTP_PORT=${HTTP_PORT:-18000}
+export HTTPS_PORT=${HTTPS_PORT:-14430}
+LOADGEN=bench/loadgen
+HTTP=http://127.0.0.1:$HTTP_PORT
+HTTPS=https://127.0.0.1:$HTTPS_PORT
+
+WORK=$(mktemp -d)
+SERVER_PID=
+cleanup()
+{
+    [ -n "$SERVER_PID" ] && kill "$SERVER_PID" 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# 请求体：与浏览器表单上传格式一致的 multipart，以及因数分解的 JSON
+BOUNDARY=----WebKitFormBoundaryBenchBoundary0
+printf -- '--%s\r\nContent-Disposition: form-data; name="fileToUpload"; filename="bench.txt"\r\nContent-Type: text/plain\r\n\r\n%s\r\n--%s--\r\n' \
+    "$BOUNDARY" "benchmark upload payload" "$BOUNDARY" > "$WORK/upload.body"
+printf '{"num":"600851475143"}' > "$WORK/factor.json"
+
+# 参数为服务器的环境变量，如 start_server HTTP_TCP_CORK=0
+start_server()
+{
+    [ "$BENCH_EXTERNAL" = 1 ] && return
+    if [ -n "$SERVER_PID" ]; then
+        kill "$SERVER_PID" 2>/dev/null
+        wait "$SERVER_PID" 2>/dev/null
+        # io_uring 的 accept 请求在进程退出后由内核异步取消，此前监听套接字仍会接受连接
+        for _ in $(seq 50); do
+            (exec 3<>/dev/tcp/127.0.0.1/"$HTTP_PORT") 2>/dev/null || break
+            sleep 0.1
+        done
+    fi
+    env "$@" ./server > /dev/null 2>&1 &
+    SERVER_PID=$!
+    for _ in $(seq 50); do
+        (exec 3<>/dev/tcp/127.0.0.1/"$HTTP_PORT") 2>/dev/null && break
+        sleep 0.1
+    done
+}
+start_server
+
+FAILED=0
+RESULTS=()
+run()
+{
+    local name=$1
+    shift
+    if [ -n "$BENCH_SCENARIOS" ] && [[ " $BENCH_SCENARIOS " != *" $name "* ]]; then
+        return
+    fi
+    local out
+    out=$("$LOADGEN" -s "$name" -d "$DURATION" -c "$CONNS" -t "$THREADS" "$@")
+    local rc=$?
+    echo "$out"
+    RESULTS+=("$(echo "$out" | grep '^RESULT')")
+    [ $rc -ne 0 ] && FAILED=1 && echo "scenario $name FAILED"
+}
+
+run static-get "$HTTP/index.html"
+run static-pipelined -P 8 "$HTTP/index.html"
+run download "$HTTP/download.do"
+run upload -b "$WORK/upload.body" -H "Content-Type: multipart/form-data; boundary=$BOUNDARY" "$HTTP/upload.do"
+run cgi-post -b "$WORK/factor.json" -H "Content-Type: application/json" "$HTTP/factor.do"
+run tls-get "$HTTPS/index.html"
+run tls-handshake -K "$HTTPS/index.html"
+
+# TCP 选项对比：先以关闭 TCP_NODELAY/TCP_CORK 的旧行为运行，再以 TCP_DEFER_ACCEPT、Fast Open 与默认的 NODELAY/CORK 运行
+# 服务器端 Fast Open 需要 net.ipv4.tcp_fastopen=3，否则 -F 退化为普通握手
+run_tcp()
+{
+    local name=$1 envs=$2
+    shift 2
+    if [ -n "$BENCH_SCENARIOS" ] && [[ " $BENCH_SCENARIOS " != *" $name "* ]]; then
+        return
+    fi
+    start_server $envs
+    run "$name" "$@"
+}
+LEGACY_TCP="HTTP_TCP_NODELAY=0 HTTP_TCP_CORK=0"
+TUNED_TCP="HTTP_DEFER_ACCEPT=1 HTTP_FASTOPEN=256"
+run_tcp accept-legacy "$LEGACY_TCP" -K "$HTTP/index.html"
+run_tcp accept-tuned "$TUNED_TCP" -K -F "$HTTP/index.html"
+run_tcp tls-small-legacy "$LEGACY_TCP" "$HTTPS/index.html"
+run_tcp tls-small-tuned "$TUNED_TCP" "$HTTPS/index.html"
+
+# 内置 HTTP/1.1 引擎，与前面 evhttp 的同名场景对比
+NATIVE="HTTP_ENGINE=native HTTPS_ENGINE=native"
+run_tcp static-get-native "$NATIVE" "$HTTP/index.html"
+run_tcp static-pipelined-native "$NATIVE" -P 8 "$HTTP/index.html"
+run_tcp cgi-post-native "$NATIVE" -b "$WORK/factor.json" -H "Content-Type: application/json" "$HTTP/factor.do"
+run_tcp tls-get-native "$NATIVE" "$HTTPS/index.html"
+
+# TLS 握手：内置引擎在事件循环中握手，与交给 crypto 线程池（HTTPS_HANDSHAKE_THREADS）对比，cps 即每秒握手数
+OFFLOAD="HTTPS_ENGINE=native HTTPS_HANDSHAKE_THREADS=2"
+run_tcp tls-handshake-native "$NATIVE" -K "$HTTPS/index.html"
+run_tcp tls-handshake-offload "$OFFLOAD" -K "$HTTPS/index.html"
+
+# 握手风暴：后台以短连接持续完整握手，同时测量同一 HTTPS 监听上 4 个持久连接的延迟
+run_storm()
+{
+    local name=$1 envs=$2
+    if [ -n "$BENCH_SCENARIOS" ] && [[ " $BENCH_SCENARIOS " != *" $name "* ]]; then
+        return
+    fi
+    start_server $envs
+    "$LOADGEN" -s "$name-handshakes" -d $((DURATION + 1)) -c 16 -t 1 -K "$HTTPS/index.html" > "$WORK/storm" &
+    local storm=$!
+    sleep 0.5
+    run "$name" -c 4 -t 1 "$HTTPS/index.html"
+    wait $storm || { FAILED=1; echo "scenario $name-handshakes FAILED"; }
+    grep '^RESULT' "$WORK/storm"
+    RESULTS+=("$(grep '^RESULT' "$WORK/storm")")
+}
+run_storm tls-storm-inline "HTTPS_ENGINE=native"
+run_storm tls-storm-offload "$OFFLOAD"
+
+# 静态资源包：由 www 生成，服务器按路径哈希从映射中返回文件
+tools/mkpack www "$WORK/www.pack" > /dev/null
+run_tcp static-get-pack "HTTP_PACK=$WORK/www.pack" "$HTTP/index.html"
+run_tcp static-get-pack-native "HTTP_PACK=$WORK/www.pack $NATIVE" "$HTTP/index.html"
+
+# 每个请求的系统调用数：服务器预加载 bench/syscount.so 计数，依次为 evhttp、内置引擎的 epoll 与 io_uring 后端
+run_syscalls()
+{
+    local name=$1 envs=$2
+    shift 2
+    if [ "$BENCH_EXTERNAL" = 1 ] || { [ -n "$BENCH_SCENARIOS" ] && [[ " $BENCH_SCENARIOS " != *" $name "* ]]; }; then
+        return
+    fi
+    start_server SYSCOUNT_FILE="$WORK/syscount" LD_PRELOAD=bench/syscount.so $envs
+    local out
+    out=$(bench/syscount -f "$WORK/syscount" -s "$name" -- "$LOADGEN" -s "$name" -d "$DURATION" -c "$CONNS" -t "$THREADS" "$@")
+    local rc=$?
+    echo "$out"
+    RESULTS+=("$(echo "$out" | grep '^RESULT')")
+    [ $rc -ne 0 ] && FAILED=1 && echo "scenario $name FAILED"
+}
+URING="HTTP_ENGINE=native HTTP_IO_BACKEND=uring"
+run_syscalls syscalls-static-evhttp "" "$HTTP/index.html"
+run_syscalls syscalls-static-native "HTTP_ENGINE=native" "$HTTP/index.html"
+run_syscalls syscalls-static-uring "$URING" "$HTTP/index.html"
+run_syscalls syscalls-upload-evhttp "" -b "$WORK/upload.body" -H "Content-Type: multipart/form-data; boundary=$BOUNDARY" "$HTTP/upload.do"
+run_syscalls syscalls-upload-uring "$URING" -b "$WORK/upload.body" -H "Content-Type: multipart/form-data; boundary=$BOUNDARY" "$HTTP/upload.do"
+
+# 大量空闲连接：服务器每连接常驻内存，超出预算(字节)时失败
+run_idle()
+{
+    local name=$1
+    shift
+    if [ -n "$BENCH_SCENARIOS" ] && [[ " $BENCH_SCENARIOS " != *" $name "* ]]; then
+        return
+    fi
+    start_server # 新进程，避免前面场景释放的堆内存被复用而低估
+    local args=()
+    [ -n "$SERVER_PID" ] && args=(-P "$SERVER_PID")
+    local out
+    out=$(bench/idleconn -s "$name" "${args[@]}" "$@")
+    local rc=$?
+    echo "$out"
+    RESULTS+=("$(echo "$out" | grep '^RESULT')")
+    [ $rc -ne 0 ] && FAILED=1 && echo "scenario $name FAILED"
+}
+
+IDLE=${BENCH_IDLE_CONNECTIONS:-100000}
+run_idle idle-http -n "$IDLE" -b "${BENCH_IDLE_HTTP_BUDGET:-4096}" "$HTTP/index.html"
+run_idle idle-https -n "$IDLE" -b "${BENCH_IDLE_HTTPS_BUDGET:-20480}" "$HTTPS/index.html"
+# 空闲 SSE 订阅者，并测量一次发布的扇出时间
+run_idle sse-idle -n "${BENCH_SSE_SUBSCRIBERS:-$IDLE}" -e -b "${BENCH_SSE_BUDGET:-4096}" "$HTTP/events?channel=bench"
+
+echo
+echo "summary:"
+printf '%s\n' "${RESULTS[@]}"
+exit $FAILED
@@ -0,0 +1,269 @@
+/*
+* 统计服务器在一次压测期间的系统调用次数
+* 同一源文件编译为两部分：
+*   syscount.so  以 LD_PRELOAD 加载到服务器中，拦截 libc 的系统调用包装函数（含 syscall()，用于 io_uring_enter），
+*                按调用累加到 SYSCOUNT_FILE 指定的共享计数文件
+*   syscount     读取计数文件，运行给定的压测命令（通常为 loadgen），从其输出的 requests 行取得完成的请求数，
+*                输出本次运行每个请求的系统调用数及最多的几种调用
+* io_uring 提交后由内核完成的操作不经过系统调用，只计入 io_uring_enter；vDSO 中的 clock_gettime 等不是系统调用，不计入
+*
+* 用法：SYSCOUNT_FILE=/tmp/sc LD_PRELOAD=bench/syscount.so ./server
+*       syscount -f /tmp/sc [-s 名称] -- 命令 [参数...]
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#define SYSCOUNT_SLOTS 64
+#define TOP 10
+
+struct syscount_slot
+{
+    char name[24];
+    uint64_t count;
+};
+
+#ifndef SYSCOUNT_MAIN
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+
+static struct syscount_slot *slots;
+static int slots_lock;
+
+/* 首次调用时按名称查找或占用一个槽 */
+static uint64_t *syscount_counter(const char *name, int *idx)
+{
+    if (slots == NULL)
+        return NULL;
+    if (*idx == 0)
+    {
+        while (__sync_lock_test_and_set(&slots_lock, 1))
+            ;
+        for (int i = 1; i < SYSCOUNT_SLOTS && *idx == 0; i++)
+        {
+            if (slots[i].name[0] == '\0')
+                strncpy(slots[i].name, name, sizeof(slots[i].name) - 1);
+            if (!strcmp(slots[i].name, name))
+                *idx = i;
+        }
+        __sync_lock_release(&slots_lock);
+    }
+    return *idx ? &slots[*idx].count : NULL;
+}
+
+__attribute__((constructor)) static void syscount_init(void)
+{
+    const char *path = getenv("SYSCOUNT_FILE");
+    if (path == NULL)
+        return;
+    int (*real_open)(const char *, int, ...) = dlsym(RTLD_NEXT, "open");
+    unsetenv("LD_PRELOAD"); // CGI 等子进程不计入
+    int fd = real_open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || ftruncate(fd, SYSCOUNT_SLOTS * sizeof(struct syscount_slot)) < 0)
+        return;
+    void *p = mmap(NULL, SYSCOUNT_SLOTS * sizeof(struct syscount_slot), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p != MAP_FAILED)
+        slots = (struct syscount_slot *)p;
+}
+
+#define COUNT(name)                                         \
+    do                                                      \
+    {                                                       \
+        static int idx_;                                    \
+        uint64_t *c_ = syscount_counter(name, &idx_);       \
+        if (c_)                                             \
+            __atomic_fetch_add(c_, 1, __ATOMIC_RELAXED);    \
+    } while (0)
+
+#define WRAP(ret, fn, params, args)                         \
+    ret fn params                                           \
+    {                                                       \
+        static ret(*real_) params;                          \
+        if (real_ == NULL)                                  \
+            real_ = (ret(*) params)dlsym(RTLD_NEXT, #fn);   \
+        COUNT(#fn);                                         \
+        return real_ args;                                  \
+    }
+
+WRAP(ssize_t, read, (int fd, void *buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, write, (int fd, const void *buf, size_t n), (fd, buf, n))
+WRAP(ssize_t, readv, (int fd, const struct iovec *iov, int n), (fd, iov, n))
+WRAP(ssize_t, writev, (int fd, const struct iovec *iov, int n), (fd, iov, n))
+WRAP(ssize_t, recv, (int fd, void *buf, size_t n, int flags), (fd, buf, n, flags))
+WRAP(ssize_t, send, (int fd, const void *buf, size_t n, int flags), (fd, buf, n, flags))
+WRAP(ssize_t, recvfrom, (int fd, void *buf, size_t n, int flags, struct sockaddr *sa, socklen_t *len), (fd, buf, n, flags, sa, len))
+WRAP(ssize_t, sendto, (int fd, const void *buf, size_t n, int flags, const struct sockaddr *sa, socklen_t len), (fd, buf, n, flags, sa, len))
+WRAP(ssize_t, recvmsg, (int fd, struct msghdr *msg, int flags), (fd, msg, flags))
+WRAP(ssize_t, sendmsg, (int fd, const struct msghdr *msg, int flags), (fd, msg, flags))
+WRAP(ssize_t, sendfile, (int out, int in, off_t *off, size_t n), (out, in, off, n))
+WRAP(ssize_t, splice, (int in, loff_t *off_in, int out, loff_t *off_out, size_t n, unsigned flags), (in, off_in, out, off_out, n, flags))
+WRAP(int, accept, (int fd, struct sockaddr *sa, socklen_t *len), (fd, sa, len))
+WRAP(int, accept4, (int fd, struct sockaddr *sa, socklen_t *len, int flags), (fd, sa, len, flags))
+WRAP(int, close, (int fd), (fd))
+WRAP(int, shutdown, (int fd, int how), (fd, how))
+WRAP(int, epoll_wait, (int fd, struct epoll_event *ev, int n, int timeout), (fd, ev, n, timeout))
+WRAP(int, epoll_ctl, (int fd, int op, int target, struct epoll_event *ev), (fd, op, target, ev))
+WRAP(int, setsockopt, (int fd, int level, int name, const void *val, socklen_t len), (fd, level, name, val, len))
+WRAP(int, getsockopt, (int fd, int level, int name, void *val, socklen_t *len), (fd, level, name, val, len))
+WRAP(int, getpeername, (int fd, struct sockaddr *sa, socklen_t *len), (fd, sa, len))
+WRAP(int, getsockname, (int fd, struct sockaddr *sa, socklen_t *len), (fd, sa, len))
+WRAP(int, fstat, (int fd, struct stat *st), (fd, st))
+WRAP(int, stat, (const char *path, struct stat *st), (path, st))
+WRAP(off_t, lseek, (int fd, off_t off, int whence), (fd, off, whence))
+WRAP(int, fsync, (int fd), (fd))
+WRAP(int, fdatasync, (int fd), (fd))
+WRAP(int, fallocate, (int fd, int mode, off_t off, off_t len), (fd, mode, off, len))
+WRAP(int, rename, (const char *from, const char *to), (from, to))
+WRAP(int, link, (const char *from, const char *to), (from, to))
+WRAP(int, unlink, (const char *path), (path))
+WRAP(int, access, (const char *path, int mode), (path, mode))
+WRAP(int, pipe2, (int *fds, int flags), (fds, flags))
+WRAP(void *, mmap, (void *addr, size_t len, int prot, int flags, int fd, off_t off), (addr, len, prot, flags, fd, off))
+WRAP(int, munmap, (void *addr, size_t len), (addr, len))
+
+int open(const char *path, int flags, ...)
+{
+    static int (*real_)(const char *, int, ...);
+    va_list ap;
+    va_start(ap, flags);
+    mode_t mode = va_arg(ap, mode_t);
+    va_end(ap);
+    if (real_ == NULL)
+        real_ = dlsym(RTLD_NEXT, "open");
+    COUNT("open");
+    return real_(path, flags, mode);
+}
+
+int fcntl(int fd, int cmd, ...)
+{
+    static int (*real_)(int, int, ...);
+    va_list ap;
+    va_start(ap, cmd);
+    void *arg = va_arg(ap, void *);
+    va_end(ap);
+    if (real_ == NULL)
+        real_ = dlsym(RTLD_NEXT, "fcntl");
+    COUNT("fcntl");
+    return real_(fd, cmd, arg);
+}
+
+/* io_uring 没有 libc 包装，服务器经 syscall() 调用 */
+long syscall(long nr, ...)
+{
+    static long (*real_)(long, ...);
+    va_list ap;
+    va_start(ap, nr);
+    long a = va_arg(ap, long), b = va_arg(ap, long), c = va_arg(ap, long);
+    long d = va_arg(ap, long), e = va_arg(ap, long), f = va_arg(ap, long);
+    va_end(ap);
+    if (real_ == NULL)
+        real_ = dlsym(RTLD_NEXT, "syscall");
+    if (nr == __NR_io_uring_enter)
+        COUNT("io_uring_enter");
+    else
+        COUNT("syscall");
+    return real_(nr, a, b, c, d, e, f);
+}
+
+#else
+
+static int snapshot(const char *path, struct syscount_slot *out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    ssize_t n = pread(fd, out, SYSCOUNT_SLOTS * sizeof(struct syscount_slot), 0);
+    close(fd);
+    return n == SYSCOUNT_SLOTS * (ssize_t)sizeof(struct syscount_slot) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *file = NULL, *scenario = "default";
+    int c;
+    while ((c = getopt(argc, argv, "f:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'f':
+            file = optarg;
+            break;
+        case 's':
+            scenario = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s -f count_file [-s name] -- command [args...]\n", argv[0]);
+            return 2;
+        }
+    }
+    static struct syscount_slot before[SYSCOUNT_SLOTS], after[SYSCOUNT_SLOTS];
+    if (file == NULL || optind >= argc || snapshot(file, before) < 0)
+    {
+        fprintf(stderr, "usage: %s -f count_file [-s name] -- command [args...]\n", argv[0]);
+        return 2;
+    }
+
+    int out[2];
+    if (pipe(out) < 0)
+        return 1;
+    pid_t child = fork();
+    if (child == 0)
+    {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        close(out[1]);
+        execvp(argv[optind], argv + optind);
+        _exit(127);
+    }
+    close(out[1]);
+    char buf[8192];
+    size_t len = 0;
+    ssize_t n;
+    while ((n = read(out[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+        len += n;
+    buf[len] = '\0';
+    int status;
+    waitpid(child, &status, 0);
+    if (snapshot(file, after) < 0)
+        return 1;
+    fputs(buf, stdout);
+
+    unsigned long long requests = 0;
+    const char *r = strstr(buf, "  requests ");
+    if (r)
+        requests = strtoull(r + 11, NULL, 10);
+    uint64_t total = 0, delta[SYSCOUNT_SLOTS];
+    for (int i = 0; i < SYSCOUNT_SLOTS; i++)
+        total += (delta[i] = after[i].count - before[i].count);
+    printf("  syscalls    %llu (%.2f per request)\n", (unsigned long long)total, requests ? (double)total / requests : 0.0);
+    for (int k = 0; k < TOP; k++)
+    {
+        int best = -1;
+        for (int i = 0; i < SYSCOUNT_SLOTS; i++)
+        {
+            if (delta[i] && (best < 0 || delta[i] > delta[best]))
+                best = i;
+        }
+        if (best < 0)
+            break;
+        printf("    %-16s %10llu  %6.2f/req\n", after[best].name, (unsigned long long)delta[best], requests ? (double)delta[best] / requests : 0.0);
+        delta[best] = 0;
+    }
+    printf("RESULT scenario=%s syscalls_per_req=%.2f requests=%llu\n", scenario, requests ? (double)total / requests : 0.0, requests);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 && requests ? 0 : 1;
+}
+#endif
@@ -1,55 +1,4 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <evhttp.h>
-#include <string.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <pthread.h>
-#include <sys/stat.h>
-#include <fcntl.h>
-#include <cjson/cJSON.h>
-
-#include <openssl/ssl.h>
-#include <openssl/err.h>
-#include <openssl/rand.h>
-
-#include "event2/event.h"
-#include "event2/buffer.h"
-#include "event2/bufferevent.h"
-#include "event2/bufferevent_compat.h"
-#include "event2/util.h"
-#include "event2/listener.h"
-#include "event2/bufferevent_ssl.h"
-
-#define WEB_PATH "www"
-#define SERVER_CRT "server.crt"
-#define SERVER_KEY "server.key"
-#define HTTP_SERVER_PORT 8000
-#define HTTPS_SERVER_PORT 4430
-#define MAX_BUF_SIZE 1024
-
-SSL_CTX *evssl_init(void);
-struct bufferevent *bevcb(struct event_base *, void *);
-void accept_request(struct evhttp_request *, void *);
-char *get_content_type(char *);
-void http_startup(void);
-void https_startup(void);
-void file_upload(struct evhttp_request *, void *);
-void file_download(struct evhttp_request *, void *);
-void serve_file(struct evhttp_request *, char *);
-void execute_cgi(struct evhttp_request *, char *, char *, int);
-void handle_get_request(struct evhttp_request *, void *);
-void handle_post_request(struct evhttp_request *, void *);
-void handle_head_request(struct evhttp_request *, void *);
-void handle_put_request(struct evhttp_request *, void *);
-void handle_delete_request(struct evhttp_request *, void *);
-void handle_options_request(struct evhttp_request *, void *);
-void handle_trace_request(struct evhttp_request *, void *);
-void handle_connect_request(struct evhttp_request *, void *);
-void handle_patch_request(struct evhttp_request *, void *);
-void handle_unknown_request(struct evhttp_request *, void *);
+#include "server.h"
 
 struct table_entry
 {
@@ -72,6 +21,156 @@ struct table_entry
     {NULL, NULL},
 };
 
+enum proxy_balance
+{
+    BALANCE_ROUND_ROBIN, // 轮询
+    BALANCE_LEAST_CONN,  // 最少连接
+};
+
+/*
+* 反向代理路由表：路径前缀匹配的请求不再交给 execute_cgi，而是转发至上游服务器池
+* 也可通过环境变量 HTTP_PROXY_ROUTES="/api/=127.0.0.1:9000,127.0.0.1:9001;/app/=..." 配置
+*/
+struct proxy_entry
+{
+    const char *prefix;         // 路由前缀
+    const char *upstreams;      // 上游列表 "host:port,host:port"
+    enum proxy_balance balance; // 负载均衡策略
+    const char *health_path;    // 健康检查路径
+} proxy_table[] = {
+    /* {"/api/", "127.0.0.1:9000,127.0.0.1:9001", BALANCE_LEAST_CONN, "/"}, */
+    {NULL, NULL, BALANCE_ROUND_ROBIN, NULL},
+};
+
+struct upstream;
+
+/* 连接池中的一条持久连接 */
+struct upstream_conn
+{
+    struct evhttp_connection *evcon;
+    int inflight; // 该连接上未完成的请求数
+    struct upstream *up;
+};
+
+/* 上游服务器 */
+struct upstream
+{
+    char host[256];
+    int port;
+    int healthy;  // 是否参与负载均衡
+    int fails;    // 连续失败次数
+    int inflight; // 未完成的请求数，用于最少连接策略
+    int checking; // 健康检查进行中
+    struct proxy_route *route;
+    struct evhttp_connection *health_evcon;
+    struct upstream_conn pool[PROXY_POOL_SIZE];
+};
+
+struct proxy_route
+{
+    char prefix[256];
+    char health_path[256];
+    enum proxy_balance balance;
+    unsigned int rr; // 轮询游标
+    int nupstreams;
+    struct upstream *upstreams;
+    struct event *health_ev;
+};
+
+/* 一次代理请求的上下文 */
+struct proxy_ctx
+{
+    struct evhttp_request *client; // 客户端请求
+    struct evhttp_request *upreq;  // 上游请求
+    struct upstream_conn *uc;      // 使用的上游连接
+    int replied;                   // 是否已向客户端发送响应头
+    int paused;                    // 客户端输出积压，已停止读取上游连接
+    int cancelled;                 // 客户端已断开，正在取消上游请求
+};
+
+/* 动态响应缓存路由表：相同路由、相同JSON请求体的POST直接返回缓存结果 */
+struct cgi_cache_conf
+{
+    const char *route; // 请求路径
+    int ttl;           // 有效期(s)
+} cgi_cache_table[] = {
+    {"/factor.do", CGI_CACHE_TTL},
+    {NULL, 0},
+};
+
+/* 按路径精确匹配的路由，其余请求交给 accept_request；evhttp 与内置引擎注册相同的表 */
+struct route_entry
+{
+    const char *path;
+    void (*cb)(struct evhttp_request *, void *);
+    int tls; // 是否同时在 HTTPS 上提供
+} route_table[] = {
+    {"/upload.do", file_upload, 0},
+    {"/download.do", file_download, 0},
+    {"/events", sse_request, 1},
+    {"/ratelimit", rate_limit_handler, 1},
+    {"/stats", stats_handler, 1},
+    {NULL, NULL, 0},
+};
+
+/* 等待同一次CGI计算结果的请求 */
+struct cgi_waiter
+{
+    struct evhttp_request *req;
+    struct cgi_waiter *next;
+};
+
+struct cgi_cache_entry;
+
+/* 一次异步执行的CGI程序，输出同时推送给所有等待者 */
+struct cgi_job
+{
+    FILE *fstream;
+    struct event *ev;
+    struct evbuffer *output;       // 已产生的全部输出
+    struct cgi_waiter *waiters;
+    struct cgi_cache_entry *entry; // 为NULL时结果不缓存
+    int paused;                    // 有等待者的输出缓冲区超过上限，暂停读取管道
+};
+
+/* 缓存项，key 为路由与规范化JSON请求体 */
+struct cgi_cache_entry
+{
+    uint64_t hash;
+    char *key;
+    size_t size;           // 计入容量的字节数
+    struct evbuffer *body; // 完整响应体，计算中为NULL
+    time_t expires;
+    struct cgi_job *job; // 计算中的任务，完成后为NULL
+    struct cgi_cache_entry *hnext;
+    struct cgi_cache_entry *lru_prev, *lru_next;
+};
+
+struct cgi_cache
+{
+    struct cgi_cache_entry *buckets[CGI_CACHE_BUCKETS];
+    struct cgi_cache_entry *lru_head, *lru_tail; // 头部为最近使用
+    size_t bytes;
+};
+
+// CGI 输出管道注册在本线程的 event_base 上，缓存与合并同样按线程划分
+static __thread struct cgi_cache cgi_cache;
+static __thread int cgi_running; // 本线程运行中的 CGI 子进程数
+struct work_pool *io_pool;      // 文件写入、删除等阻塞操作
+struct work_pool *compute_pool; // 批量分解等计算任务
+struct work_pool *crypto_pool;  // 内置引擎的 TLS 握手，NULL 时在事件循环中握手
+
+// evhttp_connection 绑定在 event_base 上，因此每个事件循环线程各自维护路由与连接池
+static __thread struct proxy_route *proxy_routes = NULL;
+static __thread int proxy_nroutes = 0;
+
+/* 握手完成时计数，卸载的握手在 crypto_pool 的线程中调用 */
+static void evssl_info_cb(const SSL *ssl, int where, int ret)
+{
+    if (where & SSL_CB_HANDSHAKE_DONE)
+        stats_handshake(SSL_session_reused((SSL *)ssl));
+}
+
 /* 初始化SSL */
 SSL_CTX *evssl_init(void)
 {
@@ -92,427 +191,7709 @@ SSL_CTX *evssl_init(void)
         return NULL;
     }
     SSL_CTX_set_options(server_ctx, SSL_OP_NO_SSLv2);
+    SSL_CTX_set_mode(server_ctx, SSL_MODE_RELEASE_BUFFERS); // 空闲连接不保留约 34KB 的记录读写缓冲区
+    SSL_CTX_set_info_callback(server_ctx, evssl_info_cb);
     return server_ctx;
 }
 
 struct bufferevent *bevcb(struct event_base *base, void *arg)
 {
-    SSL_CTX *ctx = (SSL_CTX *)arg;
-    return bufferevent_openssl_socket_new(base, -1, SSL_new(ctx), BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+    SSL_CTX *ctx = (SSL_CTX *)arg;
+    struct bufferevent *bev = bufferevent_openssl_socket_new(base, -1, SSL_new(ctx), BUFFEREVENT_SSL_ACCEPTING, BEV_OPT_CLOSE_ON_FREE);
+    stats_accept();
+    trace_accept(bev);
+    rate_accept(bev);
+    return bev;
+}
+
+/* HTTP 连接与 evhttp 默认创建的 bufferevent 相同，仅用于记录接受连接的时间 */
+struct bufferevent *bevcb_plain(struct event_base *base, void *arg)
+{
+    struct bufferevent *bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
+    stats_accept();
+    trace_accept(bev);
+    rate_accept(bev);
+    return bev;
+}
+
+/* 读取整型配置，环境变量未设置时使用默认值 */
+int env_int(const char *name, int def)
+{
+    const char *val = getenv(name);
+    return (val && *val) ? atoi(val) : def;
+}
+
+/* 读取字符串配置，环境变量未设置时使用默认值 */
+const char *env_str(const char *name, const char *def)
+{
+    const char *val = getenv(name);
+    return (val && *val) ? val : def;
+}
+
+/*
+* 进程统计
+* 主进程在 fork 之前创建匿名共享映射，工作进程各占一项，以原子操作累加连接数与请求数；
+* 单进程模式只有第 0 项，GET /stats 返回各项及合计
+*/
+static struct worker_stats *stats_table;
+static int stats_nworkers;     // 预派生的工作进程数，0 表示单进程
+static struct worker_stats *stats_self;
+int process_index;             // 本进程在 stats_table 中的序号
+
+void stats_init(int nworkers)
+{
+    int n = nworkers ? nworkers : 1;
+    void *p = mmap(NULL, n * sizeof(struct worker_stats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        printf("LINE %d: stats mmap failed: %s\n", __LINE__, strerror(errno));
+        return;
+    }
+    stats_table = (struct worker_stats *)p;
+    stats_nworkers = nworkers;
+    for (int i = 0; i < n; i++)
+        stats_table[i].last_status = -1;
+}
+
+/* 工作进程启动时调用，单进程模式以 0 调用 */
+void stats_start(int index)
+{
+    process_index = index;
+    if (stats_table == NULL)
+        return;
+    stats_self = &stats_table[index];
+    stats_self->pid = getpid();
+    stats_self->started = time(NULL);
+}
+
+void stats_accept(void)
+{
+    if (stats_self)
+        __atomic_fetch_add(&stats_self->connections, 1, __ATOMIC_RELAXED);
+}
+
+void stats_request(void)
+{
+    if (stats_self)
+        __atomic_fetch_add(&stats_self->requests, 1, __ATOMIC_RELAXED);
+}
+
+void stats_handshake(int resumed)
+{
+    if (stats_self == NULL)
+        return;
+    __atomic_fetch_add(&stats_self->tls_handshakes, 1, __ATOMIC_RELAXED);
+    if (resumed)
+        __atomic_fetch_add(&stats_self->tls_resumed, 1, __ATOMIC_RELAXED);
+}
+
+static void stats_shed(void)
+{
+    if (stats_self)
+        __atomic_fetch_add(&stats_self->shed, 1, __ATOMIC_RELAXED);
+}
+
+/* 计入阻塞时间直方图：第 0 桶不足 1ms，第 k 桶为 [2^(k-1), 2^k) ms */
+static void stats_blocked(uint64_t ns)
+{
+    if (stats_self == NULL)
+        return;
+    uint64_t ms = ns / 1000000;
+    int k = ms ? 64 - __builtin_clzll(ms) : 0;
+    __atomic_fetch_add(&stats_self->blocked[k < WATCHDOG_BUCKETS ? k : WATCHDOG_BUCKETS - 1], 1, __ATOMIC_RELAXED);
+}
+
+/* 进程的退出原因，写入 JSON */
+static void stats_status_json(struct evbuffer *buf, int status)
+{
+    if (status == -1)
+        evbuffer_add_printf(buf, "null");
+    else if (WIFSIGNALED(status))
+        evbuffer_add_printf(buf, "\"signal %d\"", WTERMSIG(status));
+    else
+        evbuffer_add_printf(buf, "\"exit %d\"", WEXITSTATUS(status));
+}
+
+/* GET /stats：各工作进程的计数与合计 */
+void stats_handler(struct evhttp_request *req, void *arg)
+{
+    trace_handler_start(req);
+    if (evhttp_request_get_command(req) != EVHTTP_REQ_GET)
+    {
+        evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+        return;
+    }
+    if (stats_table == NULL)
+    {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+        return;
+    }
+    struct evbuffer *buf = evbuffer_new();
+    uint64_t connections = 0, requests = 0, restarts = 0, shed = 0, handshakes = 0, resumed = 0;
+    time_t now = time(NULL);
+    evbuffer_add_printf(buf, "{\"mode\":\"%s\",\"pid\":%d,\"workers\":[", stats_nworkers ? "prefork" : "single", (int)getpid());
+    for (int i = 0; i < (stats_nworkers ? stats_nworkers : 1); i++)
+    {
+        struct worker_stats *w = &stats_table[i];
+        pid_t pid = __atomic_load_n(&w->pid, __ATOMIC_RELAXED);
+        uint64_t c = __atomic_load_n(&w->connections, __ATOMIC_RELAXED);
+        uint64_t r = __atomic_load_n(&w->requests, __ATOMIC_RELAXED);
+        uint64_t n = __atomic_load_n(&w->restarts, __ATOMIC_RELAXED);
+        uint64_t d = __atomic_load_n(&w->shed, __ATOMIC_RELAXED);
+        uint64_t h = __atomic_load_n(&w->tls_handshakes, __ATOMIC_RELAXED);
+        uint64_t hr = __atomic_load_n(&w->tls_resumed, __ATOMIC_RELAXED);
+        connections += c;
+        requests += r;
+        restarts += n;
+        shed += d;
+        handshakes += h;
+        resumed += hr;
+        evbuffer_add_printf(buf, "%s{\"index\":%d,\"pid\":%d,\"uptime\":%lld,\"restarts\":%llu,\"connections\":%llu,\"requests\":%llu,\"shed\":%llu,"
+                                 "\"tls_handshakes\":%llu,\"tls_resumed\":%llu,\"last_exit\":",
+                            i ? "," : "", i, (int)pid, pid ? (long long)(now - w->started) : 0LL, (unsigned long long)n,
+                            (unsigned long long)c, (unsigned long long)r, (unsigned long long)d, (unsigned long long)h, (unsigned long long)hr);
+        stats_status_json(buf, __atomic_load_n(&w->last_status, __ATOMIC_RELAXED));
+        evbuffer_add_printf(buf, ",\"blocked_ms\":{");
+        for (int k = 0; k < WATCHDOG_BUCKETS; k++) // 键为桶的下界(ms)
+            evbuffer_add_printf(buf, "%s\"%d\":%llu", k ? "," : "", k ? 1 << (k - 1) : 0,
+                                (unsigned long long)__atomic_load_n(&w->blocked[k], __ATOMIC_RELAXED));
+        evbuffer_add_printf(buf, "}}");
+    }
+    evbuffer_add_printf(buf, "],\"connections\":%llu,\"requests\":%llu,\"shed\":%llu,\"tls_handshakes\":%llu,\"tls_resumed\":%llu,\"restarts\":%llu}\n",
+                        (unsigned long long)connections, (unsigned long long)requests, (unsigned long long)shed,
+                        (unsigned long long)handshakes, (unsigned long long)resumed, (unsigned long long)restarts);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Cache-Control", "no-store");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+/*
+* 看门狗
+* 每个事件循环登记一项，由循环自己的定时器（admit_tick，每 ADMIT_TICK_MS 一次）更新心跳，
+* 定时器的延迟同时计入 /stats 的阻塞时间直方图。看门狗线程每 WATCHDOG_POLL_MS 检查一次，
+* 心跳超过 HTTP_WATCHDOG_MS 没有更新时循环正阻塞在某个回调中（popen、stat/open、fwrite 等），对每次停顿输出一次：
+* 循环名、已阻塞的时长、最近开始处理的请求，以及用 SIGUSR2 让该线程在信号处理函数中记录的调用栈；恢复后再输出一行
+*/
+struct watchdog_slot
+{
+    pthread_t thread;
+    char name[32];
+    uint64_t beat;     // 最近一次心跳(ns)，0 表示未登记或循环已退出
+    uint64_t reported; // 已报告的停顿所对应的 beat
+    char request[WATCHDOG_REQUEST_MAX]; // 最近开始处理的请求，循环阻塞时不再改写
+    uint64_t request_start;
+    void *frames[WATCHDOG_FRAMES];
+    int nframes; // 信号处理函数写入调用栈后置为帧数
+};
+
+static struct watchdog_slot watchdog_slots[2 * LOOP_MAX];
+static int watchdog_nslots;
+static uint64_t watchdog_ns; // 0 表示关闭
+static __thread struct watchdog_slot *watchdog_self;
+
+static void watchdog_backtrace(int sig)
+{
+    struct watchdog_slot *w = watchdog_self;
+    if (w)
+        __atomic_store_n(&w->nframes, backtrace(w->frames, WATCHDOG_FRAMES), __ATOMIC_RELEASE);
+}
+
+void watchdog_init(void)
+{
+    int ms = env_int("HTTP_WATCHDOG_MS", WATCHDOG_MS);
+    if (ms <= 0)
+        return;
+    watchdog_ns = ms * 1000000ULL;
+    void *frame;
+    backtrace(&frame, 1); // 首次调用会加载 libgcc 并分配内存，不能发生在信号处理函数中
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watchdog_backtrace;
+    sa.sa_flags = SA_RESTART; // 被打断的阻塞调用继续执行
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+/* 在事件循环线程中调用 */
+void watchdog_register(const char *name)
+{
+    if (watchdog_ns == 0)
+        return;
+    int i = __atomic_fetch_add(&watchdog_nslots, 1, __ATOMIC_RELAXED);
+    if (i >= 2 * LOOP_MAX)
+        return;
+    struct watchdog_slot *w = &watchdog_slots[i];
+    w->thread = pthread_self();
+    snprintf(w->name, sizeof(w->name), "%s", name);
+    __atomic_store_n(&w->beat, now_ns(), __ATOMIC_RELEASE);
+    watchdog_self = w;
+}
+
+void watchdog_unregister(void)
+{
+    if (watchdog_self)
+        __atomic_store_n(&watchdog_self->beat, 0, __ATOMIC_RELEASE);
+    watchdog_self = NULL;
+}
+
+/* 处理请求之前记录方法与 URI，阻塞时报告 */
+void watchdog_note(const char *method, const char *uri)
+{
+    struct watchdog_slot *w = watchdog_self;
+    if (w == NULL)
+        return;
+    snprintf(w->request, sizeof(w->request), "%s %s", method, uri);
+    w->request_start = now_ns();
+}
+
+/* 心跳：late 为定时器比预定晚的时长 */
+static void watchdog_tick(uint64_t now, uint64_t late)
+{
+    struct watchdog_slot *w = watchdog_self;
+    stats_blocked(late);
+    if (w == NULL)
+        return;
+    if (__atomic_load_n(&w->reported, __ATOMIC_ACQUIRE) == w->beat)
+        printf("LINE %d: Watchdog: %s unblocked after %.1fms\n", __LINE__, w->name, (now - w->beat) / 1e6);
+    __atomic_store_n(&w->beat, now, __ATOMIC_RELEASE);
+}
+
+static void watchdog_report(struct watchdog_slot *w, uint64_t beat, uint64_t now)
+{
+    __atomic_store_n(&w->nframes, 0, __ATOMIC_RELAXED);
+    pthread_kill(w->thread, SIGUSR2);
+    for (int i = 0; i < WATCHDOG_POLL_MS && __atomic_load_n(&w->nframes, __ATOMIC_ACQUIRE) == 0; i++)
+        usleep(1000);
+    printf("LINE %d: Watchdog: %s blocked for %.1fms, last request %s (started %.1fms ago)\n", __LINE__, w->name,
+           (now - beat) / 1e6, w->request[0] ? w->request : "(none)", w->request[0] ? (now - w->request_start) / 1e6 : 0.0);
+    int n = __atomic_load_n(&w->nframes, __ATOMIC_ACQUIRE);
+    char **syms = n > 0 ? backtrace_symbols(w->frames, n) : NULL;
+    for (int i = 2; syms && i < n; i++) // 跳过信号处理函数与信号返回的跳板
+        printf("LINE %d:   #%d %s\n", __LINE__, i - 2, syms[i]);
+    free(syms);
+    __atomic_store_n(&w->reported, beat, __ATOMIC_RELEASE);
+}
+
+static void *watchdog_thread(void *arg)
+{
+    for (;;)
+    {
+        usleep(WATCHDOG_POLL_MS * 1000);
+        uint64_t now = now_ns();
+        int n = __atomic_load_n(&watchdog_nslots, __ATOMIC_RELAXED);
+        for (int i = 0; i < n && i < 2 * LOOP_MAX; i++)
+        {
+            struct watchdog_slot *w = &watchdog_slots[i];
+            uint64_t beat = __atomic_load_n(&w->beat, __ATOMIC_ACQUIRE);
+            if (beat && now > beat + watchdog_ns && __atomic_load_n(&w->reported, __ATOMIC_RELAXED) != beat)
+                watchdog_report(w, beat, now);
+        }
+    }
+    return NULL;
+}
+
+/* 线程不能跨越 fork，预派生模式下在每个工作进程中启动 */
+void watchdog_start(void)
+{
+    pthread_t tid;
+    if (watchdog_ns == 0)
+        return;
+    if (pthread_create(&tid, NULL, watchdog_thread, NULL) != 0)
+        printf("LINE %d: %s\n", __LINE__, "watchdog thread create failed");
+    else
+        pthread_detach(tid);
+}
+
+/*
+* 准入控制
+* 每个事件循环以 ADMIT_TICK_MS 的定时器测量延迟：定时器实际触发时间晚于预定时间的部分，
+* 即循环被处理函数（popen、同步磁盘写入等）占用而无法及时处理事件的时长；取本次测量与上次衰减值中较大者，
+* 循环被阻塞后的一段时间内延迟逐步回落。处理请求时若定时器已经过期未触发，以过期时长为当前延迟
+* 延迟超过阈值时动态请求（CGI、上传、目录打包等）直接返回 503 与 Retry-After，
+* 本循环运行中的 CGI 子进程与线程池排队任务之和超过阈值时同样拒绝动态请求；
+* 静态文件开销小，阈值为动态请求的 ADMIT_STATIC_FACTOR 倍，最后才被拒绝；SSE、/stats 等控制路由不受限制
+*/
+struct admit_loop
+{
+    struct event *ev;
+    uint64_t due; // 定时器预定触发时间(ns)
+    uint64_t lag; // 最近测得的延迟(ns)，逐步衰减
+    uint64_t shed; // 上次输出日志以来拒绝的请求数
+    uint64_t logged; // 上次输出日志的时间(ns)
+};
+
+static __thread struct admit_loop admit_loop;
+static uint64_t admit_lag_ns, admit_static_lag_ns; // admit_lag_ns 为 0 表示关闭准入控制
+static int admit_queue;
+static char admit_retry[16];
+
+void admit_init(void)
+{
+    int lag_ms = env_int("HTTP_SHED_LAG_MS", ADMIT_LAG_MS);
+    if (lag_ms <= 0)
+        return;
+    admit_lag_ns = lag_ms * 1000000ULL;
+    admit_static_lag_ns = env_int("HTTP_SHED_STATIC_LAG_MS", lag_ms * ADMIT_STATIC_FACTOR) * 1000000ULL;
+    admit_queue = env_int("HTTP_SHED_QUEUE", ADMIT_QUEUE);
+    snprintf(admit_retry, sizeof(admit_retry), "%d", env_int("HTTP_SHED_RETRY", ADMIT_RETRY_AFTER));
+}
+
+static void admit_tick(evutil_socket_t fd, short events, void *arg)
+{
+    struct admit_loop *a = &admit_loop;
+    uint64_t now = now_ns();
+    uint64_t sample = now > a->due ? now - a->due : 0;
+    watchdog_tick(now, sample);
+    a->lag = sample > a->lag - a->lag / 4 ? sample : a->lag - a->lag / 4;
+    a->due = now + ADMIT_TICK_MS * 1000000ULL;
+    if (a->shed && now - a->logged >= 1000000000ULL)
+    {
+        printf("LINE %d: Overloaded, shed %llu requests (loop lag %.1fms, queue %d)\n", __LINE__,
+               (unsigned long long)a->shed, a->lag / 1e6, cgi_running + work_pool_pending(io_pool) + work_pool_pending(compute_pool));
+        a->shed = 0;
+        a->logged = now;
+    }
+}
+
+/* 同一定时器也是看门狗的心跳 */
+void admit_init_loop(struct event_base *base)
+{
+    if (admit_lag_ns == 0 && watchdog_ns == 0)
+        return;
+    struct timeval tv = {0, ADMIT_TICK_MS * 1000};
+    admit_loop.ev = event_new(base, -1, EV_PERSIST, admit_tick, NULL);
+    admit_loop.due = now_ns() + ADMIT_TICK_MS * 1000000ULL;
+    event_add(admit_loop.ev, &tv);
+}
+
+/* 本循环当前是否应拒绝该类请求 */
+int admit_check(enum admit_class cls)
+{
+    struct admit_loop *a = &admit_loop;
+    if (admit_lag_ns == 0 || a->ev == NULL)
+        return 0;
+    uint64_t now = now_ns(), lag = a->lag;
+    if (now > a->due && now - a->due > lag)
+        lag = now - a->due;
+    if (cls == ADMIT_STATIC)
+        return admit_static_lag_ns && lag > admit_static_lag_ns;
+    if (admit_lag_ns && lag > admit_lag_ns)
+        return 1;
+    return admit_queue && cgi_running + work_pool_pending(io_pool) + work_pool_pending(compute_pool) >= admit_queue;
+}
+
+/* 在处理函数入口调用：过载时回复 503 并返回 -1 */
+int admit_request(struct evhttp_request *req, enum admit_class cls)
+{
+    if (!admit_check(cls))
+        return 0;
+    admit_loop.shed++;
+    stats_shed();
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Retry-After", admit_retry);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain");
+    struct evbuffer *buf = evbuffer_new();
+    evbuffer_add_printf(buf, "Server overloaded, retry later\n");
+    evhttp_send_reply(req, HTTP_SERVUNAVAIL, "Service Unavailable", buf);
+    evbuffer_free(buf);
+    return -1;
+}
+
+/*
+* 请求计时
+* 每个连接按 fd 使用 req_traces 中的一项，记录当前请求经过的时间点：
+* 接受连接 -> 收到请求首字节 -> 首部完整 -> 处理函数开始 -> 响应进入输出缓冲区（处理结束） -> 写出首字节 -> 写完最后一字节
+* 收发时间点由连接输入、输出 evbuffer 的回调记录，请求完成（evhttp_request_set_on_complete_cb）时
+* 写入 Chrome Trace Event 格式的跟踪文件（可在 Perfetto 或 chrome://tracing 中打开），超过阈值的请求记入慢请求日志
+*/
+struct req_trace
+{
+    struct bufferevent *bev; // 占用该项的连接，fd 被新连接复用时覆盖
+    uint64_t accept;         // 各时间点(ns, CLOCK_MONOTONIC)，0 表示尚未发生
+    uint64_t start;          // 开始等待本请求：首个请求为接受连接，其后为上一请求完成
+    uint64_t read;
+    uint64_t headers;
+    uint64_t handler_start;
+    uint64_t handler_end;
+    uint64_t first_byte;
+    uint64_t bytes; // 本请求写出的字节数
+    unsigned requests;
+};
+
+static struct req_trace *req_traces;
+static int req_traces_max;
+static int trace_fd = -1;
+static uint64_t trace_slow_ns;
+
+uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* 读取配置，跟踪文件与慢请求日志都关闭时不做任何记录 */
+void trace_init(void)
+{
+    const char *file = env_str("HTTP_TRACE_FILE", NULL);
+    trace_slow_ns = (uint64_t)env_int("HTTP_SLOW_MS", TRACE_SLOW_MS) * 1000000;
+    if (file)
+    {
+        trace_fd = open(file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (trace_fd < 0)
+            printf("LINE %d: Open trace file %s failed: %s\n", __LINE__, file, strerror(errno));
+        else if (lseek(trace_fd, 0, SEEK_END) == 0 && write(trace_fd, "[\n", 2) != 2) // 数组结尾的 ] 可省略
+            printf("LINE %d: Write trace file %s failed\n", __LINE__, file);
+    }
+    if (trace_fd < 0 && trace_slow_ns == 0)
+        return;
+    struct rlimit rl;
+    req_traces_max = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (1 << 24) ? (int)rl.rlim_cur : (1 << 24);
+    req_traces = (struct req_trace *)calloc(req_traces_max, sizeof(struct req_trace)); // 只有用到的页才占用内存
+}
+
+void trace_input_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+    struct req_trace *t = (struct req_trace *)arg;
+    if (info->n_added == 0)
+        return;
+    uint64_t now = now_ns();
+    if (t->read == 0)
+        t->read = now;
+    if (t->headers == 0 && evbuffer_search(buf, "\r\n\r\n", 4, NULL).pos >= 0)
+        t->headers = now;
+}
+
+void trace_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+    struct req_trace *t = (struct req_trace *)arg;
+    if (t->handler_start == 0) // 处理函数之前写出的只有 100 Continue
+        return;
+    if (info->n_added && t->handler_end == 0)
+        t->handler_end = now_ns();
+    if (info->n_deleted)
+    {
+        if (t->first_byte == 0)
+            t->first_byte = now_ns();
+        t->bytes += info->n_deleted;
+    }
+}
+
+/* evhttp 在 bevcb 返回后才设置 fd，因此在同一轮事件处理中稍后登记 */
+void trace_attach(evutil_socket_t fd, short events, void *arg)
+{
+    struct bufferevent *bev = (struct bufferevent *)arg;
+    fd = bufferevent_getfd(bev);
+    if (fd < 0 || fd >= req_traces_max)
+        return;
+    struct req_trace *t = &req_traces[fd];
+    memset(t, 0, sizeof(*t));
+    t->bev = bev;
+    t->accept = t->start = now_ns();
+    evbuffer_add_cb(bufferevent_get_input(bev), trace_input_cb, t);
+    evbuffer_add_cb(bufferevent_get_output(bev), trace_output_cb, t);
+}
+
+void trace_accept(struct bufferevent *bev)
+{
+    if (req_traces && bev)
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, trace_attach, bev, NULL); // 无超时，立即激活
+}
+
+const char *method_name(enum evhttp_cmd_type cmd)
+{
+    switch (cmd)
+    {
+    case EVHTTP_REQ_GET:
+        return "GET";
+    case EVHTTP_REQ_POST:
+        return "POST";
+    case EVHTTP_REQ_HEAD:
+        return "HEAD";
+    case EVHTTP_REQ_PUT:
+        return "PUT";
+    case EVHTTP_REQ_DELETE:
+        return "DELETE";
+    case EVHTTP_REQ_OPTIONS:
+        return "OPTIONS";
+    case EVHTTP_REQ_TRACE:
+        return "TRACE";
+    case EVHTTP_REQ_CONNECT:
+        return "CONNECT";
+    case EVHTTP_REQ_PATCH:
+        return "PATCH";
+    }
+    return "UNKNOWN";
+}
+
+/* 一个阶段写成一个完整事件(ph X)，tid 取连接的 fd，同一连接上的请求依次排列 */
+void trace_add_event(struct evbuffer *out, const char *name, uint64_t from, uint64_t to, int fd)
+{
+    if (from == 0 || to < from)
+        return;
+    evbuffer_add_printf(out, "{\"name\":\"%s\",\"cat\":\"phase\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d},\n",
+                        name, from / 1e3, (to - from) / 1e3, (int)getpid(), fd);
+}
+
+void trace_complete(struct evhttp_request *req, void *arg)
+{
+    struct req_trace *t = (struct req_trace *)arg;
+    uint64_t now = now_ns();
+    int fd = (int)(t - req_traces);
+    uint64_t begin = t->requests == 0 ? t->accept : t->read; // 首个请求包含 TLS 握手
+    if (trace_fd >= 0)
+    {
+        struct evbuffer *out = evbuffer_new();
+        char name[96];
+        snprintf(name, sizeof(name), "%s %s", method_name(evhttp_request_get_command(req)), evhttp_request_get_uri(req));
+        evbuffer_add_printf(out, "{\"name\":");
+        json_add_string(out, name);
+        evbuffer_add_printf(out, ",\"cat\":\"request\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                                 "\"args\":{\"status\":%d,\"bytes\":%llu,\"tls\":%s,\"request\":%u}},\n",
+                            begin / 1e3, (now - begin) / 1e3, (int)getpid(), fd, evhttp_request_get_response_code(req),
+                            (unsigned long long)t->bytes, request_is_tls(req) ? "true" : "false", t->requests + 1);
+        if (t->requests == 0)
+            trace_add_event(out, "connect", t->accept, t->read, fd);
+        trace_add_event(out, "read headers", t->read, t->headers, fd);
+        trace_add_event(out, "read body", t->headers, t->handler_start, fd);
+        trace_add_event(out, "handler", t->handler_start, t->handler_end, fd);
+        trace_add_event(out, "first byte", t->handler_end, t->first_byte, fd);
+        trace_add_event(out, "send", t->first_byte, now, fd);
+        evbuffer_write(out, trace_fd); // O_APPEND 一次写入，两个事件循环线程的记录不会交错
+        evbuffer_free(out);
+    }
+    if (trace_slow_ns && now - t->read >= trace_slow_ns)
+    {
+#define MS(a, b) ((a) && (b) >= (a) ? ((b) - (a)) / 1e6 : 0.0)
+        printf("LINE %d: Slow request %s %s %d: %.1fms (connect %.1f, headers %.1f, body %.1f, handler %.1f, first byte %.1f, send %.1f) %llu bytes\n",
+               __LINE__, method_name(evhttp_request_get_command(req)), evhttp_request_get_uri(req), evhttp_request_get_response_code(req),
+               MS(begin, now), t->requests == 0 ? MS(t->accept, t->read) : 0.0, MS(t->read, t->headers), MS(t->headers, t->handler_start),
+               MS(t->handler_start, t->handler_end), MS(t->handler_end, t->first_byte), MS(t->first_byte, now), (unsigned long long)t->bytes);
+#undef MS
+    }
+
+    // 持久连接上的下一个请求从现在开始计时，管线化的请求可能已在输入缓冲区中
+    t->start = now;
+    t->read = t->headers = t->handler_start = t->handler_end = t->first_byte = t->bytes = 0;
+    t->requests++;
+    struct evbuffer *in = bufferevent_get_input(t->bev);
+    if (evbuffer_get_length(in))
+    {
+        t->read = now;
+        if (evbuffer_search(in, "\r\n\r\n", 4, NULL).pos >= 0)
+            t->headers = now;
+    }
+}
+
+/* 在处理函数入口调用：计入请求数，记录开始时间并登记完成回调 */
+void trace_handler_start(struct evhttp_request *req)
+{
+    stats_request();
+    watchdog_note(method_name(evhttp_request_get_command(req)), evhttp_request_get_uri(req));
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (req_traces == NULL || evcon == NULL)
+        return;
+    struct bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
+    int fd = bufferevent_getfd(bev);
+    if (fd < 0 || fd >= req_traces_max || req_traces[fd].bev != bev || req_traces[fd].handler_start)
+        return;
+    struct req_trace *t = &req_traces[fd];
+    t->handler_start = now_ns();
+    if (t->read == 0)
+        t->read = t->start;
+    if (t->headers == 0) // 仅以 \n 分隔首部时检测不到
+        t->headers = t->handler_start;
+    evhttp_request_set_on_complete_cb(req, trace_complete, t);
+}
+
+/* 绕过 bufferevent 直接写出（io_uring）时记录发送的字节；n 为 0 表示响应已准备好 */
+void trace_sent(struct bufferevent *bev, size_t n)
+{
+    int fd = bufferevent_getfd(bev);
+    if (req_traces == NULL || fd < 0 || fd >= req_traces_max || req_traces[fd].bev != bev)
+        return;
+    struct req_trace *t = &req_traces[fd];
+    uint64_t now = now_ns();
+    if (t->handler_end == 0)
+        t->handler_end = now;
+    if (n && t->first_byte == 0)
+        t->first_byte = now;
+    t->bytes += n;
+}
+
+/*
+* 发送限速
+* 每个连接自身的令牌桶限制为 min(HTTP_RATE_CONN, 匹配路由的限速)，每个请求开始时按路由重新选择
+* 连接同时加入一个 bufferevent_rate_limit_group：设置了单 IP 限速时按客户端 IP 分组，否则本循环的连接共用一组
+* libevent 中一个 bufferevent 只能属于一个组，因此全局上限按组分配：每秒统计上一周期内有发送的组数，
+* 每组速率为 min(HTTP_RATE_IP, HTTP_RATE_GLOBAL / 活跃组数)，各组之和不超过全局上限（新活跃的组在一个周期内可能超出）
+* 组属于创建它的事件循环；只限制发送方向，上传不受影响
+* 令牌桶与组都在连接的第一个请求时设置，连接关闭时（evhttp 的关闭回调或内置引擎释放连接）退出组并释放引用
+* 运行时可通过 POST /ratelimit 调整（仅本机）；未启用任何限速时接受的连接不登记，调整后需重新连接
+* 配置位于 fork 之前创建的共享映射中，预派生模式下由任一工作进程修改后对所有进程生效；
+* 活跃组数按进程记在统计区中，全局上限由所有进程的活跃组均分
+*/
+struct rate_route
+{
+    char prefix[RATE_PREFIX_MAX];
+    size_t rate;
+};
+
+struct rate_conf
+{
+    size_t conn;   // 每个连接(B/s)，0 表示不限
+    size_t ip;     // 每个客户端 IP
+    size_t global; // 全部连接合计
+    int nroutes;
+    struct rate_route routes[RATE_ROUTE_MAX]; // 按顺序匹配路径前缀
+};
+
+struct rate_group
+{
+    struct bufferevent_rate_limit_group *group;
+    char ip[INET6_ADDRSTRLEN]; // 不按 IP 分组时为空串
+    int members;               // 组内连接数，连接关闭时减少，为 0 时在下一个调整周期释放
+    ev_uint64_t written;       // 上一周期结束时的累计发送字节数
+    size_t rate;               // 当前速率，0 表示不限
+    struct rate_group *next;
+};
+
+/* 连接令牌桶配置：libevent 不复制配置，使用期间不能释放；每个线程按速率缓存并记录引用数 */
+struct rate_cfg
+{
+    size_t rate;
+    struct ev_token_bucket_cfg *cfg;
+    int refs; // 正在使用的连接数
+    struct rate_cfg *next;
+};
+
+/* 按 fd 记录连接所在的组与正在使用的令牌桶配置 */
+struct rate_conn
+{
+    struct bufferevent *bev;
+    struct evhttp_connection *evcon; // 已挂接关闭回调的 evhttp 连接
+    struct rate_group *grp;
+    struct rate_cfg *cfg;
+    void (*closecb)(struct evhttp_connection *, void *); // 处理函数设置的关闭回调，由 rate_close_cb 转调
+    void *closecb_arg;
+};
+
+struct rate_shared
+{
+    pthread_mutex_t lock; // 进程间共享，持有者崩溃后由下一个加锁者恢复
+    unsigned gen;         // conf 修改后递增
+    int enabled;          // 设置过任何限速
+    struct rate_conf conf;
+};
+
+static struct rate_shared *rate_shm;
+static int rate_active_groups; // 没有统计区时本进程各事件循环上一周期内有发送的组数
+static struct rate_conn *rate_conns;
+static int rate_conns_max;
+
+static __thread struct rate_conf rate_local; // 本线程的配置副本
+static __thread unsigned rate_local_gen;
+static __thread int rate_local_active;
+static __thread struct rate_group *rate_groups[RATE_GROUP_BUCKETS];
+static __thread struct rate_cfg *rate_cfgs;
+static __thread int rate_ncfgs;
+
+/* 解析速率：字节/秒，可带 k/m/g 后缀（1024 进制），非法时返回 -1 */
+int parse_rate(const char *str, size_t *rate)
+{
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, 10);
+    int shift = 0;
+    if (end == str || errno || *str == '-')
+        return -1;
+    switch (tolower((unsigned char)*end))
+    {
+    case 'g':
+        shift = 30;
+        break;
+    case 'm':
+        shift = 20;
+        break;
+    case 'k':
+        shift = 10;
+        break;
+    }
+    end += shift != 0;
+    if (*end != '\0' || val > (SIZE_MAX >> shift)) // 带后缀后溢出
+        return -1;
+    *rate = (size_t)val << shift;
+    return 0;
+}
+
+/* 解析 "/download.do=1m;/doc/=512k" 形式的路由限速，覆盖原有路由 */
+int rate_parse_routes(struct rate_conf *conf, const char *str)
+{
+    char *routes = strdup(str), *saveptr = NULL;
+    int n = 0, ret = 0;
+    for (char *tok = strtok_r(routes, ";", &saveptr); tok; tok = strtok_r(NULL, ";", &saveptr))
+    {
+        char *eq = strchr(tok, '=');
+        if (eq == NULL || n == RATE_ROUTE_MAX || eq - tok >= RATE_PREFIX_MAX || eq == tok)
+        {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        if (parse_rate(eq + 1, &conf->routes[n].rate) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        strcpy(conf->routes[n++].prefix, tok);
+    }
+    free(routes);
+    if (ret == 0)
+        conf->nroutes = n;
+    return ret;
+}
+
+/* 两个速率中较严格的一个，0 表示不限 */
+size_t rate_min(size_t a, size_t b)
+{
+    return a == 0 ? b : (b == 0 || a < b) ? a : b;
+}
+
+/* 令牌桶配置：每 RATE_TICK_MS 补充一次，突发上限为 RATE_BURST_MS 的量 */
+struct ev_token_bucket_cfg *rate_bucket_new(size_t rate)
+{
+    if (rate == 0)
+        return ev_token_bucket_cfg_new(EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, NULL);
+    struct timeval tick = {0, RATE_TICK_MS * 1000};
+    size_t per_tick = rate / (1000 / RATE_TICK_MS), burst = rate / (1000 / RATE_BURST_MS);
+    per_tick = per_tick == 0 ? 1 : per_tick < EV_RATE_LIMIT_MAX ? per_tick : EV_RATE_LIMIT_MAX;
+    burst = burst < per_tick ? per_tick : burst < EV_RATE_LIMIT_MAX ? burst : EV_RATE_LIMIT_MAX;
+    return ev_token_bucket_cfg_new(EV_RATE_LIMIT_MAX, EV_RATE_LIMIT_MAX, per_tick, burst, &tick);
+}
+
+/* 取得本线程中该速率的令牌桶配置并增加引用，0 表示不限，返回 NULL */
+struct rate_cfg *rate_cfg_get(size_t rate)
+{
+    if (rate == 0)
+        return NULL;
+    for (struct rate_cfg *c = rate_cfgs; c; c = c->next)
+    {
+        if (c->rate == rate)
+        {
+            c->refs++;
+            return c;
+        }
+    }
+    // 缓存较多时（反复修改限速留下的旧速率）淘汰已没有连接使用的配置
+    for (struct rate_cfg **pc = &rate_cfgs; *pc && rate_ncfgs >= RATE_ROUTE_MAX * 4;)
+    {
+        struct rate_cfg *c = *pc;
+        if (c->refs > 0)
+        {
+            pc = &c->next;
+            continue;
+        }
+        *pc = c->next;
+        ev_token_bucket_cfg_free(c->cfg);
+        free(c);
+        rate_ncfgs--;
+    }
+    struct rate_cfg *c = (struct rate_cfg *)calloc(1, sizeof(struct rate_cfg));
+    c->rate = rate;
+    c->cfg = rate_bucket_new(rate);
+    c->refs = 1;
+    c->next = rate_cfgs;
+    rate_cfgs = c;
+    rate_ncfgs++;
+    return c;
+}
+
+void rate_lock(void)
+{
+    if (pthread_mutex_lock(&rate_shm->lock) == EOWNERDEAD) // 持锁的进程崩溃，配置只在锁内整体赋值
+        pthread_mutex_consistent(&rate_shm->lock);
+}
+
+/* 取得本线程的配置副本，其他线程或进程修改后重新复制 */
+const struct rate_conf *rate_conf_local(void)
+{
+    unsigned gen = __atomic_load_n(&rate_shm->gen, __ATOMIC_ACQUIRE);
+    if (gen != rate_local_gen)
+    {
+        rate_lock();
+        rate_local = rate_shm->conf;
+        rate_local_gen = rate_shm->gen;
+        pthread_mutex_unlock(&rate_shm->lock);
+    }
+    return &rate_local;
+}
+
+/* 本进程的活跃组计数：预派生模式下位于本进程的统计项，由主进程在进程退出时清零 */
+int *rate_active_slot(void)
+{
+    return stats_self ? &stats_self->rate_active : &rate_active_groups;
+}
+
+/* 所有进程所有事件循环上一周期内有发送的组数 */
+int rate_active_total(void)
+{
+    if (stats_table == NULL)
+        return __atomic_load_n(&rate_active_groups, __ATOMIC_RELAXED);
+    int active = 0;
+    for (int i = 0; i < (stats_nworkers ? stats_nworkers : 1); i++)
+        active += __atomic_load_n(&stats_table[i].rate_active, __ATOMIC_RELAXED);
+    return active;
+}
+
+/* 组的当前速率：全局上限由所有事件循环的活跃组均分 */
+size_t rate_group_rate(const struct rate_group *g, const struct rate_conf *conf)
+{
+    int active = rate_active_total();
+    size_t share = conf->global ? conf->global / (active > 0 ? active : 1) : 0;
+    return rate_min(g->ip[0] ? conf->ip : 0, share);
+}
+
+void rate_group_set(struct rate_group *g, size_t rate)
+{
+    if (g->rate == rate)
+        return;
+    struct ev_token_bucket_cfg *cfg = rate_bucket_new(rate);
+    bufferevent_rate_limit_group_set_cfg(g->group, cfg); // 组复制配置
+    ev_token_bucket_cfg_free(cfg);
+    g->rate = rate;
+}
+
+/* 查找或创建本线程中 ip 对应的组 */
+struct rate_group *rate_group_get(struct event_base *base, const char *ip, const struct rate_conf *conf)
+{
+    unsigned b = hash_bytes(ip, strlen(ip)) % RATE_GROUP_BUCKETS;
+    for (struct rate_group *g = rate_groups[b]; g; g = g->next)
+    {
+        if (!strcmp(g->ip, ip))
+            return g;
+    }
+    struct rate_group *g = (struct rate_group *)calloc(1, sizeof(struct rate_group));
+    snprintf(g->ip, sizeof(g->ip), "%s", ip);
+    // 新组即将发送，立即计入活跃组数，避免同一周期内新建的多个组都按原来的份额发送
+    __sync_add_and_fetch(rate_active_slot(), 1);
+    rate_local_active++;
+    g->rate = rate_group_rate(g, conf);
+    struct ev_token_bucket_cfg *cfg = rate_bucket_new(g->rate);
+    g->group = bufferevent_rate_limit_group_new(base, cfg);
+    ev_token_bucket_cfg_free(cfg);
+    g->next = rate_groups[b];
+    rate_groups[b] = g;
+    return g;
+}
+
+/* 每个周期统计活跃组、释放没有连接的组，并按新的活跃组数调整各组速率 */
+void rate_rebalance(evutil_socket_t fd, short events, void *arg)
+{
+    const struct rate_conf *conf = rate_conf_local();
+    int active = 0;
+    for (int b = 0; b < RATE_GROUP_BUCKETS; b++)
+    {
+        for (struct rate_group **pg = &rate_groups[b]; *pg;)
+        {
+            struct rate_group *g = *pg;
+            if (__atomic_load_n(&g->members, __ATOMIC_ACQUIRE) == 0)
+            {
+                *pg = g->next;
+                bufferevent_rate_limit_group_free(g->group);
+                free(g);
+                continue;
+            }
+            ev_uint64_t read, written;
+            bufferevent_rate_limit_group_get_totals(g->group, &read, &written);
+            active += written != g->written;
+            g->written = written;
+            pg = &g->next;
+        }
+    }
+    __sync_add_and_fetch(rate_active_slot(), active - rate_local_active);
+    rate_local_active = active;
+    for (int b = 0; b < RATE_GROUP_BUCKETS; b++)
+    {
+        for (struct rate_group *g = rate_groups[b]; g; g = g->next)
+            rate_group_set(g, rate_group_rate(g, conf));
+    }
+}
+
+/* 创建共享配置并读取环境变量中的初始限速，进程启动时（fork 之前）调用一次 */
+void rate_init(void)
+{
+    rate_shm = (struct rate_shared *)mmap(NULL, sizeof(struct rate_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rate_shm == MAP_FAILED)
+    {
+        printf("LINE %d: rate mmap failed: %s\n", __LINE__, strerror(errno));
+        rate_shm = (struct rate_shared *)calloc(1, sizeof(struct rate_shared)); // 各工作进程的修改只在本进程生效
+    }
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&rate_shm->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    rate_shm->gen = 1;
+
+    struct rate_conf *conf = &rate_shm->conf;
+    const char *names[] = {"HTTP_RATE_CONN", "HTTP_RATE_IP", "HTTP_RATE_GLOBAL"};
+    size_t *fields[] = {&conf->conn, &conf->ip, &conf->global};
+    for (int i = 0; i < 3; i++)
+    {
+        const char *val = env_str(names[i], NULL);
+        if (val && parse_rate(val, fields[i]) < 0)
+            printf("LINE %d: Invalid %s: %s\n", __LINE__, names[i], val);
+    }
+    const char *routes = env_str("HTTP_RATE_ROUTES", NULL);
+    if (routes && rate_parse_routes(conf, routes) < 0)
+        printf("LINE %d: Invalid HTTP_RATE_ROUTES: %s\n", __LINE__, routes);
+    rate_shm->enabled = conf->conn || conf->ip || conf->global || conf->nroutes;
+
+    struct rlimit rl;
+    rate_conns_max = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (1 << 24) ? (int)rl.rlim_cur : (1 << 24);
+    rate_conns = (struct rate_conn *)calloc(rate_conns_max, sizeof(struct rate_conn));
+}
+
+/* 启动本事件循环的调整定时器 */
+void rate_init_loop(struct event_base *base)
+{
+    struct timeval tv = {RATE_INTERVAL, 0};
+    struct event *ev = event_new(base, -1, EV_PERSIST, rate_rebalance, NULL);
+    event_add(ev, &tv);
+}
+
+/*
+* 与 trace_attach 相同，evhttp 设置 fd 后再登记连接
+* 令牌桶与组推迟到第一个请求时设置：TLS 握手期间设置会使 OpenSSL bufferevent 不再读取握手数据
+*/
+void rate_attach(evutil_socket_t fd, short events, void *arg)
+{
+    struct bufferevent *bev = (struct bufferevent *)arg;
+    fd = bufferevent_getfd(bev);
+    if (fd < 0 || fd >= rate_conns_max)
+        return;
+    memset(&rate_conns[fd], 0, sizeof(rate_conns[fd]));
+    rate_conns[fd].bev = bev;
+}
+
+/* 已登记的连接记录，未登记返回 NULL */
+struct rate_conn *rate_conn_of(struct bufferevent *bev)
+{
+    int fd = bev ? bufferevent_getfd(bev) : -1;
+    if (fd < 0 || fd >= rate_conns_max || rate_conns[fd].bev != bev)
+        return NULL;
+    return &rate_conns[fd];
+}
+
+/* 按客户端 IP（未设置单 IP 限速时为本循环共用的组）加入组 */
+void rate_join(struct rate_conn *c, const struct rate_conf *conf)
+{
+    struct bufferevent *bev = c->bev;
+    int fd = bufferevent_getfd(bev);
+    char ip[INET6_ADDRSTRLEN] = "";
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    if (conf->ip && getpeername(fd, (struct sockaddr *)&ss, &len) == 0)
+    {
+        if (ss.ss_family == AF_INET6)
+            evutil_inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&ss)->sin6_addr, ip, sizeof(ip));
+        else
+            evutil_inet_ntop(AF_INET, &((struct sockaddr_in *)&ss)->sin_addr, ip, sizeof(ip));
+    }
+    c->grp = rate_group_get(bufferevent_get_base(bev), ip, conf);
+    __sync_add_and_fetch(&c->grp->members, 1);
+    bufferevent_add_to_rate_limit_group(bev, c->grp->group);
+}
+
+/* 连接关闭：退出组并释放令牌桶配置的引用，组在下一个调整周期没有成员时释放 */
+void rate_close(struct bufferevent *bev)
+{
+    struct rate_conn *c = rate_conn_of(bev);
+    if (c == NULL)
+        return;
+    if (c->cfg)
+    {
+        bufferevent_set_rate_limit(bev, NULL); // 连接可能稍后才释放，先解除对配置的引用
+        c->cfg->refs--;
+    }
+    if (c->grp)
+    {
+        bufferevent_remove_from_rate_limit_group(bev);
+        __sync_sub_and_fetch(&c->grp->members, 1);
+    }
+    memset(c, 0, sizeof(*c));
+}
+
+/* evhttp 连接的关闭回调：释放限速状态后转调处理函数设置的回调 */
+void rate_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct rate_conn *c = rate_conn_of(evhttp_connection_get_bufferevent(evcon));
+    if (c == NULL || c->evcon != evcon)
+        return;
+    void (*cb)(struct evhttp_connection *, void *) = c->closecb;
+    void *cb_arg = c->closecb_arg;
+    rate_close(c->bev);
+    if (cb)
+        cb(evcon, cb_arg);
+}
+
+/* 处理函数设置 evhttp 连接的关闭回调：已挂接 rate_close_cb 时保存以便转调，返回 0；否则返回 -1 */
+int rate_set_closecb(struct evhttp_connection *evcon, void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+    struct rate_conn *c = rate_conn_of((evhttp_connection_get_bufferevent)(evcon));
+    if (c == NULL || c->evcon != evcon)
+        return -1;
+    c->closecb = cb;
+    c->closecb_arg = arg;
+    return 0;
+}
+
+void rate_accept(struct bufferevent *bev)
+{
+    if (__atomic_load_n(&rate_shm->enabled, __ATOMIC_RELAXED) && bev)
+        event_base_once(bufferevent_get_base(bev), -1, EV_TIMEOUT, rate_attach, bev, NULL);
+}
+
+/*
+* 请求开始：按路由选择连接令牌桶（与上一个请求相同时不重置）
+* evhttp 连接在第一个请求时挂接关闭回调，此时处理函数尚未设置自己的回调；内置引擎释放连接时直接调用 rate_close
+*/
+void rate_limit_request(struct evhttp_request *req)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (evcon == NULL)
+        return;
+    struct bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
+    rate_limit_path(bev, evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req)));
+    struct rate_conn *c = rate_conn_of(bev);
+    if (c && c->evcon == NULL && !engine_connection_native(evcon))
+    {
+        c->evcon = evcon;
+        (evhttp_connection_set_closecb)(evcon, rate_close_cb, NULL);
+    }
+}
+
+/* 按请求路径选择连接的令牌桶，供不创建 evhttp_request 的请求使用 */
+void rate_limit_path(struct bufferevent *bev, const char *path)
+{
+    struct rate_conn *c = rate_conn_of(bev);
+    if (c == NULL)
+        return;
+    const struct rate_conf *conf = rate_conf_local();
+    if (c->grp == NULL && (conf->ip || conf->global))
+        rate_join(c, conf);
+    size_t rate = conf->conn;
+    for (int i = 0; path && i < conf->nroutes; i++)
+    {
+        if (!strncmp(path, conf->routes[i].prefix, strlen(conf->routes[i].prefix)))
+        {
+            rate = rate_min(rate, conf->routes[i].rate);
+            break;
+        }
+    }
+    if (c->cfg ? c->cfg->rate != rate : rate != 0)
+    {
+        struct rate_cfg *cfg = rate_cfg_get(rate);
+        bufferevent_set_rate_limit(bev, cfg ? cfg->cfg : NULL);
+        if (c->cfg)
+            c->cfg->refs--;
+        c->cfg = cfg;
+    }
+}
+
+/* 以 JSON 输出当前限速配置 */
+void rate_conf_json(struct evbuffer *buf, const struct rate_conf *conf)
+{
+    evbuffer_add_printf(buf, "{\"conn\": %zu, \"ip\": %zu, \"global\": %zu, \"active_groups\": %d, \"routes\": {",
+                        conf->conn, conf->ip, conf->global, rate_active_total());
+    for (int i = 0; i < conf->nroutes; i++)
+    {
+        evbuffer_add_printf(buf, i ? ", " : "");
+        json_add_string(buf, conf->routes[i].prefix);
+        evbuffer_add_printf(buf, ": %zu", conf->routes[i].rate);
+    }
+    evbuffer_add_printf(buf, "}}\n");
+}
+
+/*
+* GET /ratelimit 查看限速配置；POST /ratelimit?conn=1m&ip=4m&global=20m&routes=/download.do=512k 修改（仅本机）
+* 未给出的参数保持不变，0 表示不限；组速率在下一个调整周期生效，连接令牌桶在连接的下一个请求生效
+*/
+void rate_limit_handler(struct evhttp_request *req, void *arg)
+{
+    trace_handler_start(req);
+    enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+    if (cmd == EVHTTP_REQ_POST)
+    {
+        char *peer;
+        ev_uint16_t port;
+        evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer, &port);
+        if (strcmp(peer, "127.0.0.1") && strcmp(peer, "::1"))
+        {
+            evhttp_send_error(req, 403, NULL);
+            return;
+        }
+        struct evkeyvalq query;
+        const char *q = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+        if (evhttp_parse_query_str(q ? q : "", &query) < 0)
+        {
+            evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+            return;
+        }
+        rate_lock();
+        struct rate_conf conf = rate_shm->conf;
+        const char *names[] = {"conn", "ip", "global"};
+        size_t *fields[] = {&conf.conn, &conf.ip, &conf.global};
+        int bad = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            const char *val = evhttp_find_header(&query, names[i]);
+            if (val && parse_rate(val, fields[i]) < 0)
+                bad = 1;
+        }
+        const char *routes = evhttp_find_header(&query, "routes");
+        if (routes && rate_parse_routes(&conf, routes) < 0)
+            bad = 1;
+        if (!bad)
+        {
+            rate_shm->conf = conf;
+            __atomic_add_fetch(&rate_shm->gen, 1, __ATOMIC_RELEASE);
+            if (conf.conn || conf.ip || conf.global || conf.nroutes)
+                __atomic_store_n(&rate_shm->enabled, 1, __ATOMIC_RELAXED);
+            printf("LINE %d: Rate limits changed: conn %zu, ip %zu, global %zu, %d routes\n", __LINE__,
+                   conf.conn, conf.ip, conf.global, conf.nroutes);
+        }
+        pthread_mutex_unlock(&rate_shm->lock);
+        evhttp_clear_headers(&query);
+        if (bad)
+        {
+            evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: invalid rate");
+            return;
+        }
+    }
+    else if (cmd != EVHTTP_REQ_GET)
+    {
+        evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+        return;
+    }
+    struct evbuffer *buf = evbuffer_new();
+    rate_conf_json(buf, rate_conf_local());
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/json");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf);
+    evbuffer_free(buf);
+}
+
+/* 逐跳首部不转发 */
+int is_hop_header(const char *key)
+{
+    static const char *hop_headers[] = {"Connection", "Keep-Alive", "Proxy-Authenticate", "Proxy-Authorization",
+                                        "TE", "Trailer", "Transfer-Encoding", "Upgrade", NULL};
+    for (int i = 0; hop_headers[i]; i++)
+    {
+        if (!evutil_ascii_strcasecmp(key, hop_headers[i]))
+            return 1;
+    }
+    return 0;
+}
+
+/* 记录上游失败，连续失败过多则摘除，等待健康检查恢复 */
+void upstream_failed(struct upstream *up)
+{
+    if (++up->fails >= PROXY_MAX_FAILS && up->healthy)
+    {
+        up->healthy = 0;
+        printf("LINE %d: upstream %s:%d marked down\n", __LINE__, up->host, up->port);
+    }
+}
+
+void upstream_succeeded(struct upstream *up)
+{
+    up->fails = 0;
+    if (!up->healthy)
+    {
+        up->healthy = 1;
+        printf("LINE %d: upstream %s:%d marked up\n", __LINE__, up->host, up->port);
+    }
+}
+
+void proxy_health_done(struct evhttp_request *req, void *arg)
+{
+    struct upstream *up = (struct upstream *)arg;
+    up->checking = 0;
+    if (req != NULL && evhttp_request_get_response_code(req) > 0 && evhttp_request_get_response_code(req) < 500)
+        upstream_succeeded(up);
+    else
+        upstream_failed(up);
+}
+
+/* 定时健康检查 */
+void proxy_health_check(evutil_socket_t fd, short events, void *arg)
+{
+    struct proxy_route *route = (struct proxy_route *)arg;
+    for (int i = 0; i < route->nupstreams; i++)
+    {
+        struct upstream *up = &route->upstreams[i];
+        if (up->checking)
+            continue;
+        struct evhttp_request *req = evhttp_request_new(proxy_health_done, up);
+        evhttp_add_header(evhttp_request_get_output_headers(req), "Host", up->host);
+        up->checking = 1;
+        if (evhttp_make_request(up->health_evcon, req, EVHTTP_REQ_GET, route->health_path) != 0)
+        {
+            up->checking = 0;
+            upstream_failed(up);
+        }
+    }
+}
+
+/* 添加一条代理路由，upstreams 形如 "host:port,host:port" */
+int proxy_add_route(struct event_base *base, const char *prefix, const char *upstreams,
+                    enum proxy_balance balance, const char *health_path)
+{
+    struct proxy_route *routes = realloc(proxy_routes, (proxy_nroutes + 1) * sizeof(*routes));
+    if (routes == NULL)
+        return -1;
+    proxy_routes = routes;
+    struct proxy_route *route = &proxy_routes[proxy_nroutes];
+    memset(route, 0, sizeof(*route));
+    snprintf(route->prefix, sizeof(route->prefix), "%s", prefix);
+    snprintf(route->health_path, sizeof(route->health_path), "%s", health_path ? health_path : "/");
+    route->balance = balance;
+
+    char *list = strdup(upstreams), *saveptr = NULL;
+    for (char *tok = strtok_r(list, ",", &saveptr); tok; tok = strtok_r(NULL, ",", &saveptr))
+    {
+        char *colon = strrchr(tok, ':');
+        if (colon == NULL)
+        {
+            printf("LINE %d: bad upstream '%s'\n", __LINE__, tok);
+            continue;
+        }
+        route->upstreams = realloc(route->upstreams, (route->nupstreams + 1) * sizeof(struct upstream));
+        struct upstream *up = &route->upstreams[route->nupstreams++];
+        memset(up, 0, sizeof(*up));
+        snprintf(up->host, sizeof(up->host), "%.*s", (int)(colon - tok), tok);
+        up->port = atoi(colon + 1);
+        up->healthy = 1;
+    }
+    free(list);
+    if (route->nupstreams == 0)
+        return -1;
+
+    // 地址在 realloc 完成后才固定，再建立连接池
+    for (int i = 0; i < route->nupstreams; i++)
+    {
+        struct upstream *up = &route->upstreams[i];
+        up->route = route;
+        for (int j = 0; j < PROXY_POOL_SIZE; j++)
+        {
+            up->pool[j].up = up;
+            up->pool[j].evcon = evhttp_connection_base_new(base, NULL, up->host, up->port);
+            evhttp_connection_set_timeout(up->pool[j].evcon, PROXY_TIMEOUT);
+        }
+        up->health_evcon = evhttp_connection_base_new(base, NULL, up->host, up->port);
+        evhttp_connection_set_timeout(up->health_evcon, PROXY_HEALTH_INTERVAL);
+    }
+    proxy_nroutes++;
+    printf("LINE %d: proxy %s -> %s\n", __LINE__, route->prefix, upstreams);
+    return 0;
+}
+
+/* 按路由表与环境变量初始化本线程的反向代理 */
+int proxy_init(struct event_base *base)
+{
+    enum proxy_balance balance = strcmp(env_str("HTTP_PROXY_BALANCE", "rr"), "lc") ? BALANCE_ROUND_ROBIN : BALANCE_LEAST_CONN;
+    const char *health_path = env_str("HTTP_PROXY_HEALTH", "/");
+    for (struct proxy_entry *ent = &proxy_table[0]; ent->prefix; ++ent)
+        proxy_add_route(base, ent->prefix, ent->upstreams, ent->balance, ent->health_path);
+
+    const char *conf = env_str("HTTP_PROXY_ROUTES", NULL);
+    if (conf != NULL)
+    {
+        char *routes = strdup(conf), *saveptr = NULL;
+        for (char *tok = strtok_r(routes, ";", &saveptr); tok; tok = strtok_r(NULL, ";", &saveptr))
+        {
+            char *eq = strchr(tok, '=');
+            if (eq == NULL)
+                continue;
+            *eq = '\0';
+            proxy_add_route(base, tok, eq + 1, balance, health_path);
+        }
+        free(routes);
+    }
+
+    // 路由数组不再变化后启动健康检查定时器
+    struct timeval tv = {PROXY_HEALTH_INTERVAL, 0};
+    for (int i = 0; i < proxy_nroutes; i++)
+    {
+        proxy_routes[i].health_ev = event_new(base, -1, EV_PERSIST, proxy_health_check, &proxy_routes[i]);
+        event_add(proxy_routes[i].health_ev, &tv);
+    }
+    return 0;
+}
+
+/* 按路径前缀查找代理路由 */
+struct proxy_route *proxy_match(const char *uri)
+{
+    for (int i = 0; i < proxy_nroutes; i++)
+    {
+        if (!strncmp(uri, proxy_routes[i].prefix, strlen(proxy_routes[i].prefix)))
+            return &proxy_routes[i];
+    }
+    return NULL;
+}
+
+/* 负载均衡：选择上游，全部不可用时返回NULL */
+struct upstream *proxy_pick_upstream(struct proxy_route *route)
+{
+    struct upstream *best = NULL;
+    for (int i = 0; i < route->nupstreams; i++)
+    {
+        struct upstream *up = &route->upstreams[(route->rr + i) % route->nupstreams];
+        if (!up->healthy)
+            continue;
+        if (route->balance == BALANCE_ROUND_ROBIN)
+        {
+            best = up;
+            break;
+        }
+        if (best == NULL || up->inflight < best->inflight)
+            best = up;
+    }
+    route->rr++;
+    return best;
+}
+
+/* 选择连接池中最空闲的连接，evhttp_connection 会对同一连接上的请求排队 */
+struct upstream_conn *upstream_pick_conn(struct upstream *up)
+{
+    struct upstream_conn *best = &up->pool[0];
+    for (int i = 1; i < PROXY_POOL_SIZE && best->inflight > 0; i++)
+    {
+        if (up->pool[i].inflight < best->inflight)
+            best = &up->pool[i];
+    }
+    return best;
+}
+
+/* 上游响应头到达：转发状态行与首部，开始向客户端流式回复 */
+int proxy_header_cb(struct evhttp_request *upreq, void *arg)
+{
+    struct proxy_ctx *ctx = (struct proxy_ctx *)arg;
+    struct evkeyvalq *out = evhttp_request_get_output_headers(ctx->client);
+    struct evkeyval *header;
+    for (header = evhttp_request_get_input_headers(upreq)->tqh_first; header; header = header->next.tqe_next)
+    {
+        if (!is_hop_header(header->key))
+            evhttp_add_header(out, header->key, header->value);
+    }
+    // 保留上游的 Content-Length 时 evhttp 直接透传，否则对 HTTP/1.1 客户端自动分块
+    evhttp_send_reply_start(ctx->client, evhttp_request_get_response_code(upreq),
+                            evhttp_request_get_response_code_line(upreq));
+    struct evhttp_connection *evcon = evhttp_request_get_connection(ctx->client);
+    if (evcon)
+        bufferevent_setwatermark(evhttp_connection_get_bufferevent(evcon), EV_WRITE, STREAM_LOW_WATERMARK, 0);
+    ctx->replied = 1;
+    return 0;
+}
+
+/* 恢复读取上游连接 */
+void proxy_resume(struct proxy_ctx *ctx)
+{
+    if (!ctx->paused)
+        return;
+    ctx->paused = 0;
+    bufferevent_enable(evhttp_connection_get_bufferevent(ctx->uc->evcon), EV_READ);
+}
+
+/* 客户端输出缓冲区降到 STREAM_LOW_WATERMARK */
+void proxy_client_drained(struct evhttp_connection *evcon, void *arg)
+{
+    proxy_resume((struct proxy_ctx *)arg);
+}
+
+/*
+* 上游响应体分段到达：整段移交给客户端连接，不做整体缓存
+* 客户端输出积压超过 STREAM_HIGH_WATERMARK 时停止读取上游连接，由 TCP 流控让上游放慢，
+* 排空到低水位后继续，每个代理请求占用的缓冲与响应大小、客户端速度无关
+*/
+void proxy_chunk_cb(struct evhttp_request *upreq, void *arg)
+{
+    struct proxy_ctx *ctx = (struct proxy_ctx *)arg;
+    evhttp_send_reply_chunk_with_cb(ctx->client, evhttp_request_get_input_buffer(upreq), proxy_client_drained, ctx);
+    struct evhttp_connection *evcon = evhttp_request_get_connection(ctx->client);
+    if (evcon && !ctx->paused &&
+        evbuffer_get_length(bufferevent_get_output(evhttp_connection_get_bufferevent(evcon))) >= STREAM_HIGH_WATERMARK)
+    {
+        ctx->paused = 1;
+        bufferevent_disable(evhttp_connection_get_bufferevent(ctx->uc->evcon), EV_READ);
+    }
+}
+
+void proxy_error_cb(enum evhttp_request_error error, void *arg)
+{
+    struct proxy_ctx *ctx = (struct proxy_ctx *)arg;
+    if (ctx->cancelled)
+        return;
+    printf("LINE %d: upstream %s:%d request failed: %d\n", __LINE__, ctx->uc->up->host, ctx->uc->up->port, error);
+    upstream_failed(ctx->uc->up);
+}
+
+/* 上游请求结束（出错时 upreq 为 NULL） */
+void proxy_done_cb(struct evhttp_request *upreq, void *arg)
+{
+    struct proxy_ctx *ctx = (struct proxy_ctx *)arg;
+    ctx->uc->inflight--;
+    ctx->uc->up->inflight--;
+    ctx->upreq = NULL;
+    if (ctx->cancelled)
+        return; // 由 proxy_client_close_cb 结束客户端请求并释放 ctx
+    proxy_resume(ctx);
+    struct evhttp_connection *evcon = evhttp_request_get_connection(ctx->client);
+    if (evcon)
+    {
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        if (ctx->replied)
+            bufferevent_setwatermark(evhttp_connection_get_bufferevent(evcon), EV_WRITE, 0, 0);
+    }
+    if (upreq != NULL && evhttp_request_get_response_code(upreq) > 0)
+    {
+        upstream_succeeded(ctx->uc->up);
+        if (!ctx->replied)
+            proxy_header_cb(upreq, ctx);
+        if (evbuffer_get_length(evhttp_request_get_input_buffer(upreq)) > 0)
+            evhttp_send_reply_chunk(ctx->client, evhttp_request_get_input_buffer(upreq));
+        evhttp_send_reply_end(ctx->client);
+    }
+    else if (ctx->replied)
+    {
+        stream_abort(ctx->client); // 响应已开始，只能截断
+        evhttp_send_reply_end(ctx->client);
+    }
+    else
+        evhttp_send_error(ctx->client, 502, "Bad Gateway");
+    free(ctx);
+}
+
+/* 客户端在响应完成前断开：取消上游请求（正在进行时 evhttp 会重置上游连接），结束已分离的客户端请求 */
+void proxy_client_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct proxy_ctx *ctx = (struct proxy_ctx *)arg;
+    ctx->cancelled = 1;
+    if (ctx->upreq)
+    {
+        evhttp_cancel_request(ctx->upreq);
+        if (ctx->upreq) // 取消时 evhttp 没有调用完成回调
+        {
+            ctx->uc->inflight--;
+            ctx->uc->up->inflight--;
+        }
+    }
+    evhttp_send_reply_end(ctx->client);
+    free(ctx);
+}
+
+/* 将请求转发至上游服务器池 */
+void handle_proxy_request(struct evhttp_request *req, struct proxy_route *route)
+{
+    struct upstream *up = proxy_pick_upstream(route);
+    if (up == NULL)
+    {
+        printf("LINE %d: no healthy upstream for %s\n", __LINE__, route->prefix);
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, "No Upstream Available");
+        return;
+    }
+    struct proxy_ctx *ctx = calloc(1, sizeof(*ctx));
+    ctx->client = req;
+    ctx->uc = upstream_pick_conn(up);
+
+    struct evhttp_request *upreq = evhttp_request_new(proxy_done_cb, ctx);
+    evhttp_request_set_header_cb(upreq, proxy_header_cb);
+    evhttp_request_set_chunked_cb(upreq, proxy_chunk_cb);
+    evhttp_request_set_error_cb(upreq, proxy_error_cb);
+
+    // 转发首部
+    struct evkeyvalq *out = evhttp_request_get_output_headers(upreq);
+    struct evkeyval *header;
+    for (header = evhttp_request_get_input_headers(req)->tqh_first; header; header = header->next.tqe_next)
+    {
+        if (!is_hop_header(header->key) && evutil_ascii_strcasecmp(header->key, "Content-Length"))
+            evhttp_add_header(out, header->key, header->value);
+    }
+    char *peer_addr = NULL;
+    ev_uint16_t peer_port = 0;
+    evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer_addr, &peer_port);
+    if (peer_addr)
+        evhttp_add_header(out, "X-Forwarded-For", peer_addr);
+
+    // 请求体整段移交（evbuffer 链表转移，不拷贝数据）
+    struct evbuffer *body = evhttp_request_get_output_buffer(upreq);
+    evbuffer_add_buffer(body, evhttp_request_get_input_buffer(req));
+    if (evbuffer_get_length(body) > 0)
+    {
+        char len[32];
+        snprintf(len, sizeof(len), "%zu", evbuffer_get_length(body));
+        evhttp_add_header(out, "Content-Length", len);
+    }
+
+    ctx->uc->inflight++;
+    up->inflight++;
+    if (evhttp_make_request(ctx->uc->evcon, upreq, evhttp_request_get_command(req), evhttp_request_get_uri(req)) != 0)
+    {
+        // evhttp_make_request 失败时已释放 upreq
+        ctx->uc->inflight--;
+        up->inflight--;
+        upstream_failed(up);
+        evhttp_send_error(req, 502, "Bad Gateway");
+        free(ctx);
+        return;
+    }
+    ctx->upreq = upreq;
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), proxy_client_close_cb, ctx);
+}
+
+/*
+* 静态资源包（HTTP_PACK，由 tools/mkpack 从 www 生成）
+* 整个包只读映射，按路径哈希查找条目；首部与 gzip 变体都已预先生成，命中时不访问文件系统，
+* 内容以 evbuffer_add_reference 引用映射中的页，每个引用持有包的一个计数
+* 部署即原子替换包文件（rename）：HTTP 循环 0 每 PACK_CHECK_INTERVAL 秒 stat 一次，文件变化后加载并校验新包，
+* 各线程在下一次查找时换用新包，旧包在最后一个引用它的响应发完后解除映射；新包无效时继续使用旧包
+* 包中没有的路径仍从 www 读取
+*/
+struct asset_pack
+{
+    const char *base;
+    size_t size;
+    const struct pack_header *hdr;
+    const uint32_t *slots;
+    const struct pack_entry *entries;
+    int refcnt;
+    struct stat st; // 映射时的文件状态，用于发现替换
+};
+
+static const char *pack_path;
+static struct asset_pack *pack_global;
+static unsigned pack_generation; // 每次替换 pack_global 加 1
+static pthread_mutex_t pack_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct asset_pack *loop_pack;
+static __thread unsigned loop_pack_generation;
+
+static int pack_range_ok(const struct asset_pack *pack, uint64_t off, uint64_t len)
+{
+    return off <= pack->size && len <= pack->size - off;
+}
+
+/* 校验文件头与每个偏移，返回错误说明，有效时返回 NULL */
+static const char *pack_validate(struct asset_pack *pack)
+{
+    const struct pack_header *hdr = pack->hdr;
+    if (memcmp(hdr->magic, PACK_MAGIC, sizeof(hdr->magic)) || hdr->version != PACK_VERSION)
+        return "bad magic or version";
+    if (hdr->size != pack->size)
+        return "size mismatch";
+    if (hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) || hdr->slots_off % sizeof(uint32_t) ||
+        !pack_range_ok(pack, hdr->slots_off, (uint64_t)hdr->nslots * sizeof(uint32_t)))
+        return "bad slot table";
+    if (hdr->entries_off % sizeof(uint64_t) ||
+        !pack_range_ok(pack, hdr->entries_off, (uint64_t)hdr->nentries * sizeof(struct pack_entry)))
+        return "bad entry table";
+    pack->slots = (const uint32_t *)(pack->base + hdr->slots_off);
+    pack->entries = (const struct pack_entry *)(pack->base + hdr->entries_off);
+    for (uint32_t i = 0; i < hdr->nslots; i++)
+    {
+        if (pack->slots[i] > hdr->nentries)
+            return "bad slot";
+    }
+    for (uint32_t i = 0; i < hdr->nentries; i++)
+    {
+        const struct pack_entry *e = &pack->entries[i];
+        if (!pack_range_ok(pack, e->path_off, e->path_len) || e->variants[PACK_IDENTITY].head_len == 0)
+            return "bad entry";
+        for (int k = 0; k < PACK_ENCODINGS; k++)
+        {
+            const struct pack_variant *v = &e->variants[k];
+            if (v->head_len == 0)
+                continue;
+            if (v->head_len < 2 || v->head_len > PACK_HEAD_MAX || !pack_range_ok(pack, v->head_off, v->head_len) ||
+                !pack_range_ok(pack, v->body_off, v->body_len) || memchr(v->etag, '\0', sizeof(v->etag)) == NULL ||
+                memcmp(pack->base + v->head_off + v->head_len - 2, "\r\n", 2))
+                return "bad variant";
+        }
+    }
+    return NULL;
+}
+
+/* 映射并校验包文件，任何偏移越界都拒绝整个包；返回的包持有一个计数 */
+struct asset_pack *pack_load(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct pack_header))
+    {
+        printf("LINE %d: Cannot load pack %s: %s\n", __LINE__, path, fd < 0 ? strerror(errno) : "too short");
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        printf("LINE %d: mmap %s failed: %s\n", __LINE__, path, strerror(errno));
+        return NULL;
+    }
+    struct asset_pack *pack = (struct asset_pack *)calloc(1, sizeof(struct asset_pack));
+    pack->base = (const char *)base;
+    pack->size = st.st_size;
+    pack->hdr = (const struct pack_header *)base;
+    pack->refcnt = 1;
+    pack->st = st;
+    const char *err = pack_validate(pack);
+    if (err)
+    {
+        printf("LINE %d: Invalid pack %s: %s\n", __LINE__, path, err);
+        munmap(base, st.st_size);
+        free(pack);
+        return NULL;
+    }
+    return pack;
+}
+
+void pack_unref(struct asset_pack *pack)
+{
+    if (__sync_sub_and_fetch(&pack->refcnt, 1) == 0)
+    {
+        munmap((void *)pack->base, pack->size);
+        free(pack);
+    }
+}
+
+/* evbuffer_add_reference 的释放回调，arg 为包 */
+static void pack_ref_cleanup(const void *data, size_t len, void *arg)
+{
+    pack_unref((struct asset_pack *)arg);
+}
+
+/* 引用包中的内容，发送完成后释放计数 */
+static void pack_add_body(struct evbuffer *out, struct asset_pack *pack, const struct pack_variant *v)
+{
+    if (v->body_len == 0)
+        return;
+    __sync_add_and_fetch(&pack->refcnt, 1);
+    evbuffer_add_reference(out, pack->base + v->body_off, v->body_len, pack_ref_cleanup, pack);
+}
+
+/* 按路径（相对于 WEB_PATH，以 / 开头）查找条目 */
+const struct pack_entry *pack_lookup(const struct asset_pack *pack, const char *key)
+{
+    size_t len = strlen(key);
+    uint64_t hash = hash_bytes(key, len);
+    uint32_t mask = pack->hdr->nslots - 1;
+    for (uint32_t i = 0, slot = hash & mask; i <= mask; i++, slot = (slot + 1) & mask)
+    {
+        uint32_t idx = pack->slots[slot];
+        if (idx == 0)
+            return NULL;
+        const struct pack_entry *e = &pack->entries[idx - 1];
+        if (e->hash == hash && e->path_len == len && !memcmp(pack->base + e->path_off, key, len))
+            return e;
+    }
+    return NULL;
+}
+
+/* 本线程使用的包，不持有额外计数；包被替换后在下一次调用时换用新包 */
+static struct asset_pack *pack_current(void)
+{
+    if (__atomic_load_n(&pack_generation, __ATOMIC_ACQUIRE) == loop_pack_generation)
+        return loop_pack;
+    pthread_mutex_lock(&pack_lock);
+    struct asset_pack *old = loop_pack;
+    loop_pack = pack_global;
+    if (loop_pack)
+        __sync_add_and_fetch(&loop_pack->refcnt, 1);
+    loop_pack_generation = pack_generation;
+    pthread_mutex_unlock(&pack_lock);
+    if (old)
+        pack_unref(old);
+    return loop_pack;
+}
+
+static void pack_install(struct asset_pack *pack)
+{
+    pthread_mutex_lock(&pack_lock);
+    struct asset_pack *old = pack_global;
+    pack_global = pack;
+    __atomic_store_n(&pack_generation, pack_generation + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&pack_lock);
+    if (old)
+        pack_unref(old);
+    printf("LINE %d: Serving pack %s: %u entries, %zu bytes\n", __LINE__, pack_path, pack->hdr->nentries, pack->size);
+}
+
+static int pack_same_file(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino && a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/* 定时检查包文件是否被替换；同一个无效文件只报告一次 */
+static void pack_check(evutil_socket_t fd, short events, void *arg)
+{
+    static struct stat rejected;
+    struct stat st;
+    if (stat(pack_path, &st) < 0 || (pack_global && pack_same_file(&st, &pack_global->st)) || pack_same_file(&st, &rejected))
+        return; // 只有本线程替换 pack_global，读取不需要加锁
+    struct asset_pack *pack = pack_load(pack_path);
+    if (pack == NULL)
+    {
+        rejected = st;
+        return;
+    }
+    pack_install(pack);
+}
+
+/* 读取 HTTP_PACK 并加载，进程启动时调用一次；加载失败时从 www 读取，等待下一次部署 */
+void pack_init(void)
+{
+    pack_path = env_str("HTTP_PACK", NULL);
+    if (pack_path == NULL)
+        return;
+    struct asset_pack *pack = pack_load(pack_path);
+    if (pack)
+        pack_install(pack);
+}
+
+/* 启动包文件检查定时器，只需一个循环执行 */
+void pack_init_loop(struct event_base *base)
+{
+    if (pack_path == NULL)
+        return;
+    struct timeval tv = {PACK_CHECK_INTERVAL, 0};
+    struct event *ev = event_new(base, -1, EV_PERSIST, pack_check, NULL);
+    event_add(ev, &tv);
+}
+
+/* 跳过逗号分隔列表中一项前后的空白，返回该项长度并把 *s 移到下一项 */
+static size_t pack_list_item(const char **s, const char *end, const char **item)
+{
+    const char *p = *s;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+        p++;
+    const char *q = p;
+    while (q < end && *q != ',')
+        q++;
+    *s = q;
+    *item = p;
+    while (q > p && (q[-1] == ' ' || q[-1] == '\t'))
+        q--;
+    return q - p;
+}
+
+/* Accept-Encoding 是否接受 gzip：列出 gzip 时按其 q 值，否则按 *；q=0 表示拒绝 */
+static int pack_accepts_gzip(const char *s, size_t len)
+{
+    const char *end = s + len, *item;
+    int star = 0;
+    while (s < end)
+    {
+        size_t n = pack_list_item(&s, end, &item);
+        size_t name = 0;
+        while (name < n && item[name] != ';' && item[name] != ' ' && item[name] != '\t')
+            name++;
+        const char *q = item + name;
+        while (q < item + n && (q = memchr(q, ';', item + n - q)) != NULL)
+        {
+            q++;
+            while (q < item + n && (*q == ' ' || *q == '\t'))
+                q++;
+            if (q + 1 < item + n && (*q == 'q' || *q == 'Q') && q[1] == '=')
+                break;
+        }
+        int accepted = 1;
+        if (q != NULL && q < item + n) // q=0、q=0.0 等
+        {
+            accepted = 0;
+            for (const char *d = q + 2; d < item + n && *d != ';' && *d != ' '; d++)
+                accepted |= *d >= '1' && *d <= '9';
+        }
+        if ((name == 4 && !strncasecmp(item, "gzip", 4)) || (name == 6 && !strncasecmp(item, "x-gzip", 6)))
+            return accepted;
+        if (name == 1 && item[0] == '*')
+            star = accepted;
+    }
+    return star;
+}
+
+/* 按 Accept-Encoding 选择变体 */
+static const struct pack_variant *pack_variant(const struct pack_entry *e, const char *accept, size_t len)
+{
+    if (accept && e->variants[PACK_GZIP].head_len && pack_accepts_gzip(accept, len))
+        return &e->variants[PACK_GZIP];
+    return &e->variants[PACK_IDENTITY];
+}
+
+/* If-None-Match 中是否有与 etag 相同的实体标签（弱比较）或 * */
+static int pack_etag_match(const char *s, size_t len, const char *etag)
+{
+    const char *end = s + len, *item;
+    size_t etag_len = strlen(etag);
+    while (s < end)
+    {
+        size_t n = pack_list_item(&s, end, &item);
+        if (n >= 2 && item[0] == 'W' && item[1] == '/')
+        {
+            item += 2;
+            n -= 2;
+        }
+        if ((n == 1 && item[0] == '*') || (n == etag_len && !memcmp(item, etag, n)))
+            return 1;
+    }
+    return 0;
+}
+
+/* 把预先生成的首部行逐行加入 evkeyvalq */
+static void pack_add_headers(struct evkeyvalq *headers, const char *s, size_t len)
+{
+    char line[PACK_HEAD_MAX + 1];
+    const char *end = s + len;
+    while (s < end)
+    {
+        const char *eol = memchr(s, '\n', end - s);
+        size_t n = (eol ? eol : end) - s;
+        memcpy(line, s, n);
+        line[n > 0 && line[n - 1] == '\r' ? n - 1 : n] = '\0';
+        s += n + 1;
+        char *value = strchr(line, ':');
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        evhttp_add_header(headers, line, value + strspn(value, " "));
+    }
+}
+
+/* 从包中返回 path（以 WEB_PATH 开头）对应的文件，包中没有时返回 -1 */
+int pack_serve(struct evhttp_request *req, const char *path)
+{
+    struct asset_pack *pack = pack_current();
+    size_t root = strlen(WEB_PATH);
+    const struct pack_entry *e;
+    if (pack == NULL || strncmp(path, WEB_PATH, root) || (e = pack_lookup(pack, path + root)) == NULL)
+        return -1;
+    struct evkeyvalq *in = evhttp_request_get_input_headers(req), *out = evhttp_request_get_output_headers(req);
+    const char *accept = evhttp_find_header(in, "Accept-Encoding"), *match = evhttp_find_header(in, "If-None-Match");
+    const struct pack_variant *v = pack_variant(e, accept, accept ? strlen(accept) : 0);
+    if (match && pack_etag_match(match, strlen(match), v->etag))
+    {
+        evhttp_add_header(out, "ETag", v->etag);
+        if (e->variants[PACK_GZIP].head_len)
+            evhttp_add_header(out, "Vary", "Accept-Encoding");
+        evhttp_send_reply(req, HTTP_NOTMODIFIED, "Not Modified", NULL);
+        return 0;
+    }
+    pack_add_headers(out, pack->base + v->head_off, v->head_len);
+    struct evbuffer *body = evbuffer_new();
+    pack_add_body(body, pack, v);
+    tcp_cork_response(req);
+    evhttp_send_reply(req, HTTP_OK, "OK", body);
+    evbuffer_free(body);
+    return 0;
+}
+
+/* 组装文件响应首部 */
+void add_file_headers(struct evkeyvalq *headers, const char *path, const struct stat *st)
+{
+    char date[64];
+    struct tm tm;
+    evhttp_add_header(headers, "Content-Type", get_content_type(path)); // 获取文件类型
+    gmtime_r(&st->st_mtime, &tm);
+    if (evutil_date_rfc1123(date, sizeof(date), &tm) > 0)
+        evhttp_add_header(headers, "Last-Modified", date);
+}
+
+/* 返回网页文件 */
+void serve_file(struct evhttp_request *req, char *path)
+{
+    if (pack_serve(req, path) == 0) // 静态资源包中的文件
+        return;
+    struct stat st, st_p;      // 获取文件
+    if (stat(path, &st) == -1) // 请求文件不存在
+    {
+        printf("LINE %d: %s%s\n", __LINE__, path, "-file not found");
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文件未找到
+        return;
+    }
+    else
+    {
+        if (S_ISDIR(st.st_mode)) // 若path是目录，自动添加index.html
+        {
+            strcat(path, "/index.html");
+            if (stat(path, &st_p) == -1)
+            {
+                printf("LINE %d: %s%s\n", __LINE__, path, "-file not found");
+                evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文件未找到
+                return;
+            }
+            st = st_p;
+        }
+
+        int fd = -1;
+        if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        {
+            printf("LINE %d: %s\n", __LINE__, "Open | fstat failed.");
+            evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文档打开失败
+            return;
+        }
+        // 添加响应头信息
+        add_file_headers(evhttp_request_get_output_headers(req), path, &st);
+        // HTTPS 无法使用 sendfile，直接引用映射的文件页交给 OpenSSL 加密，省去读入用户态缓冲区的拷贝
+        int use_mmap = request_is_tls(req) && env_int("HTTP_TLS_MMAP", 1);
+        if (serve_file_stream(req, fd, st.st_size, use_mmap) == 0 ||
+            (use_mmap && serve_file_stream(req, fd, st.st_size, 0) == 0)) // 映射失败时改用文件段
+            return;
+        close(fd);
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+    }
+}
+
+/* 判断请求是否来自 HTTPS 连接 */
+int request_is_tls(struct evhttp_request *req)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (evcon == NULL)
+        return 0;
+    return bufferevent_openssl_get_ssl(evhttp_connection_get_bufferevent(evcon)) != NULL;
+}
+
+/* 文件映射窗口，引用它的所有 evbuffer 分块释放后解除映射 */
+struct mmap_window
+{
+    void *addr;
+    size_t len;
+    int refcnt;
+};
+
+void mmap_window_unref(const void *data, size_t datalen, void *extra)
+{
+    struct mmap_window *win = (struct mmap_window *)extra;
+    if (__sync_sub_and_fetch(&win->refcnt, 1) == 0)
+    {
+        munmap(win->addr, win->len);
+        free(win);
+    }
+}
+
+/*
+* HTTPS 响应首部与文件内容合并发送
+* OpenSSL bufferevent 对输出缓冲区的每个数据块分别调用 SSL_write，首部、分块头与每个分块各成为一个 TLS 记录，
+* 开启 TCP_NODELAY 后各自成为一个小包。发送文件期间设置 TCP_CORK，内核只发出满 MSS 的包，
+* 输出缓冲区写空时解除，剩余部分立即发出
+* HTTP 的首部与分块（已读入内存的文件段）由一次 writev 写出，本身就在同一个包中，设置 TCP_CORK 只会多两次系统调用
+*/
+int tcp_cork_enabled = 1;
+
+void tcp_uncork_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info, void *arg)
+{
+    if (info->n_deleted == 0 || evbuffer_get_length(buf) > 0)
+        return;
+    int fd = (int)(intptr_t)arg, off = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+    evbuffer_remove_cb(buf, tcp_uncork_cb, arg); // 允许在回调中移除自身
+}
+
+void tcp_cork_response(struct evhttp_request *req)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (tcp_cork_enabled && evcon != NULL && request_is_tls(req))
+        tcp_cork_bev(evhttp_connection_get_bufferevent(evcon));
+}
+
+/* 设置 TCP_CORK，输出缓冲区写空时解除 */
+void tcp_cork_bev(struct bufferevent *bev)
+{
+    int fd = bufferevent_getfd(bev), on = 1;
+    if (fd < 0)
+        return;
+    struct evbuffer *output = bufferevent_get_output(bev);
+    evbuffer_remove_cb(output, tcp_uncork_cb, (void *)(intptr_t)fd); // 管线化时上一个响应可能尚未写完
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    evbuffer_add_cb(output, tcp_uncork_cb, (void *)(intptr_t)fd);
+}
+
+/*
+* 分块响应发送到中途失败：关闭连接的发送方向，之后的结束分块不会送达，
+* 客户端看到没有结束分块的连接关闭，能识别出响应不完整，而不是收到一个被截断的"完整"响应
+*/
+void stream_abort(struct evhttp_request *req)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    int fd = evcon ? bufferevent_getfd(evhttp_connection_get_bufferevent(evcon)) : -1;
+    if (fd >= 0)
+        shutdown(fd, SHUT_WR);
+}
+
+/* 映射从 offset 开始的一个窗口，由调用者持有一个引用 */
+struct mmap_window *mmap_window_new(int fd, off_t offset, off_t size)
+{
+    size_t len = size - offset > MMAP_WINDOW_SIZE ? MMAP_WINDOW_SIZE : size - offset;
+    void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, offset);
+    if (addr == MAP_FAILED)
+    {
+        printf("LINE %d: mmap failed: %s\n", __LINE__, strerror(errno));
+        return NULL;
+    }
+    madvise(addr, len, MADV_SEQUENTIAL);
+    struct mmap_window *win = (struct mmap_window *)malloc(sizeof(struct mmap_window));
+    win->addr = addr;
+    win->len = len;
+    win->refcnt = 1;
+    return win;
+}
+
+/*
+* 文件流式发送
+* 连接输出缓冲区中待发送的数据不超过 STREAM_HIGH_WATERMARK，降到 STREAM_LOW_WATERMARK 时
+* 由 evhttp_send_reply_chunk_with_cb 的回调继续填充，每个连接占用的缓冲与文件引用和文件大小、客户端速度无关
+* HTTP 的分块引用同一文件段（sendfile）；HTTPS 的分块通过 evbuffer_add_reference 引用 mmap 窗口中的页，
+* 不做拷贝，窗口发送完才映射下一个
+* 注意：发送期间文件被截断会导致访问映射页时 SIGBUS，静态文件目录应只做原子替换
+*/
+struct file_stream
+{
+    struct evhttp_request *req;
+    int fd;
+    off_t offset, size;
+    struct evbuffer_file_segment *seg; // HTTP
+    struct mmap_window *win;           // HTTPS 当前窗口
+    off_t win_offset;                  // 当前窗口在文件中的起点
+};
+
+void file_stream_free(struct file_stream *stream)
+{
+    if (stream->seg)
+        evbuffer_file_segment_free(stream->seg); // 最后一个分块发出后关闭 fd
+    else
+        close(stream->fd); // 映射在关闭 fd 后仍然有效
+    if (stream->win)
+        mmap_window_unref(NULL, 0, stream->win);
+    free(stream);
+}
+
+/* 客户端在发送完成前断开：请求已与连接分离，结束它以释放 */
+void file_stream_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct file_stream *stream = (struct file_stream *)arg;
+    evhttp_send_reply_end(stream->req);
+    file_stream_free(stream);
+}
+
+void file_stream_fill(struct file_stream *stream);
+
+void file_stream_drained(struct evhttp_connection *evcon, void *arg)
+{
+    file_stream_fill((struct file_stream *)arg);
+}
+
+void file_stream_fill(struct file_stream *stream)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(stream->req);
+    struct bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
+    struct evbuffer *output = bufferevent_get_output(bev);
+    while (stream->offset < stream->size && evbuffer_get_length(output) < STREAM_HIGH_WATERMARK)
+    {
+        struct evbuffer *buf = evbuffer_new();
+        size_t n;
+        if (stream->seg)
+        {
+            n = stream->size - stream->offset > MAX_BUF_SIZE ? MAX_BUF_SIZE : stream->size - stream->offset;
+            evbuffer_add_file_segment(buf, stream->seg, stream->offset, n);
+        }
+        else
+        {
+            if (stream->offset == stream->win_offset + (off_t)stream->win->len) // 当前窗口已全部排入
+            {
+                mmap_window_unref(NULL, 0, stream->win);
+                stream->win = mmap_window_new(stream->fd, stream->offset, stream->size);
+                stream->win_offset = stream->offset;
+                if (stream->win == NULL)
+                {
+                    evbuffer_free(buf);
+                    break; // 已发送部分内容，只能断开连接
+                }
+            }
+            size_t left = stream->win_offset + stream->win->len - stream->offset;
+            n = left > TLS_CHUNK_SIZE ? TLS_CHUNK_SIZE : left;
+            __sync_add_and_fetch(&stream->win->refcnt, 1);
+            evbuffer_add_reference(buf, (char *)stream->win->addr + (stream->offset - stream->win_offset), n,
+                                   mmap_window_unref, stream->win);
+        }
+        stream->offset += n;
+        evhttp_send_reply_chunk_with_cb(stream->req, buf, file_stream_drained, stream);
+        evbuffer_free(buf);
+    }
+    if (stream->offset < stream->size && (stream->seg || stream->win)) // win 为 NULL 表示映射失败
+        return; // 等待输出缓冲区降到低水位
+
+    // 全部排入输出缓冲区：恢复默认水位，让 evhttp 在数据全部写出后才完成请求
+    if (stream->offset < stream->size) // 映射失败，已发送部分内容
+        stream_abort(stream->req);
+    bufferevent_setwatermark(bev, EV_WRITE, 0, 0);
+    evhttp_connection_set_closecb(evcon, NULL, NULL);
+    evhttp_send_reply_end(stream->req); // 结束分块
+    file_stream_free(stream);
+}
+
+/*
+* 以分块传输流式发送文件，use_mmap 时引用映射页（HTTPS），否则使用文件段
+* 无法开始时返回 -1，fd 仍归调用者（尚未开始响应，可改用其他方式）；成功后接管 fd
+*/
+int serve_file_stream(struct evhttp_request *req, int fd, off_t size, int use_mmap)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    struct mmap_window *win = NULL;
+    struct evbuffer_file_segment *seg = NULL;
+    if (evcon == NULL)
+        return -1;
+    if (use_mmap && size > 0 && (win = mmap_window_new(fd, 0, size)) == NULL)
+        return -1;
+    // 各分块共享同一文件段（evbuffer_add_file 每次调用都会接管并关闭fd，不能对同一fd重复使用）
+    if (!use_mmap && (seg = evbuffer_file_segment_new(fd, 0, size, EVBUF_FS_CLOSE_ON_FREE)) == NULL)
+        return -1;
+
+    struct file_stream *stream = (struct file_stream *)calloc(1, sizeof(struct file_stream));
+    stream->req = req;
+    stream->fd = fd;
+    stream->size = size;
+    stream->seg = seg;
+    stream->win = win;
+    tcp_cork_response(req);
+    evhttp_send_reply_start(req, HTTP_OK, "OK"); // 分块传输
+    bufferevent_setwatermark(evhttp_connection_get_bufferevent(evcon), EV_WRITE, STREAM_LOW_WATERMARK, 0);
+    evhttp_connection_set_closecb(evcon, file_stream_close_cb, stream);
+    file_stream_fill(stream);
+    return 0;
+}
+
+/*
+* 解析GET请求URI：拒绝包含 .. 的路径，解析查询参数，生成网页文件路径
+* 返回 -1 表示疑似路径穿越，-2 表示参数错误；成功时调用者负责 evhttp_clear_headers(query)
+*/
+int parse_request_uri(const char *uri, char *path, size_t size, struct evkeyvalq *query)
+{
+    if (strstr(uri, "..")) // 请求中包含 ..
+        return -1;
+    if (evhttp_parse_query(uri, query) == -1) // 参数错误
+        return -2;
+    int len = snprintf(path, size, "%s%.*s", WEB_PATH, (int)strcspn(uri, "?"), uri); // 网页文件路径
+    if (len > 0 && (size_t)len < size && path[len - 1] == '/') // 默认找路径下的index.html
+        snprintf(path + len, size - len, "index.html");
+    return 0;
+}
+
+/* 处理GET请求 */
+void handle_get_request(struct evhttp_request *req, void *arg)
+{
+    // 解析URI参数
+    const char *uri = evhttp_request_get_uri(req); // get url
+    printf("LINE %d: %s%s\n", __LINE__, "Get a 'get' request:", uri);
+    struct evkeyvalq http_query; // get argument
+    char path[512];
+    switch (parse_request_uri(uri, path, sizeof(path), &http_query))
+    {
+    case -1:
+        printf("LINE %d: %s\n", __LINE__, "Get a request include '..'.");
+        evhttp_send_error(req, HTTP_BADREQUEST, "Are You Hacking Me?");
+        return;
+    case -2:
+        printf("LINE %d: %s\n", __LINE__, "Get request parm failed");
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+
+    // 遍历输出参数
+    struct evkeyval *header;
+    for (header = http_query.tqh_first; header; header = header->next.tqe_next)
+    {
+        printf("  %s: %s\n", header->key, header->value);
+    }
+    evhttp_clear_headers(&http_query);
+
+    serve_file(req, path); // 向客户端返回数据
+}
+
+/* 处理POST请求 */
+void handle_post_request(struct evhttp_request *req, void *arg)
+{
+    // 处理post请求数据：请求体留在 evbuffer 中，由 execute_cgi 流式解析
+    struct evbuffer *body = evhttp_request_get_input_buffer(req);
+    size_t post_size = evbuffer_get_length(body);
+    if (post_size == 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Post message is empty");
+        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: Message is empty!");
+        return;
+    }
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    printf("LINE %d: Post len:%zu\n", __LINE__, post_size);
+    if (path && !strcmp(path, BATCH_ROUTE))
+        handle_factor_batch(req, body);
+    else
+        execute_cgi(req, path ? path : "/", body);
+}
+
+/*
+* 解析 multipart/form-data 请求体中的文件部分
+* 第一行为分隔符 --boundary，part首部中含 filename="..."，数据以 \r\n--boundary 结束
+* 成功返回0，data 指向 body 内的文件数据（不拷贝）
+*/
+int multipart_parse(const char *body, size_t len, char *filename, size_t fn_size, const char **data, size_t *data_len)
+{
+    const char *end = body + len;
+    const char *eol = memmem(body, len, "\r\n", 2);
+    if (eol == NULL || eol - body < 3 || body[0] != '-' || body[1] != '-')
+        return -1;
+    size_t boundary_len = eol - body; // 含前导 --
+    const char *head_end = memmem(eol, end - eol, "\r\n\r\n", 4);
+    if (head_end == NULL)
+        return -1;
+
+    // 获取文件名，只保留最后一级，防止路径穿越
+    const char *fn = memmem(eol, head_end - eol, "filename=\"", 10);
+    if (fn == NULL)
+        return -1;
+    fn += 10;
+    const char *fn_end = memchr(fn, '"', head_end - fn);
+    if (fn_end == NULL)
+        return -1;
+    for (const char *p = fn; p < fn_end; p++)
+    {
+        if (*p == '/' || *p == '\\')
+            fn = p + 1;
+    }
+    size_t fn_len = fn_end - fn;
+    if (fn_len == 0 || fn_len >= fn_size || (fn[0] == '.' && (fn_len == 1 || (fn_len == 2 && fn[1] == '.'))))
+        return -1;
+    memcpy(filename, fn, fn_len);
+    filename[fn_len] = '\0';
+
+    // 查找结束分隔符
+    const char *start = head_end + 4, *p = start;
+    for (;;)
+    {
+        const char *b = memmem(p, end - p, body, boundary_len);
+        if (b == NULL)
+            return -1;
+        if (b - start >= 2 && b[-2] == '\r' && b[-1] == '\n')
+        {
+            *data = start;
+            *data_len = b - 2 - start;
+            return 0;
+        }
+        p = b + 1;
+    }
+}
+
+/*
+* 线程池：阻塞的磁盘或计算任务在工作线程执行，done 回调通过 event_base_once 回到提交任务的事件循环
+* 需要在创建 event_base 之前调用 evthread_use_pthreads()
+*/
+struct work_item
+{
+    void (*work)(void *);
+    void (*done)(void *);
+    void *arg;
+    struct event_base *base;
+    struct work_item *next;
+};
+
+struct work_pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct work_item *head, *tail;
+    int pending; // 队列中尚未开始的任务数，准入控制读取
+};
+
+void work_item_done(evutil_socket_t fd, short events, void *arg)
+{
+    struct work_item *item = (struct work_item *)arg;
+    item->done(item->arg);
+    free(item);
+}
+
+void *work_thread(void *arg)
+{
+    struct work_pool *pool = (struct work_pool *)arg;
+    for (;;)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->head == NULL)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        struct work_item *item = pool->head;
+        pool->head = item->next;
+        if (pool->head == NULL)
+            pool->tail = NULL;
+        __atomic_store_n(&pool->pending, pool->pending - 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&pool->lock);
+
+        item->work(item->arg);
+        struct timeval now = {0, 0};
+        event_base_once(item->base, -1, EV_TIMEOUT, work_item_done, item, &now);
+    }
+    return NULL;
+}
+
+struct work_pool *work_pool_new(int nthreads)
+{
+    struct work_pool *pool = (struct work_pool *)calloc(1, sizeof(struct work_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, work_thread, pool) != 0)
+        {
+            printf("LINE %d: %s\n", __LINE__, "work thread create failed");
+            break;
+        }
+        pthread_detach(tid);
+    }
+    return pool;
+}
+
+void work_submit(struct work_pool *pool, struct event_base *base, void (*work)(void *), void (*done)(void *), void *arg)
+{
+    struct work_item *item = (struct work_item *)malloc(sizeof(struct work_item));
+    item->work = work;
+    item->done = done;
+    item->arg = arg;
+    item->base = base;
+    item->next = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->tail)
+        pool->tail->next = item;
+    else
+        pool->head = item;
+    pool->tail = item;
+    __atomic_store_n(&pool->pending, pool->pending + 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int work_pool_pending(struct work_pool *pool)
+{
+    return pool ? __atomic_load_n(&pool->pending, __ATOMIC_RELAXED) : 0;
+}
+
+/* 以十六进制写出二进制数据，out 至少 2*len+1 字节 */
+void hex_encode(const unsigned char *in, size_t len, char *out)
+{
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++)
+    {
+        out[2 * i] = hex[in[i] >> 4];
+        out[2 * i + 1] = hex[in[i] & 0xf];
+    }
+    out[2 * len] = '\0';
+}
+
+/* 持久化目录项（rename/link/unlink 之后调用） */
+void fsync_dir(const char *dir)
+{
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd >= 0)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/* 比较 base64 摘要，忽略首尾空白 */
+int digest_b64_equal(const char *value, size_t value_len, const unsigned char *md, unsigned int md_len)
+{
+    char b64[EVP_MAX_MD_SIZE * 2];
+    int n = EVP_EncodeBlock((unsigned char *)b64, md, md_len);
+    while (value_len && (*value == ' ' || *value == '\t'))
+        value++, value_len--;
+    while (value_len && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t'))
+        value_len--;
+    return value_len == (size_t)n && !memcmp(value, b64, n);
+}
+
+/* 逐块计算 evbuffer 内容的摘要，不做 pullup；返回摘要长度，失败返回 0 */
+unsigned int digest_evbuffer(struct evbuffer *buf, const EVP_MD *type, unsigned char *md)
+{
+    unsigned int md_len = 0;
+    int n = evbuffer_peek(buf, -1, NULL, NULL, 0);
+    struct evbuffer_iovec *vec = (struct evbuffer_iovec *)malloc((n > 0 ? n : 1) * sizeof(struct evbuffer_iovec));
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    int ok = vec && ctx && EVP_DigestInit_ex(ctx, type, NULL);
+    n = evbuffer_peek(buf, -1, NULL, vec, n);
+    for (int i = 0; ok && i < n; i++)
+        ok = EVP_DigestUpdate(ctx, vec[i].iov_base, vec[i].iov_len);
+    if (ok && !EVP_DigestFinal_ex(ctx, md, &md_len))
+        md_len = 0;
+    EVP_MD_CTX_free(ctx);
+    free(vec);
+    return md_len;
+}
+
+/*
+* 校验客户端提供的文件内容摘要，支持 Digest: sha-256=<base64>, md5=<base64> 与 Content-MD5: <base64>
+* digest/content_md5 为对应请求头（可为NULL），未提供或只含未知算法时视为通过；返回 -1 表示不匹配
+*/
+int upload_verify_digest(const char *digest, const char *content_md5, struct evbuffer *body, const unsigned char *sha256)
+{
+    unsigned char md5[EVP_MAX_MD_SIZE];
+    unsigned int md5_len = 0;
+    if ((content_md5 || (digest && strcasestr(digest, "md5="))) && !(md5_len = digest_evbuffer(body, EVP_md5(), md5)))
+        return -1;
+    if (content_md5 && !digest_b64_equal(content_md5, strlen(content_md5), md5, md5_len))
+        return -1;
+    for (const char *p = digest; p && *p;)
+    {
+        const char *end = strchr(p, ',');
+        size_t item_len = end ? (size_t)(end - p) : strlen(p);
+        while (item_len && *p == ' ')
+            p++, item_len--;
+        if (item_len > 8 && !strncasecmp(p, "sha-256=", 8) && !digest_b64_equal(p + 8, item_len - 8, sha256, 32))
+            return -1;
+        if (item_len > 4 && !strncasecmp(p, "md5=", 4) && !digest_b64_equal(p + 4, item_len - 4, md5, md5_len))
+            return -1;
+        p = end ? end + 1 : NULL;
+    }
+    return 0;
+}
+
+/*
+* io_uring 后端（HTTP_IO_BACKEND=uring）
+* 每个事件循环一个 ring，不依赖 liburing，直接使用系统调用与共享的提交/完成队列
+* 完成事件经注册的 eventfd（边沿触发，无需读取）唤醒 libevent，回调在事件循环线程中执行；
+* 各回调中准备的请求先写入提交队列，由一个激活事件在本轮回调之后以一次 io_uring_enter 批量提交
+* 读取使用注册的缓冲区组（IORING_REGISTER_PBUF_RING），空闲连接不占用读缓冲区
+* 需要 5.19 以上的内核（缓冲区环与多次触发的 accept），不满足时 uring_new 返回 NULL，调用方回退到 epoll
+*/
+int io_uring_enabled = 0;
+static __thread struct uring *loop_uring; // 本事件循环的 ring，未启用时为 NULL
+
+struct uring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // 已写入未发布的提交位置
+    unsigned unsubmitted;
+    void *ring_mem;
+    size_t ring_len, sqes_len;
+    struct io_uring_buf_ring *bufring;
+    char *bufs;
+    int efd;
+    struct event *cq_ev, *flush_ev;
+    struct uring_op *current; // 正在执行回调的操作，回调返回后才能释放
+    int npipes;
+    struct uring_pipe pipes[URING_PIPES];
+};
+
+static const struct __kernel_timespec uring_timeout = {ENGINE_TIMEOUT, 0};
+
+static int uring_enter(int fd, unsigned to_submit)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, 0, 0, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+/* 发布并提交队列中的请求 */
+static void uring_submit(struct uring *ring)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    while (ring->unsubmitted)
+    {
+        int n = uring_enter(ring->fd, ring->unsubmitted);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            printf("LINE %d: io_uring_enter failed: %s\n", __LINE__, strerror(errno));
+            break; // 已发布的请求留在队列中，下次提交时一并处理
+        }
+        ring->unsubmitted -= n;
+    }
+}
+
+static void uring_flush_cb(evutil_socket_t fd, short events, void *arg)
+{
+    uring_submit((struct uring *)arg);
+}
+
+/* 保证接下来的 n 个请求在同一次提交中（链接的请求不能跨提交） */
+void uring_reserve(struct uring *ring, unsigned n)
+{
+    if (ring->sq_local_tail + n - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) > ring->sq_entries)
+        uring_submit(ring);
+}
+
+/* 取一个提交项，op 为 NULL 时完成事件被忽略 */
+static struct io_uring_sqe *uring_sqe(struct uring *ring, struct uring_op *op, int step)
+{
+    uring_reserve(ring, 1);
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = op ? (uintptr_t)op | (unsigned)step : 0;
+    if (op)
+        op->inflight++;
+    ring->sq_local_tail++;
+    if (ring->unsubmitted++ == 0)
+        event_active(ring->flush_ev, EV_TIMEOUT, 0);
+    return sqe;
+}
+
+/* 处理完成队列；回调可能再提交请求，或通过置空 arg 交出 op */
+static void uring_cq_cb(evutil_socket_t fd, short events, void *arg)
+{
+    struct uring *ring = (struct uring *)arg;
+    unsigned head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+        struct uring_op *op = (struct uring_op *)(uintptr_t)(user_data & ~(uint64_t)7);
+        if (op == NULL)
+            continue;
+        if (!(flags & IORING_CQE_F_MORE))
+            op->inflight--;
+        ring->current = op;
+        op->cb(op, (int)(user_data & 7), res, flags);
+        ring->current = NULL;
+        if (op->arg == NULL && op->inflight == 0)
+            free(op);
+    }
+}
+
+/* 检查所需操作是否都受支持 */
+static int uring_probe(int fd)
+{
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_SPLICE, IORING_OP_POLL_ADD,
+                              IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL, IORING_OP_WRITEV, IORING_OP_FSYNC};
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = (struct io_uring_probe *)calloc(1, len);
+    int ok = uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; ok && i < sizeof(ops) / sizeof(ops[0]); i++)
+        ok = ops[i] <= probe->last_op && (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok ? 0 : -1;
+}
+
+struct uring *uring_new(struct event_base *base)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = URING_ENTRIES * 4; // 多次触发的 accept 与 recv 的超时各产生完成事件
+    int fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0)
+    {
+        printf("LINE %d: io_uring_setup failed: %s\n", __LINE__, strerror(errno));
+        return NULL;
+    }
+    struct uring *ring = (struct uring *)calloc(1, sizeof(struct uring));
+    ring->fd = fd;
+    ring->efd = -1;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_FAST_POLL) || uring_probe(fd) < 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "io_uring lacks required features");
+        uring_free(ring);
+        return NULL;
+    }
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_mem = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->ring_mem == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        printf("LINE %d: io_uring mmap failed: %s\n", __LINE__, strerror(errno));
+        uring_free(ring);
+        return NULL;
+    }
+    char *m = (char *)ring->ring_mem;
+    ring->sq_head = (unsigned *)(m + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(m + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(m + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(m + p.sq_off.array);
+    ring->cq_head = (unsigned *)(m + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(m + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(m + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(m + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    for (unsigned i = 0; i < p.sq_entries; i++) // 提交项与队列位置一一对应
+        ring->sq_array[i] = i;
+
+    // 读取缓冲区组：内核在数据到达时才从中取缓冲区
+    ring->bufring = (struct io_uring_buf_ring *)mmap(NULL, URING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring->bufs = (char *)mmap(NULL, (size_t)URING_BUFS * URING_BUF_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring->bufring;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = 0;
+    if (ring->bufring == MAP_FAILED || ring->bufs == MAP_FAILED || uring_register(fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+    {
+        printf("LINE %d: io_uring buffer ring failed: %s\n", __LINE__, strerror(errno));
+        uring_free(ring);
+        return NULL;
+    }
+    for (int i = 0; i < URING_BUFS; i++)
+    {
+        struct io_uring_buf *b = &ring->bufring->bufs[i];
+        b->addr = (uintptr_t)(ring->bufs + (size_t)i * URING_BUF_SIZE);
+        b->len = URING_BUF_SIZE;
+        b->bid = i;
+    }
+    __atomic_store_n(&ring->bufring->tail, URING_BUFS, __ATOMIC_RELEASE);
+
+    ring->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->efd < 0 || uring_register(fd, IORING_REGISTER_EVENTFD, &ring->efd, 1) < 0)
+    {
+        printf("LINE %d: io_uring eventfd failed: %s\n", __LINE__, strerror(errno));
+        uring_free(ring);
+        return NULL;
+    }
+    ring->cq_ev = event_new(base, ring->efd, EV_READ | EV_PERSIST | EV_ET, uring_cq_cb, ring);
+    ring->flush_ev = event_new(base, -1, 0, uring_flush_cb, ring);
+    event_add(ring->cq_ev, NULL);
+    return ring;
+}
+
+void uring_free(struct uring *ring)
+{
+    if (ring->cq_ev)
+        event_free(ring->cq_ev);
+    if (ring->flush_ev)
+        event_free(ring->flush_ev);
+    if (ring->efd >= 0)
+        close(ring->efd);
+    if (ring->ring_mem && ring->ring_mem != MAP_FAILED)
+        munmap(ring->ring_mem, ring->ring_len);
+    if (ring->sqes && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_len);
+    if (ring->bufring && ring->bufring != MAP_FAILED)
+        munmap(ring->bufring, URING_BUFS * sizeof(struct io_uring_buf));
+    if (ring->bufs && ring->bufs != MAP_FAILED)
+        munmap(ring->bufs, (size_t)URING_BUFS * URING_BUF_SIZE);
+    for (int i = 0; i < ring->npipes; i++)
+    {
+        close(ring->pipes[i].fd[0]);
+        close(ring->pipes[i].fd[1]);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+/* size 为包含 struct uring_op（第一个成员）的结构大小 */
+struct uring_op *uring_op_new(void (*cb)(struct uring_op *, int, int, unsigned), void *arg, size_t size)
+{
+    struct uring_op *op = (struct uring_op *)calloc(1, size);
+    op->cb = cb;
+    op->arg = arg;
+    return op;
+}
+
+/* 所属对象释放：取消 0..steps-1 各步骤仍未完成的请求，op 由最后一个完成事件释放 */
+void uring_op_release(struct uring *ring, struct uring_op *op, int steps)
+{
+    op->arg = NULL;
+    if (op->inflight == 0)
+    {
+        if (op != ring->current)
+            free(op);
+        return;
+    }
+    for (int step = 0; step < steps; step++)
+    {
+        struct io_uring_sqe *sqe = uring_sqe(ring, NULL, 0);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t)op | (unsigned)step;
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+    }
+}
+
+/* 多次触发的 accept，每个新连接一个完成事件，res 为已设置非阻塞的 fd */
+void uring_accept(struct uring *ring, struct uring_op *op, int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, 0);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+/* 读取到缓冲区组中的一个缓冲区（完成事件带 IORING_CQE_F_BUFFER），ENGINE_TIMEOUT 内没有数据时以 -ECANCELED 结束 */
+void uring_recv(struct uring *ring, struct uring_op *op, int fd)
+{
+    uring_reserve(ring, 2);
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, 0);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = URING_BUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->buf_group = 0;
+    sqe = uring_sqe(ring, NULL, 0);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&uring_timeout;
+    sqe->len = 1;
+}
+
+/* 发送完整的 len 字节（MSG_WAITALL），link 非零时与下一个请求链接 */
+void uring_send(struct uring *ring, struct uring_op *op, int step, int fd, const void *buf, size_t len, int link)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, step);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+}
+
+/* off 为 -1 表示 in 为管道或套接字；结果不足 len 时链接中的后续请求以 -ECANCELED 结束 */
+void uring_splice(struct uring *ring, struct uring_op *op, int step, int in, int64_t off, int out, size_t len, int link)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, step);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->splice_fd_in = in;
+    sqe->splice_off_in = (uint64_t)off;
+    sqe->fd = out;
+    sqe->off = (uint64_t)-1;
+    sqe->len = len;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+}
+
+/* 等待套接字可写，ENGINE_TIMEOUT 后以 -ECANCELED 结束 */
+void uring_poll_out(struct uring *ring, struct uring_op *op, int step, int fd)
+{
+    uring_reserve(ring, 2);
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, step);
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe = uring_sqe(ring, NULL, 0);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->addr = (uintptr_t)&uring_timeout;
+    sqe->len = 1;
+}
+
+/* iov 须保持有效直到完成 */
+void uring_writev(struct uring *ring, struct uring_op *op, int step, int fd, const struct iovec *iov, int n, int64_t off, int link)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, step);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)iov;
+    sqe->len = n;
+    sqe->off = (uint64_t)off;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+}
+
+void uring_fsync(struct uring *ring, struct uring_op *op, int step, int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe(ring, op, step);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = fd;
+}
+
+/* 完成事件中的缓冲区，处理后须以 uring_buf_return 归还 */
+char *uring_buf(struct uring *ring, unsigned flags)
+{
+    return ring->bufs + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * URING_BUF_SIZE;
+}
+
+void uring_buf_return(struct uring *ring, unsigned flags)
+{
+    unsigned short bid = flags >> IORING_CQE_BUFFER_SHIFT, tail = ring->bufring->tail;
+    struct io_uring_buf *b = &ring->bufring->bufs[tail & (URING_BUFS - 1)];
+    b->addr = (uintptr_t)(ring->bufs + (size_t)bid * URING_BUF_SIZE);
+    b->len = URING_BUF_SIZE;
+    b->bid = bid;
+    __atomic_store_n(&ring->bufring->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+/* 取一个空管道，容量尽量调整为 STREAM_HIGH_WATERMARK，使一个静态文件只需一次 splice */
+int uring_pipe_get(struct uring *ring, struct uring_pipe *pipe)
+{
+    if (ring->npipes)
+    {
+        *pipe = ring->pipes[--ring->npipes];
+        return 0;
+    }
+    if (pipe2(pipe->fd, O_CLOEXEC) < 0)
+        return -1;
+    pipe->size = fcntl(pipe->fd[1], F_SETPIPE_SZ, STREAM_HIGH_WATERMARK);
+    if (pipe->size < 0)
+        pipe->size = 65536; // 超过 pipe-max-size 时保持默认容量
+    return 0;
+}
+
+/* empty 为零时管道中可能有残留数据，直接关闭 */
+void uring_pipe_put(struct uring *ring, struct uring_pipe *pipe, int empty)
+{
+    if (empty && ring->npipes < URING_PIPES)
+    {
+        ring->pipes[ring->npipes++] = *pipe;
+        return;
+    }
+    close(pipe->fd[0]);
+    close(pipe->fd[1]);
+}
+
+/*
+* 内容寻址存储：对象按 SHA-256 保存为 upload/.objects/<前2位>/<其余62位>
+* 对象已存在时不再写盘，返回 1；新写入返回 0（会取走 body 中的数据）；失败返回 -1
+* 先按长度预分配临时文件，写入并 fsync 后再 rename，保证以摘要命名的对象内容完整
+* store_open/store_commit 为其前后两半，供由 io_uring 写入与 fsync 的上传使用
+*/
+int store_put(struct evbuffer *body, const char *hex)
+{
+    char tmp[512];
+    int fd;
+    int rc = store_open(hex, evbuffer_get_length(body), tmp, sizeof(tmp), &fd);
+    if (rc != 0)
+        return rc;
+    while (evbuffer_get_length(body) > 0) // 按块 writev，不合并缓冲区
+    {
+        if (evbuffer_write(body, fd) < 0 && errno != EINTR)
+            break;
+    }
+    int ok = evbuffer_get_length(body) == 0 && fsync(fd) == 0;
+    if (!ok)
+        printf("LINE %d: %s-write failed: %s\n", __LINE__, tmp, strerror(errno));
+    return store_commit(hex, tmp, fd, ok);
+}
+
+/*
+* 对象已存在时刷新其 ctime 并返回 1，否则返回 0
+* 调用方随后才建立文件名链接，期间对象链接数为1；store_gc 跳过一个清理间隔内 ctime 有变化的对象，
+* 并用对象目录上的 flock 保证不会在检查与删除之间被命中
+*/
+int store_touch(const char *hex)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%.2s/%s", UPLOAD_OBJECTS_DIR, hex, hex + 2);
+    int lock = open(UPLOAD_OBJECTS_DIR, O_RDONLY | O_DIRECTORY);
+    if (lock >= 0)
+        flock(lock, LOCK_SH);
+    int found = utimensat(AT_FDCWD, path, NULL, 0) == 0;
+    if (lock >= 0)
+        close(lock);
+    return found;
+}
+
+/* 对象已存在返回 1；否则创建并预分配临时文件，fd 与路径由 fd/tmp 返回，返回 0；失败返回 -1 */
+int store_open(const char *hex, size_t len, char *tmp, size_t tmp_size, int *fd)
+{
+    if (store_touch(hex)) // 相同内容已存储
+        return 1;
+    mkdir(UPLOAD_OBJECTS_DIR, 0755);
+    snprintf(tmp, tmp_size, "%s/%.2s", UPLOAD_OBJECTS_DIR, hex);
+    mkdir(tmp, 0755);
+    snprintf(tmp, tmp_size, "%s/tmp.XXXXXX", UPLOAD_OBJECTS_DIR);
+    *fd = mkstemp(tmp);
+    if (*fd < 0)
+    {
+        printf("LINE %d: %s-mkstemp failed: %s\n", __LINE__, tmp, strerror(errno));
+        return -1;
+    }
+    if ((len > 0 && fallocate(*fd, 0, 0, len) < 0 && errno != EOPNOTSUPP) || fchmod(*fd, 0644) < 0) // 一次分配连续空间，磁盘满时尽早失败
+    {
+        printf("LINE %d: %s-fallocate failed: %s\n", __LINE__, tmp, strerror(errno));
+        close(*fd);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* 关闭已写入并 fsync 的临时文件（ok 为 1）并以摘要命名，ok 为 0 时删除；返回 0 或 -1 */
+int store_commit(const char *hex, const char *tmp, int fd, int ok)
+{
+    char path[512];
+    close(fd);
+    if (!ok)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%.2s/%s", UPLOAD_OBJECTS_DIR, hex, hex + 2);
+    if (rename(tmp, path) < 0)
+    {
+        printf("LINE %d: %s-rename failed: %s\n", __LINE__, path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/%.2s", UPLOAD_OBJECTS_DIR, hex);
+    fsync_dir(path);
+    return 0;
+}
+
+/* 将文件名原子地指向对象（硬链接），已有同名文件时整体替换 */
+int store_link(const char *hex, const char *name)
+{
+    static __thread unsigned int seq = 0;
+    char obj[512], tmp[512], dst[512];
+    snprintf(obj, sizeof(obj), "%s/%.2s/%s", UPLOAD_OBJECTS_DIR, hex, hex + 2);
+    snprintf(tmp, sizeof(tmp), "%s/.link.%d.%lx.%u", UPLOAD_DIR, (int)getpid(), (unsigned long)pthread_self(), seq++);
+    snprintf(dst, sizeof(dst), "%s/%s", UPLOAD_DIR, name);
+    if (link(obj, tmp) < 0)
+    {
+        printf("LINE %d: %s-link failed: %s\n", __LINE__, obj, strerror(errno));
+        return -1;
+    }
+    if (rename(tmp, dst) < 0)
+    {
+        printf("LINE %d: %s-rename failed: %s\n", __LINE__, dst, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    unlink(tmp); // 目标已是同一对象的链接时 rename 不做任何操作，临时链接仍在
+    fsync_dir(UPLOAD_DIR);
+    return 0;
+}
+
+/*
+* 定时清理：删除已没有文件名引用（链接数为1）且 ctime 早于一个清理间隔的对象及遗留的临时文件
+* 定时器在 HTTP 循环 0 中触发，目录遍历、stat、flock 与 unlink 在 io_pool 中进行，上一轮未结束时跳过本轮
+*/
+struct store_gc_job
+{
+    int removed;
+};
+
+static int store_gc_running = 0; // 只在 HTTP 循环 0 中访问
+
+void store_gc_work(void *arg)
+{
+    struct store_gc_job *job = (struct store_gc_job *)arg;
+    DIR *top = opendir(UPLOAD_OBJECTS_DIR);
+    if (top == NULL)
+        return;
+    time_t now = time(NULL);
+    int removed = 0;
+    struct dirent *d, *e;
+    char path[1024];
+    while ((d = readdir(top)) != NULL)
+    {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", UPLOAD_OBJECTS_DIR, d->d_name);
+        if (!strncmp(d->d_name, "tmp.", 4))
+        {
+            if (stat(path, &st) == 0 && now - st.st_mtime > UPLOAD_GC_INTERVAL)
+                removed += unlink(path) == 0;
+            continue;
+        }
+        if (strlen(d->d_name) != 2 || !isxdigit((unsigned char)d->d_name[0]) || !isxdigit((unsigned char)d->d_name[1]))
+            continue; // 只处理摘要前缀目录（同时跳过 . 和 ..）
+        DIR *sub = opendir(path);
+        if (sub == NULL)
+            continue;
+        while ((e = readdir(sub)) != NULL)
+        {
+            snprintf(path, sizeof(path), "%s/%s/%s", UPLOAD_OBJECTS_DIR, d->d_name, e->d_name);
+            if (e->d_name[0] == '.' || stat(path, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink != 1 || now - st.st_ctime <= UPLOAD_GC_INTERVAL)
+                continue; // 新写入或刚被去重命中的对象在建立链接前链接数也是1，按 ctime 跳过
+            flock(dirfd(top), LOCK_EX);
+            if (stat(path, &st) == 0 && st.st_nlink == 1 && now - st.st_ctime > UPLOAD_GC_INTERVAL)
+                removed += unlink(path) == 0;
+            flock(dirfd(top), LOCK_UN);
+        }
+        closedir(sub);
+    }
+    closedir(top);
+
+    // 长时间没有进展的可续传上传
+    if ((top = opendir(UPLOAD_RESUMABLE_DIR)) != NULL)
+    {
+        while ((d = readdir(top)) != NULL)
+        {
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s/ranges", UPLOAD_RESUMABLE_DIR, d->d_name);
+            if (d->d_name[0] != '.' && stat(path, &st) == 0 && now - st.st_mtime > RESUMABLE_EXPIRE)
+            {
+                snprintf(path, sizeof(path), "%s/%s", UPLOAD_RESUMABLE_DIR, d->d_name);
+                resumable_remove(path);
+                removed++;
+            }
+        }
+        closedir(top);
+    }
+    job->removed = removed;
+}
+
+void store_gc_done(void *arg)
+{
+    struct store_gc_job *job = (struct store_gc_job *)arg;
+    if (job->removed)
+        printf("LINE %d: store gc removed %d objects\n", __LINE__, job->removed);
+    free(job);
+    store_gc_running = 0;
+}
+
+/* arg 为定时器所在的 event_base */
+void store_gc(evutil_socket_t fd, short events, void *arg)
+{
+    if (store_gc_running)
+        return;
+    store_gc_running = 1;
+    work_submit(io_pool, (struct event_base *)arg, store_gc_work, store_gc_done, calloc(1, sizeof(struct store_gc_job)));
+}
+
+/*
+* Server-Sent Events：GET /events?channel=<名称> 订阅，POST /events?channel=<名称>&event=<类型> 发布（仅限本机）
+* 每个事件只序列化一次，所有订阅者的输出缓冲区通过 evbuffer_add_reference 引用同一块内存
+* 订阅者按事件循环分组（每个循环一个 sse_hub），发布时把事件投递到各循环，由各自线程写出
+*/
+struct sse_event
+{
+    int refcnt;
+    uint64_t id;
+    char channel[SSE_CHANNEL_MAX];
+    size_t len;
+    char data[]; // 完整的 "id: ...\nevent: ...\ndata: ...\n\n"
+};
+
+struct sse_subscriber
+{
+    struct evhttp_request *req;
+    struct sse_hub *hub;
+    struct sse_subscriber *prev, *next;
+    char channel[SSE_CHANNEL_MAX];
+};
+
+struct sse_hub
+{
+    struct event_base *base;
+    struct sse_subscriber *head;
+    struct event *heartbeat;
+    int count;
+};
+
+struct sse_delivery
+{
+    struct sse_hub *hub;
+    struct sse_event *ev;
+};
+
+static pthread_mutex_t sse_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sse_hub *sse_hubs[SSE_MAX_HUBS];
+static int sse_nhubs;
+static struct sse_event *sse_history[SSE_HISTORY]; // 最近的事件，供 Last-Event-ID 重连补发
+static uint64_t sse_next_id = 1;
+static __thread struct sse_hub *sse_local_hub;
+
+void sse_event_unref(const void *data, size_t len, void *arg)
+{
+    struct sse_event *ev = (struct sse_event *)arg;
+    if (__sync_sub_and_fetch(&ev->refcnt, 1) == 0)
+        free(ev);
+}
+
+/* 向一个订阅者发送共享的事件数据，tmp 为可复用的空 evbuffer */
+void sse_send(struct sse_subscriber *sub, struct sse_event *ev, struct evbuffer *tmp)
+{
+    __sync_add_and_fetch(&ev->refcnt, 1);
+    evbuffer_add_reference(tmp, ev->data, ev->len, sse_event_unref, ev);
+    evhttp_send_reply_chunk(sub->req, tmp); // 数据链移入连接的输出缓冲区，tmp 重新变空
+}
+
+void sse_deliver(evutil_socket_t fd, short events, void *arg)
+{
+    struct sse_delivery *d = (struct sse_delivery *)arg;
+    struct evbuffer *tmp = evbuffer_new();
+    for (struct sse_subscriber *sub = d->hub->head; sub; sub = sub->next)
+    {
+        if (!strcmp(sub->channel, d->ev->channel))
+            sse_send(sub, d->ev, tmp);
+    }
+    evbuffer_free(tmp);
+    sse_event_unref(NULL, 0, d->ev);
+    free(d);
+}
+
+/* 发布事件，可在任意线程调用；data 中的换行会拆成多行 data: */
+void sse_publish(const char *channel, const char *event, const char *data, size_t len)
+{
+    struct evbuffer *buf = evbuffer_new();
+    pthread_mutex_lock(&sse_lock);
+    uint64_t id = sse_next_id++;
+    pthread_mutex_unlock(&sse_lock);
+    evbuffer_add_printf(buf, "id: %llu\nevent: %s\n", (unsigned long long)id, event);
+    for (size_t pos = 0; pos <= len;)
+    {
+        const char *nl = memchr(data + pos, '\n', len - pos);
+        size_t line = nl ? (size_t)(nl - (data + pos)) : len - pos;
+        evbuffer_add(buf, "data: ", 6);
+        evbuffer_add(buf, data + pos, line);
+        evbuffer_add(buf, "\n", 1);
+        pos += line + 1;
+    }
+    evbuffer_add(buf, "\n", 1);
+
+    size_t n = evbuffer_get_length(buf);
+    struct sse_event *ev = (struct sse_event *)malloc(sizeof(struct sse_event) + n);
+    ev->refcnt = 1; // 发布者持有
+    ev->id = id;
+    snprintf(ev->channel, sizeof(ev->channel), "%s", channel);
+    ev->len = n;
+    evbuffer_remove(buf, ev->data, n);
+    evbuffer_free(buf);
+
+    struct timeval now = {0, 0};
+    pthread_mutex_lock(&sse_lock);
+    struct sse_event *old = sse_history[id % SSE_HISTORY];
+    __sync_add_and_fetch(&ev->refcnt, 1);
+    sse_history[id % SSE_HISTORY] = ev;
+    for (int i = 0; i < sse_nhubs; i++)
+    {
+        if (sse_hubs[i]->count == 0)
+            continue;
+        struct sse_delivery *d = (struct sse_delivery *)malloc(sizeof(struct sse_delivery));
+        d->hub = sse_hubs[i];
+        d->ev = ev;
+        __sync_add_and_fetch(&ev->refcnt, 1);
+        event_base_once(d->hub->base, -1, EV_TIMEOUT, sse_deliver, d, &now);
+    }
+    pthread_mutex_unlock(&sse_lock);
+    if (old)
+        sse_event_unref(NULL, 0, old);
+    sse_event_unref(NULL, 0, ev);
+}
+
+/* 定时发送注释行，防止中间代理因空闲断开 */
+void sse_heartbeat(evutil_socket_t fd, short events, void *arg)
+{
+    static const char ping[] = ":\n\n";
+    struct sse_hub *hub = (struct sse_hub *)arg;
+    struct evbuffer *tmp = evbuffer_new();
+    for (struct sse_subscriber *sub = hub->head; sub; sub = sub->next)
+    {
+        evbuffer_add_reference(tmp, ping, sizeof(ping) - 1, NULL, NULL);
+        evhttp_send_reply_chunk(sub->req, tmp);
+    }
+    evbuffer_free(tmp);
+}
+
+/* 创建当前事件循环的 hub，在每个服务线程启动时调用 */
+void sse_init(struct event_base *base)
+{
+    struct sse_hub *hub = (struct sse_hub *)calloc(1, sizeof(struct sse_hub));
+    struct timeval interval = {SSE_HEARTBEAT, 0};
+    hub->base = base;
+    hub->heartbeat = event_new(base, -1, EV_PERSIST, sse_heartbeat, hub);
+    event_add(hub->heartbeat, &interval);
+    pthread_mutex_lock(&sse_lock);
+    if (sse_nhubs < SSE_MAX_HUBS)
+        sse_hubs[sse_nhubs++] = hub;
+    pthread_mutex_unlock(&sse_lock);
+    sse_local_hub = hub;
+}
+
+/* 连接关闭：移出订阅列表并结束响应（请求已与连接分离，reply_end 负责释放） */
+void sse_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct sse_subscriber *sub = (struct sse_subscriber *)arg;
+    if (sub->prev)
+        sub->prev->next = sub->next;
+    else
+        sub->hub->head = sub->next;
+    if (sub->next)
+        sub->next->prev = sub->prev;
+    pthread_mutex_lock(&sse_lock);
+    sub->hub->count--;
+    pthread_mutex_unlock(&sse_lock);
+    evhttp_send_reply_end(sub->req);
+    free(sub);
+}
+
+void sse_subscribe(struct evhttp_request *req, const char *channel)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    struct sse_hub *hub = sse_local_hub;
+    if (hub == NULL || evcon == NULL)
+    {
+        evhttp_send_error(req, HTTP_SERVUNAVAIL, NULL);
+        return;
+    }
+    struct sse_subscriber *sub = (struct sse_subscriber *)calloc(1, sizeof(struct sse_subscriber));
+    sub->req = req;
+    sub->hub = hub;
+    snprintf(sub->channel, sizeof(sub->channel), "%s", channel);
+
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Content-Type", "text/event-stream");
+    evhttp_add_header(headers, "Cache-Control", "no-cache");
+    evhttp_add_header(headers, "X-Accel-Buffering", "no");
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+    evhttp_clear_headers(headers); // 首部已写出，订阅期间不再保留
+    evhttp_connection_set_closecb(evcon, sse_close_cb, sub);
+
+    struct evbuffer *tmp = evbuffer_new();
+    evbuffer_add_printf(tmp, "retry: %d\n\n", SSE_RETRY_MS);
+    evhttp_send_reply_chunk(req, tmp);
+
+    // 重连时补发 Last-Event-ID 之后仍在历史中的事件
+    const char *last = evhttp_find_header(evhttp_request_get_input_headers(req), "Last-Event-ID");
+    if (last)
+    {
+        uint64_t last_id = strtoull(last, NULL, 10);
+        pthread_mutex_lock(&sse_lock);
+        uint64_t first = sse_next_id > SSE_HISTORY ? sse_next_id - SSE_HISTORY : 1;
+        for (uint64_t id = last_id + 1 > first ? last_id + 1 : first; id < sse_next_id; id++)
+        {
+            struct sse_event *ev = sse_history[id % SSE_HISTORY];
+            if (ev && ev->id == id && !strcmp(ev->channel, sub->channel))
+                sse_send(sub, ev, tmp);
+        }
+        pthread_mutex_unlock(&sse_lock);
+    }
+    evbuffer_free(tmp);
+
+    sub->next = hub->head;
+    if (hub->head)
+        hub->head->prev = sub;
+    hub->head = sub;
+    pthread_mutex_lock(&sse_lock);
+    hub->count++;
+    pthread_mutex_unlock(&sse_lock);
+}
+
+/* /events：GET 订阅，POST 发布（请求体为事件数据，只接受来自本机的请求） */
+void sse_request(struct evhttp_request *req, void *arg)
+{
+    trace_handler_start(req);
+    rate_limit_request(req);
+    struct evkeyvalq query;
+    const char *q = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+    TAILQ_INIT(&query);
+    if (q && evhttp_parse_query_str(q, &query) < 0)
+    {
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    const char *channel = evhttp_find_header(&query, "channel");
+    const char *event = evhttp_find_header(&query, "event");
+    channel = channel ? channel : SSE_DEFAULT_CHANNEL;
+    if (strlen(channel) >= SSE_CHANNEL_MAX || (event && (strlen(event) > 64 || strpbrk(event, "\r\n"))))
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+    else if (evhttp_request_get_command(req) == EVHTTP_REQ_GET)
+        sse_subscribe(req, channel);
+    else if (evhttp_request_get_command(req) == EVHTTP_REQ_POST)
+    {
+        char *peer;
+        ev_uint16_t port;
+        evhttp_connection_get_peer(evhttp_request_get_connection(req), &peer, &port);
+        if (strcmp(peer, "127.0.0.1") && strcmp(peer, "::1"))
+            evhttp_send_error(req, 403, NULL);
+        else
+        {
+            struct evbuffer *body = evhttp_request_get_input_buffer(req);
+            size_t len = evbuffer_get_length(body);
+            sse_publish(channel, event ? event : "message", (const char *)evbuffer_pullup(body, -1), len);
+            evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+        }
+    }
+    else
+        evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+    evhttp_clear_headers(&query);
+}
+
+/* 上传完成的通知，data 为 {"name":..., "size":..., "sha256":...} */
+void sse_publish_upload(const char *name, off_t size, const unsigned char *sha256)
+{
+    char hex[65];
+    struct evbuffer *buf = evbuffer_new();
+    hex_encode(sha256, 32, hex);
+    evbuffer_add(buf, "{\"name\":", 8);
+    json_add_string(buf, name);
+    evbuffer_add_printf(buf, ",\"size\":%lld,\"sha256\":\"%s\"}", (long long)size, hex);
+    size_t len = evbuffer_get_length(buf);
+    sse_publish(SSE_DEFAULT_CHANNEL, "upload", (const char *)evbuffer_pullup(buf, -1), len);
+    evbuffer_free(buf);
+}
+
+/*
+* 表单上传：事件循环只解析 multipart 与回复，摘要、写入对象、fsync 与链接文件名都在 IO 线程池中进行
+* 请求在回复之前一直有效（连接断开时与连接分离），文件数据直接引用请求体
+* 使用 io_uring 时线程池只计算摘要并创建临时文件，写入与 fsync 由 ring 完成，最后的改名与链接再交给线程池
+*/
+struct upload_task
+{
+    struct evhttp_request *req;
+    struct event_base *base;
+    const char *data;
+    size_t len;
+    char *digest; // 客户端提供的摘要请求头
+    char *content_md5;
+    char filename[256];
+    char hex[65];
+    char tmp[512]; // io_uring 写入的临时文件
+    unsigned char sha256[32];
+    int fd;
+    int uring;  // 由本循环的 io_uring 写入对象
+    int failed; // io_uring 写入失败
+    int stored; // store_put/store_open 的结果：1 已存在，0 新写入，-1 失败
+    int status; // 非 0 时以该状态码回复错误
+};
+
+static void upload_task_free(struct upload_task *task)
+{
+    free(task->digest);
+    free(task->content_md5);
+    free(task);
+}
+
+static void upload_store_uring(struct upload_task *task);
+
+/* 线程池：计算并校验摘要，然后存储对象并链接文件名（io_uring 写入时只创建临时文件） */
+static void upload_work(void *arg)
+{
+    struct upload_task *task = (struct upload_task *)arg;
+    struct evbuffer *file = evbuffer_new(); // 引用请求体中的文件数据，不拷贝
+    evbuffer_add_reference(file, task->data, task->len, NULL, NULL);
+    if (!digest_evbuffer(file, EVP_sha256(), task->sha256))
+        task->status = HTTP_INTERNAL;
+    else if (upload_verify_digest(task->digest, task->content_md5, file, task->sha256) < 0)
+    {
+        printf("LINE %d: %s-digest mismatch\n", __LINE__, task->filename);
+        task->status = HTTP_BADREQUEST;
+    }
+    if (task->status)
+    {
+        evbuffer_free(file);
+        return;
+    }
+    // 相同内容只存储一份，文件名链接到对象
+    hex_encode(task->sha256, sizeof(task->sha256), task->hex);
+    if (task->uring)
+        task->stored = store_open(task->hex, task->len, task->tmp, sizeof(task->tmp), &task->fd);
+    else
+        task->stored = store_put(file, task->hex);
+    evbuffer_free(file);
+    if (task->stored < 0 || (task->uring && task->stored == 0))
+        return; // 失败，或临时文件已创建，由 io_uring 写入
+    task->uring = 0;
+    if (store_link(task->hex, task->filename) < 0)
+        task->stored = -1;
+}
+
+/* 线程池：io_uring 写入并 fsync 的临时文件改名为对象并链接文件名 */
+static void upload_commit_work(void *arg)
+{
+    struct upload_task *task = (struct upload_task *)arg;
+    task->uring = 0;
+    task->stored = store_commit(task->hex, task->tmp, task->fd, !task->failed);
+    if (task->stored == 0 && store_link(task->hex, task->filename) < 0)
+        task->stored = -1;
+}
+
+/* 事件循环：回复，或把对象写入交给 io_uring */
+static void upload_done(void *arg)
+{
+    struct upload_task *task = (struct upload_task *)arg;
+    struct evhttp_request *req = task->req;
+    if (task->status)
+    {
+        evhttp_send_error(req, task->status, task->status == HTTP_BADREQUEST ? "Bad Request: Digest mismatch" : NULL);
+        upload_task_free(task);
+        return;
+    }
+    if (task->uring && task->stored == 0)
+    {
+        upload_store_uring(task);
+        return;
+    }
+    if (task->stored < 0)
+    {
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        upload_task_free(task);
+        return;
+    }
+    printf("LINE %d: %s -> %s%s\n", __LINE__, task->filename, task->hex, task->stored == 1 ? " (dedup)" : "");
+    sse_publish_upload(task->filename, task->len, task->sha256);
+
+    // 返回数据
+    char b64[64];
+    EVP_EncodeBlock((unsigned char *)b64, task->sha256, 32);
+    char digest_hdr[80];
+    snprintf(digest_hdr, sizeof(digest_hdr), "sha-256=%s", b64);
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Digest", digest_hdr);
+    struct evbuffer *buf_ret = evbuffer_new();
+    evbuffer_add_printf(buf_ret, "upload successful");
+    evhttp_send_reply(req, HTTP_OK, "OK", buf_ret);
+    evbuffer_free(buf_ret);
+    upload_task_free(task);
+}
+
+/* 由 io_uring 写入对象：链接的 WRITEV 与 FSYNC 一次提交 */
+enum
+{
+    UPLOAD_WRITE = 1,
+    UPLOAD_FSYNC,
+};
+
+struct upload_job
+{
+    struct uring_op op; // arg 为 upload_task
+    struct iovec iov;   // 尚未写入的部分
+    off_t written;
+};
+
+static void upload_submit(struct upload_job *job)
+{
+    struct upload_task *task = (struct upload_task *)job->op.arg;
+    uring_reserve(loop_uring, 2);
+    uring_writev(loop_uring, &job->op, UPLOAD_WRITE, task->fd, &job->iov, 1, job->written, 1);
+    uring_fsync(loop_uring, &job->op, UPLOAD_FSYNC, task->fd);
+}
+
+static void upload_uring_cb(struct uring_op *op, int step, int res, unsigned flags)
+{
+    struct upload_job *job = (struct upload_job *)op;
+    struct upload_task *task = (struct upload_task *)op->arg;
+    if (step == UPLOAD_WRITE && res > 0)
+    {
+        job->iov.iov_base = (char *)job->iov.iov_base + res;
+        job->iov.iov_len -= res;
+        job->written += res;
+    }
+    else if (step == UPLOAD_WRITE || res != -ECANCELED) // 写入不完整时 FSYNC 以 -ECANCELED 结束，接着写剩余部分
+    {
+        if (res < 0 && !task->failed)
+            printf("LINE %d: %s-%s failed: %s\n", __LINE__, task->tmp, step == UPLOAD_WRITE ? "write" : "fsync", strerror(-res));
+        task->failed |= step == UPLOAD_WRITE || res < 0;
+    }
+    if (op->inflight)
+        return;
+    if (!task->failed && job->iov.iov_len)
+    {
+        upload_submit(job);
+        return;
+    }
+    op->arg = NULL; // 返回后释放
+    work_submit(io_pool, task->base, upload_commit_work, upload_done, task);
+}
+
+static void upload_store_uring(struct upload_task *task)
+{
+    struct upload_job *job = (struct upload_job *)uring_op_new(upload_uring_cb, task, sizeof(struct upload_job));
+    job->iov.iov_base = (void *)task->data;
+    job->iov.iov_len = task->len;
+    upload_submit(job);
+}
+
+/* 文件上传 */
+void file_upload(struct evhttp_request *req, void *arg)
+{
+    trace_handler_start(req);
+    rate_limit_request(req);
+    if (admit_request(req, ADMIT_DYNAMIC) < 0)
+        return;
+    // 处理post请求数据
+    size_t post_size = evbuffer_get_length(req->input_buffer); //获取数据长度
+    if (post_size <= 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Post message is empty");
+        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: Message is empty!");
+        return;
+    }
+    printf("LINE %d: Get a upload file, len:%zu\n", __LINE__, post_size);
+
+    // 获取文件名与数据
+    struct upload_task *task = (struct upload_task *)calloc(1, sizeof(struct upload_task));
+    const char *body = (const char *)evbuffer_pullup(req->input_buffer, -1);
+    if (multipart_parse(body, post_size, task->filename, sizeof(task->filename), &task->data, &task->len) < 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Bad multipart body.");
+        upload_task_free(task);
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    printf("LINE %d: %s\n", __LINE__, task->filename);
+
+    if (task->filename[0] == '.') // 隐藏文件名保留给对象存储
+    {
+        upload_task_free(task);
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+
+    // 摘要校验、存储与链接交给IO线程池
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    const char *digest = evhttp_find_header(headers, "Digest");
+    const char *content_md5 = evhttp_find_header(headers, "Content-MD5");
+    task->req = req;
+    task->base = evhttp_connection_get_base(evhttp_request_get_connection(req));
+    task->digest = digest ? strdup(digest) : NULL;
+    task->content_md5 = content_md5 ? strdup(content_md5) : NULL;
+    task->uring = loop_uring != NULL && task->len > 0;
+    work_submit(io_pool, task->base, upload_work, upload_done, task);
+}
+
+/* 文件下载 */
+void file_download(struct evhttp_request *req, void *arg)
+{
+    trace_handler_start(req);
+    rate_limit_request(req);
+    struct evkeyvalq query;
+    const char *q = evhttp_uri_get_query(evhttp_request_get_evhttp_uri(req));
+    TAILQ_INIT(&query);
+    if (q && evhttp_parse_query_str(q, &query) < 0)
+    {
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    const char *dir = evhttp_find_header(&query, "dir"), *method = evhttp_find_header(&query, "method");
+    if (admit_request(req, dir ? ADMIT_DYNAMIC : ADMIT_STATIC) < 0)
+    {
+        evhttp_clear_headers(&query);
+        return;
+    }
+    if (dir) // 整个目录打包为 ZIP
+        zip_download(req, dir, method == NULL || strcmp(method, "store"));
+    else
+        serve_file(req, "doc/test.txt"); // 向客户端返回数据
+    evhttp_clear_headers(&query);
+}
+
+/*
+* 目录打包下载：/download.do?dir=相对于 doc 的目录[&method=store]
+* 边遍历目录边读文件边生成 ZIP，以分块传输直接写入连接，不使用临时文件
+* 读文件与压缩在 io_pool 中进行，每次读入 ZIP_CHUNK 字节，连接输出缓冲区超过 STREAM_HIGH_WATERMARK 后
+* 等待降到 STREAM_LOW_WATERMARK 再继续，内存与文件大小无关；只有中央目录（每个条目约 50 字节加文件名）要保存到最后
+* 条目大小在写出本地文件头时未知，本地文件头之后以数据描述符给出 CRC 与大小（通用标志第 3 位）；
+* 文件不小于 4 GB、偏移或条目数超出 32/16 位时使用 ZIP64 扩展
+* 以 . 开头的文件与目录、符号链接不打包；读取出错时不写中央目录，客户端得到不完整的压缩包
+*/
+#define ZIP_LIMIT32 0xffffffffULL
+#define ZIP_LIMIT16 0xffff
+
+struct zip_stream
+{
+    struct evhttp_request *req;
+    struct event_base *base;
+    int deflate;  // 0 为 store
+    int busy;     // 正在 io_pool 中生成下一段
+    int closed;   // 客户端已断开
+    int finished; // 已写出结尾记录
+    int failed;
+    struct evbuffer *out;     // 本次生成的数据，交给连接后清空
+    struct evbuffer *central; // 中央目录
+    uint64_t offset;          // 已生成的字节数
+    uint64_t nentries;
+    // 目录遍历，path 为当前条目的文件系统路径，条目名为 path + name_off
+    char path[1024];
+    size_t name_off;
+    DIR *dirs[ZIP_MAX_DEPTH];
+    size_t dir_len[ZIP_MAX_DEPTH];
+    int depth;
+    // 当前文件
+    int fd; // -1 表示没有正在写出的文件
+    off_t left;
+    int zip64;
+    uint16_t time, date;
+    uint32_t mode, crc;
+    uint64_t local_off, csize, usize;
+    int z_ready;
+    z_stream z;
+    unsigned char *buf; // ZIP_CHUNK
+};
+
+static void zip_put16(unsigned char *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void zip_put32(unsigned char *p, uint32_t v)
+{
+    zip_put16(p, v);
+    zip_put16(p + 2, v >> 16);
+}
+
+static void zip_put64(unsigned char *p, uint64_t v)
+{
+    zip_put32(p, v);
+    zip_put32(p + 4, v >> 32);
+}
+
+/* MS-DOS 格式的修改时间 */
+static void zip_dos_time(time_t t, uint16_t *time, uint16_t *date)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+    if (tm.tm_year < 80)
+    {
+        *time = 0;
+        *date = (1 << 5) | 1; // 1980-01-01
+        return;
+    }
+    *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+    *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+}
+
+/* 取下一个文件或目录，结果在 zs->path 中；遍历完成返回 0 */
+static int zip_next(struct zip_stream *zs, struct stat *st)
+{
+    while (zs->depth > 0)
+    {
+        struct dirent *de = readdir(zs->dirs[zs->depth - 1]);
+        if (de == NULL)
+        {
+            closedir(zs->dirs[--zs->depth]);
+            continue;
+        }
+        if (de->d_name[0] == '.')
+            continue;
+        size_t base = zs->dir_len[zs->depth - 1];
+        int n = snprintf(zs->path + base, sizeof(zs->path) - base - 1, "/%s", de->d_name); // 留出目录名后的 /
+        if (n < 0 || (size_t)n >= sizeof(zs->path) - base - 1)
+        {
+            printf("LINE %d: zip: path too long, skipped: %s/%s\n", __LINE__, zs->path, de->d_name);
+            continue;
+        }
+        if (lstat(zs->path, st) < 0 || !(S_ISREG(st->st_mode) || S_ISDIR(st->st_mode)))
+            continue;
+        if (S_ISDIR(st->st_mode))
+        {
+            DIR *sub = zs->depth < ZIP_MAX_DEPTH ? opendir(zs->path) : NULL;
+            if (sub == NULL)
+            {
+                printf("LINE %d: zip: directory skipped: %s\n", __LINE__, zs->path);
+                continue;
+            }
+            zs->dirs[zs->depth] = sub;
+            zs->dir_len[zs->depth++] = base + n;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+static void zip_add_central(struct zip_stream *zs, const char *name, size_t name_len, uint16_t flags, uint16_t method)
+{
+    int big = zs->zip64 || zs->csize >= ZIP_LIMIT32 || zs->usize >= ZIP_LIMIT32;
+    int far = zs->local_off >= ZIP_LIMIT32;
+    unsigned char h[46 + 28];
+    unsigned char *x = h + 46;
+    size_t extra = 0;
+    if (big || far)
+    {
+        extra = 4 + (big ? 16 : 0) + (far ? 8 : 0);
+        zip_put16(x, 0x0001);
+        zip_put16(x + 2, extra - 4);
+        if (big)
+        {
+            zip_put64(x + 4, zs->usize);
+            zip_put64(x + 12, zs->csize);
+        }
+        if (far)
+            zip_put64(x + 4 + (big ? 16 : 0), zs->local_off);
+    }
+    uint16_t version = big || far ? 45 : 20;
+    zip_put32(h, 0x02014b50);
+    zip_put16(h + 4, (3 << 8) | version); // Unix，外部属性高 16 位为文件模式
+    zip_put16(h + 6, version);
+    zip_put16(h + 8, flags);
+    zip_put16(h + 10, method);
+    zip_put16(h + 12, zs->time);
+    zip_put16(h + 14, zs->date);
+    zip_put32(h + 16, zs->crc);
+    zip_put32(h + 20, big ? ZIP_LIMIT32 : zs->csize);
+    zip_put32(h + 24, big ? ZIP_LIMIT32 : zs->usize);
+    zip_put16(h + 28, name_len);
+    zip_put16(h + 30, extra);
+    memset(h + 32, 0, 6); // 注释长度、磁盘号、内部属性
+    zip_put32(h + 38, (zs->mode << 16) | (S_ISDIR(zs->mode) ? 0x10 : 0));
+    zip_put32(h + 42, far ? ZIP_LIMIT32 : zs->local_off);
+    evbuffer_add(zs->central, h, 46);
+    evbuffer_add(zs->central, name, name_len);
+    evbuffer_add(zs->central, x, extra);
+    zs->nentries++;
+}
+
+/* 写出本地文件头；目录的大小与 CRC 已知为 0，不需要数据描述符 */
+static void zip_begin_entry(struct zip_stream *zs, const struct stat *st)
+{
+    int dir = S_ISDIR(st->st_mode);
+    size_t name_len = strlen(zs->path + zs->name_off);
+    if (dir)
+        strcpy(zs->path + zs->name_off + name_len++, "/");
+    zs->local_off = zs->offset + evbuffer_get_length(zs->out);
+    zs->zip64 = !dir && (uint64_t)st->st_size >= ZIP_LIMIT32 - (ZIP_LIMIT32 >> 8); // 压缩后可能略大于原文件
+    zs->mode = st->st_mode;
+    zs->crc = crc32(0, NULL, 0);
+    zs->csize = zs->usize = 0;
+    zip_dos_time(st->st_mtime, &zs->time, &zs->date);
+    uint16_t flags = dir ? 0x0800 : 0x0808; // 文件名为 UTF-8；文件以数据描述符给出大小
+    uint16_t method = dir || !zs->deflate ? 0 : 8;
+    unsigned char h[30 + 20];
+    zip_put32(h, 0x04034b50);
+    zip_put16(h + 4, zs->zip64 ? 45 : 20);
+    zip_put16(h + 6, flags);
+    zip_put16(h + 8, method);
+    zip_put16(h + 10, zs->time);
+    zip_put16(h + 12, zs->date);
+    zip_put32(h + 14, 0);
+    zip_put32(h + 18, zs->zip64 ? ZIP_LIMIT32 : 0);
+    zip_put32(h + 22, zs->zip64 ? ZIP_LIMIT32 : 0);
+    zip_put16(h + 26, name_len);
+    zip_put16(h + 28, zs->zip64 ? 20 : 0);
+    zip_put16(h + 30, 0x0001); // ZIP64 扩展，大小在数据描述符中
+    zip_put16(h + 32, 16);
+    memset(h + 34, 0, 16);
+    evbuffer_add(zs->out, h, 30);
+    evbuffer_add(zs->out, zs->path + zs->name_off, name_len);
+    evbuffer_add(zs->out, h + 30, zs->zip64 ? 20 : 0);
+    if (dir)
+    {
+        zip_add_central(zs, zs->path + zs->name_off, name_len, flags, method);
+        zs->path[zs->name_off + name_len - 1] = '\0';
+        return;
+    }
+    if (zs->deflate)
+        deflateReset(&zs->z);
+}
+
+/* 写出数据描述符与中央目录记录 */
+static void zip_end_entry(struct zip_stream *zs)
+{
+    unsigned char d[24];
+    zip_put32(d, 0x08074b50);
+    zip_put32(d + 4, zs->crc);
+    if (zs->zip64)
+    {
+        zip_put64(d + 8, zs->csize);
+        zip_put64(d + 16, zs->usize);
+    }
+    else
+    {
+        zip_put32(d + 8, zs->csize);
+        zip_put32(d + 12, zs->usize);
+    }
+    evbuffer_add(zs->out, d, zs->zip64 ? 24 : 16);
+    zip_add_central(zs, zs->path + zs->name_off, strlen(zs->path + zs->name_off), 0x0808, zs->deflate ? 8 : 0);
+    close(zs->fd);
+    zs->fd = -1;
+}
+
+/* 压缩 len 字节（finish 时结束当前条目的压缩流），输出追加到 zs->out */
+static int zip_deflate(struct zip_stream *zs, const unsigned char *data, size_t len, int finish)
+{
+    zs->z.next_in = (Bytef *)data;
+    zs->z.avail_in = len;
+    int rc;
+    do
+    {
+        struct evbuffer_iovec v;
+        if (evbuffer_reserve_space(zs->out, ZIP_CHUNK, &v, 1) < 1)
+            return -1;
+        zs->z.next_out = (Bytef *)v.iov_base;
+        zs->z.avail_out = v.iov_len;
+        rc = deflate(&zs->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        v.iov_len -= zs->z.avail_out;
+        zs->csize += v.iov_len;
+        evbuffer_commit_space(zs->out, &v, 1);
+        if (rc == Z_STREAM_ERROR)
+            return -1;
+    } while (zs->z.avail_out == 0 || (finish && rc != Z_STREAM_END));
+    return 0;
+}
+
+/* 中央目录与结尾记录，需要时先写 ZIP64 结尾记录与定位器 */
+static void zip_finish(struct zip_stream *zs)
+{
+    uint64_t cd_off = zs->offset + evbuffer_get_length(zs->out), cd_size = evbuffer_get_length(zs->central);
+    evbuffer_add_buffer(zs->out, zs->central);
+    int zip64 = zs->nentries >= ZIP_LIMIT16 || cd_off >= ZIP_LIMIT32 || cd_size >= ZIP_LIMIT32;
+    unsigned char e[56 + 20 + 22];
+    unsigned char *p = e;
+    if (zip64)
+    {
+        zip_put32(p, 0x06064b50);
+        zip_put64(p + 4, 44);
+        zip_put16(p + 12, (3 << 8) | 45);
+        zip_put16(p + 14, 45);
+        zip_put32(p + 16, 0);
+        zip_put32(p + 20, 0);
+        zip_put64(p + 24, zs->nentries);
+        zip_put64(p + 32, zs->nentries);
+        zip_put64(p + 40, cd_size);
+        zip_put64(p + 48, cd_off);
+        zip_put32(p + 56, 0x07064b50);
+        zip_put32(p + 60, 0);
+        zip_put64(p + 64, cd_off + cd_size); // ZIP64 结尾记录的偏移
+        zip_put32(p + 72, 1);
+        p += 76;
+    }
+    zip_put32(p, 0x06054b50);
+    zip_put32(p + 4, 0);
+    zip_put16(p + 8, zip64 ? ZIP_LIMIT16 : zs->nentries);
+    zip_put16(p + 10, zip64 ? ZIP_LIMIT16 : zs->nentries);
+    zip_put32(p + 12, zip64 ? ZIP_LIMIT32 : cd_size);
+    zip_put32(p + 16, zip64 ? ZIP_LIMIT32 : cd_off);
+    zip_put16(p + 20, 0);
+    evbuffer_add(zs->out, e, p + 22 - e);
+    zs->finished = 1;
+}
+
+/* io_pool 中执行：生成至少 ZIP_CHUNK 字节或到结尾为止 */
+static void zip_work(void *arg)
+{
+    struct zip_stream *zs = (struct zip_stream *)arg;
+    while (!zs->failed && !zs->finished && evbuffer_get_length(zs->out) < ZIP_CHUNK)
+    {
+        struct stat st;
+        if (zs->fd < 0)
+        {
+            if (zs->nentries >= ZIP_MAX_ENTRIES)
+            {
+                printf("LINE %d: zip: more than %d entries\n", __LINE__, ZIP_MAX_ENTRIES);
+                zs->failed = 1;
+            }
+            else if (!zip_next(zs, &st))
+                zip_finish(zs);
+            else if (S_ISDIR(st.st_mode))
+                zip_begin_entry(zs, &st);
+            else if ((zs->fd = open(zs->path, O_RDONLY | O_CLOEXEC)) < 0)
+                printf("LINE %d: zip: open %s failed: %s\n", __LINE__, zs->path, strerror(errno)); // 跳过
+            else
+            {
+                zs->left = st.st_size; // 只读打包时的大小，之后追加的内容不计入
+                zip_begin_entry(zs, &st);
+            }
+            continue;
+        }
+        size_t want = zs->left < ZIP_CHUNK ? (size_t)zs->left : ZIP_CHUNK;
+        ssize_t n = want ? read(zs->fd, zs->buf, want) : 0;
+        if (n < 0)
+        {
+            printf("LINE %d: zip: read %s failed: %s\n", __LINE__, zs->path, strerror(errno));
+            zs->failed = 1;
+            break;
+        }
+        zs->left = n ? zs->left - n : 0; // 文件被截断时提前结束
+        zs->usize += n;
+        zs->crc = crc32(zs->crc, zs->buf, n);
+        if (!zs->deflate)
+        {
+            evbuffer_add(zs->out, zs->buf, n);
+            zs->csize += n;
+        }
+        else if (zip_deflate(zs, zs->buf, n, zs->left == 0) < 0)
+        {
+            zs->failed = 1;
+            break;
+        }
+        if (zs->left == 0)
+            zip_end_entry(zs);
+    }
+    zs->offset += evbuffer_get_length(zs->out);
+}
+
+static void zip_stream_free(struct zip_stream *zs)
+{
+    if (zs->fd >= 0)
+        close(zs->fd);
+    while (zs->depth > 0)
+        closedir(zs->dirs[--zs->depth]);
+    if (zs->z_ready)
+        deflateEnd(&zs->z);
+    evbuffer_free(zs->out);
+    evbuffer_free(zs->central);
+    free(zs->buf);
+    free(zs);
+}
+
+/* 客户端在发送完成前断开：请求已与连接分离，结束它以释放；正在生成时由完成回调释放 */
+static void zip_stream_close_cb(struct evhttp_connection *evcon, void *arg)
+{
+    struct zip_stream *zs = (struct zip_stream *)arg;
+    zs->closed = 1;
+    evhttp_send_reply_end(zs->req);
+    if (!zs->busy)
+        zip_stream_free(zs);
+}
+
+static void zip_stream_fill(struct zip_stream *zs);
+
+static void zip_stream_drained(struct evhttp_connection *evcon, void *arg)
+{
+    zip_stream_fill((struct zip_stream *)arg);
+}
+
+static void zip_done(void *arg)
+{
+    struct zip_stream *zs = (struct zip_stream *)arg;
+    zs->busy = 0;
+    if (zs->closed)
+    {
+        zip_stream_free(zs);
+        return;
+    }
+    if (zs->failed)
+        stream_abort(zs->req); // 已发出部分内容，不能以结束分块让客户端当作完整的 ZIP
+    else if (evbuffer_get_length(zs->out))
+        evhttp_send_reply_chunk_with_cb(zs->req, zs->out, zip_stream_drained, zs);
+    evbuffer_drain(zs->out, evbuffer_get_length(zs->out));
+    if (zs->finished || zs->failed)
+    {
+        // 恢复默认水位，让 evhttp 在数据全部写出后才完成请求
+        struct evhttp_connection *evcon = evhttp_request_get_connection(zs->req);
+        bufferevent_setwatermark(evhttp_connection_get_bufferevent(evcon), EV_WRITE, 0, 0);
+        evhttp_connection_set_closecb(evcon, NULL, NULL);
+        evhttp_send_reply_end(zs->req);
+        zip_stream_free(zs);
+        return;
+    }
+    zip_stream_fill(zs);
+}
+
+/* 输出缓冲区低于高水位时生成下一段，否则等待降到低水位 */
+static void zip_stream_fill(struct zip_stream *zs)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(zs->req);
+    struct evbuffer *output = bufferevent_get_output(evhttp_connection_get_bufferevent(evcon));
+    if (zs->busy || evbuffer_get_length(output) >= STREAM_HIGH_WATERMARK)
+        return;
+    zs->busy = 1;
+    work_submit(io_pool, zs->base, zip_work, zip_done, zs);
+}
+
+/* 以 ZIP 流式返回 DOWNLOAD_DIR 下的目录 dir，deflate 为 0 时只存储不压缩 */
+void zip_download(struct evhttp_request *req, const char *dir, int deflate)
+{
+    struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+    if (evcon == NULL)
+        return;
+    if (strstr(dir, "..") || dir[0] == '/' || strstr(dir, "/.") || (dir[0] == '.' && dir[1] != '\0'))
+    {
+        printf("LINE %d: %s\n", __LINE__, "Get a request include '..'.");
+        evhttp_send_error(req, HTTP_BADREQUEST, "Are You Hacking Me?");
+        return;
+    }
+    struct zip_stream *zs = (struct zip_stream *)calloc(1, sizeof(struct zip_stream));
+    int n = snprintf(zs->path, sizeof(zs->path), "%s%s%s", DOWNLOAD_DIR, dir[0] && strcmp(dir, ".") ? "/" : "", strcmp(dir, ".") ? dir : "");
+    while (n > 0 && zs->path[n - 1] == '/')
+        zs->path[--n] = '\0';
+    struct stat st;
+    if ((size_t)n >= sizeof(zs->path) / 2 || lstat(zs->path, &st) < 0 || !S_ISDIR(st.st_mode) ||
+        (zs->dirs[0] = opendir(zs->path)) == NULL)
+    {
+        printf("LINE %d: %s%s\n", __LINE__, zs->path, "-directory not found");
+        free(zs);
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+        return;
+    }
+    const char *slash = strrchr(zs->path, '/');
+    zs->name_off = slash ? slash - zs->path + 1 : 0; // 条目名以所请求目录的名称开头
+    zs->dir_len[0] = n;
+    zs->depth = 1;
+    zs->fd = -1;
+    zs->deflate = deflate;
+    if (deflate && deflateInit2(&zs->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        zs->deflate = 0;
+    zs->z_ready = zs->deflate;
+    zs->req = req;
+    zs->base = evhttp_connection_get_base(evcon);
+    zs->out = evbuffer_new();
+    zs->central = evbuffer_new();
+    zs->buf = (unsigned char *)malloc(ZIP_CHUNK);
+
+    char disposition[256], *d = disposition + snprintf(disposition, sizeof(disposition) - 5, "attachment; filename=\"%.200s", zs->path + zs->name_off);
+    for (char *c = disposition + strlen("attachment; filename=\""); c < d; c++)
+    {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+            *c = '_';
+    }
+    strcpy(d, ".zip\"");
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(headers, "Content-Type", "application/zip");
+    evhttp_add_header(headers, "Content-Disposition", disposition);
+    evhttp_send_reply_start(req, HTTP_OK, "OK"); // 分块传输
+    bufferevent_setwatermark(evhttp_connection_get_bufferevent(evcon), EV_WRITE, STREAM_LOW_WATERMARK, 0);
+    evhttp_connection_set_closecb(evcon, zip_stream_close_cb, zs);
+    zip_stream_fill(zs);
+}
+
+/*
+* 流式 JSON 解析：逐块读取 evbuffer，不拼接缓冲区、不建立 DOM、不分配内存
+* 只回调关心的标量值：顶层对象的成员、顶层数组的元素、顶层对象中数组成员的元素
+* 其余层级只做语法检查；字符串中的普通字符用 SSE2 一次跳过16字节
+*/
+enum json_state
+{
+    JS_VALUE,     // 期待一个值
+    JS_FIRST,     // '[' 之后：值或 ']'
+    JS_KEY_FIRST, // '{' 之后：键或 '}'
+    JS_KEY,       // ',' 之后：键
+    JS_COLON,
+    JS_AFTER, // 值之后：',' 或结束符
+    JS_STRING,
+    JS_ESCAPE,
+    JS_UNICODE,
+    JS_NUMBER,
+    JS_LITERAL,
+    JS_DONE
+};
+
+/* 数字的语法状态，按 JSON 文法：-?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)? */
+enum json_num_state
+{
+    JN_SIGN,
+    JN_ZERO,
+    JN_INT,
+    JN_DOT,
+    JN_FRAC,
+    JN_E,
+    JN_ESIGN,
+    JN_EXP
+};
+
+void json_parser_init(struct json_parser *p, json_value_cb cb, void *arg)
+{
+    memset(p, 0, sizeof(*p));
+    p->state = JS_VALUE;
+    p->cb = cb;
+    p->arg = arg;
+}
+
+/* 返回开头连续的普通字符串字节数（非 '"'、'\\' 与控制字符） */
+static size_t json_plain_span(const char *s, size_t n)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i quote = _mm_set1_epi8('"'), bslash = _mm_set1_epi8('\\'), ctrl = _mm_set1_epi8(0x1f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, bslash)),
+                                 _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl)); // v <= 0x1f
+        int mask = _mm_movemask_epi8(m);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+    for (; i < n; i++)
+    {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c < 0x20)
+            break;
+    }
+    return i;
+}
+
+/* 追加到当前键或值，超长部分只计数不保存 */
+static void json_put(struct json_parser *p, const char *s, size_t n)
+{
+    char *buf = p->in_key ? p->key : p->value;
+    size_t *len = p->in_key ? &p->key_len : &p->value_len;
+    size_t cap = (p->in_key ? JSON_KEY_MAX : JSON_VALUE_MAX) - 1;
+    if (*len < cap)
+        memcpy(buf + *len, s, n < cap - *len ? n : cap - *len);
+    *len += n;
+}
+
+static void json_put_utf8(struct json_parser *p, unsigned int cp)
+{
+    char out[4];
+    size_t n;
+    if (cp < 0x80)
+        out[0] = cp, n = 1;
+    else if (cp < 0x800)
+        out[0] = 0xc0 | cp >> 6, out[1] = 0x80 | (cp & 0x3f), n = 2;
+    else if (cp < 0x10000)
+        out[0] = 0xe0 | cp >> 12, out[1] = 0x80 | (cp >> 6 & 0x3f), out[2] = 0x80 | (cp & 0x3f), n = 3;
+    else
+        out[0] = 0xf0 | cp >> 18, out[1] = 0x80 | (cp >> 12 & 0x3f), out[2] = 0x80 | (cp >> 6 & 0x3f), out[3] = 0x80 | (cp & 0x3f), n = 4;
+    json_put(p, out, n);
+}
+
+/* 栈顶数组的元素是否需要回调（需要记录元素序号） */
+static int json_index_level(struct json_parser *p)
+{
+    return (p->depth == 1 && p->stack[0] == '[') || (p->depth == 2 && p->stack[0] == '{' && p->stack[1] == '[');
+}
+
+/* 一个值开始：判断是否需要回调 */
+static void json_value_start(struct json_parser *p, enum json_type type)
+{
+    p->type = type;
+    p->value_len = 0;
+    p->capture = (p->depth == 1 && (p->stack[0] == '[' || p->key_len < JSON_KEY_MAX)) ||
+                 (p->depth == 2 && p->stack[0] == '{' && p->stack[1] == '[' && p->key_len < JSON_KEY_MAX);
+}
+
+/* 一个值结束：回调并转入 JS_AFTER */
+static void json_value_end(struct json_parser *p)
+{
+    if (p->capture && p->cb)
+    {
+        p->value[p->value_len < JSON_VALUE_MAX ? p->value_len : JSON_VALUE_MAX - 1] = '\0';
+        int in_array = p->stack[p->depth - 1] == '[';
+        p->cb(p->arg, p->depth == 1 && in_array ? "" : p->key, in_array ? p->index : -1, p->type, p->value, p->value_len);
+    }
+    p->capture = 0;
+    p->state = p->depth == 0 ? JS_DONE : JS_AFTER;
+}
+
+static int json_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/* 数字的下一个字符，返回0表示数字在此结束（c 不属于数字），-1 表示语法错误 */
+static int json_number_step(struct json_parser *p, char c)
+{
+    int digit = c >= '0' && c <= '9';
+    switch (p->num_state)
+    {
+    case JN_SIGN:
+        if (!digit)
+            return -1;
+        p->num_state = c == '0' ? JN_ZERO : JN_INT;
+        return 1;
+    case JN_ZERO:
+    case JN_INT:
+        if (digit && p->num_state == JN_INT)
+            return 1;
+        if (c == '.')
+            return p->num_state = JN_DOT, 1;
+        if (c == 'e' || c == 'E')
+            return p->num_state = JN_E, 1;
+        return digit ? -1 : 0; // 前导零后不能再跟数字
+    case JN_DOT:
+        return digit ? (p->num_state = JN_FRAC, 1) : -1;
+    case JN_FRAC:
+        if (digit)
+            return 1;
+        if (c == 'e' || c == 'E')
+            return p->num_state = JN_E, 1;
+        return 0;
+    case JN_E:
+        if (c == '+' || c == '-')
+            return p->num_state = JN_ESIGN, 1;
+        /* fall through */
+    case JN_ESIGN:
+        return digit ? (p->num_state = JN_EXP, 1) : -1;
+    default: // JN_EXP
+        return digit ? 1 : 0;
+    }
+}
+
+/* 处理一个结构字符或值的首字符 */
+static int json_structural(struct json_parser *p, char c)
+{
+    static const char *literals[] = {"true", "false", "null"};
+    switch (p->state)
+    {
+    case JS_KEY_FIRST:
+        if (c == '}')
+            goto close;
+        /* fall through */
+    case JS_KEY:
+        if (c != '"')
+            return -1;
+        p->is_key = 1;
+        p->in_key = p->depth == 1; // 只保存顶层对象的键
+        if (p->in_key)
+            p->key_len = 0;
+        p->state = JS_STRING;
+        return 0;
+    case JS_COLON:
+        if (c != ':')
+            return -1;
+        p->state = JS_VALUE;
+        return 0;
+    case JS_AFTER:
+        if (c == ',')
+        {
+            if (p->stack[p->depth - 1] == '{')
+                p->state = JS_KEY;
+            else
+            {
+                if (json_index_level(p))
+                    p->index++;
+                p->state = JS_VALUE;
+            }
+            return 0;
+        }
+        if (c == '}' || c == ']')
+            goto close;
+        return -1;
+    case JS_FIRST:
+        if (c == ']')
+            goto close;
+        /* fall through */
+    case JS_VALUE:
+        if (c == '{' || c == '[')
+        {
+            if (p->depth == JSON_MAX_DEPTH)
+                return -1;
+            json_value_start(p, c == '{' ? JSON_OBJECT : JSON_ARRAY);
+            if (p->capture && p->cb) // 容器只通知类型
+            {
+                p->value[0] = '\0';
+                int in_array = p->depth > 0 && p->stack[p->depth - 1] == '[';
+                p->cb(p->arg, p->depth == 1 && in_array ? "" : p->key, in_array ? p->index : -1, p->type, p->value, 0);
+            }
+            p->capture = 0;
+            p->stack[p->depth++] = c;
+            if (c == '[' && json_index_level(p))
+                p->index = 0;
+            p->state = c == '{' ? JS_KEY_FIRST : JS_FIRST;
+            return 0;
+        }
+        if (p->depth == 0)
+            return -1; // 顶层必须是对象或数组
+        if (c == '"')
+        {
+            json_value_start(p, JSON_STRING);
+            p->is_key = p->in_key = 0;
+            p->state = JS_STRING;
+            return 0;
+        }
+        if (c == '-' || (c >= '0' && c <= '9'))
+        {
+            json_value_start(p, JSON_NUMBER);
+            p->num_state = JN_SIGN;
+            p->state = JS_NUMBER;
+            if (c != '-' && json_number_step(p, c) < 0)
+                return -1;
+            if (p->capture)
+                json_put(p, &c, 1);
+            return 0;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            if (c == literals[i][0])
+            {
+                json_value_start(p, i == 2 ? JSON_NULL : JSON_BOOL);
+                p->literal = literals[i];
+                p->lit_pos = 1;
+                p->state = JS_LITERAL;
+                if (p->capture)
+                    json_put(p, &c, 1);
+                return 0;
+            }
+        }
+        return -1;
+    default:
+        return -1;
+    }
+close:
+    if (p->depth == 0 || p->stack[p->depth - 1] != (c == '}' ? '{' : '['))
+        return -1;
+    p->depth--;
+    p->state = p->depth == 0 ? JS_DONE : JS_AFTER;
+    return 0;
+}
+
+/* 输入一段数据，可在任意位置切分；语法错误返回 -1 */
+int json_parser_feed(struct json_parser *p, const char *s, size_t n)
+{
+    size_t i = 0;
+    while (i < n && p->state >= 0)
+    {
+        char c = s[i];
+        switch (p->state)
+        {
+        case JS_STRING:
+        {
+            size_t span = json_plain_span(s + i, n - i);
+            if (span)
+            {
+                if (p->in_key || p->capture)
+                    json_put(p, s + i, span);
+                i += span;
+                continue;
+            }
+            i++;
+            if (c == '"')
+            {
+                if (p->is_key)
+                {
+                    if (p->in_key)
+                        p->key[p->key_len < JSON_KEY_MAX ? p->key_len : JSON_KEY_MAX - 1] = '\0';
+                    p->is_key = p->in_key = 0;
+                    p->state = JS_COLON;
+                }
+                else
+                    json_value_end(p);
+            }
+            else if (c == '\\')
+                p->state = JS_ESCAPE;
+            else
+                p->state = -1; // 字符串中不允许控制字符
+            continue;
+        }
+        case JS_ESCAPE:
+        {
+            static const char from[] = "\"\\/bfnrt", to[] = "\"\\/\b\f\n\r\t";
+            const char *e = strchr(from, c);
+            i++;
+            if (c == 'u')
+            {
+                p->uchar = 0;
+                p->uhex = 0;
+                p->state = JS_UNICODE;
+            }
+            else if (e && c)
+            {
+                if (p->in_key || p->capture)
+                    json_put(p, &to[e - from], 1);
+                p->state = JS_STRING;
+            }
+            else
+                p->state = -1;
+            continue;
+        }
+        case JS_UNICODE:
+        {
+            int v = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            i++;
+            if (v < 0)
+            {
+                p->state = -1;
+                continue;
+            }
+            p->uchar = p->uchar << 4 | v;
+            if (++p->uhex < 4)
+                continue;
+            p->state = JS_STRING;
+            if (p->uchar >= 0xd800 && p->uchar < 0xdc00) // 代理对的高位，等待低位
+                p->surrogate = p->uchar;
+            else if (p->uchar >= 0xdc00 && p->uchar < 0xe000 && p->surrogate)
+            {
+                if (p->in_key || p->capture)
+                    json_put_utf8(p, 0x10000 + ((p->surrogate - 0xd800) << 10) + (p->uchar - 0xdc00));
+                p->surrogate = 0;
+            }
+            else if (p->in_key || p->capture)
+                json_put_utf8(p, p->uchar);
+            continue;
+        }
+        case JS_NUMBER:
+        {
+            int r = json_number_step(p, c);
+            if (r < 0)
+                p->state = -1;
+            else if (r > 0)
+            {
+                if (p->capture)
+                    json_put(p, &c, 1);
+                i++;
+            }
+            else if (p->num_state == JN_ZERO || p->num_state == JN_INT || p->num_state == JN_FRAC || p->num_state == JN_EXP)
+                json_value_end(p); // 数字结束，当前字符重新处理
+            else
+                p->state = -1;
+            continue;
+        }
+        case JS_LITERAL:
+            i++;
+            if (c != p->literal[p->lit_pos])
+            {
+                p->state = -1;
+                continue;
+            }
+            if (p->capture)
+                json_put(p, &c, 1);
+            if (p->literal[++p->lit_pos] == '\0')
+                json_value_end(p);
+            continue;
+        default:
+            i++;
+            if (json_is_space(c))
+                continue;
+            if (p->state == JS_DONE || json_structural(p, c) < 0)
+                p->state = -1;
+            continue;
+        }
+    }
+    return p->state < 0 ? -1 : 0;
+}
+
+/* 输入结束：顶层值必须完整 */
+int json_parser_finish(struct json_parser *p)
+{
+    return p->state == JS_DONE ? 0 : -1;
+}
+
+/* 解析 evbuffer 中的全部数据（不移除），逐个数据块输入 */
+int json_parse_evbuffer(struct evbuffer *buf, json_value_cb cb, void *arg)
+{
+    struct json_parser p;
+    struct evbuffer_ptr ptr;
+    struct evbuffer_iovec vec[16];
+    json_parser_init(&p, cb, arg);
+    evbuffer_ptr_set(buf, &ptr, 0, EVBUFFER_PTR_SET);
+    size_t left = evbuffer_get_length(buf);
+    while (left > 0)
+    {
+        int n = evbuffer_peek(buf, left, &ptr, vec, 16);
+        if (n <= 0)
+            return -1;
+        n = n < 16 ? n : 16;
+        for (int i = 0; i < n; i++)
+        {
+            size_t len = vec[i].iov_len < left ? vec[i].iov_len : left;
+            if (json_parser_feed(&p, (const char *)vec[i].iov_base, len) < 0)
+                return -1;
+            left -= len;
+            evbuffer_ptr_set(buf, &ptr, len, EVBUFFER_PTR_ADD);
+        }
+    }
+    return json_parser_finish(&p);
+}
+
+/* 写出JSON字符串（加引号并转义） */
+void json_add_string(struct evbuffer *out, const char *str)
+{
+    evbuffer_add(out, "\"", 1);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            evbuffer_add_printf(out, "\\%c", *p);
+        else if (*p < 0x20)
+            evbuffer_add_printf(out, "\\u%04x", *p);
+        else
+            evbuffer_add(out, p, 1);
+    }
+    evbuffer_add(out, "\"", 1);
+}
+
+void json_field_cb(void *arg, const char *key, int index, enum json_type type, const char *value, size_t len)
+{
+    struct json_fields *fs = (struct json_fields *)arg;
+    if (index != -1)
+        return;
+    for (int i = 0; i < fs->n; i++)
+    {
+        struct json_field *f = &fs->fields[i];
+        if (!strcmp(f->key, key)) // 重复的键以最后一个为准
+        {
+            f->type = type;
+            f->len = len;
+            size_t n = len < f->size - 1 ? len : f->size - 1;
+            memcpy(f->value, value, n);
+            f->value[n] = '\0';
+        }
+    }
+}
+
+/*
+* 从JSON对象中取出声明的顶层字段，值写入调用者提供的缓冲区
+* 字段未出现时 type 为 JSON_NONE；len 为完整长度，len >= size 表示被截断
+*/
+int json_extract(struct evbuffer *body, struct json_field *fields, int n)
+{
+    struct json_fields fs = {fields, n};
+    for (int i = 0; i < n; i++)
+    {
+        fields[i].type = JSON_NONE;
+        fields[i].len = 0;
+        fields[i].value[0] = '\0';
+    }
+    return json_parse_evbuffer(body, json_field_cb, &fs);
+}
+
+/* FNV-1a 64位哈希 */
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* 返回路由的缓存有效期，未配置缓存时为0 */
+int cgi_cache_ttl(const char *route)
+{
+    if (!env_int("HTTP_CGI_CACHE", 1))
+        return 0;
+    for (struct cgi_cache_conf *conf = &cgi_cache_table[0]; conf->route; ++conf)
+    {
+        if (!strcmp(conf->route, route))
+            return conf->ttl;
+    }
+    return 0;
+}
+
+void cgi_cache_unlink_lru(struct cgi_cache_entry *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else if (cgi_cache.lru_head == entry)
+        cgi_cache.lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else if (cgi_cache.lru_tail == entry)
+        cgi_cache.lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+/* 移至LRU头部 */
+void cgi_cache_touch(struct cgi_cache_entry *entry)
+{
+    cgi_cache_unlink_lru(entry);
+    entry->lru_next = cgi_cache.lru_head;
+    if (cgi_cache.lru_head)
+        cgi_cache.lru_head->lru_prev = entry;
+    cgi_cache.lru_head = entry;
+    if (cgi_cache.lru_tail == NULL)
+        cgi_cache.lru_tail = entry;
+}
+
+void cgi_cache_remove(struct cgi_cache_entry *entry)
+{
+    struct cgi_cache_entry **pp = &cgi_cache.buckets[entry->hash % CGI_CACHE_BUCKETS];
+    while (*pp != entry)
+        pp = &(*pp)->hnext;
+    *pp = entry->hnext;
+    cgi_cache_unlink_lru(entry);
+    cgi_cache.bytes -= entry->size;
+    if (entry->body)
+        evbuffer_free(entry->body);
+    free(entry->key);
+    free(entry);
+}
+
+/* 超出容量时从最久未使用的一端淘汰，计算中的缓存项不淘汰 */
+void cgi_cache_evict(void)
+{
+    struct cgi_cache_entry *entry = cgi_cache.lru_tail, *prev;
+    while (entry && cgi_cache.bytes > CGI_CACHE_MAX_BYTES)
+    {
+        prev = entry->lru_prev;
+        if (entry->job == NULL)
+            cgi_cache_remove(entry);
+        entry = prev;
+    }
+}
+
+/* 查找缓存项，已过期的直接删除 */
+struct cgi_cache_entry *cgi_cache_lookup(const char *key, uint64_t hash)
+{
+    struct cgi_cache_entry *entry;
+    for (entry = cgi_cache.buckets[hash % CGI_CACHE_BUCKETS]; entry; entry = entry->hnext)
+    {
+        if (entry->hash != hash || strcmp(entry->key, key))
+            continue;
+        if (entry->job == NULL && entry->expires <= time(NULL))
+        {
+            cgi_cache_remove(entry);
+            return NULL;
+        }
+        cgi_cache_touch(entry);
+        return entry;
+    }
+    return NULL;
+}
+
+struct cgi_cache_entry *cgi_cache_insert(char *key, uint64_t hash)
+{
+    struct cgi_cache_entry *entry = calloc(1, sizeof(*entry));
+    entry->hash = hash;
+    entry->key = key;
+    entry->size = sizeof(*entry) + strlen(key);
+    entry->hnext = cgi_cache.buckets[hash % CGI_CACHE_BUCKETS];
+    cgi_cache.buckets[hash % CGI_CACHE_BUCKETS] = entry;
+    cgi_cache.bytes += entry->size;
+    cgi_cache_touch(entry);
+    return entry;
+}
+
+/* 是否有仍连接着的等待者积压了超过 STREAM_HIGH_WATERMARK 的输出 */
+int cgi_job_congested(struct cgi_job *job)
+{
+    for (struct cgi_waiter *w = job->waiters; w; w = w->next)
+    {
+        struct evhttp_connection *evcon = evhttp_request_get_connection(w->req);
+        if (evcon && evbuffer_get_length(bufferevent_get_output(evhttp_connection_get_bufferevent(evcon))) >= STREAM_HIGH_WATERMARK)
+            return 1;
+    }
+    return 0;
+}
+
+/* 等待者的输出缓冲区写空或连接关闭：不再积压时恢复读取管道 */
+void cgi_job_resume(struct evhttp_connection *evcon, void *arg)
+{
+    struct cgi_job *job = (struct cgi_job *)arg;
+    if (job->paused && !cgi_job_congested(job))
+    {
+        job->paused = 0;
+        event_add(job->ev, NULL);
+    }
+}
+
+/* 加入等待者并开始分块回复，已产生的输出立即补发 */
+void cgi_job_add_waiter(struct cgi_job *job, struct evhttp_request *req)
+{
+    struct cgi_waiter *waiter = malloc(sizeof(*waiter));
+    waiter->req = req;
+    waiter->next = job->waiters;
+    job->waiters = waiter;
+    evhttp_send_reply_start(req, HTTP_OK, "Client");
+    // 积压的等待者断开后不会再有写空回调，由关闭回调恢复读取
+    evhttp_connection_set_closecb(evhttp_request_get_connection(req), cgi_job_resume, job);
+    if (evbuffer_get_length(job->output) > 0)
+    {
+        struct evbuffer *chunk = evbuffer_new();
+        evbuffer_add_buffer_reference(chunk, job->output);
+        evhttp_send_reply_chunk_with_cb(req, chunk, cgi_job_resume, job);
+        evbuffer_free(chunk);
+    }
+}
+
+/* CGI管道可读：转发新输出；读到EOF后结束所有回复并写入缓存 */
+void cgi_read_cb(evutil_socket_t fd, short events, void *arg)
+{
+    struct cgi_job *job = (struct cgi_job *)arg;
+    char buff[MAX_BUF_SIZE];
+    ssize_t n;
+    while ((n = read(fd, buff, sizeof(buff))) > 0)
+    {
+        evbuffer_add(job->output, buff, n);
+        for (struct cgi_waiter *w = job->waiters; w; w = w->next)
+        {
+            struct evbuffer *chunk = evbuffer_new();
+            evbuffer_add(chunk, buff, n);
+            evhttp_send_reply_chunk_with_cb(w->req, chunk, cgi_job_resume, job);
+            evbuffer_free(chunk);
+        }
+        if (cgi_job_congested(job))
+        {
+            // 客户端读得比CGI程序写得慢：停止读取，管道写满后CGI程序阻塞在 write 上
+            event_del(job->ev);
+            job->paused = 1;
+            return;
+        }
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    // EOF 或读错误：本次计算结束
+    event_free(job->ev);
+    int status = pclose(job->fstream);
+    cgi_running--;
+    while (job->waiters)
+    {
+        struct cgi_waiter *w = job->waiters;
+        job->waiters = w->next;
+        struct evhttp_connection *evcon = evhttp_request_get_connection(w->req);
+        if (evcon) // 关闭回调在 keep-alive 的后续请求中仍然有效，任务释放前清除
+            evhttp_connection_set_closecb(evcon, NULL, NULL);
+        evhttp_send_reply_end(w->req);
+        free(w);
+    }
+    struct cgi_cache_entry *entry = job->entry;
+    if (entry != NULL)
+    {
+        entry->job = NULL;
+        if (n == 0 && status == 0)
+        {
+            entry->body = job->output;
+            entry->size += evbuffer_get_length(job->output);
+            cgi_cache.bytes += evbuffer_get_length(job->output);
+            job->output = NULL;
+            cgi_cache_evict();
+        }
+        else
+            cgi_cache_remove(entry); // 失败的结果不缓存
+    }
+    if (job->output)
+        evbuffer_free(job->output);
+    free(job);
+}
+
+/* 启动CGI程序，以非阻塞方式读取其输出 */
+void cgi_job_start(struct evhttp_request *req, const char *cmd, struct cgi_job *job)
+{
+    // 新建fork()进程、管道，处理cgi
+    if ((job->fstream = popen(cmd, "r")) == NULL)
+    {
+        fprintf(stderr, "execute command failed: %s", strerror(errno));
+        evhttp_send_error(req, HTTP_INTERNAL, NULL);
+        if (job->entry)
+            cgi_cache_remove(job->entry);
+        free(job);
+        return;
+    }
+    cgi_running++;
+    int fd = fileno(job->fstream);
+    evutil_make_socket_nonblocking(fd);
+    job->output = evbuffer_new();
+    job->ev = event_new(evhttp_connection_get_base(evhttp_request_get_connection(req)), fd,
+                        EV_READ | EV_PERSIST, cgi_read_cb, job);
+    event_add(job->ev, NULL);
+    cgi_job_add_waiter(job, req);
+}
+
+/* 处理动态请求 */
+void execute_cgi(struct evhttp_request *req, const char *route, struct evbuffer *body)
+{
+    // 处理参数：只取出 num 字段，可以是字符串或数字，但必须全为数字（会拼接进命令行）
+    char num[JSON_VALUE_MAX];
+    struct json_field fields[] = {{"num", num, sizeof(num)}};
+    if (json_extract(body, fields, 1) < 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Query json in invalid.");
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    if ((fields[0].type != JSON_STRING && fields[0].type != JSON_NUMBER) || fields[0].len == 0 ||
+        fields[0].len >= sizeof(num) || strspn(num, "0123456789") != fields[0].len)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Field num is missing or not a positive integer.");
+        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: num must be a positive integer");
+        return;
+    }
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "/usr/bin/factor %s", num);
+
+    int ttl = cgi_cache_ttl(route);
+    struct cgi_job *job = calloc(1, sizeof(struct cgi_job));
+    if (ttl > 0)
+    {
+        // 缓存键：路由 + 处理函数实际使用的字段，与空白、键顺序、其他字段无关
+        size_t key_len = strlen(route) + fields[0].len + 6;
+        char *key = malloc(key_len);
+        snprintf(key, key_len, "%s\nnum=%s", route, num);
+        uint64_t hash = hash_bytes(key, strlen(key));
+
+        struct cgi_cache_entry *entry = cgi_cache_lookup(key, hash);
+        if (entry != NULL)
+        {
+            free(key);
+            free(job);
+            if (entry->job != NULL) // 相同请求正在计算，等待同一结果
+            {
+                evhttp_add_header(evhttp_request_get_output_headers(req), "X-Cache", "WAIT");
+                cgi_job_add_waiter(entry->job, req);
+                return;
+            }
+            struct evbuffer *buf_ret = evbuffer_new();
+            evbuffer_add_buffer_reference(buf_ret, entry->body);
+            evhttp_add_header(evhttp_request_get_output_headers(req), "X-Cache", "HIT");
+            evhttp_send_reply(req, HTTP_OK, "Client", buf_ret);
+            evbuffer_free(buf_ret);
+            return;
+        }
+        job->entry = cgi_cache_insert(key, hash);
+        job->entry->job = job;
+        job->entry->expires = time(NULL) + ttl;
+        evhttp_add_header(evhttp_request_get_output_headers(req), "X-Cache", "MISS");
+    }
+    cgi_job_start(req, cmd, job);
+}
+
+/*
+* 批量分解质因数：POST /factor_batch.do，请求体为数字数组（[12, "34"] 或 {"nums": [...]}）
+* 每 BATCH_TASK_SIZE 个数作为一个任务交给计算线程池，在进程内分解（不再为每个数 fork /usr/bin/factor），
+* 每个任务完成后立即以 NDJSON 分块返回，行的顺序不固定，由 index 对应请求中的位置
+*/
+struct batch_item
+{
+    uint64_t num;
+    int valid;
+};
+
+struct factor_batch
+{
+    struct evhttp_request *req;
+    struct batch_item *items;
+    int count, cap, pending;
+    int cancelled; // 客户端已断开，剩余任务直接跳过
+};
+
+struct factor_task
+{
+    struct factor_batch *batch;
+    int start, end;
+    struct evbuffer *out;
+};
+
+static uint64_t mulmod(uint64_t a, uint64_t b, uint64_t m)
+{
+    return (unsigned __int128)a * b % m;
+}
+
+static uint64_t powmod(uint64_t a, uint64_t e, uint64_t m)
+{
+    uint64_t r = 1;
+    for (a %= m; e; e >>= 1, a = mulmod(a, a, m))
+        if (e & 1)
+            r = mulmod(r, a, m);
+    return r;
+}
+
+/* 确定性 Miller-Rabin，这组底数对 64 位整数无误判 */
+static int is_prime_u64(uint64_t n)
+{
+    static const uint64_t bases[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    if (n < 2)
+        return 0;
+    for (int i = 0; i < 12; i++)
+        if (n % bases[i] == 0)
+            return n == bases[i];
+    uint64_t d = n - 1;
+    int s = 0;
+    while ((d & 1) == 0)
+        d >>= 1, s++;
+    for (int i = 0; i < 12; i++)
+    {
+        uint64_t x = powmod(bases[i], d, n);
+        if (x == 1 || x == n - 1)
+            continue;
+        int r = 1;
+        for (; r < s; r++)
+            if ((x = mulmod(x, x, n)) == n - 1)
+                break;
+        if (r == s)
+            return 0;
+    }
+    return 1;
+}
+
+static uint64_t gcd_u64(uint64_t a, uint64_t b)
+{
+    while (b)
+    {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+/* Pollard rho（Brent），返回 n 的一个非平凡因子，n 为奇合数 */
+static uint64_t pollard_rho(uint64_t n)
+{
+    for (uint64_t c = 1;; c++)
+    {
+        uint64_t y = 2, x = 2, q = 1, g = 1, ys = 2;
+        uint64_t r = 1;
+        do
+        {
+            x = y;
+            for (uint64_t i = 0; i < r; i++)
+                y = (mulmod(y, y, n) + c) % n;
+            for (uint64_t k = 0; k < r && g == 1; k += 128)
+            {
+                ys = y;
+                for (uint64_t i = 0; i < 128 && i < r - k; i++)
+                {
+                    y = (mulmod(y, y, n) + c) % n;
+                    q = mulmod(q, x > y ? x - y : y - x, n);
+                }
+                g = gcd_u64(q, n);
+            }
+            r <<= 1;
+        } while (g == 1);
+        if (g == n) // 批量乘积跳过了因子，逐步回退
+        {
+            do
+            {
+                ys = (mulmod(ys, ys, n) + c) % n;
+                g = gcd_u64(x > ys ? x - ys : ys - x, n);
+            } while (g == 1);
+        }
+        if (g != n)
+            return g;
+    }
+}
+
+static void factor_rec(uint64_t n, uint64_t *out, int *count)
+{
+    if (n == 1)
+        return;
+    if (is_prime_u64(n))
+    {
+        out[(*count)++] = n;
+        return;
+    }
+    uint64_t d = pollard_rho(n);
+    factor_rec(d, out, count);
+    factor_rec(n / d, out, count);
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* 分解 n，质因数按升序写入 out（至多64个），返回个数；与 factor 命令一致，0 和 1 没有因数 */
+int factor_u64(uint64_t n, uint64_t *out)
+{
+    int count = 0;
+    if (n < 2)
+        return 0;
+    for (uint64_t p = 2; p < 64 && p * p <= n; p += p == 2 ? 1 : 2) // 先除去小因子
+    {
+        while (n % p == 0)
+        {
+            out[count++] = p;
+            n /= p;
+        }
+    }
+    factor_rec(n, out, &count);
+    qsort(out, count, sizeof(uint64_t), cmp_u64);
+    return count;
+}
+
+/* 工作线程：分解一段数字，结果写成 NDJSON */
+void factor_task_work(void *arg)
+{
+    struct factor_task *task = (struct factor_task *)arg;
+    uint64_t factors[64];
+    task->out = evbuffer_new();
+    for (int i = task->start; i < task->end && !__atomic_load_n(&task->batch->cancelled, __ATOMIC_RELAXED); i++)
+    {
+        struct batch_item *item = &task->batch->items[i];
+        if (!item->valid)
+        {
+            evbuffer_add_printf(task->out, "{\"index\":%d,\"error\":\"not an integer in [0, 2^64)\"}\n", i);
+            continue;
+        }
+        int n = factor_u64(item->num, factors);
+        evbuffer_add_printf(task->out, "{\"index\":%d,\"num\":\"%llu\",\"factors\":[", i, (unsigned long long)item->num);
+        for (int j = 0; j < n; j++)
+            evbuffer_add_printf(task->out, "%s\"%llu\"", j ? "," : "", (unsigned long long)factors[j]);
+        evbuffer_add(task->out, "]}\n", 3);
+    }
+}
+
+/* 事件循环：发送一个任务的结果，全部完成后结束响应 */
+void factor_task_done(void *arg)
+{
+    struct factor_task *task = (struct factor_task *)arg;
+    struct factor_batch *batch = task->batch;
+    if (evhttp_request_get_connection(batch->req) == NULL)
+        __atomic_store_n(&batch->cancelled, 1, __ATOMIC_RELAXED);
+    else
+        evhttp_send_reply_chunk(batch->req, task->out);
+    evbuffer_free(task->out);
+    free(task);
+    if (--batch->pending == 0)
+    {
+        evhttp_send_reply_end(batch->req);
+        free(batch->items);
+        free(batch);
+    }
+}
+
+/* 收集数组元素：字符串或数字，必须是 64 位无符号整数 */
+void factor_batch_cb(void *arg, const char *key, int index, enum json_type type, const char *value, size_t len)
+{
+    struct factor_batch *batch = (struct factor_batch *)arg;
+    if (index < 0 || (key[0] && strcmp(key, "nums")))
+        return;
+    if (batch->count == BATCH_MAX_ITEMS)
+    {
+        batch->cancelled = 1; // 标记超限
+        return;
+    }
+    if (batch->count == batch->cap)
+    {
+        batch->cap = batch->cap ? batch->cap * 2 : 256;
+        batch->items = (struct batch_item *)realloc(batch->items, batch->cap * sizeof(struct batch_item));
+    }
+    struct batch_item *item = &batch->items[batch->count++];
+    char *end;
+    errno = 0;
+    item->valid = (type == JSON_STRING || type == JSON_NUMBER) && len > 0 && len < JSON_VALUE_MAX &&
+                  strspn(value, "0123456789") == len;
+    item->num = item->valid ? strtoull(value, &end, 10) : 0;
+    if (errno == ERANGE)
+        item->valid = 0;
+}
+
+void handle_factor_batch(struct evhttp_request *req, struct evbuffer *body)
+{
+    struct factor_batch *batch = (struct factor_batch *)calloc(1, sizeof(struct factor_batch));
+    batch->req = req;
+    if (json_parse_evbuffer(body, factor_batch_cb, batch) < 0 || batch->cancelled)
+    {
+        int too_large = batch->cancelled;
+        free(batch->items);
+        free(batch);
+        evhttp_send_error(req, too_large ? 413 : HTTP_BADREQUEST, too_large ? "Too many numbers" : NULL);
+        return;
+    }
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "application/x-ndjson");
+    evhttp_send_reply_start(req, HTTP_OK, "OK");
+    if (batch->count == 0)
+    {
+        evhttp_send_reply_end(req);
+        free(batch->items);
+        free(batch);
+        return;
+    }
+    struct event_base *base = evhttp_connection_get_base(evhttp_request_get_connection(req));
+    batch->pending = (batch->count + BATCH_TASK_SIZE - 1) / BATCH_TASK_SIZE;
+    for (int start = 0; start < batch->count; start += BATCH_TASK_SIZE)
+    {
+        struct factor_task *task = (struct factor_task *)calloc(1, sizeof(struct factor_task));
+        task->batch = batch;
+        task->start = start;
+        task->end = start + BATCH_TASK_SIZE < batch->count ? start + BATCH_TASK_SIZE : batch->count;
+        work_submit(compute_pool, base, factor_task_work, factor_task_done, task);
+    }
+}
+
+void handle_head_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+/* 解析 /upload/<name> 形式的对象路径，name 不能包含 / 或以 . 开头 */
+int object_name_from_uri(struct evhttp_request *req, char *name, size_t size)
+{
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    size_t prefix = strlen(UPLOAD_DIR) + 2;
+    if (path == NULL || strncmp(path, "/" UPLOAD_DIR "/", prefix))
+        return -1;
+    char *decoded = evhttp_uridecode(path + prefix, 0, NULL);
+    if (decoded == NULL)
+        return -1;
+    int ok = decoded[0] && decoded[0] != '.' && !strchr(decoded, '/') && strlen(decoded) < size;
+    if (ok)
+        strcpy(name, decoded);
+    free(decoded);
+    return ok ? 0 : -1;
+}
+
+struct object_job
+{
+    struct evhttp_request *req;
+    struct evbuffer *body; // PUT 请求体，从请求中移交过来
+    char *digest;          // 客户端提供的摘要请求头
+    char *content_md5;
+    char name[256];
+    off_t size;
+    unsigned char sha256[32];
+    int status;
+};
+
+void object_job_free(struct object_job *job)
+{
+    if (job->body)
+        evbuffer_free(job->body);
+    free(job->digest);
+    free(job->content_md5);
+    free(job);
+}
+
+/* 工作线程：计算摘要、写入对象并原子替换文件名 */
+void put_work(void *arg)
+{
+    struct object_job *job = (struct object_job *)arg;
+    char hex[65], path[512];
+    job->size = evbuffer_get_length(job->body);
+    if (!digest_evbuffer(job->body, EVP_sha256(), job->sha256))
+    {
+        job->status = HTTP_INTERNAL;
+        return;
+    }
+    if (upload_verify_digest(job->digest, job->content_md5, job->body, job->sha256) < 0)
+    {
+        job->status = HTTP_BADREQUEST;
+        return;
+    }
+    hex_encode(job->sha256, sizeof(job->sha256), hex);
+    snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, job->name);
+    int existed = access(path, F_OK) == 0;
+    if (store_put(job->body, hex) < 0 || store_link(hex, job->name) < 0)
+        job->status = HTTP_INTERNAL;
+    else
+        job->status = existed ? HTTP_NOCONTENT : 201;
+}
+
+/* 事件循环：返回 PUT 结果 */
+void put_done(void *arg)
+{
+    struct object_job *job = (struct object_job *)arg;
+    if (job->status == HTTP_NOCONTENT || job->status == 201)
+    {
+        char b64[64], digest_hdr[80];
+        EVP_EncodeBlock((unsigned char *)b64, job->sha256, sizeof(job->sha256));
+        snprintf(digest_hdr, sizeof(digest_hdr), "sha-256=%s", b64);
+        evhttp_add_header(evhttp_request_get_output_headers(job->req), "Digest", digest_hdr);
+        evhttp_send_reply(job->req, job->status, job->status == 201 ? "Created" : "No Content", NULL);
+        sse_publish_upload(job->name, job->size, job->sha256);
+    }
+    else
+        evhttp_send_error(job->req, job->status, job->status == HTTP_BADREQUEST ? "Bad Request: Digest mismatch" : NULL);
+    object_job_free(job);
+}
+
+void delete_work(void *arg)
+{
+    struct object_job *job = (struct object_job *)arg;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", UPLOAD_DIR, job->name);
+    if (unlink(path) == 0)
+    {
+        fsync_dir(UPLOAD_DIR);
+        job->status = HTTP_NOCONTENT; // 无引用的对象由 store_gc 清理
+    }
+    else
+        job->status = errno == ENOENT ? HTTP_NOTFOUND : HTTP_INTERNAL;
+}
+
+void delete_done(void *arg)
+{
+    struct object_job *job = (struct object_job *)arg;
+    if (job->status == HTTP_NOCONTENT)
+        evhttp_send_reply(job->req, HTTP_NOCONTENT, "No Content", NULL);
+    else
+        evhttp_send_error(job->req, job->status, NULL);
+    object_job_free(job);
+}
+
+/* PUT /upload/<name>：请求体原样存为文件，磁盘操作在IO线程池中完成 */
+void handle_put_request(struct evhttp_request *req, void *arg)
+{
+    struct object_job *job = (struct object_job *)calloc(1, sizeof(struct object_job));
+    if (object_name_from_uri(req, job->name, sizeof(job->name)) < 0)
+    {
+        free(job);
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    const char *digest = evhttp_find_header(headers, "Digest");
+    const char *content_md5 = evhttp_find_header(headers, "Content-MD5");
+    job->req = req;
+    job->digest = digest ? strdup(digest) : NULL;
+    job->content_md5 = content_md5 ? strdup(content_md5) : NULL;
+    job->body = evbuffer_new();
+    evbuffer_add_buffer(job->body, evhttp_request_get_input_buffer(req)); // 移交数据链，不拷贝
+    work_submit(io_pool, evhttp_connection_get_base(evhttp_request_get_connection(req)), put_work, put_done, job);
+}
+
+/* DELETE /upload/<name> */
+void handle_delete_request(struct evhttp_request *req, void *arg)
+{
+    struct object_job *job = (struct object_job *)calloc(1, sizeof(struct object_job));
+    if (object_name_from_uri(req, job->name, sizeof(job->name)) < 0)
+    {
+        free(job);
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    job->req = req;
+    work_submit(io_pool, evhttp_connection_get_base(evhttp_request_get_connection(req)), delete_work, delete_done, job);
+}
+
+/*
+* 可续传上传（参考 tus 1.0 协议）：
+*   POST   /files/      Upload-Length，可选 Upload-Metadata: filename <base64>，返回 201 与 Location: /files/<id>；
+*                       超过 Tus-Max-Size（OPTIONS 与 HEAD 返回）时 413，避免按任意长度预分配磁盘
+*   PATCH  /files/<id>  Upload-Offset 指定写入位置，多个连接可并行上传互不重叠的区间，返回 204 与当前 Upload-Offset；
+*                       与已收区间重叠时返回 409
+*   HEAD   /files/<id>  Upload-Offset 为从0开始连续收到的字节数，Upload-Ranges 列出已收到的全部区间
+*   DELETE /files/<id>  放弃上传
+* 状态保存在 upload/.uploads/<id>/（info、data、ranges 三个文件），服务重启或多进程下均可继续；
+* 收齐全部区间后按摘要移入对象存储，并链接为 upload/<文件名>
+* 同一上传的 PATCH/DELETE 在 data 文件上加 flock 互斥（跨线程与进程），区间检查、写入、记录与合并在锁内完成，
+* 合并时 data 被 rename 成对象，等锁的请求随后发现 data 已不是同一文件而返回 404，不会写进对象
+*/
+struct byte_range
+{
+    off_t start, end; // [start, end)
+};
+
+struct resumable_job
+{
+    struct evhttp_request *req;
+    enum evhttp_cmd_type cmd;
+    char id[33];
+    char name[256];
+    struct evbuffer *body; // PATCH 数据
+    off_t offset, length, received;
+    char *ranges; // HEAD 返回的 Upload-Ranges
+    unsigned char sha256[32];
+    int status, complete;
+};
+
+int byte_range_cmp(const void *a, const void *b)
+{
+    off_t x = ((const struct byte_range *)a)->start, y = ((const struct byte_range *)b)->start;
+    return x < y ? -1 : x > y;
+}
+
+/* 读取区间日志并合并重叠区间，返回区间数；*out 由调用者释放 */
+int resumable_ranges(const char *dir, struct byte_range **out)
+{
+    char path[512];
+    snprintf(path, sizeof(path), "%s/ranges", dir);
+    int n = 0, cap = 16;
+    struct byte_range *r = (struct byte_range *)malloc(cap * sizeof(struct byte_range));
+    FILE *fp = fopen(path, "r");
+    long long start, end;
+    while (fp && fscanf(fp, "%lld %lld", &start, &end) == 2)
+    {
+        if (n == cap)
+            r = (struct byte_range *)realloc(r, (cap *= 2) * sizeof(struct byte_range));
+        r[n].start = start;
+        r[n++].end = end;
+    }
+    if (fp)
+        fclose(fp);
+    qsort(r, n, sizeof(struct byte_range), byte_range_cmp);
+    int m = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (m > 0 && r[i].start <= r[m - 1].end)
+            r[m - 1].end = r[i].end > r[m - 1].end ? r[i].end : r[m - 1].end;
+        else
+            r[m++] = r[i];
+    }
+    *out = r;
+    return m;
+}
+
+/* 读取上传信息，返回 -1 表示上传不存在 */
+int resumable_info(const char *dir, off_t *length, char *name, size_t size)
+{
+    char path[512], line[300];
+    snprintf(path, sizeof(path), "%s/info", dir);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return -1;
+    long long len = -1;
+    int ok = fgets(line, sizeof(line), fp) && sscanf(line, "%lld", &len) == 1 && fgets(line, sizeof(line), fp);
+    fclose(fp);
+    if (!ok || len < 0)
+        return -1;
+    line[strcspn(line, "\n")] = '\0';
+    snprintf(name, size, "%s", line);
+    *length = len;
+    return 0;
+}
+
+/* 删除上传的状态目录 */
+void resumable_remove(const char *dir)
+{
+    static const char *files[] = {"info", "data", "ranges", "lock"}; // lock 为旧版本留下的合并标记
+    char path[512];
+    for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+    {
+        snprintf(path, sizeof(path), "%s/%s", dir, files[i]);
+        unlink(path);
+    }
+    rmdir(dir);
+}
+
+/*
+* 打开 data 并加排他 flock，返回可写的 fd；上传不存在或已合并完成返回 -1
+* 加锁后再确认 data 路径仍指向同一文件：等锁期间可能已被合并 rename 成对象或被删除
+*/
+int resumable_lock(const char *dir)
+{
+    char path[512];
+    struct stat st, cur;
+    snprintf(path, sizeof(path), "%s/data", dir);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    if (flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0 || stat(path, &cur) < 0 || st.st_ino != cur.st_ino || st.st_dev != cur.st_dev)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* 收齐后计算摘要，数据文件移入对象存储（已有相同内容时直接丢弃）并链接文件名 */
+int resumable_finish(struct resumable_job *job, const char *dir)
+{
+    char data[512], obj[512], hex[65];
+    snprintf(data, sizeof(data), "%s/data", dir);
+    int fd = open(data, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    char *buf = (char *)malloc(1 << 20);
+    ssize_t n;
+    EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+    while ((n = read(fd, buf, 1 << 20)) > 0)
+        EVP_DigestUpdate(ctx, buf, n);
+    EVP_DigestFinal_ex(ctx, job->sha256, NULL);
+    EVP_MD_CTX_free(ctx);
+    free(buf);
+    close(fd);
+    if (n < 0)
+        return -1;
+
+    hex_encode(job->sha256, sizeof(job->sha256), hex);
+    snprintf(obj, sizeof(obj), "%s/%.2s/%s", UPLOAD_OBJECTS_DIR, hex, hex + 2);
+    if (!store_touch(hex)) // 新内容：数据文件已逐块 fdatasync，直接 rename 进对象目录（chmod/rename 更新 ctime）
+    {
+        mkdir(UPLOAD_OBJECTS_DIR, 0755);
+        snprintf(obj, sizeof(obj), "%s/%.2s", UPLOAD_OBJECTS_DIR, hex);
+        mkdir(obj, 0755);
+        snprintf(obj, sizeof(obj), "%s/%.2s/%s", UPLOAD_OBJECTS_DIR, hex, hex + 2);
+        if (chmod(data, 0644) < 0 || rename(data, obj) < 0)
+            return -1;
+        snprintf(obj, sizeof(obj), "%s/%.2s", UPLOAD_OBJECTS_DIR, hex);
+        fsync_dir(obj);
+    }
+    if (store_link(hex, job->name) < 0)
+        return -1;
+    resumable_remove(dir);
+    printf("LINE %d: resumable upload %s -> %s\n", __LINE__, job->id, job->name);
+    return 0;
+}
+
+void resumable_create(struct resumable_job *job)
+{
+    unsigned char rnd[16];
+    char dir[256], path[512];
+    RAND_bytes(rnd, sizeof(rnd));
+    hex_encode(rnd, sizeof(rnd), job->id);
+    if (job->name[0] == '\0')
+        strcpy(job->name, job->id);
+    mkdir(UPLOAD_RESUMABLE_DIR, 0755);
+    snprintf(dir, sizeof(dir), "%s/%s", UPLOAD_RESUMABLE_DIR, job->id);
+    if (mkdir(dir, 0755) < 0)
+    {
+        job->status = HTTP_INTERNAL;
+        return;
+    }
+    // 数据文件按总长度预分配，并行写入的区间不会产生碎片
+    snprintf(path, sizeof(path), "%s/data", dir);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0 || (job->length > 0 && fallocate(fd, 0, 0, job->length) < 0 && errno != EOPNOTSUPP))
+    {
+        job->status = fd >= 0 && errno == ENOSPC ? 413 : HTTP_INTERNAL;
+        if (fd >= 0)
+            close(fd);
+        resumable_remove(dir);
+        return;
+    }
+    close(fd);
+    snprintf(path, sizeof(path), "%s/ranges", dir);
+    close(open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644));
+    snprintf(path, sizeof(path), "%s/info", dir); // info 最后写入，存在即表示上传已创建
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL)
+    {
+        job->status = HTTP_INTERNAL;
+        resumable_remove(dir);
+        return;
+    }
+    fprintf(fp, "%lld\n%s\n", (long long)job->length, job->name);
+    fclose(fp);
+    job->status = 201;
+    if (job->length == 0 && resumable_finish(job, dir) == 0) // 空文件无需上传数据
+        job->complete = 1;
+}
+
+void resumable_patch(struct resumable_job *job)
+{
+    char dir[256], path[512];
+    snprintf(dir, sizeof(dir), "%s/%s", UPLOAD_RESUMABLE_DIR, job->id);
+    if (resumable_info(dir, &job->length, job->name, sizeof(job->name)) < 0)
+    {
+        job->status = HTTP_NOTFOUND;
+        return;
+    }
+    size_t len = evbuffer_get_length(job->body);
+    if (job->offset > job->length - (off_t)len)
+    {
+        job->status = HTTP_BADREQUEST;
+        return;
+    }
+
+    int fd = resumable_lock(dir);
+    if (fd < 0)
+    {
+        job->status = HTTP_NOTFOUND; // 已完成或被删除
+        return;
+    }
+    struct byte_range *r;
+    int m = resumable_ranges(dir, &r);
+    for (int i = 0; i < m && len > 0; i++)
+    {
+        if (r[i].start < job->offset + (off_t)len && job->offset < r[i].end)
+        {
+            job->status = 409; // 与已收区间重叠：重传或内容冲突，由客户端 HEAD 后补传缺失部分
+            free(r);
+            close(fd);
+            return;
+        }
+    }
+    free(r);
+
+    // 按块 pwritev 到指定位置，数据落盘后才记录区间
+    struct evbuffer_iovec vec[64];
+    off_t pos = job->offset;
+    while (evbuffer_get_length(job->body) > 0)
+    {
+        int n = evbuffer_peek(job->body, -1, NULL, vec, 64);
+        struct iovec iov[64];
+        for (int i = 0; i < n && i < 64; i++)
+        {
+            iov[i].iov_base = vec[i].iov_base;
+            iov[i].iov_len = vec[i].iov_len;
+        }
+        ssize_t w = pwritev(fd, iov, n < 64 ? n : 64, pos);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w <= 0)
+            break;
+        evbuffer_drain(job->body, w);
+        pos += w;
+    }
+    int ok = evbuffer_get_length(job->body) == 0 && fdatasync(fd) == 0;
+    if (ok && len > 0)
+    {
+        char rec[64];
+        int rec_len = snprintf(rec, sizeof(rec), "%lld %lld\n", (long long)job->offset, (long long)pos);
+        snprintf(path, sizeof(path), "%s/ranges", dir);
+        int log = open(path, O_WRONLY | O_APPEND);
+        ok = log >= 0 && write(log, rec, rec_len) == rec_len && fdatasync(log) == 0;
+        if (log >= 0)
+            close(log);
+    }
+    if (!ok)
+    {
+        job->status = HTTP_INTERNAL;
+        close(fd);
+        return;
+    }
+
+    m = resumable_ranges(dir, &r);
+    job->received = m > 0 && r[0].start == 0 ? r[0].end : 0;
+    int full = m == 1 && r[0].start == 0 && r[0].end == job->length;
+    free(r);
+    job->status = HTTP_NOCONTENT;
+    if (full) // 仍持有锁，合并期间没有其他请求写 data
+    {
+        if (resumable_finish(job, dir) < 0)
+            job->status = HTTP_INTERNAL;
+        else
+            job->complete = 1;
+    }
+    close(fd);
+}
+
+void resumable_head(struct resumable_job *job)
+{
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s/%s", UPLOAD_RESUMABLE_DIR, job->id);
+    if (resumable_info(dir, &job->length, job->name, sizeof(job->name)) < 0)
+    {
+        job->status = HTTP_NOTFOUND;
+        return;
+    }
+    struct byte_range *r;
+    int m = resumable_ranges(dir, &r);
+    struct evbuffer *out = evbuffer_new();
+    for (int i = 0; i < m; i++) // 闭区间，与 HTTP Range 的写法一致
+        evbuffer_add_printf(out, "%s%lld-%lld", i ? "," : "", (long long)r[i].start, (long long)r[i].end - 1);
+    evbuffer_add(out, "", 1);
+    job->ranges = strdup((const char *)evbuffer_pullup(out, -1));
+    evbuffer_free(out);
+    job->received = m > 0 && r[0].start == 0 ? r[0].end : 0;
+    free(r);
+    job->status = HTTP_OK;
+}
+
+void resumable_work(void *arg)
+{
+    struct resumable_job *job = (struct resumable_job *)arg;
+    char dir[256];
+    int fd;
+    switch (job->cmd)
+    {
+    case EVHTTP_REQ_POST:
+        resumable_create(job);
+        break;
+    case EVHTTP_REQ_PATCH:
+        resumable_patch(job);
+        break;
+    case EVHTTP_REQ_HEAD:
+        resumable_head(job);
+        break;
+    default: // DELETE
+        snprintf(dir, sizeof(dir), "%s/%s", UPLOAD_RESUMABLE_DIR, job->id);
+        fd = resumable_lock(dir); // 等待进行中的 PATCH 写完，已合并完成的不再删除
+        job->status = fd < 0 || resumable_info(dir, &job->length, job->name, sizeof(job->name)) < 0 ? HTTP_NOTFOUND : HTTP_NOCONTENT;
+        if (job->status == HTTP_NOCONTENT)
+            resumable_remove(dir);
+        if (fd >= 0)
+            close(fd);
+        break;
+    }
+}
+
+/* 可续传上传允许的最大长度(字节) */
+off_t resumable_max_size(void)
+{
+    return (off_t)env_int("HTTP_RESUMABLE_MAX_MB", RESUMABLE_MAX_MB) << 20;
+}
+
+void resumable_done(void *arg)
+{
+    struct resumable_job *job = (struct resumable_job *)arg;
+    struct evkeyvalq *headers = evhttp_request_get_output_headers(job->req);
+    char value[128];
+    evhttp_add_header(headers, "Tus-Resumable", "1.0.0");
+    if (job->status == 201)
+    {
+        snprintf(value, sizeof(value), "%s%s", RESUMABLE_PREFIX, job->id);
+        evhttp_add_header(headers, "Location", value);
+    }
+    if (job->status == HTTP_OK || (job->status == HTTP_NOCONTENT && job->cmd == EVHTTP_REQ_PATCH))
+    {
+        snprintf(value, sizeof(value), "%lld", (long long)job->received);
+        evhttp_add_header(headers, "Upload-Offset", value);
+        snprintf(value, sizeof(value), "%lld", (long long)job->length);
+        evhttp_add_header(headers, "Upload-Length", value);
+        evhttp_add_header(headers, "Cache-Control", "no-store");
+    }
+    if (job->ranges)
+        evhttp_add_header(headers, "Upload-Ranges", job->ranges);
+    if (job->cmd == EVHTTP_REQ_HEAD)
+    {
+        snprintf(value, sizeof(value), "%lld", (long long)resumable_max_size());
+        evhttp_add_header(headers, "Tus-Max-Size", value);
+    }
+    if (job->complete)
+    {
+        sse_publish_upload(job->name, job->length, job->sha256);
+        char b64[64];
+        EVP_EncodeBlock((unsigned char *)b64, job->sha256, sizeof(job->sha256));
+        snprintf(value, sizeof(value), "sha-256=%s", b64);
+        evhttp_add_header(headers, "Digest", value);
+    }
+    if (job->status == HTTP_OK || job->status == HTTP_NOCONTENT || job->status == 201)
+        evhttp_send_reply(job->req, job->status, job->status == 201 ? "Created" : job->status == HTTP_OK ? "OK" : "No Content", NULL);
+    else
+        evhttp_send_error(job->req, job->status, NULL);
+    if (job->body)
+        evbuffer_free(job->body);
+    free(job->ranges);
+    free(job);
+}
+
+/* 解析非负整数请求头，失败返回 -1 */
+off_t header_offset(struct evkeyvalq *headers, const char *key)
+{
+    const char *value = evhttp_find_header(headers, key);
+    char *end;
+    if (value == NULL || *value < '0' || *value > '9')
+        return -1;
+    long long n = strtoll(value, &end, 10);
+    return *end == '\0' && n >= 0 ? (off_t)n : -1;
+}
+
+/* 从 Upload-Metadata（key base64,key base64...）中取出文件名，未提供时 name 为空串 */
+int resumable_metadata_name(const char *meta, char *name, size_t size)
+{
+    name[0] = '\0';
+    for (const char *p = meta; p && *p;)
+    {
+        while (*p == ' ' || *p == ',')
+            p++;
+        const char *end = strchr(p, ',');
+        size_t item_len = end ? (size_t)(end - p) : strlen(p);
+        if (item_len > 9 && !strncmp(p, "filename ", 9))
+        {
+            size_t b64_len = item_len - 9;
+            unsigned char *out = (unsigned char *)malloc(b64_len + 4);
+            int n = EVP_DecodeBlock(out, (const unsigned char *)p + 9, b64_len);
+            for (size_t i = b64_len; n > 0 && i > 0 && p[9 + i - 1] == '='; i--) // 去掉填充产生的零字节
+                n--;
+            int ok = n > 0 && (size_t)n < size && !memchr(out, '/', n) && !memchr(out, '\0', n) && out[0] != '.';
+            if (ok)
+            {
+                memcpy(name, out, n);
+                name[n] = '\0';
+            }
+            free(out);
+            return ok ? 0 : -1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+/* /files/ 下的请求：解析参数后交给IO线程池 */
+void handle_resumable_request(struct evhttp_request *req)
+{
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    const char *id = path + strlen(RESUMABLE_PREFIX);
+    struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+    struct evkeyvalq *out = evhttp_request_get_output_headers(req);
+    char max_size[32];
+    snprintf(max_size, sizeof(max_size), "%lld", (long long)resumable_max_size());
+    evhttp_add_header(out, "Tus-Resumable", "1.0.0");
+    if (cmd == EVHTTP_REQ_OPTIONS)
+    {
+        evhttp_add_header(out, "Tus-Version", "1.0.0");
+        evhttp_add_header(out, "Tus-Max-Size", max_size);
+        evhttp_add_header(out, "Tus-Extension", "creation,termination");
+        evhttp_send_reply(req, HTTP_NOCONTENT, "No Content", NULL);
+        return;
+    }
+
+    struct resumable_job *job = (struct resumable_job *)calloc(1, sizeof(struct resumable_job));
+    job->req = req;
+    job->cmd = cmd;
+    int status = 0;
+    if (cmd == EVHTTP_REQ_POST)
+    {
+        if (*id != '\0' || (job->length = header_offset(headers, "Upload-Length")) < 0 ||
+            resumable_metadata_name(evhttp_find_header(headers, "Upload-Metadata"), job->name, sizeof(job->name)) < 0)
+            status = HTTP_BADREQUEST;
+        else if (job->length > resumable_max_size())
+        {
+            evhttp_add_header(out, "Tus-Max-Size", max_size);
+            status = 413;
+        }
+    }
+    else if (cmd == EVHTTP_REQ_PATCH || cmd == EVHTTP_REQ_HEAD || cmd == EVHTTP_REQ_DELETE)
+    {
+        if (strlen(id) != 32 || strspn(id, "0123456789abcdef") != 32)
+            status = HTTP_NOTFOUND;
+        else
+            strcpy(job->id, id);
+        if (!status && cmd == EVHTTP_REQ_PATCH)
+        {
+            const char *type = evhttp_find_header(headers, "Content-Type");
+            if (type == NULL || strcmp(type, "application/offset+octet-stream"))
+                status = 415;
+            else if ((job->offset = header_offset(headers, "Upload-Offset")) < 0)
+                status = HTTP_BADREQUEST;
+            job->body = evbuffer_new();
+            evbuffer_add_buffer(job->body, evhttp_request_get_input_buffer(req)); // 移交数据链，不拷贝
+        }
+    }
+    else
+        status = HTTP_BADMETHOD;
+    if (status)
+    {
+        if (job->body)
+            evbuffer_free(job->body);
+        free(job);
+        if (status == 413)
+            evhttp_send_reply(req, status, "Request Entity Too Large", NULL); // send_error 会清掉 Tus-Max-Size
+        else
+            evhttp_send_error(req, status, NULL);
+        return;
+    }
+    work_submit(io_pool, evhttp_connection_get_base(evhttp_request_get_connection(req)), resumable_work, resumable_done, job);
+}
+
+void handle_options_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+void handle_trace_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+void handle_connect_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+void handle_patch_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+void handle_unknown_request(struct evhttp_request *req, void *arg)
+{
+    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+}
+
+/* 处理客户端请求 */
+void accept_request(struct evhttp_request *req, void *arg)
+{
+    if (req == NULL)
+    {
+        printf("LINE %d: %s\n", __LINE__, "Get a null request");
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    trace_handler_start(req);
+    rate_limit_request(req);
+    enum evhttp_cmd_type cmd = evhttp_request_get_command(req);
+    if (admit_request(req, cmd == EVHTTP_REQ_GET || cmd == EVHTTP_REQ_HEAD ? ADMIT_STATIC : ADMIT_DYNAMIC) < 0)
+        return;
+    struct proxy_route *route = proxy_match(evhttp_request_get_uri(req));
+    if (route != NULL) // 反向代理路由
+    {
+        handle_proxy_request(req, route);
+        return;
+    }
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    if (path && !strncmp(path, RESUMABLE_PREFIX, strlen(RESUMABLE_PREFIX))) // 可续传上传
+    {
+        handle_resumable_request(req);
+        return;
+    }
+    switch (cmd) // 请求类型
+    {
+    case EVHTTP_REQ_GET:
+        handle_get_request(req, arg);
+        break;
+    case EVHTTP_REQ_POST:
+        handle_post_request(req, arg);
+        break;
+    case EVHTTP_REQ_HEAD:
+        handle_head_request(req, arg);
+        break;
+    case EVHTTP_REQ_PUT:
+        handle_put_request(req, arg);
+        break;
+    case EVHTTP_REQ_DELETE:
+        handle_delete_request(req, arg);
+        break;
+    case EVHTTP_REQ_OPTIONS:
+        handle_options_request(req, arg);
+        break;
+    case EVHTTP_REQ_TRACE:
+        handle_trace_request(req, arg);
+        break;
+    case EVHTTP_REQ_CONNECT:
+        handle_connect_request(req, arg);
+        break;
+    case EVHTTP_REQ_PATCH:
+        handle_patch_request(req, arg);
+        break;
+    default:
+        handle_unknown_request(req, arg);
+        break;
+    }
+}
+
+/*
+* 内置 HTTP/1.1 引擎（HTTP_ENGINE / HTTPS_ENGINE=native）
+* 直接在 bufferevent 上解析请求：http_parse_head 以 SSE2 每次检查 16 字节找出行尾与非法控制字符，
+* 请求行与首部以切片（相对偏移）留在输入缓冲区中，不拷贝也不分配；处理期间停止读取，切片保持有效，
+* 响应写完后才丢弃这部分输入，接着解析已经收到的下一个请求（管线化）
+* 交给处理函数的仍是 evhttp_request（每个连接复用一个），URI 原地以 NUL 结尾后直接引用，
+* 首部在处理函数第一次读取时才建成 evkeyvalq；有请求体时在移出请求体之前建好
+* 不属于任何路由的小静态文件 GET 不经过 evhttp_request，由 engine_serve_static 直接写出
+*/
+static const struct
+{
+    const char *name;
+    size_t len;
+    enum evhttp_cmd_type type;
+} http_methods[] = {
+    {"GET", 3, EVHTTP_REQ_GET},
+    {"POST", 4, EVHTTP_REQ_POST},
+    {"HEAD", 4, EVHTTP_REQ_HEAD},
+    {"PUT", 3, EVHTTP_REQ_PUT},
+    {"DELETE", 6, EVHTTP_REQ_DELETE},
+    {"OPTIONS", 7, EVHTTP_REQ_OPTIONS},
+    {"TRACE", 5, EVHTTP_REQ_TRACE},
+    {"CONNECT", 7, EVHTTP_REQ_CONNECT},
+    {"PATCH", 5, EVHTTP_REQ_PATCH},
+};
+
+/* 从 from 开始找行尾 '\n' 并返回其下标；遇到 \t 以外的控制字符或不在行尾的 \r 返回 -1，没有完整的行返回 -2 */
+static ssize_t http_scan_line(const char *s, size_t n, size_t from)
+{
+    size_t i = from;
+#ifdef __SSE2__
+    const __m128i ctrl = _mm_set1_epi8(0x1f), del = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i m = _mm_or_si128(_mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl), _mm_cmpeq_epi8(v, del)); // v <= 0x1f 或 0x7f
+        for (int mask = _mm_movemask_epi8(m); mask; mask &= mask - 1)
+        {
+            size_t k = i + __builtin_ctz(mask);
+            if (s[k] == '\n')
+                return k;
+            if (s[k] == '\r' ? k + 1 < n && s[k + 1] != '\n' : s[k] != '\t')
+                return -1;
+        }
+    }
+#endif
+    for (; i < n; i++)
+    {
+        unsigned char c = s[i];
+        if (c >= 0x20 && c != 0x7f)
+            continue;
+        if (c == '\n')
+            return i;
+        if (c == '\r' ? i + 1 < n && s[i + 1] != '\n' : c != '\t')
+            return -1;
+    }
+    return -2;
+}
+
+static int slice_is(const char *s, struct http_slice sl, const char *lit)
+{
+    return sl.len == strlen(lit) && !strncasecmp(s + sl.off, lit, sl.len);
+}
+
+/* 记录影响请求体与连接的首部 */
+static int http_head_field(const char *s, struct http_head *h, struct http_slice name, struct http_slice value)
+{
+    if (slice_is(s, name, "Content-Length"))
+    {
+        ev_int64_t len = 0;
+        if (value.len == 0 || value.len > 18)
+            return -1;
+        for (int i = 0; i < value.len; i++)
+        {
+            if (!isdigit((unsigned char)s[value.off + i]))
+                return -1;
+            len = len * 10 + s[value.off + i] - '0';
+        }
+        if (h->content_length >= 0 && h->content_length != len) // 重复且不一致
+            return -1;
+        h->content_length = len;
+    }
+    else if (slice_is(s, name, "Transfer-Encoding"))
+    {
+        if (slice_is(s, value, "chunked"))
+            h->chunked = 1;
+        else
+            h->other_te = 1;
+    }
+    else if (slice_is(s, name, "Connection"))
+    {
+        h->close |= slice_is(s, value, "close");
+        h->keep_alive |= slice_is(s, value, "keep-alive");
+    }
+    else if (slice_is(s, name, "Expect"))
+        h->expect_continue = slice_is(s, value, "100-continue");
+    return 0;
+}
+
+/*
+* 解析请求行与首部，切片偏移相对于 s；只检查前 ENGINE_HEAD_MAX 字节
+* 返回请求头（含结尾空行）的长度，0 表示尚不完整，-1 表示格式错误，-2 表示首部行数超过上限
+*/
+int http_parse_head(const char *s, size_t n, struct http_head *h)
+{
+    size_t pos = 0;
+    if (n > ENGINE_HEAD_MAX)
+        n = ENGINE_HEAD_MAX;
+    h->method = 0;
+    h->nfields = 0;
+    h->content_length = -1;
+    h->chunked = h->other_te = h->close = h->keep_alive = h->expect_continue = 0;
+    while (pos < n && (s[pos] == '\r' || s[pos] == '\n')) // 上一个请求体之后多余的空行
+        pos++;
+    ssize_t eol = http_scan_line(s, n, pos);
+    if (eol < 0)
+        return eol == -2 ? 0 : -1;
+    const char *line = s + pos;
+    size_t len = eol - pos - (eol > pos && s[eol - 1] == '\r');
+    const char *sp1 = memchr(line, ' ', len);
+    const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', len - (sp1 + 1 - line)) : NULL;
+    if (sp2 == NULL || sp2 == sp1 + 1 || line + len - (sp2 + 1) != 8 || memcmp(sp2 + 1, "HTTP/", 5) ||
+        !isdigit((unsigned char)sp2[6]) || sp2[7] != '.' || !isdigit((unsigned char)sp2[8]))
+        return -1;
+    for (size_t i = 0; i < sizeof(http_methods) / sizeof(http_methods[0]); i++)
+    {
+        if ((size_t)(sp1 - line) == http_methods[i].len && !memcmp(line, http_methods[i].name, http_methods[i].len))
+            h->method = http_methods[i].type;
+    }
+    h->target.off = sp1 + 1 - s;
+    h->target.len = sp2 - sp1 - 1;
+    h->major = sp2[6] - '0';
+    h->minor = sp2[8] - '0';
+
+    for (pos = eol + 1;; pos = eol + 1)
+    {
+        eol = http_scan_line(s, n, pos);
+        if (eol < 0)
+            return eol == -2 ? 0 : -1;
+        line = s + pos;
+        len = eol - pos - (eol > pos && s[eol - 1] == '\r');
+        if (len == 0)
+            return eol + 1;
+        if (line[0] == ' ' || line[0] == '\t') // 不接受折行
+            return -1;
+        const char *colon = memchr(line, ':', len), *end = line + len;
+        if (colon == NULL || colon == line || colon[-1] == ' ' || colon[-1] == '\t')
+            return -1;
+        if (h->nfields == ENGINE_HEADERS_MAX)
+            return -2;
+        const char *v = colon + 1;
+        while (v < end && (*v == ' ' || *v == '\t'))
+            v++;
+        while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        struct http_slice name = {line - s, colon - line}, value = {v - s, end - v};
+        if (http_head_field(s, h, name, value) < 0)
+            return -1;
+        h->names[h->nfields] = name;
+        h->values[h->nfields++] = value;
+    }
+}
+
+struct engine_route
+{
+    char *path;
+    void (*cb)(struct evhttp_request *, void *);
+    void *arg;
+};
+
+struct http_engine
+{
+    struct event_base *base;
+    struct evconnlistener *listener;
+    evutil_socket_t fd;
+    struct uring_op *accept; // io_uring 时代替 listener 的多次触发 accept
+    SSL_CTX *tls_offload;    // 非 NULL 时握手交给 crypto_pool，完成后再创建 bufferevent
+    struct bufferevent *(*bevcb)(struct event_base *, void *);
+    void *bevcb_arg;
+    ev_uint16_t allowed_methods;
+    int nroutes;
+    struct engine_route routes[ENGINE_ROUTES_MAX];
+    void (*gencb)(struct evhttp_request *, void *);
+    void *gencb_arg;
+};
+
+enum engine_state
+{
+    ENGINE_IDLE, // 等待请求头
+    ENGINE_BODY, // 读取请求体
+    ENGINE_BUSY, // 处理与发送响应，停止读取
+};
+
+enum engine_chunk
+{
+    CHUNK_NONE, // 按 Content-Length 读取
+    CHUNK_SIZE,
+    CHUNK_DATA,
+    CHUNK_CRLF,
+    CHUNK_TRAILER,
+};
+
+struct engine_conn
+{
+    struct http_engine *engine;
+    struct bufferevent *bev;
+    evutil_socket_t fd;
+    enum engine_state state;
+    enum engine_chunk chunk;
+    ev_int64_t body_left;         // 剩余的请求体或当前分块字节数
+    unsigned close : 1;           // 响应写完后关闭连接
+    unsigned eof : 1;             // 客户端已关闭写方向
+    unsigned borrowed : 1;        // URI 与首部仍引用输入缓冲区开头的请求头
+    unsigned headers_built : 1;   // 已建成 evkeyvalq
+    struct evhttp_request *req;   // 当前请求，快速路径与出错响应为 NULL
+    struct evhttp_request *spare; // 供下一个请求复用
+    char *head;                   // 请求头在输入缓冲区中的起点
+    size_t head_len;
+    void (*write_cb)(struct evhttp_connection *, void *); // 输出缓冲区降到低水位时调用
+    void *write_cb_arg;
+    void (*closecb)(struct evhttp_connection *, void *);
+    void *closecb_arg;
+    char peer[INET6_ADDRSTRLEN]; // 由 io_uring 接受的连接在第一次取用时才获取
+    ev_uint16_t port;
+    struct http_head h;
+    struct uring_op *rx;           // io_uring 读取，HTTP 连接在 HTTP_IO_BACKEND=uring 时使用，否则为 NULL
+    struct engine_sendfile *tx;    // io_uring 发送中的静态文件
+    unsigned rx_held : 1;          // 处理期间完成的读取，恢复读取时再处理
+    unsigned rx_flags;
+    int rx_res;
+};
+
+// 按 fd 索引；交给处理函数的 evhttp_connection 即连接所在项的地址，据此与 evhttp 的连接区分
+static struct engine_conn **engine_conns;
+static int engine_conns_max;
+
+#define ENGINE_EVCON(conn) ((struct evhttp_connection *)&engine_conns[(conn)->fd])
+#define ENGINE_ERR_FORMAT "<HTML><HEAD>\n<TITLE>%d %s</TITLE>\n</HEAD><BODY>\n<H1>%s</H1>\n</BODY></HTML>\n" // 与 evhttp 相同
+
+/* 引擎请求的标记，cb_arg 为所属连接，连接关闭后为 NULL */
+static void engine_request_cb(struct evhttp_request *req, void *arg)
+{
+}
+
+static int engine_request(const struct evhttp_request *req)
+{
+    return req != NULL && req->cb == engine_request_cb;
+}
+
+static struct engine_conn **engine_slot(struct evhttp_connection *evcon)
+{
+    uintptr_t p = (uintptr_t)evcon, base = (uintptr_t)engine_conns;
+    if (engine_conns == NULL || p < base || p >= base + engine_conns_max * sizeof(*engine_conns))
+        return NULL;
+    return (struct engine_conn **)evcon;
+}
+
+/* 连接属于内置引擎时返回 1 */
+int engine_connection_native(struct evhttp_connection *evcon)
+{
+    return engine_slot(evcon) != NULL;
+}
+
+const char *http_status_phrase(int code)
+{
+    switch (code)
+    {
+    case 100:
+        return "Continue";
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    case 204:
+        return "No Content";
+    case 206:
+        return "Partial Content";
+    case 301:
+        return "Moved Permanently";
+    case 302:
+        return "Found";
+    case 304:
+        return "Not Modified";
+    case 400:
+        return "Bad Request";
+    case 403:
+        return "Forbidden";
+    case 404:
+        return "Not Found";
+    case 405:
+        return "Method Not Allowed";
+    case 409:
+        return "Conflict";
+    case 411:
+        return "Length Required";
+    case 412:
+        return "Precondition Failed";
+    case 413:
+        return "Payload Too Large";
+    case 415:
+        return "Unsupported Media Type";
+    case 416:
+        return "Range Not Satisfiable";
+    case 429:
+        return "Too Many Requests";
+    case 431:
+        return "Request Header Fields Too Large";
+    case 500:
+        return "Internal Server Error";
+    case 501:
+        return "Not Implemented";
+    case 502:
+        return "Bad Gateway";
+    case 503:
+        return "Service Unavailable";
+    case 504:
+        return "Gateway Timeout";
+    case 505:
+        return "HTTP Version Not Supported";
+    }
+    return code < 400 ? "OK" : code < 500 ? "Client Error" : "Server Error";
+}
+
+/* 每秒格式化一次的 Date 首部值 */
+static const char *engine_date(void)
+{
+    static __thread time_t last;
+    static __thread char buf[64];
+    time_t now = time(NULL);
+    if (now != last)
+    {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        evutil_date_rfc1123(buf, sizeof(buf), &tm);
+        last = now;
+    }
+    return buf;
+}
+
+static void engine_build_headers(struct engine_conn *conn, struct evhttp_request *req)
+{
+    for (int i = 0; i < conn->h.nfields; i++)
+    {
+        struct evkeyval *kv = (struct evkeyval *)malloc(sizeof(struct evkeyval));
+        kv->key = strndup(conn->head + conn->h.names[i].off, conn->h.names[i].len);
+        kv->value = strndup(conn->head + conn->h.values[i].off, conn->h.values[i].len);
+        TAILQ_INSERT_TAIL(req->input_headers, kv, next);
+    }
+    conn->headers_built = 1;
+}
+
+/* 请求不再引用输入缓冲区：拷贝 URI，建好首部，丢弃输入中的请求头 */
+static void engine_materialize(struct engine_conn *conn, struct evhttp_request *req)
+{
+    if (!conn->borrowed)
+        return;
+    if (!conn->headers_built)
+        engine_build_headers(conn, req);
+    req->uri = strdup(conn->head + conn->h.target.off);
+    evbuffer_drain(bufferevent_get_input(conn->bev), conn->head_len);
+    conn->borrowed = 0;
+}
+
+static struct evhttp_request *engine_request_new(struct engine_conn *conn)
+{
+    struct evhttp_request *req = conn->spare ? conn->spare : evhttp_request_new(engine_request_cb, conn);
+    conn->spare = NULL;
+    req->cb_arg = conn;
+    req->kind = EVHTTP_REQUEST;
+    req->type = conn->h.method;
+    req->major = conn->h.major;
+    req->minor = conn->h.minor;
+    conn->req = req;
+    conn->headers_built = 0;
+    return req;
+}
+
+/* 请求结束：清空后留给连接的下一个请求 */
+static void engine_request_release(struct engine_conn *conn, struct evhttp_request *req)
+{
+    if (conn->spare)
+    {
+        evhttp_request_free(req);
+        return;
+    }
+    evhttp_clear_headers(req->input_headers);
+    evhttp_clear_headers(req->output_headers);
+    evbuffer_drain(req->input_buffer, evbuffer_get_length(req->input_buffer));
+    evbuffer_drain(req->output_buffer, evbuffer_get_length(req->output_buffer));
+    if (req->uri_elems)
+        evhttp_uri_free(req->uri_elems);
+    free(req->uri);
+    free(req->host_cache);
+    free(req->response_code_line);
+    req->uri_elems = NULL;
+    req->uri = req->host_cache = req->response_code_line = NULL;
+    req->flags = 0;
+    req->response_code = 0;
+    req->chunked = req->userdone = 0;
+    req->on_complete_cb = NULL;
+    req->on_complete_cb_arg = NULL;
+    conn->spare = req;
+}
+
+static void engine_process(struct engine_conn *conn);
+static void engine_rx_complete(struct engine_conn *conn, int res, unsigned flags);
+
+// io_uring 发送静态文件的各步骤
+enum
+{
+    SEND_HEAD = 1, // 首部
+    SEND_FILL,     // 文件 splice 到管道
+    SEND_DRAIN,    // 管道 splice 到套接字
+    SEND_POLL,     // 套接字缓冲区满，等待可写
+    SEND_STEPS,
+};
+
+/* 恢复或停止读取；io_uring 连接同一时间只有一个读取请求，停止读取期间完成的结果留到恢复时处理 */
+static void engine_read_enable(struct engine_conn *conn, int on)
+{
+    if (conn->rx == NULL)
+    {
+        if (on)
+            bufferevent_enable(conn->bev, EV_READ);
+        else
+            bufferevent_disable(conn->bev, EV_READ);
+    }
+    else if (on && conn->rx->inflight == 0 && !conn->rx_held && !conn->eof)
+        uring_recv(loop_uring, conn->rx, conn->fd);
+}
+
+/* 连接关闭：处理函数仍持有的请求与连接分离，由它发送响应时释放 */
+static void engine_conn_free(struct engine_conn *conn)
+{
+    struct evhttp_request *req = conn->req;
+    if (req && conn->state == ENGINE_BUSY && !req->userdone)
+    {
+        engine_materialize(conn, req);
+        req->cb_arg = NULL;
+    }
+    else if (req)
+        evhttp_request_free(req);
+    conn->req = NULL;
+    if (conn->closecb)
+        conn->closecb(ENGINE_EVCON(conn), conn->closecb_arg);
+    engine_conns[conn->fd] = NULL;
+    if (conn->spare)
+        evhttp_request_free(conn->spare);
+    if (conn->rx)
+    {
+        if (conn->rx_held && (conn->rx_flags & IORING_CQE_F_BUFFER))
+            uring_buf_return(loop_uring, conn->rx_flags);
+        uring_op_release(loop_uring, conn->rx, 1);
+    }
+    if (conn->tx) // 由其完成回调关闭文件与管道
+        uring_op_release(loop_uring, (struct uring_op *)conn->tx, SEND_STEPS);
+    rate_close(conn->bev);
+    bufferevent_free(conn->bev);
+    free(conn);
+}
+
+/* 输出缓冲区写空即响应完成，继续处理输入中的下一个请求 */
+static void engine_send_done(struct evhttp_connection *evcon, void *arg)
+{
+    struct engine_conn *conn = (struct engine_conn *)arg;
+    if (evbuffer_get_length(bufferevent_get_output(conn->bev)))
+        return;
+    struct evhttp_request *req = conn->req;
+    conn->req = NULL;
+    conn->write_cb = NULL;
+    if (req && req->on_complete_cb) // 完成回调会检查输入中是否已有下一个请求，先丢弃本请求的部分
+        engine_materialize(conn, req);
+    if (conn->borrowed)
+        evbuffer_drain(bufferevent_get_input(conn->bev), conn->head_len);
+    conn->borrowed = 0;
+    if (req)
+    {
+        if (req->on_complete_cb)
+            req->on_complete_cb(req, req->on_complete_cb_arg);
+        engine_request_release(conn, req);
+    }
+    if (conn->close)
+    {
+        engine_conn_free(conn);
+        return;
+    }
+    conn->state = ENGINE_IDLE;
+    if (conn->rx_held)
+    {
+        conn->rx_held = 0;
+        engine_rx_complete(conn, conn->rx_res, conn->rx_flags);
+        return;
+    }
+    engine_read_enable(conn, 1);
+    engine_process(conn);
+}
+
+static void engine_response_done(struct engine_conn *conn)
+{
+    conn->req->userdone = 1;
+    conn->write_cb = engine_send_done;
+    conn->write_cb_arg = conn;
+}
+
+/* 解析阶段出错：直接写出错误页并在写完后关闭 */
+static void engine_reject(struct engine_conn *conn, int code)
+{
+    char body[256];
+    const char *reason = http_status_phrase(code);
+    int len = snprintf(body, sizeof(body), ENGINE_ERR_FORMAT, code, reason, reason);
+    if (conn->req)
+        evhttp_request_free(conn->req);
+    conn->req = NULL;
+    conn->borrowed = 0;
+    conn->close = 1;
+    conn->state = ENGINE_BUSY;
+    engine_read_enable(conn, 0);
+    evbuffer_add_printf(bufferevent_get_output(conn->bev),
+                        "HTTP/1.1 %d %s\r\nContent-Type: text/html; charset=ISO-8859-1\r\nConnection: close\r\n"
+                        "Date: %s\r\nContent-Length: %d\r\n\r\n%s",
+                        code, reason, engine_date(), len, body);
+    conn->write_cb = engine_send_done;
+    conn->write_cb_arg = conn;
+}
+
+static int engine_needs_body(const struct evhttp_request *req, int code)
+{
+    return req->type != EVHTTP_REQ_HEAD && code >= 200 && code != 204 && code != 304;
+}
+
+/* 写出状态行与首部，body_len 为 -1 表示流式响应（HTTP/1.1 分块，HTTP/1.0 以关闭连接结束） */
+static void engine_write_head(struct engine_conn *conn, struct evhttp_request *req, int code, const char *reason, ev_ssize_t body_len)
+{
+    struct evbuffer *out = bufferevent_get_output(conn->bev);
+    struct evkeyvalq *headers = req->output_headers;
+    int body = engine_needs_body(req, code);
+    const char *connection = evhttp_find_header(headers, "Connection");
+    if (connection && !evutil_ascii_strcasecmp(connection, "close"))
+        conn->close = 1;
+    req->response_code = code;
+    req->chunked = 0;
+    evbuffer_add_printf(out, "HTTP/%d.%d %d %s\r\n", req->major, req->minor, code, reason ? reason : http_status_phrase(code));
+    if (req->minor >= 1 && evhttp_find_header(headers, "Date") == NULL)
+        evbuffer_add_printf(out, "Date: %s\r\n", engine_date());
+    if (body && evhttp_find_header(headers, "Content-Type") == NULL)
+        evbuffer_add_printf(out, "Content-Type: text/html; charset=ISO-8859-1\r\n");
+    if (body && evhttp_find_header(headers, "Content-Length") == NULL && evhttp_find_header(headers, "Transfer-Encoding") == NULL)
+    {
+        if (body_len >= 0)
+            evbuffer_add_printf(out, "Content-Length: %zd\r\n", body_len);
+        else if (req->minor >= 1)
+        {
+            evbuffer_add_printf(out, "Transfer-Encoding: chunked\r\n");
+            req->chunked = 1;
+        }
+        else
+            conn->close = 1;
+    }
+    if (conn->close)
+        evbuffer_add_printf(out, "Connection: close\r\n");
+    else if (req->minor == 0)
+        evbuffer_add_printf(out, "Connection: keep-alive\r\n");
+    struct evkeyval *kv;
+    TAILQ_FOREACH(kv, headers, next)
+    {
+        if (evutil_ascii_strcasecmp(kv->key, "Connection"))
+            evbuffer_add_printf(out, "%s: %s\r\n", kv->key, kv->value);
+    }
+    evbuffer_add(out, "\r\n", 2);
+}
+
+/*
+* io_uring 发送静态文件：首部 SEND、文件 splice 到管道、管道 splice 到套接字三个请求链接后一次提交，
+* 文件不超过管道容量时整个响应不需要任何系统调用；套接字缓冲区满时等待可写后继续发送管道中剩余的数据
+* 连接关闭时取消未完成的请求，最后一个完成事件关闭文件与管道
+*/
+struct engine_sendfile
+{
+    struct uring_op op; // arg 为连接
+    int file;
+    struct uring_pipe pipe;
+    off_t off, size; // 已读入管道的文件偏移与文件大小
+    size_t in_pipe;  // 管道中尚未发出的字节数
+    int failed;
+    size_t head_len;
+    char head[512];
+};
+
+static void engine_sendfile_next(struct engine_conn *conn, struct engine_sendfile *tx, int head)
+{
+    size_t n = tx->size - tx->off < tx->pipe.size ? (size_t)(tx->size - tx->off) : (size_t)tx->pipe.size;
+    uring_reserve(loop_uring, 3);
+    if (head)
+        uring_send(loop_uring, &tx->op, SEND_HEAD, conn->fd, tx->head, tx->head_len, 1);
+    uring_splice(loop_uring, &tx->op, SEND_FILL, tx->file, tx->off, tx->pipe.fd[1], n, 1);
+    uring_splice(loop_uring, &tx->op, SEND_DRAIN, tx->pipe.fd[0], -1, conn->fd, n, 0);
+}
+
+static void engine_sendfile_cb(struct uring_op *op, int step, int res, unsigned flags)
+{
+    struct engine_sendfile *tx = (struct engine_sendfile *)op;
+    struct engine_conn *conn = (struct engine_conn *)op->arg;
+    if (step == SEND_HEAD)
+        tx->failed |= res != (int)tx->head_len;
+    else if (step == SEND_FILL && res > 0)
+    {
+        tx->off += res;
+        tx->in_pipe += res;
+    }
+    else if (step == SEND_DRAIN && res > 0)
+        tx->in_pipe -= res;
+    else if (step == SEND_FILL || step == SEND_POLL || (res != -EAGAIN && res != -ECANCELED)) // 读入不完整时 DRAIN 以 -ECANCELED 结束
+        tx->failed = 1;
+    if (conn && res > 0 && (step == SEND_HEAD || step == SEND_DRAIN))
+        trace_sent(conn->bev, res);
+    if (op->inflight)
+        return;
+    if (conn == NULL || tx->failed)
+    {
+        uring_pipe_put(loop_uring, &tx->pipe, 0);
+        close(tx->file);
+        if (conn)
+        {
+            conn->tx = NULL;
+            op->arg = NULL;
+            engine_conn_free(conn);
+        }
+        return;
+    }
+    if (tx->in_pipe)
+    {
+        if (step == SEND_POLL)
+            uring_splice(loop_uring, op, SEND_DRAIN, tx->pipe.fd[0], -1, conn->fd, tx->in_pipe, 0);
+        else
+            uring_poll_out(loop_uring, op, SEND_POLL, conn->fd);
+        return;
+    }
+    if (tx->off < tx->size)
+    {
+        engine_sendfile_next(conn, tx, 0);
+        return;
+    }
+    uring_pipe_put(loop_uring, &tx->pipe, 1);
+    close(tx->file);
+    conn->tx = NULL;
+    op->arg = NULL;
+    engine_send_done(ENGINE_EVCON(conn), conn);
+}
+
+/* 取走 fd；失败返回 -1，由调用方改用输出缓冲区 */
+static int engine_sendfile(struct engine_conn *conn, int fd, off_t size, const char *head, size_t head_len)
+{
+    struct engine_sendfile *tx = (struct engine_sendfile *)uring_op_new(engine_sendfile_cb, conn, sizeof(struct engine_sendfile));
+    if (head_len > sizeof(tx->head) || uring_pipe_get(loop_uring, &tx->pipe) < 0)
+    {
+        free(tx);
+        return -1;
+    }
+    memcpy(tx->head, head, head_len);
+    tx->head_len = head_len;
+    tx->file = fd;
+    tx->size = size;
+    conn->tx = tx;
+    trace_sent(conn->bev, 0);
+    engine_sendfile_next(conn, tx, 1);
+    return 0;
+}
+
+/* 快速路径开始响应：登记限速与请求计时，丢弃请求头，之后不能再引用请求头中的切片 */
+static void engine_static_start(struct engine_conn *conn, const char *target, int code)
+{
+    rate_limit_path(conn->bev, target);
+    if (req_traces)
+    {
+        struct evhttp_request *req = engine_request_new(conn);
+        req->response_code = code;
+        trace_handler_start(req);
+        engine_materialize(conn, req); // 丢弃请求头后完成回调仍要读取 URI
+    }
+    else
+        stats_request(); // 否则由 trace_handler_start 计数
+    if (conn->borrowed) // 开启请求计时时已由 engine_materialize 丢弃
+        evbuffer_drain(bufferevent_get_input(conn->bev), conn->head_len);
+    conn->borrowed = 0;
+}
+
+/* 从静态资源包写出：预先生成的首部与映射中的内容直接排入输出缓冲区 */
+static void engine_serve_pack(struct engine_conn *conn, const char *target, struct asset_pack *pack, const struct pack_entry *e)
+{
+    const struct http_head *h = &conn->h;
+    const char *accept = NULL, *match = NULL;
+    size_t accept_len = 0, match_len = 0;
+    for (int i = 0; i < h->nfields; i++)
+    {
+        if (slice_is(conn->head, h->names[i], "Accept-Encoding"))
+        {
+            accept = conn->head + h->values[i].off;
+            accept_len = h->values[i].len;
+        }
+        else if (slice_is(conn->head, h->names[i], "If-None-Match"))
+        {
+            match = conn->head + h->values[i].off;
+            match_len = h->values[i].len;
+        }
+    }
+    const struct pack_variant *v = pack_variant(e, accept, accept_len);
+    int not_modified = match && pack_etag_match(match, match_len, v->etag);
+    engine_static_start(conn, target, not_modified ? HTTP_NOTMODIFIED : HTTP_OK);
+    struct evbuffer *out = bufferevent_get_output(conn->bev);
+    const char *connection = conn->close ? "Connection: close\r\n" : h->minor == 0 ? "Connection: keep-alive\r\n" : "";
+    if (not_modified)
+        evbuffer_add_printf(out, "HTTP/1.%d 304 Not Modified\r\nDate: %s\r\nETag: %s\r\n%s%s\r\n", h->minor, engine_date(), v->etag,
+                            e->variants[PACK_GZIP].head_len ? "Vary: Accept-Encoding\r\n" : "", connection);
+    else
+    {
+        if (tcp_cork_enabled && bufferevent_openssl_get_ssl(conn->bev))
+            tcp_cork_bev(conn->bev);
+        evbuffer_add_printf(out, "HTTP/1.%d 200 OK\r\nDate: %s\r\n", h->minor, engine_date());
+        evbuffer_add(out, pack->base + v->head_off, v->head_len);
+        evbuffer_add_printf(out, "%s\r\n", connection);
+        pack_add_body(out, pack, v);
+    }
+    conn->write_cb = engine_send_done;
+    conn->write_cb_arg = conn;
+}
+
+/*
+* 静态文件快速路径：GET、路径中没有查询参数与转义、不属于任何路由且文件不超过 STREAM_HIGH_WATERMARK 时，
+* 由请求头切片拼出文件路径，首部与文件一起排入输出缓冲区（HTTP 为 sendfile），不创建 evhttp_request
+* 先查静态资源包，包中的文件不受大小限制，也包括目录
+* 目录、不存在的文件与大文件返回 -1，交给 accept_request，行为与 evhttp 相同
+* 开启请求计时时仍需一个（复用的）evhttp_request 登记完成回调
+*/
+static int engine_serve_static(struct engine_conn *conn)
+{
+    const struct http_head *h = &conn->h;
+    const char *target = conn->head + h->target.off; // 已以 NUL 结尾
+    char path[512];
+    struct engine_route *route = conn->engine->routes;
+    if (h->method != EVHTTP_REQ_GET || target[0] != '/' || strpbrk(target, "?%") || strstr(target, "..") ||
+        !strncmp(target, RESUMABLE_PREFIX, strlen(RESUMABLE_PREFIX)) || proxy_match(target) || admit_check(ADMIT_STATIC))
+        return -1; // 过载时由 accept_request 回复 503
+    watchdog_note("GET", target);
+    for (int i = 0; i < conn->engine->nroutes; i++)
+    {
+        if (!strcmp(route[i].path, target))
+            return -1;
+    }
+    size_t cap = sizeof(path) - strlen("index.html");
+    int n = snprintf(path, cap, "%s%s", WEB_PATH, target);
+    if (n < 0 || (size_t)n >= cap)
+        return -1;
+    if (path[n - 1] == '/')
+        strcpy(path + n, "index.html");
+    struct asset_pack *pack = pack_current();
+    const struct pack_entry *e = pack ? pack_lookup(pack, path + strlen(WEB_PATH)) : NULL;
+    if (e)
+    {
+        engine_serve_pack(conn, target, pack, e);
+        return 0;
+    }
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size > STREAM_HIGH_WATERMARK)
+    {
+        close(fd);
+        return -1;
+    }
+    engine_static_start(conn, target, HTTP_OK);
+    char date[64];
+    struct tm tm;
+    gmtime_r(&st.st_mtime, &tm);
+    evutil_date_rfc1123(date, sizeof(date), &tm);
+    struct evbuffer *out = bufferevent_get_output(conn->bev);
+    char head[512];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.%d 200 OK\r\nContent-Type: %s\r\nLast-Modified: %s\r\nDate: %s\r\nContent-Length: %lld\r\n%s\r\n",
+                            h->minor, get_content_type(path), date, engine_date(), (long long)st.st_size,
+                            conn->close ? "Connection: close\r\n" : h->minor == 0 ? "Connection: keep-alive\r\n" : "");
+    if (conn->rx && st.st_size > 0 && !__atomic_load_n(&rate_shm->enabled, __ATOMIC_RELAXED) && // 限速只作用于输出缓冲区
+        engine_sendfile(conn, fd, st.st_size, head, head_len) == 0)
+        return 0;
+    if (tcp_cork_enabled && bufferevent_openssl_get_ssl(conn->bev))
+        tcp_cork_bev(conn->bev);
+    evbuffer_add(out, head, head_len);
+    if (st.st_size == 0)
+        close(fd);
+    else if (evbuffer_add_file(out, fd, 0, st.st_size) < 0)
+    {
+        printf("LINE %d: %s\n", __LINE__, "evbuffer_add_file failed");
+        conn->close = 1; // 首部已写出
+    }
+    conn->write_cb = engine_send_done;
+    conn->write_cb_arg = conn;
+    return 0;
+}
+
+/* 请求完整：停止读取并交给路由或通用处理函数 */
+static void engine_dispatch(struct engine_conn *conn)
+{
+    struct http_engine *engine = conn->engine;
+    conn->state = ENGINE_BUSY;
+    conn->write_cb = NULL;
+    engine_read_enable(conn, 0);
+    if (conn->req == NULL && engine_serve_static(conn) == 0)
+        return;
+    struct evhttp_request *req = conn->req ? conn->req : engine_request_new(conn);
+    if (req->uri_elems == NULL &&
+        (req->uri_elems = evhttp_uri_parse_with_flags(evhttp_request_get_uri(req), EVHTTP_URI_NONCONFORMANT)) == NULL)
+    {
+        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        return;
+    }
+    const char *path = evhttp_uri_get_path(req->uri_elems);
+    char *decoded = path && strchr(path, '%') ? evhttp_decode_uri(path) : NULL; // evhttp 以解码后的路径匹配
+    struct engine_route *route = NULL;
+    for (int i = 0; path && i < engine->nroutes && route == NULL; i++)
+    {
+        if (!strcmp(engine->routes[i].path, decoded ? decoded : path))
+            route = &engine->routes[i];
+    }
+    free(decoded);
+    if (route)
+        route->cb(req, route->arg);
+    else if (engine->gencb)
+        engine->gencb(req, engine->gencb_arg);
+    else
+        evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+}
+
+/* 把输入中的请求体移入请求（整块转移，不拷贝），返回 1 表示读完，0 表示需要更多数据，-1 表示分块格式错误 */
+static int engine_read_body(struct engine_conn *conn, struct evbuffer *input)
+{
+    struct evbuffer *body = conn->req->input_buffer;
+    for (;;)
+    {
+        size_t avail = evbuffer_get_length(input);
+        if (conn->chunk == CHUNK_NONE || conn->chunk == CHUNK_DATA)
+        {
+            size_t n = avail < (size_t)conn->body_left ? avail : (size_t)conn->body_left;
+            evbuffer_remove_buffer(input, body, n);
+            if ((conn->body_left -= n) > 0)
+                return 0;
+            if (conn->chunk == CHUNK_NONE)
+                return 1;
+            conn->chunk = CHUNK_CRLF;
+            continue;
+        }
+        char line[64];
+        size_t eol_len;
+        struct evbuffer_ptr eol = evbuffer_search_eol(input, NULL, &eol_len, EVBUFFER_EOL_CRLF);
+        if (eol.pos < 0)
+            return avail > ENGINE_HEAD_MAX ? -1 : 0;
+        if (conn->chunk == CHUNK_TRAILER) // 忽略尾部首部
+        {
+            evbuffer_drain(input, eol.pos + eol_len);
+            if (eol.pos == 0)
+                return 1;
+            continue;
+        }
+        if ((size_t)eol.pos >= sizeof(line))
+            return -1;
+        evbuffer_remove(input, line, eol.pos);
+        evbuffer_drain(input, eol_len);
+        line[eol.pos] = '\0';
+        if (conn->chunk == CHUNK_CRLF)
+        {
+            if (eol.pos != 0)
+                return -1;
+            conn->chunk = CHUNK_SIZE;
+            continue;
+        }
+        char *end;
+        errno = 0;
+        long long size = strtoll(line, &end, 16);
+        if (!isxdigit((unsigned char)line[0]) || errno || (*end && *end != ';' && *end != ' ' && *end != '\t'))
+            return -1;
+        conn->chunk = size ? CHUNK_DATA : CHUNK_TRAILER;
+        conn->body_left = size;
+    }
+}
+
+/* 解析输入中的下一个请求 */
+static void engine_process(struct engine_conn *conn)
+{
+    struct evbuffer *input = bufferevent_get_input(conn->bev);
+    struct http_head *h = &conn->h;
+    if (conn->state == ENGINE_IDLE)
+    {
+        size_t len = evbuffer_get_length(input);
+        struct evbuffer_iovec v = {NULL, 0};
+        int rc = 0;
+        if (len)
+        {
+            evbuffer_peek(input, -1, NULL, &v, 1); // 通常整个请求头都在第一个数据块中
+            rc = http_parse_head((const char *)v.iov_base, v.iov_len, h);
+            if (rc == 0 && v.iov_len < len && v.iov_len < ENGINE_HEAD_MAX)
+            {
+                v.iov_len = len < ENGINE_HEAD_MAX ? len : ENGINE_HEAD_MAX;
+                v.iov_base = evbuffer_pullup(input, v.iov_len);
+                rc = http_parse_head((const char *)v.iov_base, v.iov_len, h);
+            }
+        }
+        if (rc == 0)
+        {
+            if (len >= ENGINE_HEAD_MAX)
+                engine_reject(conn, 431);
+            else if (conn->eof)
+                engine_conn_free(conn);
+            return;
+        }
+        if (rc < 0 || h->major != 1 || h->method == 0 || !(h->method & conn->engine->allowed_methods) || h->other_te)
+        {
+            engine_reject(conn, rc == -2 ? 431 : rc < 0 ? HTTP_BADREQUEST : h->major != 1 ? 505 : HTTP_NOTIMPLEMENTED);
+            return;
+        }
+        conn->head = (char *)v.iov_base;
+        conn->head_len = rc;
+        conn->head[h->target.off + h->target.len] = '\0'; // 原为空格，URI 可直接作为字符串使用
+        conn->borrowed = 1;
+        conn->close = h->close || conn->eof || (h->minor == 0 && !h->keep_alive);
+        if (!h->chunked && h->content_length <= 0)
+        {
+            engine_dispatch(conn);
+            return;
+        }
+        // 有请求体：请求头先转为请求自己的副本，再移出请求体
+        engine_materialize(conn, engine_request_new(conn));
+        conn->state = ENGINE_BODY;
+        conn->chunk = h->chunked ? CHUNK_SIZE : CHUNK_NONE;
+        conn->body_left = h->chunked ? 0 : h->content_length;
+        if (h->expect_continue && h->minor >= 1 && (h->chunked || evbuffer_get_length(input) < (size_t)h->content_length))
+            evbuffer_add_printf(bufferevent_get_output(conn->bev), "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+    if (conn->state == ENGINE_BODY)
+    {
+        int rc = engine_read_body(conn, input);
+        if (rc < 0)
+            engine_reject(conn, HTTP_BADREQUEST);
+        else if (rc > 0)
+            engine_dispatch(conn);
+        else if (conn->eof)
+            engine_conn_free(conn);
+    }
+}
+
+static void engine_read_cb(struct bufferevent *bev, void *arg)
+{
+    struct engine_conn *conn = (struct engine_conn *)arg;
+    if (conn->state != ENGINE_BUSY)
+        engine_process(conn);
+}
+
+static void engine_write_cb(struct bufferevent *bev, void *arg)
+{
+    struct engine_conn *conn = (struct engine_conn *)arg;
+    if (conn->write_cb)
+        conn->write_cb(ENGINE_EVCON(conn), conn->write_cb_arg);
+}
+
+static void engine_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+    struct engine_conn *conn = (struct engine_conn *)arg;
+    if (events & BEV_EVENT_CONNECTED) // TLS 握手完成
+        return;
+    if ((events & BEV_EVENT_EOF) && !(events & BEV_EVENT_ERROR) && conn->state != ENGINE_BUSY)
+    {
+        conn->eof = 1; // 客户端只关闭了写方向，已收到的请求仍然处理
+        engine_process(conn);
+        return;
+    }
+    engine_conn_free(conn);
+}
+
+/* io_uring 读取完成：数据交给解析，res 为 0 或负值时按 bufferevent 的事件处理 */
+static void engine_rx_complete(struct engine_conn *conn, int res, unsigned flags)
+{
+    if (res > 0)
+    {
+        evbuffer_add(bufferevent_get_input(conn->bev), uring_buf(loop_uring, flags), res);
+        uring_buf_return(loop_uring, flags);
+        evutil_socket_t fd = conn->fd;
+        engine_process(conn);
+        if (engine_conns[fd] == conn) // 连接可能已在处理中关闭
+            engine_read_enable(conn, conn->state != ENGINE_BUSY);
+        return;
+    }
+    if (flags & IORING_CQE_F_BUFFER)
+        uring_buf_return(loop_uring, flags);
+    if (res == -ENOBUFS) // 缓冲区暂时用尽
+        engine_read_enable(conn, 1);
+    else
+        engine_event_cb(conn->bev, BEV_EVENT_READING | (res == 0 ? BEV_EVENT_EOF : res == -ECANCELED ? BEV_EVENT_TIMEOUT : BEV_EVENT_ERROR), conn);
+}
+
+static void engine_rx_cb(struct uring_op *op, int step, int res, unsigned flags)
+{
+    struct engine_conn *conn = (struct engine_conn *)op->arg;
+    if (conn && conn->state != ENGINE_BUSY)
+        engine_rx_complete(conn, res, flags);
+    else if (conn && res != -ECANCELED) // 处理期间不计读取超时
+    {
+        conn->rx_held = 1;
+        conn->rx_res = res;
+        conn->rx_flags = flags;
+    }
+    else if (flags & IORING_CQE_F_BUFFER)
+        uring_buf_return(loop_uring, flags);
+}
+
+static void engine_set_peer(struct engine_conn *conn, const struct sockaddr *sa)
+{
+    if (sa->sa_family == AF_INET6)
+    {
+        evutil_inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)sa)->sin6_addr, conn->peer, sizeof(conn->peer));
+        conn->port = ntohs(((const struct sockaddr_in6 *)sa)->sin6_port);
+    }
+    else if (sa->sa_family == AF_INET)
+    {
+        evutil_inet_ntop(AF_INET, &((const struct sockaddr_in *)sa)->sin_addr, conn->peer, sizeof(conn->peer));
+        conn->port = ntohs(((const struct sockaddr_in *)sa)->sin_port);
+    }
+}
+
+/* 已创建 bufferevent 的连接；sa 为 NULL 时对端地址在第一次取用时获取 */
+static void engine_conn_attach(struct http_engine *engine, struct bufferevent *bev, evutil_socket_t fd, const struct sockaddr *sa)
+{
+    struct engine_conn *conn = (struct engine_conn *)calloc(1, sizeof(struct engine_conn));
+    conn->engine = engine;
+    conn->bev = bev;
+    conn->fd = fd;
+    if (sa)
+        engine_set_peer(conn, sa);
+    struct timeval tv = {ENGINE_TIMEOUT, 0};
+    bufferevent_setcb(bev, engine_read_cb, engine_write_cb, engine_event_cb, conn);
+    bufferevent_set_timeouts(bev, &tv, &tv);
+    engine_conns[fd] = conn;
+    if (loop_uring && bufferevent_openssl_get_ssl(bev) == NULL) // TLS 连接仍由 bufferevent 读取
+    {
+        conn->rx = uring_op_new(engine_rx_cb, conn, sizeof(struct uring_op));
+        bufferevent_enable(bev, EV_WRITE);
+        engine_read_enable(conn, 1);
+    }
+    else
+        bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+/*
+* TLS 握手卸载（HTTPS_HANDSHAKE_THREADS）
+* OpenSSL bufferevent 在事件循环中握手，完整握手的私钥签名与密钥交换期间同一循环的其他连接都要等待；
+* libevent 不处理 SSL_MODE_ASYNC 的 SSL_ERROR_WANT_ASYNC，因此改为在 bufferevent 之外握手：
+* 循环只等待套接字可读/可写，每一步 SSL_do_handshake（包括签名与密钥交换）在 crypto_pool 中执行，
+* 同一时刻只有一个线程使用该 SSL 对象；握手完成后以 BUFFEREVENT_SSL_OPEN 创建 bufferevent，之后与其他连接相同
+*/
+struct tls_handshake
+{
+    struct http_engine *engine;
+    evutil_socket_t fd;
+    SSL *ssl;
+    struct event *ev;
+    int err; // 上一步 SSL_do_handshake 的结果，SSL_ERROR_NONE 表示完成
+    struct sockaddr_storage sa;
+    int has_sa;
+};
+
+static void tls_handshake_free(struct tls_handshake *hs)
+{
+    event_free(hs->ev);
+    SSL_free(hs->ssl);
+    evutil_closesocket(hs->fd);
+    free(hs);
+}
+
+static void tls_handshake_work(void *arg)
+{
+    struct tls_handshake *hs = (struct tls_handshake *)arg;
+    int r = SSL_do_handshake(hs->ssl);
+    hs->err = r == 1 ? SSL_ERROR_NONE : SSL_get_error(hs->ssl, r);
+    ERR_clear_error(); // 错误队列属于线程，不留给该线程的下一个连接
+}
+
+static void tls_handshake_wait(struct tls_handshake *hs, short what);
+
+static void tls_handshake_done(void *arg)
+{
+    struct tls_handshake *hs = (struct tls_handshake *)arg;
+    if (hs->err == SSL_ERROR_WANT_READ || hs->err == SSL_ERROR_WANT_WRITE)
+    {
+        tls_handshake_wait(hs, hs->err == SSL_ERROR_WANT_READ ? EV_READ : EV_WRITE);
+        return;
+    }
+    if (hs->err != SSL_ERROR_NONE)
+    {
+        tls_handshake_free(hs);
+        return;
+    }
+    struct http_engine *engine = hs->engine;
+    struct bufferevent *bev = bufferevent_openssl_socket_new(engine->base, hs->fd, hs->ssl, BUFFEREVENT_SSL_OPEN, BEV_OPT_CLOSE_ON_FREE);
+    if (bev == NULL)
+    {
+        tls_handshake_free(hs);
+        return;
+    }
+    trace_accept(bev); // 请求计时的 connect 阶段从握手完成算起
+    rate_accept(bev);
+    stats_accept();
+    engine_conn_attach(engine, bev, hs->fd, hs->has_sa ? (struct sockaddr *)&hs->sa : NULL);
+    event_free(hs->ev);
+    free(hs);
+}
+
+static void tls_handshake_ready(evutil_socket_t fd, short events, void *arg)
+{
+    struct tls_handshake *hs = (struct tls_handshake *)arg;
+    if (events & EV_TIMEOUT)
+        tls_handshake_free(hs);
+    else
+        work_submit(crypto_pool, hs->engine->base, tls_handshake_work, tls_handshake_done, hs);
+}
+
+static void tls_handshake_wait(struct tls_handshake *hs, short what)
+{
+    struct timeval tv = {ENGINE_TIMEOUT, 0};
+    event_assign(hs->ev, hs->engine->base, hs->fd, what, tls_handshake_ready, hs);
+    event_add(hs->ev, &tv);
+}
+
+static void tls_handshake_start(struct http_engine *engine, evutil_socket_t fd, const struct sockaddr *sa, int socklen)
+{
+    struct tls_handshake *hs = (struct tls_handshake *)calloc(1, sizeof(struct tls_handshake));
+    hs->engine = engine;
+    hs->fd = fd;
+    hs->ssl = SSL_new(engine->tls_offload);
+    hs->ev = event_new(engine->base, -1, 0, NULL, NULL);
+    if (sa && socklen <= (int)sizeof(hs->sa))
+    {
+        memcpy(&hs->sa, sa, socklen);
+        hs->has_sa = 1;
+    }
+    if (hs->ssl == NULL || hs->ev == NULL || !SSL_set_fd(hs->ssl, fd))
+    {
+        if (hs->ev)
+            event_free(hs->ev);
+        SSL_free(hs->ssl);
+        evutil_closesocket(fd);
+        free(hs);
+        return;
+    }
+    SSL_set_accept_state(hs->ssl);
+    tls_handshake_wait(hs, EV_READ); // 等待 ClientHello
+}
+
+/* 接受的连接；sa 为 NULL 时对端地址在第一次取用时获取 */
+static void engine_conn_new(struct http_engine *engine, evutil_socket_t fd, struct sockaddr *sa, int socklen)
+{
+    if (fd < engine_conns_max && engine->tls_offload)
+    {
+        tls_handshake_start(engine, fd, sa, socklen);
+        return;
+    }
+    struct bufferevent *bev = fd < engine_conns_max ? engine->bevcb(engine->base, engine->bevcb_arg) : NULL;
+    if (bev == NULL)
+    {
+        evutil_closesocket(fd);
+        return;
+    }
+    bufferevent_setfd(bev, fd);
+    engine_conn_attach(engine, bev, fd, sa);
+}
+
+static void engine_accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *sa, int socklen, void *arg)
+{
+    engine_conn_new((struct http_engine *)arg, fd, sa, socklen);
+}
+
+static void engine_accept_uring_cb(struct uring_op *op, int step, int res, unsigned flags)
+{
+    struct http_engine *engine = (struct http_engine *)op->arg;
+    if (engine && res >= 0)
+        engine_conn_new(engine, res, NULL, 0);
+    else if (res >= 0)
+        close(res);
+    else if (res != -ECANCELED)
+        printf("LINE %d: io_uring accept failed: %s\n", __LINE__, strerror(-res));
+    if (engine && !(flags & IORING_CQE_F_MORE)) // 出错或完成队列溢出时多次触发结束，重新提交
+        uring_accept(loop_uring, op, engine->fd);
+}
+
+/* 分配按 fd 索引的连接表，在创建任何引擎之前调用 */
+void engine_init(void)
+{
+    struct rlimit rl;
+    engine_conns_max = getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (1 << 24) ? (int)rl.rlim_cur : (1 << 24);
+    engine_conns = (struct engine_conn **)calloc(engine_conns_max, sizeof(struct engine_conn *));
+}
+
+/* 在已 listen() 的 fd 上接受连接，bevcb 为每个连接创建 bufferevent（同 evhttp_set_bevcb） */
+struct http_engine *engine_new(struct event_base *base, evutil_socket_t fd, struct bufferevent *(*bevcb)(struct event_base *, void *), void *arg)
+{
+    struct http_engine *engine = (struct http_engine *)calloc(1, sizeof(struct http_engine));
+    engine->base = base;
+    engine->bevcb = bevcb;
+    engine->bevcb_arg = arg;
+    engine->allowed_methods = EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_HEAD | EVHTTP_REQ_PUT | EVHTTP_REQ_DELETE;
+    engine->fd = fd;
+    if (engine_conns && loop_uring)
+    {
+        engine->accept = uring_op_new(engine_accept_uring_cb, engine, sizeof(struct uring_op));
+        uring_accept(loop_uring, engine->accept, fd);
+    }
+    else if (engine_conns)
+        engine->listener = evconnlistener_new(base, engine_accept_cb, engine, LEV_OPT_CLOSE_ON_FREE, 0, fd);
+    if (engine->listener == NULL && engine->accept == NULL)
+    {
+        free(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void engine_set_cb(struct http_engine *engine, const char *path, void (*cb)(struct evhttp_request *, void *), void *arg)
+{
+    if (engine->nroutes == ENGINE_ROUTES_MAX)
+    {
+        printf("LINE %d: Too many engine routes, %s ignored\n", __LINE__, path);
+        return;
+    }
+    engine->routes[engine->nroutes++] = (struct engine_route){strdup(path), cb, arg};
+}
+
+void engine_set_gencb(struct http_engine *engine, void (*cb)(struct evhttp_request *, void *), void *arg)
+{
+    engine->gencb = cb;
+    engine->gencb_arg = arg;
+}
+
+void engine_set_allowed_methods(struct http_engine *engine, ev_uint16_t methods)
+{
+    engine->allowed_methods = methods;
+}
+
+/* TLS 连接在 crypto_pool 中握手，完成后才创建 bufferevent，不再调用 bevcb */
+void engine_set_tls_offload(struct http_engine *engine, SSL_CTX *ctx)
+{
+    engine->tls_offload = ctx;
+}
+
+/* 停止接受连接；已有连接在各自关闭时释放 */
+void engine_free(struct http_engine *engine)
+{
+    if (engine->accept)
+    {
+        uring_op_release(loop_uring, engine->accept, 1);
+        evutil_closesocket(engine->fd);
+    }
+    else
+        evconnlistener_free(engine->listener);
+    for (int i = 0; i < engine->nroutes; i++)
+        free(engine->routes[i].path);
+    free(engine);
+}
+
+/* ---- evhttp 适配层，见 server.h ---- */
+
+struct evhttp_connection *engine_request_get_connection(struct evhttp_request *req)
+{
+    if (!engine_request(req))
+        return (evhttp_request_get_connection)(req);
+    return req->cb_arg ? ENGINE_EVCON((struct engine_conn *)req->cb_arg) : NULL;
+}
+
+const char *engine_request_get_uri(const struct evhttp_request *req)
+{
+    struct engine_conn *conn = engine_request(req) ? (struct engine_conn *)req->cb_arg : NULL;
+    if (conn && conn->borrowed)
+        return conn->head + conn->h.target.off;
+    return (evhttp_request_get_uri)(req);
+}
+
+struct evkeyvalq *engine_request_get_input_headers(struct evhttp_request *req)
+{
+    struct engine_conn *conn = engine_request(req) ? (struct engine_conn *)req->cb_arg : NULL;
+    if (conn && conn->borrowed && !conn->headers_built)
+        engine_build_headers(conn, req);
+    return (evhttp_request_get_input_headers)(req);
+}
+
+struct bufferevent *engine_connection_get_bufferevent(struct evhttp_connection *evcon)
+{
+    struct engine_conn **slot = engine_slot(evcon);
+    if (slot == NULL)
+        return (evhttp_connection_get_bufferevent)(evcon);
+    return *slot ? (*slot)->bev : NULL;
+}
+
+struct event_base *engine_connection_get_base(struct evhttp_connection *evcon)
+{
+    struct engine_conn **slot = engine_slot(evcon);
+    if (slot == NULL)
+        return (evhttp_connection_get_base)(evcon);
+    return *slot ? (*slot)->engine->base : NULL;
 }
 
-/* 返回网页文件 */
-void serve_file(struct evhttp_request *req, char *path)
+void engine_connection_get_peer(struct evhttp_connection *evcon, char **address, ev_uint16_t *port)
 {
-    struct stat st, st_p;      // 获取文件
-    if (stat(path, &st) == -1) // 请求文件不存在
+    struct engine_conn **slot = engine_slot(evcon);
+    if (slot == NULL)
     {
-        printf("LINE %d: %s%s\n", __LINE__, path, "-file not found");
-        evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文件未找到
+        (evhttp_connection_get_peer)(evcon, address, port);
         return;
     }
-    else
+    struct engine_conn *conn = *slot;
+    if (conn && conn->peer[0] == '\0')
     {
-        if (S_ISDIR(st.st_mode)) // 若path是目录，自动添加index.html
-        {
-            strcat(path, "/index.html");
-            if (stat(path, &st_p) == -1)
-            {
-                printf("LINE %d: %s%s\n", __LINE__, path, "-file not found");
-                evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文件未找到
-                return;
-            }
-            st = st_p;
-        }
-
-        int fd = -1;
-        char *type = get_content_type(path); // 获取文件类型
-        if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
-        {
-            printf("LINE %d: %s\n", __LINE__, "Open | fstat failed.");
-            evhttp_send_error(req, HTTP_NOTFOUND, NULL); // 文档打开失败
-            return;
-        }
-        // 添加响应头信息
-        evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", type);
-        struct evbuffer *buf = NULL; // 初始化返回客户端的数据缓存
-        ev_off_t offset = 0;
-        size_t bytes_left = 0, bytes_to_read = 0;
-        evhttp_send_reply_start(req, HTTP_OK, "OK"); // 分块传输
-        while (offset < st.st_size)
-        {
-            buf = evbuffer_new();
-            bytes_left = st.st_size - offset;
-            bytes_to_read = bytes_left > MAX_BUF_SIZE ? MAX_BUF_SIZE : bytes_left;
-            evbuffer_add_file(buf, fd, offset, bytes_to_read);
-            evhttp_send_reply_chunk(req, buf);
-            offset += bytes_to_read;
-            evbuffer_free(buf);
-        }
-        evhttp_send_reply_end(req); // 结束分块
-        close(fd);
+        struct sockaddr_storage ss;
+        socklen_t len = sizeof(ss);
+        if (getpeername(conn->fd, (struct sockaddr *)&ss, &len) == 0)
+            engine_set_peer(conn, (struct sockaddr *)&ss);
     }
+    *address = conn ? conn->peer : "";
+    *port = conn ? conn->port : 0;
 }
 
-/* 处理GET请求 */
-void handle_get_request(struct evhttp_request *req, void *arg)
+void engine_connection_set_closecb(struct evhttp_connection *evcon, void (*cb)(struct evhttp_connection *, void *), void *arg)
 {
-    // 解析URI参数
-    char *decode_uri = strdup((char *)evhttp_request_uri(req)); // get url
-    printf("LINE %d: %s%s\n", __LINE__, "Get a 'get' request:", decode_uri);
-    struct evkeyvalq http_query;                                // get argument
-    // 请求中包含 ..
-    if (strstr(decode_uri, ".."))
+    struct engine_conn **slot = engine_slot(evcon);
+    if (slot == NULL)
     {
-        printf("LINE %d: %s\n", __LINE__, "Get a request include '..'.");
-        evhttp_send_error(req, HTTP_BADREQUEST, "Are You Hacking Me?");
-        free(decode_uri);
-        return;
-    }
-    // 参数错误
-    if (evhttp_parse_query(decode_uri, &http_query) == -1)
-    {
-        printf("LINE %d: %s\n", __LINE__, "Get request parm failed");
-        free(decode_uri);
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
-        return;
+        if (rate_set_closecb(evcon, cb, arg) < 0)
+            (evhttp_connection_set_closecb)(evcon, cb, arg);
     }
-
-    char path[512];
-    sprintf(path, "%s%s", WEB_PATH, strtok(decode_uri, "?")); // 网页文件路径
-    if (path[strlen(path) - 1] == '/')                        // 默认找路径下的index.html
-        strcat(path, "index.html");
-
-    // 遍历输出参数
-    struct evkeyval *header;
-    for (header = http_query.tqh_first; header; header = header->next.tqe_next)
+    else if (*slot)
     {
-        printf("  %s: %s\n", header->key, header->value);
+        (*slot)->closecb = cb;
+        (*slot)->closecb_arg = arg;
     }
-
-    serve_file(req, path); // 向客户端返回数据
-    free(decode_uri);
 }
 
-/* 处理POST请求 */
-void handle_post_request(struct evhttp_request *req, void *arg)
+void engine_send_reply(struct evhttp_request *req, int code, const char *reason, struct evbuffer *body)
 {
-    // 处理post请求数据
-    char *decode_uri = strdup((char *)evhttp_request_uri(req)); // get url
-    size_t post_size = evbuffer_get_length(req->input_buffer);  // get len
-    if (post_size <= 0)
+    if (!engine_request(req))
     {
-        printf("LINE %d: %s\n", __LINE__, "Post message is empty");
-        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: Message is empty!");
+        (evhttp_send_reply)(req, code, reason, body);
         return;
     }
-    size_t copy_len = post_size > MAX_BUF_SIZE ? MAX_BUF_SIZE : post_size;
-    char buf[MAX_BUF_SIZE] = {0};
-    printf("LINE %d: Post len:%d, Copy len:%ld\n", __LINE__, post_size, copy_len);
-    memcpy(buf, evbuffer_pullup(req->input_buffer, -1), copy_len);
-    buf[post_size] = '\0';
-    // printf("LINE %d: Post message:%s\n", __LINE__, buf);
-    if (buf == NULL)
+    struct engine_conn *conn = (struct engine_conn *)req->cb_arg;
+    if (conn == NULL) // 连接已关闭
     {
-        printf("LINE %d: %s\n", __LINE__, "Get a null msg.");
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        evhttp_request_free(req);
         return;
     }
-    else
-    {
-        // 可以使用json库解析需要的数据
-        printf("LINE %d: Request data:%s\n", __LINE__, buf);
-        execute_cgi(req, decode_uri, buf, post_size);
-    }
+    size_t len = body ? evbuffer_get_length(body) : 0;
+    engine_write_head(conn, req, code, reason, len);
+    if (len && engine_needs_body(req, code))
+        evbuffer_add_buffer(bufferevent_get_output(conn->bev), body);
+    else if (len)
+        evbuffer_drain(body, len);
+    engine_response_done(conn);
 }
 
-/* 文件上传 */
-void file_upload(struct evhttp_request *req, void *arg)
+void engine_send_error(struct evhttp_request *req, int code, const char *reason)
 {
-    // 处理post请求数据
-    size_t post_size = evbuffer_get_length(req->input_buffer); //获取数据长度
-    if (post_size <= 0)
+    if (!engine_request(req))
     {
-        printf("LINE %d: %s\n", __LINE__, "Post message is empty");
-        evhttp_send_error(req, HTTP_BADREQUEST, "Bad Request: Message is empty!");
+        (evhttp_send_error)(req, code, reason);
         return;
     }
-    printf("LINE %d: Get a upload file, len:%d\n", __LINE__, post_size);
+    struct evbuffer *body = evbuffer_new();
+    reason = reason ? reason : http_status_phrase(code);
+    evbuffer_add_printf(body, ENGINE_ERR_FORMAT, code, reason, reason);
+    evhttp_add_header(req->output_headers, "Connection", "close");
+    engine_send_reply(req, code, reason, body);
+    evbuffer_free(body);
+}
 
-    // 读buf & 写入文件
-    size_t copy_len = post_size > MAX_BUF_SIZE ? MAX_BUF_SIZE : post_size;
-    char buf[MAX_BUF_SIZE] = {0};
-    memcpy(buf, evbuffer_pullup(req->input_buffer, -1), copy_len);
-    buf[copy_len] = '\0';
-    // printf("LINE %d: Post message:%s\n", __LINE__, buf);
-    if (buf == NULL)
+void engine_send_reply_start(struct evhttp_request *req, int code, const char *reason)
+{
+    if (!engine_request(req))
     {
-        printf("LINE %d: %s\n", __LINE__, "Get a null msg.");
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        (evhttp_send_reply_start)(req, code, reason);
         return;
     }
-    else
-    {
-        // 获取文件名
-        char filename[512] = {'\0'};
-        int fn_i = strlen(buf) - strlen(strstr(buf, "filename=\""));
-        for (int i = 0; buf[fn_i + 10 + i] != '"'; i++)
-        {
-            filename[i] = buf[fn_i + 10 + i];
-        }
-        printf("LINE %d: %s\n", __LINE__, filename);
-
-        // 处理数据
-        int head_len = 46, tail_len = 44, data_i = 0;
-        char *token = strtok(buf, "\n");
-
-        for (int i = 0; i < 3; i++)
-        {
-            token = strtok(NULL, "\n");
-            head_len += strlen(token);
-        }
-        for (int j = head_len - 1; data_i < post_size - head_len - tail_len; j++, data_i++)
-        {
-            buf[data_i] = buf[j];
-        }
-        buf[data_i] = '\0';
+    req->response_code = code;
+    if (req->cb_arg)
+        engine_write_head((struct engine_conn *)req->cb_arg, req, code, reason, -1);
+}
 
-        printf("LINE %d: Request data:%s\n", __LINE__, buf);
-        char path[512];
-        sprintf(path, "upload/%s", filename);
-        printf("LINE %d: %s\n", __LINE__, path);
-        FILE *fp = fopen(path, "w");
-        fwrite(buf, sizeof(char), sizeof(char) * data_i, fp);
-        fclose(fp);
+void engine_send_reply_chunk_with_cb(struct evhttp_request *req, struct evbuffer *body,
+                                     void (*cb)(struct evhttp_connection *, void *), void *arg)
+{
+    if (!engine_request(req))
+    {
+        (evhttp_send_reply_chunk_with_cb)(req, body, cb, arg);
+        return;
     }
-    // 返回数据
-    struct evbuffer *buf_ret = evbuffer_new();
-    evbuffer_add_printf(buf_ret, "upload successful");
-    evhttp_send_reply(req, HTTP_OK, "OK", buf_ret);
+    struct engine_conn *conn = (struct engine_conn *)req->cb_arg;
+    size_t len = evbuffer_get_length(body);
+    if (conn == NULL || len == 0 || !engine_needs_body(req, req->response_code))
+        return;
+    struct evbuffer *out = bufferevent_get_output(conn->bev);
+    if (req->chunked)
+        evbuffer_add_printf(out, "%zx\r\n", len);
+    evbuffer_add_buffer(out, body);
+    if (req->chunked)
+        evbuffer_add(out, "\r\n", 2);
+    conn->write_cb = cb;
+    conn->write_cb_arg = arg;
 }
 
-/* 文件下载 */
-void file_download(struct evhttp_request *req, void *arg)
+void engine_send_reply_chunk(struct evhttp_request *req, struct evbuffer *body)
 {
-    serve_file(req, "doc/test.txt"); // 向客户端返回数据
+    engine_send_reply_chunk_with_cb(req, body, NULL, NULL);
 }
 
-/* 处理动态请求 */
-void execute_cgi(struct evhttp_request *req, char *path, char *query_string, int len)
+void engine_send_reply_end(struct evhttp_request *req)
 {
-    // 处理参数
-    cJSON *qs_json = cJSON_Parse(query_string);
-    if (qs_json == NULL)
-    {
-        printf("LINE %d: %s\n", __LINE__, "Query json in invalid.");
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
-        return;
-    }
-    char *num_str = cJSON_GetObjectItem(qs_json, "num")->valuestring;
-    char cmd[512] = "/usr/bin/factor ";
-    // 新建fork()线程、管道，处理cgi
-    FILE *fstream = NULL;
-    char buff[1024];
-    memset(buff, 0, sizeof(buff));
-    if ((fstream = popen(strcat(cmd, num_str), "r")) == NULL)
+    if (!engine_request(req))
     {
-        fprintf(stderr, "execute command failed: %s", strerror(errno));
+        (evhttp_send_reply_end)(req);
         return;
     }
-    struct evbuffer *buf_ret = evbuffer_new();
-    if (buf_ret == NULL)
+    struct engine_conn *conn = (struct engine_conn *)req->cb_arg;
+    if (conn == NULL)
     {
-        printf("LINE %d: %s\n", __LINE__, "Reply buf is null.");
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
+        evhttp_request_free(req);
         return;
     }
-    evhttp_send_reply_start(req, HTTP_OK, "Client");
-    while (fgets(buff, sizeof(buff), fstream) != NULL)
-    {
-        evbuffer_add_printf(buf_ret, buff);
-        evhttp_send_reply_chunk(req, buf_ret);
-    }
-    evhttp_send_reply_end(req);
-    evbuffer_free(buf_ret);
-    pclose(fstream);
+    if (req->chunked)
+        evbuffer_add(bufferevent_get_output(conn->bev), "0\r\n\r\n", 5);
+    engine_response_done(conn);
 }
 
-void handle_head_request(struct evhttp_request *req, void *arg)
+/* 获取文件类型 */
+const char *get_content_type(const char *path)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    const char *ext, *ret = strrchr(path, '.');
+    struct table_entry *ent;
+    if (!ret || strchr(ret, '/'))
+        return "application/misc";
+    ext = ret + 1;
+    for (ent = &content_type_table[0]; ent->extension; ++ent)
+    {
+        if (!evutil_ascii_strcasecmp(ent->extension, ext))
+            return ent->content_type;
+    }
+    return "application/misc"; // 未知扩展名
 }
 
-void handle_put_request(struct evhttp_request *req, void *arg)
+/* 解析 CPU 列表，如 "0-3,8,10-11"，返回 CPU 个数 */
+int parse_cpu_list(const char *list, int *cpus, int max)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    int n = 0;
+    while (list && *list && n < max)
+    {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last && n < max; cpu++)
+            cpus[n++] = (int)cpu;
+        if (*end != ',' && *end != '\0')
+            return -1;
+        list = *end ? end + 1 : end;
+    }
+    return n;
 }
 
-void handle_delete_request(struct evhttp_request *req, void *arg)
+/* 把当前线程绑定到 cpu，之后本线程首次访问的内存（事件循环、缓冲区、各线程的缓存）都从该 CPU 所在的 NUMA 节点分配 */
+void pin_thread(const char *name, int cpu)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err)
+    {
+        printf("LINE %d: %s bind to CPU %d failed: %s\n", __LINE__, name, cpu, strerror(err));
+        return;
+    }
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0); // 即使进程以 numactl --interleave 等策略启动
+    unsigned int cur, node;
+    if (getcpu(&cur, &node) == 0)
+        printf("LINE %d: %s running on CPU %u, NUMA node %u\n", __LINE__, name, cur, node);
 }
 
-void handle_options_request(struct evhttp_request *req, void *arg)
+/* 创建监听套接字，reuseport 时同一端口可以有多个套接字，每个事件循环一个 */
+evutil_socket_t listen_socket(int port, int reuseport)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(port);
+    evutil_socket_t fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if ((reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) ||
+        bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    {
+        evutil_closesocket(fd);
+        return -1;
+    }
+    tune_listen_socket(fd);
+    // 实际队列长度不超过 net.core.somaxconn
+    if (listen(fd, env_int("HTTP_BACKLOG", LISTEN_BACKLOG)) < 0)
+    {
+        evutil_closesocket(fd);
+        return -1;
+    }
+    return fd;
 }
 
-void handle_trace_request(struct evhttp_request *req, void *arg)
+/*
+* 监听套接字的 TCP 选项，接受的连接继承 TCP_NODELAY
+* TCP_DEFER_ACCEPT：收到请求数据（或 TLS ClientHello）后才唤醒 accept，只建立连接不发数据的客户端不占用事件循环
+* TCP_FASTOPEN：重复访问的客户端可在 SYN 中携带请求，省去一次往返，需 net.ipv4.tcp_fastopen 包含 2
+*/
+void tune_listen_socket(evutil_socket_t fd)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    int defer = env_int("HTTP_DEFER_ACCEPT", 0), fastopen = env_int("HTTP_FASTOPEN", 0);
+    if (defer > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer)) < 0)
+        printf("LINE %d: TCP_DEFER_ACCEPT failed: %s\n", __LINE__, strerror(errno));
+    if (fastopen > 0)
+    {
+        FILE *fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r");
+        int mode = 0;
+        if (fp && fscanf(fp, "%d", &mode) == 1 && !(mode & 2))
+            printf("LINE %d: net.ipv4.tcp_fastopen=%d does not enable server-side Fast Open\n", __LINE__, mode);
+        if (fp)
+            fclose(fp);
+        if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &fastopen, sizeof(fastopen)) < 0)
+            printf("LINE %d: TCP_FASTOPEN failed: %s\n", __LINE__, strerror(errno));
+    }
+    // 关闭 Nagle：OpenSSL 每个记录单独写出，响应的后几个记录会等待客户端的延迟确认（约 40ms）；文件响应由 TCP_CORK 合并
+    int one = 1;
+    if (env_int("HTTP_TCP_NODELAY", 1))
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 }
 
-void handle_connect_request(struct evhttp_request *req, void *arg)
+/*
+* 在 reuseport 组上挂载 cBPF 程序：取处理该连接数据包的 CPU，选择绑定在该 CPU 上的第一个循环的套接字，
+* 不在列表中的 CPU 按取模分配。组内套接字的序号即 listen() 的先后顺序
+*/
+int attach_steering_bpf(evutil_socket_t fd, const int *cpus, int n)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    struct sock_filter code[2 * LOOP_MAX + 3];
+    int k = 0;
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+    for (int i = 0; i < n; i++)
+    {
+        code[k++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+        code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, i);
+    }
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, n);
+    code[k++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    struct sock_fprog prog = {k, code};
+    return setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
 }
 
-void handle_patch_request(struct evhttp_request *req, void *arg)
+/*
+* 为一种协议创建 n 个监听套接字，n > 1 时使用 SO_REUSEPORT，并按 steering 把连接分给对应 CPU 上的循环：
+*   cpu  每个套接字设置 SO_INCOMING_CPU，内核优先选择与处理数据包的 CPU 相同的套接字（默认）
+*   bpf  挂载 attach_steering_bpf 的程序
+*   off  按四元组哈希分发
+*/
+int listen_workers(struct loop_worker *workers, int n, int port, const char *steering)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    int cpus[LOOP_MAX];
+    for (int i = 0; i < n; i++)
+    {
+        workers[i].fd = listen_socket(port, n > 1);
+        if (workers[i].fd < 0)
+        {
+            printf("LINE %d: Listen on port %d failed: %s\n", __LINE__, port, strerror(errno));
+            return -1;
+        }
+        cpus[i] = workers[i].cpu;
+        if (n > 1 && workers[i].cpu >= 0 && !strcmp(steering, "cpu") &&
+            setsockopt(workers[i].fd, SOL_SOCKET, SO_INCOMING_CPU, &workers[i].cpu, sizeof(int)) < 0)
+            printf("LINE %d: SO_INCOMING_CPU failed: %s\n", __LINE__, strerror(errno));
+    }
+    if (n > 1 && workers[0].cpu >= 0 && !strcmp(steering, "bpf") && attach_steering_bpf(workers[0].fd, cpus, n) < 0)
+        printf("LINE %d: SO_ATTACH_REUSEPORT_CBPF failed: %s\n", __LINE__, strerror(errno));
+    return 0;
 }
 
-void handle_unknown_request(struct evhttp_request *req, void *arg)
+void loop_http_free(struct loop_worker *worker, struct event_base *base)
 {
-    evhttp_send_error(req, HTTP_NOTIMPLEMENTED, NULL);
+    watchdog_unregister();
+    if (worker->engine)
+        engine_free(worker->engine);
+    if (worker->http)
+        evhttp_free(worker->http);
+    worker->engine = NULL;
+    worker->http = NULL;
+    if (loop_uring)
+        uring_free(loop_uring);
+    loop_uring = NULL;
+    event_base_free(base);
 }
 
-/* 处理客户端请求 */
-void accept_request(struct evhttp_request *req, void *arg)
+/* 创建事件循环并在 worker->fd 上接受连接，注册路由；worker->native 时使用内置引擎，否则使用 evhttp */
+struct event_base *loop_http_new(struct loop_worker *worker, struct bufferevent *(*cb)(struct event_base *, void *), void *arg)
 {
-    if (req == NULL)
+    char name[32];
+    snprintf(name, sizeof(name), "%s loop %d", worker->tls ? "HTTPS" : "HTTP", worker->index);
+    pin_thread(name, worker->cpu); // 先绑定 CPU，再分配本循环的状态
+    watchdog_register(name);
+    // 每个线程使用独立的 event_base，event_init() 会改写全局 current_base，线程间存在竞争
+    struct event_base *base = event_base_new();
+    if (base == NULL)
     {
-        printf("LINE %d: %s\n", __LINE__, "Get a null request");
-        evhttp_send_error(req, HTTP_BADREQUEST, NULL);
-        return;
+        printf("LINE %d: %s evbase create failed\n", __LINE__, name);
+        return NULL;
     }
-    switch (evhttp_request_get_command(req)) // 请求类型
+    if (io_uring_enabled && (loop_uring = uring_new(base)) == NULL)
+        printf("LINE %d: %s io_uring unavailable, falling back to epoll\n", __LINE__, name);
+    if (worker->native)
     {
-    case EVHTTP_REQ_GET:
-        handle_get_request(req, arg);
-        break;
-    case EVHTTP_REQ_POST:
-        handle_post_request(req, arg);
-        break;
-    case EVHTTP_REQ_HEAD:
-        handle_head_request(req, arg);
-        break;
-    case EVHTTP_REQ_PUT:
-        handle_put_request(req, arg);
-        break;
-    case EVHTTP_REQ_DELETE:
-        handle_delete_request(req, arg);
-        break;
-    case EVHTTP_REQ_OPTIONS:
-        handle_options_request(req, arg);
-        break;
-    case EVHTTP_REQ_TRACE:
-        handle_trace_request(req, arg);
-        break;
-    case EVHTTP_REQ_CONNECT:
-        handle_connect_request(req, arg);
-        break;
-    case EVHTTP_REQ_PATCH:
-        handle_patch_request(req, arg);
-        break;
-    default:
-        handle_unknown_request(req, arg);
-        break;
+        worker->engine = engine_new(base, worker->fd, cb, arg); // 已 listen()
+        if (worker->engine == NULL)
+        {
+            printf("LINE %d: %s engine create failed\n", __LINE__, name);
+            loop_http_free(worker, base);
+            return NULL;
+        }
+        for (struct route_entry *r = route_table; r->path; r++)
+        {
+            if (!worker->tls || r->tls)
+                engine_set_cb(worker->engine, r->path, r->cb, NULL);
+        }
+        engine_set_allowed_methods(worker->engine, SERVER_METHODS);
+        if (worker->tls && crypto_pool)
+            engine_set_tls_offload(worker->engine, (SSL_CTX *)arg);
+        engine_set_gencb(worker->engine, accept_request, NULL); // 设置事件处理函数
+        return base;
+    }
+    worker->http = evhttp_new(base);
+    struct evconnlistener *listener = evconnlistener_new(base, NULL, NULL, LEV_OPT_CLOSE_ON_FREE, 0, worker->fd); // 已 listen()
+    if (worker->http == NULL || listener == NULL || evhttp_bind_listener(worker->http, listener) == NULL)
+    {
+        printf("LINE %d: %s evhttp create failed\n", __LINE__, name);
+        return NULL;
     }
+    evhttp_set_bevcb(worker->http, cb, arg);
+    for (struct route_entry *r = route_table; r->path; r++)
+    {
+        if (!worker->tls || r->tls)
+            evhttp_set_cb(worker->http, r->path, r->cb, NULL);
+    }
+    evhttp_set_allowed_methods(worker->http, SERVER_METHODS);
+    evhttp_set_gencb(worker->http, accept_request, NULL); // 设置事件处理函数
+    return base;
 }
 
-/* 获取文件类型 */
-char *get_content_type(char *path)
+/* 启动HTTP线程 */
+void *http_startup(void *arg)
 {
-    char *ext, *ret = strrchr(path, '.');
-    struct table_entry *ent;
-    if (!ret || strchr(ret, '/'))
-        return "application/misc";
-    ext = ret + 1;
-    for (ent = &content_type_table[0]; ent->extension; ++ent)
+    struct loop_worker *worker = (struct loop_worker *)arg;
+    struct event_base *evbase = loop_http_new(worker, bevcb_plain, NULL); // 启动http服务端
+    if (evbase == NULL)
+        return NULL;
+    proxy_init(evbase);
+    struct event *gc_ev = NULL;
+    if (worker->index == 0) // 上传对象定时清理只需一个进程的一个循环执行，包文件检查每个进程一个
     {
-        if (!evutil_ascii_strcasecmp(ent->extension, ext))
-            return ent->content_type;
+        struct timeval gc_interval = {UPLOAD_GC_INTERVAL, 0};
+        if (process_index == 0)
+        {
+            gc_ev = event_new(evbase, -1, EV_PERSIST, store_gc, evbase);
+            event_add(gc_ev, &gc_interval);
+        }
+        pack_init_loop(evbase);
     }
+    sse_init(evbase);
+    rate_init_loop(evbase);
+    admit_init_loop(evbase);
+    event_base_dispatch(evbase); // 循环监听
+    if (gc_ev)
+        event_free(gc_ev);
+    loop_http_free(worker, evbase);
+    return NULL;
 }
 
-/* 启动HTTP线程 */
-void http_startup(void)
+/* 启动HTTPS线程 */
+void *https_startup(void *arg)
 {
-    struct event_base *evbase = event_init(); // 初始化evbase
+    struct loop_worker *worker = (struct loop_worker *)arg;
+    struct event_base *evbase = loop_http_new(worker, bevcb, worker->ssl_ctx); // magic
     if (evbase == NULL)
+        return NULL;
+    proxy_init(evbase);
+    sse_init(evbase);
+    rate_init_loop(evbase);
+    admit_init_loop(evbase);
+    event_base_dispatch(evbase); // 循环监听
+    loop_http_free(worker, evbase);
+    return NULL;
+}
+
+#ifndef SERVER_NO_MAIN
+/* 创建后台线程池与各事件循环线程，直到全部循环退出；线程不能跨越 fork，预派生模式下在每个工作进程中调用 */
+static int serve_loops(struct loop_worker *workers, int nloops, SSL_CTX *ctx)
+{
+    io_pool = work_pool_new(env_int("HTTP_IO_THREADS", IO_THREADS));
+    compute_pool = work_pool_new(env_int("HTTP_COMPUTE_THREADS", sysconf(_SC_NPROCESSORS_ONLN)));
+    int nhandshake = env_int("HTTPS_HANDSHAKE_THREADS", 0);
+    if (nhandshake > 0 && ctx)
+        crypto_pool = work_pool_new(nhandshake);
+    watchdog_start();
+
+    // 创建http线程和https线程
+    for (int i = 0; i < 2 * nloops; i++)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTP evbase create failed");
-        return;
+        if (workers[i].tls && ctx == NULL)
+            continue;
+        workers[i].ssl_ctx = ctx;
+        if (pthread_create(&workers[i].thread, NULL, workers[i].tls ? https_startup : http_startup, &workers[i]) != 0)
+        {
+            printf("LINE %d: %s pthread_create failed\n", __LINE__, workers[i].tls ? "HTTPS" : "HTTP");
+            return 1;
+        }
+    }
+    for (int i = 0; i < 2 * nloops; i++)
+    {
+        if (workers[i].thread)
+            pthread_join(workers[i].thread, NULL);
     }
+    return 0;
+}
+
+static volatile sig_atomic_t master_stop;
+
+static void master_signal(int sig)
+{
+    master_stop = sig;
+}
 
-    char *http_addr = "0.0.0.0";
-    struct evhttp *http_server = evhttp_start(http_addr, HTTP_SERVER_PORT); // 启动http服务端
-    if (http_server == NULL)
+/* 派生第 index 个工作进程，子进程运行事件循环直到退出 */
+static pid_t spawn_worker(int index, struct loop_worker *workers, int nloops, SSL_CTX *ctx)
+{
+    fflush(stdout); // 缓冲区中尚未写出的日志否则会在子进程中再写一次
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid != 0)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTP evhttp create failed");
-        return;
+        if (pid < 0)
+            printf("LINE %d: fork failed: %s\n", __LINE__, strerror(errno));
+        return pid;
     }
-    evhttp_set_cb(http_server, "/upload.do", file_upload, NULL);
-    evhttp_set_cb(http_server, "/download.do", file_download, NULL);
-    evhttp_set_gencb(http_server, accept_request, NULL); // 设置事件处理函数
-    event_dispatch();                                    // 循环监听
-    evhttp_free(http_server);
-    return;
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM); // 主进程退出时工作进程随之退出
+    if (getppid() != master)
+        _exit(0);
+    stats_start(index);
+    _exit(serve_loops(workers, nloops, ctx));
 }
 
-/* 启动HTTPS线程 */
-void https_startup(void)
+/*
+* 预派生模式的主进程：监听套接字、SSL_CTX 与共享统计区已在 fork 之前创建，由工作进程继承，
+* 各工作进程在同一组套接字上接受连接。主进程只负责等待工作进程退出并重新派生，
+* 一个工作进程崩溃只断开它自己的连接，其余进程继续服务；收到 SIGTERM/SIGINT 时通知全部工作进程退出
+*/
+static int master_run(int nworkers, struct loop_worker *workers, int nloops, SSL_CTX *ctx)
 {
-    SSL_CTX *ctx = evssl_init(); // 初始化ssl
-    if (ctx == NULL)
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = master_signal; // 不设置 SA_RESTART，waitpid 被信号打断后检查 master_stop
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    for (int i = 0; i < nworkers; i++)
     {
-        printf("LINE %d: %s\n", __LINE__, "SSL init failed");
-        return;
+        if (spawn_worker(i, workers, nloops, ctx) < 0)
+            return 1;
     }
-    /*
-    * event_base_new()
-    * event_init() 是否多线程共享
-    */
-    struct event_base *evbase = event_init(); // 创建HTTPS线程的event_base
-    if (evbase == NULL)
+    printf("LINE %d: Master %d started %d workers\n", __LINE__, (int)getpid(), nworkers);
+    while (!master_stop)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTPS evbase create failed");
-        return;
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0)
+        {
+            if (errno != EINTR)
+                break;
+            continue;
+        }
+        int i = 0;
+        while (i < nworkers && stats_table[i].pid != pid)
+            i++;
+        if (i == nworkers)
+            continue;
+        struct worker_stats *w = &stats_table[i];
+        __atomic_store_n(&w->pid, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->last_status, status, __ATOMIC_RELAXED);
+        __atomic_store_n(&w->rate_active, 0, __ATOMIC_RELAXED); // 它的限速组已随进程消失
+        if (WIFSIGNALED(status))
+            printf("LINE %d: Worker %d (pid %d) killed by signal %d (%s)\n", __LINE__, i, (int)pid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        else
+            printf("LINE %d: Worker %d (pid %d) exited with status %d\n", __LINE__, i, (int)pid, WEXITSTATUS(status));
+        if (time(NULL) - w->started < WORKER_MIN_UPTIME)
+            sleep(WORKER_MIN_UPTIME);
+        if (master_stop)
+            break;
+        __atomic_fetch_add(&w->restarts, 1, __ATOMIC_RELAXED);
+        spawn_worker(i, workers, nloops, ctx);
     }
-
-    char *https_addr = "0.0.0.0";
-    struct evhttp *https_server = evhttp_start(https_addr, HTTPS_SERVER_PORT); // 创建evhttp以处理请求
-    if (https_server == NULL)
+    for (int i = 0; i < nworkers; i++)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTPS evhttp create failed");
-        return;
+        if (stats_table[i].pid > 0)
+            kill(stats_table[i].pid, SIGTERM);
     }
-    evhttp_set_bevcb(https_server, bevcb, ctx); // magic
-
-    evhttp_set_gencb(https_server, accept_request, NULL); // 设置事件处理函数
-    event_dispatch();                                     // 循环监听
-    evhttp_free(https_server);
-    SSL_CTX_free(ctx);
-    return;
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+        ;
+    printf("LINE %d: Master %d exiting on signal %d\n", __LINE__, (int)getpid(), (int)master_stop);
+    return 0;
 }
 
 int main()
 {
-    pthread_t thread_http, thread_https;
-    // 创建http线程和https线程
-    if (pthread_create(&thread_http, NULL, http_startup, NULL) != 0)
+    static struct loop_worker workers[2 * LOOP_MAX]; // 先 HTTP 后 HTTPS
+    signal(SIGPIPE, SIG_IGN); // 客户端提前断开时写socket不应终止进程
+    evthread_use_pthreads();  // 工作线程向事件循环投递完成回调
+    struct rlimit rl;         // 每个连接（包括 SSE 订阅者）占用一个fd，软限制提高到硬限制
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTP pthread_create failed");
-        return;
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
-    if (pthread_create(&thread_https, NULL, https_startup, NULL) != 0)
+    trace_init();
+    rate_init();
+    admit_init();
+    watchdog_init();
+    pack_init();
+    int nworkers = env_int("HTTP_WORKERS", 0); // 0 为单进程
+    nworkers = nworkers < 0 ? 0 : nworkers > WORKERS_MAX ? WORKERS_MAX : nworkers;
+    stats_init(nworkers);
+
+    // 每种协议的事件循环数及其绑定的 CPU
+    int nloops = env_int("HTTP_LOOPS", 1);
+    nloops = nloops < 1 ? 1 : nloops > LOOP_MAX ? LOOP_MAX : nloops;
+    int cpus[2 * LOOP_MAX];
+    int ncpus = parse_cpu_list(env_str("HTTP_CPUS", NULL), cpus, 2 * LOOP_MAX);
+    if (ncpus < 0)
     {
-        printf("LINE %d: %s\n", __LINE__, "HTTPS pthread_create failed");
-        return;
+        printf("LINE %d: %s\n", __LINE__, "Invalid HTTP_CPUS, expected a list like 0-3,8");
+        ncpus = 0;
     }
-    while (1)
+    int native = 0;
+    for (int i = 0; i < 2 * nloops; i++)
     {
+        workers[i].index = i % nloops;
+        workers[i].tls = i >= nloops;
+        workers[i].cpu = ncpus ? cpus[i % ncpus] : -1;
+        workers[i].native = !strcmp(env_str(workers[i].tls ? "HTTPS_ENGINE" : "HTTP_ENGINE", "evhttp"), "native");
+        native |= workers[i].native;
     }
-    return 0;
-}
\ No newline at end of file
+    if (native)
+        engine_init();
+    const char *steering = env_str("HTTP_STEERING", "cpu");
+    tcp_cork_enabled = env_int("HTTP_TCP_CORK", 1);
+    io_uring_enabled = !strcmp(env_str("HTTP_IO_BACKEND", "epoll"), "uring");
+    if (listen_workers(workers, nloops, env_int("HTTP_PORT", HTTP_SERVER_PORT), steering) < 0)
+        return 1;
+    SSL_CTX *ctx = evssl_init(); // 初始化ssl，各 HTTPS 循环共用
+    if (ctx == NULL)
+        printf("LINE %d: %s\n", __LINE__, "SSL init failed");
+    else if (listen_workers(workers + nloops, nloops, env_int("HTTPS_PORT", HTTPS_SERVER_PORT), steering) < 0)
+        return 1;
+
+    int ret;
+    if (nworkers && stats_table)
+        ret = master_run(nworkers, workers, nloops, ctx);
+    else
+    {
+        stats_start(0);
+        ret = serve_loops(workers, nloops, ctx);
+    }
+    if (ctx)
+        SSL_CTX_free(ctx);
+    return ret;
+}
+#endif
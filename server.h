@@ -0,0 +1,486 @@
+/*
+* 服务器公共声明
+* server.c 以 -DSERVER_NO_MAIN 编译时不含 main()，可作为库链接到基准测试等程序
+*/
+#ifndef SERVER_H
+#define SERVER_H
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <evhttp.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/queue.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/file.h>
+#include <execinfo.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/filter.h>
+#include <linux/mempolicy.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/evp.h>
+
+#include "event2/event.h"
+#include "event2/buffer.h"
+#include "event2/bufferevent.h"
+#include "event2/bufferevent_compat.h"
+#include "event2/util.h"
+#include "event2/listener.h"
+#include "event2/bufferevent_ssl.h"
+#include "event2/thread.h"
+
+#define SERVER_METHODS (EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_HEAD | EVHTTP_REQ_PUT | EVHTTP_REQ_DELETE | EVHTTP_REQ_OPTIONS | EVHTTP_REQ_PATCH)
+#define WEB_PATH "www"
+#define SERVER_CRT "server.crt"
+#define SERVER_KEY "server.key"
+#define HTTP_SERVER_PORT 8000
+#define HTTPS_SERVER_PORT 4430
+#define MAX_BUF_SIZE 1024
+#define LISTEN_BACKLOG 128 // 与 evhttp_bind_socket 相同
+#define LOOP_MAX 32        // 每种协议的事件循环数上限（SSE_MAX_HUBS 需容纳两种协议的全部循环）
+#define MMAP_WINDOW_SIZE (4 << 20) // HTTPS 静态文件每次映射的窗口大小
+#define TLS_CHUNK_SIZE (16 * 1024) // HTTPS 分块大小，与 TLS 记录最大长度一致
+#define STREAM_HIGH_WATERMARK (256 * 1024) // 流式响应排入输出缓冲区的数据上限，超过后暂停填充
+#define STREAM_LOW_WATERMARK (64 * 1024)   // 输出缓冲区降到该值以下时继续填充
+
+#define PROXY_POOL_SIZE 8       // 每个上游服务器的持久连接数
+#define PROXY_TIMEOUT 30        // 上游请求超时(s)
+#define PROXY_HEALTH_INTERVAL 5 // 健康检查间隔(s)
+#define PROXY_MAX_FAILS 3       // 连续失败达到该次数后摘除上游
+
+#define UPLOAD_DIR "upload"
+#define UPLOAD_OBJECTS_DIR "upload/.objects" // 内容寻址对象目录
+#define UPLOAD_GC_INTERVAL 600                // 清理无引用对象的间隔(s)
+#define UPLOAD_RESUMABLE_DIR "upload/.uploads" // 可续传上传的状态目录
+#define RESUMABLE_PREFIX "/files/"
+#define RESUMABLE_EXPIRE 86400                // 可续传上传无进展的保留时间(s)
+#define RESUMABLE_MAX_MB 16384                // 可续传上传的最大长度(MB)
+#define IO_THREADS 4                          // 磁盘IO线程数
+
+#define DOWNLOAD_DIR "doc"          // /download.do?dir= 打包下载的根目录
+#define ZIP_CHUNK (64 * 1024)       // 每次读入压缩的文件数据量
+#define ZIP_MAX_DEPTH 16            // 目录嵌套层数上限
+#define ZIP_MAX_ENTRIES (1 << 20)   // 条目数上限，中央目录在发送完成前保存在内存中
+
+#define JSON_MAX_DEPTH 64  // 嵌套层数上限
+#define JSON_KEY_MAX 64     // 顶层键的保存长度
+#define JSON_VALUE_MAX 256  // 回调值的保存长度
+
+#define BATCH_ROUTE "/factor_batch.do" // 批量分解质因数
+#define BATCH_MAX_ITEMS 100000          // 每个请求的数字个数上限
+#define BATCH_TASK_SIZE 64              // 每个计算任务处理的数字个数
+
+#define SSE_DEFAULT_CHANNEL "uploads" // 上传完成通知的频道
+#define SSE_CHANNEL_MAX 32             // 频道名长度上限
+#define SSE_MAX_HUBS 64                // 事件循环数量上限
+#define SSE_HISTORY 64                 // 保留的最近事件数，供断线重连补发
+#define SSE_HEARTBEAT 15               // 心跳间隔(s)
+#define SSE_RETRY_MS 3000              // 建议客户端的重连间隔(ms)
+
+#define TRACE_SLOW_MS 1000 // 默认慢请求阈值(ms)，HTTP_SLOW_MS=0 关闭
+
+#define ADMIT_TICK_MS 50        // 测量事件循环延迟的定时器间隔(ms)
+#define ADMIT_LAG_MS 100        // 默认延迟阈值(ms)：超过后动态请求返回 503，HTTP_SHED_LAG_MS=0 关闭
+#define ADMIT_STATIC_FACTOR 4   // 静态请求的延迟阈值为动态阈值的倍数
+#define ADMIT_QUEUE 256         // 默认排队深度阈值：本循环运行中的 CGI 子进程与线程池中未开始的任务
+#define ADMIT_RETRY_AFTER 1     // 503 响应的 Retry-After(s)
+
+#define WATCHDOG_MS 1000          // 默认阈值(ms)：事件循环超过该时长没有心跳时报告，HTTP_WATCHDOG_MS=0 关闭
+#define WATCHDOG_POLL_MS 100      // 看门狗线程的检查间隔(ms)
+#define WATCHDOG_FRAMES 32        // 报告的调用栈深度上限
+#define WATCHDOG_REQUEST_MAX 256  // 记录的最近请求（方法与 URI）长度上限
+#define WATCHDOG_BUCKETS 12       // 阻塞时间直方图的桶数：不足 1ms，[1, 2)，[2, 4) ... [1024, ∞) ms
+
+#define WORKERS_MAX 64      // 预派生的工作进程数上限
+#define WORKER_MIN_UPTIME 1 // 工作进程运行不足该时长(s)即退出时，等待同样时长再重启，避免崩溃循环
+
+#define RATE_TICK_MS 100       // 令牌桶补充间隔(ms)
+#define RATE_BURST_MS 200      // 令牌桶容量，按速率折算的时长(ms)
+#define RATE_INTERVAL 1        // 按活跃组重新分配全局上限的间隔(s)
+#define RATE_ROUTE_MAX 16      // 路由限速条数上限
+#define RATE_PREFIX_MAX 64     // 路由前缀长度上限
+#define RATE_GROUP_BUCKETS 256 // 每个线程的限速组哈希桶数量
+
+#define ENGINE_HEAD_MAX (32 * 1024) // 内置引擎的请求行与首部总长上限，切片以 16 位偏移表示
+#define ENGINE_HEADERS_MAX 64       // 每个请求的首部行数上限
+#define ENGINE_ROUTES_MAX 16        // 精确匹配的路由数上限
+#define ENGINE_TIMEOUT 50           // 连接读写超时(s)，与 evhttp 的默认值相同
+
+#define URING_ENTRIES 256    // 每个事件循环的提交队列长度
+#define URING_BUFS 256       // 读取用的注册缓冲区个数（2 的幂）
+#define URING_BUF_SIZE 4096  // 每个注册缓冲区的大小
+#define URING_PIPES 64       // 每个事件循环缓存的 splice 管道数
+
+#define CGI_CACHE_TTL 10              // 动态响应缓存有效期(s)
+#define CGI_CACHE_MAX_BYTES (8 << 20) // 每个线程的缓存容量上限
+#define CGI_CACHE_BUCKETS 1024        // 缓存哈希桶数量
+
+#define PACK_MAGIC "WPAK"      // 静态资源包文件头
+#define PACK_VERSION 1
+#define PACK_HEAD_MAX 1024     // 每个变体预先生成的首部长度上限
+#define PACK_CHECK_INTERVAL 1  // 检查包文件是否被替换的间隔(s)
+
+/* 每个工作进程一项，位于 fork 之前创建的共享映射中；进程重启后沿用同一项，计数继续累加 */
+struct worker_stats
+{
+    pid_t pid;       // 0 表示未运行
+    time_t started;
+    int last_status; // 上次退出时 waitpid 返回的状态，-1 表示未退出过
+    uint64_t restarts;
+    uint64_t connections;
+    uint64_t requests;
+    uint64_t shed; // 过载时以 503 拒绝的请求
+    uint64_t tls_handshakes; // 完成的 TLS 握手，包括会话复用
+    uint64_t tls_resumed;
+    uint64_t blocked[WATCHDOG_BUCKETS]; // 每次心跳时事件循环的延迟分布
+    int rate_active;                    // 本进程上一周期内有发送的限速组数，全局限速按所有进程之和均分
+};
+
+/* 准入控制的请求类别：静态文件开销小，过载时最后拒绝 */
+enum admit_class
+{
+    ADMIT_STATIC,
+    ADMIT_DYNAMIC,
+};
+
+SSL_CTX *evssl_init(void);
+struct bufferevent *bevcb(struct event_base *, void *);
+struct bufferevent *bevcb_plain(struct event_base *, void *);
+uint64_t now_ns(void);
+void trace_init(void);
+void trace_accept(struct bufferevent *);
+void trace_handler_start(struct evhttp_request *);
+void trace_sent(struct bufferevent *, size_t);
+const char *method_name(enum evhttp_cmd_type);
+int parse_rate(const char *, size_t *);
+void rate_init(void);
+void rate_init_loop(struct event_base *);
+void rate_accept(struct bufferevent *);
+void rate_limit_request(struct evhttp_request *);
+void rate_limit_path(struct bufferevent *, const char *);
+void rate_close(struct bufferevent *);
+int rate_set_closecb(struct evhttp_connection *, void (*)(struct evhttp_connection *, void *), void *);
+void rate_limit_handler(struct evhttp_request *, void *);
+extern int process_index;
+void stats_init(int);
+void stats_start(int);
+void stats_accept(void);
+void stats_handshake(int);
+void stats_request(void);
+void stats_handler(struct evhttp_request *, void *);
+void watchdog_init(void);
+void watchdog_start(void);
+void watchdog_register(const char *);
+void watchdog_unregister(void);
+void watchdog_note(const char *, const char *);
+void admit_init(void);
+void admit_init_loop(struct event_base *);
+int admit_check(enum admit_class);
+int admit_request(struct evhttp_request *, enum admit_class);
+uint64_t hash_bytes(const void *, size_t);
+void accept_request(struct evhttp_request *, void *);
+const char *get_content_type(const char *);
+struct loop_worker
+{
+    int index; // 在同一协议的循环中的序号
+    int tls;
+    int cpu; // 绑定的 CPU，-1 表示不绑定
+    int native; // 使用内置 HTTP/1.1 引擎而不是 evhttp
+    evutil_socket_t fd;
+    SSL_CTX *ssl_ctx;
+    pthread_t thread;
+    struct evhttp *http;
+    struct http_engine *engine;
+};
+void *http_startup(void *);
+void *https_startup(void *);
+int parse_cpu_list(const char *, int *, int);
+void pin_thread(const char *, int);
+evutil_socket_t listen_socket(int, int);
+void tune_listen_socket(evutil_socket_t);
+extern int tcp_cork_enabled;
+extern int io_uring_enabled;
+void tcp_cork_response(struct evhttp_request *);
+void tcp_cork_bev(struct bufferevent *);
+void stream_abort(struct evhttp_request *);
+int listen_workers(struct loop_worker *, int, int, const char *);
+void file_upload(struct evhttp_request *, void *);
+void file_download(struct evhttp_request *, void *);
+void zip_download(struct evhttp_request *, const char *, int);
+void serve_file(struct evhttp_request *, char *);
+int request_is_tls(struct evhttp_request *);
+int serve_file_stream(struct evhttp_request *, int, off_t, int);
+void execute_cgi(struct evhttp_request *, const char *, struct evbuffer *);
+int factor_u64(uint64_t, uint64_t *);
+void handle_factor_batch(struct evhttp_request *, struct evbuffer *);
+void handle_get_request(struct evhttp_request *, void *);
+void handle_post_request(struct evhttp_request *, void *);
+void handle_head_request(struct evhttp_request *, void *);
+void handle_put_request(struct evhttp_request *, void *);
+void handle_delete_request(struct evhttp_request *, void *);
+void handle_options_request(struct evhttp_request *, void *);
+void handle_trace_request(struct evhttp_request *, void *);
+void handle_connect_request(struct evhttp_request *, void *);
+void handle_patch_request(struct evhttp_request *, void *);
+void handle_unknown_request(struct evhttp_request *, void *);
+int env_int(const char *, int);
+const char *env_str(const char *, const char *);
+struct proxy_route;
+int proxy_init(struct event_base *);
+struct proxy_route *proxy_match(const char *);
+void handle_proxy_request(struct evhttp_request *, struct proxy_route *);
+int parse_request_uri(const char *, char *, size_t, struct evkeyvalq *);
+int multipart_parse(const char *, size_t, char *, size_t, const char **, size_t *);
+void add_file_headers(struct evkeyvalq *, const char *, const struct stat *);
+
+/*
+* 静态资源包（tools/mkpack 生成）：文件头、按路径哈希开放寻址的槽、条目表，之后是路径、首部与内容
+* 偏移都相对于文件起点，整数为主机字节序；槽中为条目下标加 1，0 表示空槽
+*/
+enum pack_encoding
+{
+    PACK_IDENTITY,
+    PACK_GZIP,
+    PACK_ENCODINGS,
+};
+
+struct pack_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t nentries, nslots; // nslots 为 2 的幂
+    uint64_t size;             // 整个文件的长度
+    uint64_t slots_off, entries_off;
+};
+
+/* 一种编码的响应：首部为若干 "名称: 值\r\n" 行（Content-Type、Content-Length、ETag 等），不含状态行 */
+struct pack_variant
+{
+    uint64_t body_off, body_len;
+    uint64_t head_off, head_len; // head_len 为 0 表示没有该变体
+    char etag[24];               // 带引号，以 NUL 结尾
+};
+
+struct pack_entry
+{
+    uint64_t hash; // hash_bytes(path)
+    uint64_t path_off;
+    uint32_t path_len;
+    uint32_t reserved;
+    struct pack_variant variants[PACK_ENCODINGS];
+};
+
+struct asset_pack;
+void pack_init(void);
+void pack_init_loop(struct event_base *);
+struct asset_pack *pack_load(const char *);
+void pack_unref(struct asset_pack *);
+const struct pack_entry *pack_lookup(const struct asset_pack *, const char *);
+int pack_serve(struct evhttp_request *, const char *);
+void hex_encode(const unsigned char *, size_t, char *);
+struct work_pool;
+extern struct work_pool *io_pool, *compute_pool, *crypto_pool;
+struct work_pool *work_pool_new(int);
+void work_submit(struct work_pool *, struct event_base *, void (*)(void *), void (*)(void *), void *);
+int work_pool_pending(struct work_pool *);
+void fsync_dir(const char *);
+unsigned int digest_evbuffer(struct evbuffer *, const EVP_MD *, unsigned char *);
+int upload_verify_digest(const char *, const char *, struct evbuffer *, const unsigned char *);
+int store_touch(const char *);
+int store_open(const char *, size_t, char *, size_t, int *);
+int store_commit(const char *, const char *, int, int);
+int store_put(struct evbuffer *, const char *);
+int store_link(const char *, const char *);
+void store_gc(evutil_socket_t, short, void *);
+void resumable_remove(const char *);
+void sse_init(struct event_base *);
+void sse_request(struct evhttp_request *, void *);
+void sse_publish(const char *, const char *, const char *, size_t);
+void sse_publish_upload(const char *, off_t, const unsigned char *);
+void handle_resumable_request(struct evhttp_request *);
+
+/* 请求头中的一段，偏移相对于请求行起点，不做拷贝 */
+struct http_slice
+{
+    uint16_t off, len;
+};
+
+/* io_uring 后端中的一个异步操作，提交的每个请求以 user_data 的低 3 位区分步骤 */
+struct uring;
+struct uring_op
+{
+    void (*cb)(struct uring_op *, int step, int res, unsigned flags);
+    void *arg;    // 所属对象；对象先释放时置 NULL，由最后一个完成事件释放
+    int inflight; // 已提交未完成的请求数，多次触发的请求只计一次
+};
+struct uring_pipe
+{
+    int fd[2];
+    int size;
+};
+struct uring *uring_new(struct event_base *);
+void uring_free(struct uring *);
+struct uring_op *uring_op_new(void (*)(struct uring_op *, int, int, unsigned), void *, size_t);
+void uring_op_release(struct uring *, struct uring_op *, int);
+void uring_reserve(struct uring *, unsigned);
+void uring_accept(struct uring *, struct uring_op *, int);
+void uring_recv(struct uring *, struct uring_op *, int);
+void uring_send(struct uring *, struct uring_op *, int, int, const void *, size_t, int);
+void uring_splice(struct uring *, struct uring_op *, int, int, int64_t, int, size_t, int);
+void uring_poll_out(struct uring *, struct uring_op *, int, int);
+void uring_writev(struct uring *, struct uring_op *, int, int, const struct iovec *, int, int64_t, int);
+void uring_fsync(struct uring *, struct uring_op *, int, int);
+char *uring_buf(struct uring *, unsigned);
+void uring_buf_return(struct uring *, unsigned);
+int uring_pipe_get(struct uring *, struct uring_pipe *);
+void uring_pipe_put(struct uring *, struct uring_pipe *, int);
+
+/* http_parse_head 的结果 */
+struct http_head
+{
+    enum evhttp_cmd_type method; // 0 表示不认识的方法
+    struct http_slice target;
+    int major, minor;
+    int nfields;
+    struct http_slice names[ENGINE_HEADERS_MAX], values[ENGINE_HEADERS_MAX];
+    ev_int64_t content_length; // -1 表示未给出
+    unsigned chunked : 1, other_te : 1, close : 1, keep_alive : 1, expect_continue : 1;
+};
+
+int http_parse_head(const char *, size_t, struct http_head *);
+const char *http_status_phrase(int);
+
+/* 内置 HTTP/1.1 引擎，接口与 evhttp 的服务端部分对应 */
+struct http_engine;
+void engine_init(void);
+struct http_engine *engine_new(struct event_base *, evutil_socket_t, struct bufferevent *(*)(struct event_base *, void *), void *);
+void engine_set_cb(struct http_engine *, const char *, void (*)(struct evhttp_request *, void *), void *);
+void engine_set_gencb(struct http_engine *, void (*)(struct evhttp_request *, void *), void *);
+void engine_set_allowed_methods(struct http_engine *, ev_uint16_t);
+void engine_set_tls_offload(struct http_engine *, SSL_CTX *);
+void engine_free(struct http_engine *);
+
+struct evhttp_connection *engine_request_get_connection(struct evhttp_request *);
+const char *engine_request_get_uri(const struct evhttp_request *);
+struct evkeyvalq *engine_request_get_input_headers(struct evhttp_request *);
+struct bufferevent *engine_connection_get_bufferevent(struct evhttp_connection *);
+struct event_base *engine_connection_get_base(struct evhttp_connection *);
+void engine_connection_get_peer(struct evhttp_connection *, char **, ev_uint16_t *);
+void engine_connection_set_closecb(struct evhttp_connection *, void (*)(struct evhttp_connection *, void *), void *);
+void engine_send_error(struct evhttp_request *, int, const char *);
+int engine_connection_native(struct evhttp_connection *);
+void engine_send_reply(struct evhttp_request *, int, const char *, struct evbuffer *);
+void engine_send_reply_start(struct evhttp_request *, int, const char *);
+void engine_send_reply_chunk(struct evhttp_request *, struct evbuffer *);
+void engine_send_reply_chunk_with_cb(struct evhttp_request *, struct evbuffer *, void (*)(struct evhttp_connection *, void *), void *);
+void engine_send_reply_end(struct evhttp_request *);
+
+/*
+* evhttp 适配层：处理函数照常调用下列 evhttp 接口，内置引擎的请求同样是 evhttp_request，
+* 涉及连接与发送的接口由 engine_* 判断请求属于哪一方，evhttp 的请求原样交给 libevent
+* 函数名加括号（如 (evhttp_send_reply)(...)）可绕过替换
+*/
+#define evhttp_request_get_connection(req) engine_request_get_connection(req)
+#define evhttp_request_get_uri(req) engine_request_get_uri(req)
+#define evhttp_request_get_input_headers(req) engine_request_get_input_headers(req)
+#define evhttp_connection_get_bufferevent(evcon) engine_connection_get_bufferevent(evcon)
+#define evhttp_connection_get_base(evcon) engine_connection_get_base(evcon)
+#define evhttp_connection_get_peer(evcon, address, port) engine_connection_get_peer(evcon, address, port)
+#define evhttp_connection_set_closecb(evcon, cb, arg) engine_connection_set_closecb(evcon, cb, arg)
+#define evhttp_send_error(req, code, reason) engine_send_error(req, code, reason)
+#define evhttp_send_reply(req, code, reason, body) engine_send_reply(req, code, reason, body)
+#define evhttp_send_reply_start(req, code, reason) engine_send_reply_start(req, code, reason)
+#define evhttp_send_reply_chunk(req, body) engine_send_reply_chunk(req, body)
+#define evhttp_send_reply_chunk_with_cb(req, body, cb, arg) engine_send_reply_chunk_with_cb(req, body, cb, arg)
+#define evhttp_send_reply_end(req) engine_send_reply_end(req)
+
+enum json_type
+{
+    JSON_NONE,
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOL,
+    JSON_NULL,
+    JSON_OBJECT,
+    JSON_ARRAY
+};
+
+/*
+* 标量值回调：key 为顶层对象的键（顶层数组时为空串），index 为数组元素序号（-1 表示对象成员）
+* 字符串已解码，数字与 true/false/null 为原文；len >= JSON_VALUE_MAX 表示 value 被截断
+* 对象与数组成员只通知类型，value 为空串
+*/
+typedef void (*json_value_cb)(void *, const char *, int, enum json_type, const char *, size_t);
+
+struct json_parser
+{
+    int state, num_state;
+    int depth;
+    unsigned char stack[JSON_MAX_DEPTH]; // '{' 或 '['
+    int index;                           // 当前关心的数组中的元素序号
+    int is_key, in_key, capture;
+    enum json_type type;
+    const char *literal;
+    int lit_pos;
+    unsigned int uchar, surrogate;
+    int uhex;
+    char key[JSON_KEY_MAX];
+    size_t key_len;
+    char value[JSON_VALUE_MAX];
+    size_t value_len;
+    json_value_cb cb;
+    void *arg;
+};
+
+/* json_extract 要取出的字段，value/size 由调用者提供 */
+struct json_field
+{
+    const char *key;
+    char *value;
+    size_t size;
+    size_t len;
+    enum json_type type;
+};
+
+struct json_fields
+{
+    struct json_field *fields;
+    int n;
+};
+
+void json_parser_init(struct json_parser *, json_value_cb, void *);
+int json_parser_feed(struct json_parser *, const char *, size_t);
+int json_parser_finish(struct json_parser *);
+int json_parse_evbuffer(struct evbuffer *, json_value_cb, void *);
+int json_extract(struct evbuffer *, struct json_field *, int);
+void json_add_string(struct evbuffer *, const char *);
+
+#endif
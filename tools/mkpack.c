@@ -0,0 +1,311 @@
+/*
+* 把网站根目录打包成一个静态资源包，服务器以 HTTP_PACK 指定后映射整个文件，按路径哈希查找，不再访问 www
+* 每个文件一个条目：Content-Type（服务器的扩展名表）、Content-Length、ETag（内容哈希）与 Last-Modified 首部预先生成，
+* gzip 压缩后不超过原大小 90% 时另存一个 gzip 变体；含 index.html 的目录另有一个不带 / 的别名条目
+* 以 . 开头的文件与目录不打包
+* 先写临时文件并 fsync，再 rename 到目标，运行中的服务器在下一次检查时换用新包
+*
+* 用法：tools/mkpack www www.pack
+*/
+#include <zlib.h>
+#include <libgen.h>
+#include "../server.h"
+
+#define GZIP_RATIO 0.9 // gzip 变体与原文件的大小比不超过该值时才保存
+
+struct pack_file
+{
+    char key[512];  // 相对于根目录，以 / 开头
+    char path[1024]; // 文件系统路径
+    struct stat st;
+};
+
+static struct pack_file *files;
+static size_t nfiles, files_cap;
+
+/* 数据区：路径、首部与内容依次追加，偏移在写出前加上数据区的起点 */
+static char *blob;
+static size_t blob_len, blob_cap;
+
+static uint64_t blob_add(const void *data, size_t len)
+{
+    if (blob_len + len > blob_cap)
+    {
+        while (blob_len + len > blob_cap)
+            blob_cap = blob_cap ? blob_cap * 2 : (1 << 20);
+        blob = (char *)realloc(blob, blob_cap);
+        if (blob == NULL)
+        {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(blob + blob_len, data, len);
+    blob_len += len;
+    return blob_len - len;
+}
+
+static int scan(const char *dir, const char *prefix)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        fprintf(stderr, "opendir %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    struct dirent *de;
+    int ret = 0;
+    while (ret == 0 && (de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.')
+            continue;
+        if (nfiles == files_cap)
+        {
+            files_cap = files_cap ? files_cap * 2 : 64;
+            files = (struct pack_file *)realloc(files, files_cap * sizeof(struct pack_file));
+        }
+        struct pack_file *f = &files[nfiles];
+        if ((size_t)snprintf(f->path, sizeof(f->path), "%s/%s", dir, de->d_name) >= sizeof(f->path) ||
+            (size_t)snprintf(f->key, sizeof(f->key), "%s/%s", prefix, de->d_name) >= sizeof(f->key))
+        {
+            fprintf(stderr, "path too long: %s/%s\n", dir, de->d_name);
+            ret = -1;
+        }
+        else if (stat(f->path, &f->st) < 0)
+        {
+            fprintf(stderr, "stat %s: %s\n", f->path, strerror(errno));
+            ret = -1;
+        }
+        else if (S_ISDIR(f->st.st_mode))
+        {
+            char sub[1024], subkey[512];
+            strcpy(sub, f->path);
+            strcpy(subkey, f->key);
+            ret = scan(sub, subkey);
+        }
+        else if (S_ISREG(f->st.st_mode))
+            nfiles++;
+    }
+    closedir(d);
+    return ret;
+}
+
+static int cmp_file(const void *a, const void *b)
+{
+    return strcmp(((const struct pack_file *)a)->key, ((const struct pack_file *)b)->key);
+}
+
+static int read_file(const char *path, size_t size, char **out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    char *buf = (char *)malloc(size ? size : 1);
+    size_t got = 0;
+    ssize_t n = 1;
+    while (got < size && (n = read(fd, buf + got, size - got)) > 0)
+        got += n;
+    close(fd);
+    if (got < size)
+    {
+        free(buf);
+        return -1;
+    }
+    *out = buf;
+    return 0;
+}
+
+/* gzip 压缩，结果不超过 limit 时返回其长度，否则返回 0 */
+static size_t gzip_compress(const char *in, size_t len, char **out, size_t limit)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+        return 0;
+    size_t cap = deflateBound(&zs, len);
+    *out = (char *)malloc(cap);
+    zs.next_in = (Bytef *)in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)*out;
+    zs.avail_out = cap;
+    int rc = deflate(&zs, Z_FINISH);
+    size_t n = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END || n > limit)
+    {
+        free(*out);
+        *out = NULL;
+        return 0;
+    }
+    return n;
+}
+
+static void set_variant(struct pack_variant *v, const char *type, const char *date, const char *body, size_t len,
+                        const char *etag, int gzip, int vary)
+{
+    char head[PACK_HEAD_MAX];
+    int n = snprintf(head, sizeof(head), "Content-Type: %s\r\nContent-Length: %zu\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s",
+                     type, len, etag, date, vary ? "Vary: Accept-Encoding\r\n" : "", gzip ? "Content-Encoding: gzip\r\n" : "");
+    v->head_off = blob_add(head, n);
+    v->head_len = n;
+    v->body_off = blob_add(body, len);
+    v->body_len = len;
+    snprintf(v->etag, sizeof(v->etag), "%s", etag);
+}
+
+static int pack_file_entry(const struct pack_file *f, struct pack_entry *e, size_t *saved)
+{
+    char *body, *gz = NULL;
+    if (read_file(f->path, f->st.st_size, &body) < 0)
+    {
+        fprintf(stderr, "read %s: %s\n", f->path, strerror(errno));
+        return -1;
+    }
+    size_t len = f->st.st_size;
+    size_t gz_len = len ? gzip_compress(body, len, &gz, (size_t)(len * GZIP_RATIO)) : 0;
+    uint64_t content = hash_bytes(body, len);
+    char date[64], etag[24], gz_etag[24];
+    struct tm tm;
+    gmtime_r(&f->st.st_mtime, &tm);
+    evutil_date_rfc1123(date, sizeof(date), &tm);
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)content);
+    snprintf(gz_etag, sizeof(gz_etag), "\"%016llx-gz\"", (unsigned long long)content);
+
+    memset(e, 0, sizeof(*e));
+    e->path_len = strlen(f->key);
+    e->path_off = blob_add(f->key, e->path_len);
+    e->hash = hash_bytes(f->key, e->path_len);
+    const char *type = get_content_type(f->key);
+    set_variant(&e->variants[PACK_IDENTITY], type, date, body, len, etag, 0, gz_len > 0);
+    if (gz_len)
+    {
+        set_variant(&e->variants[PACK_GZIP], type, date, gz, gz_len, gz_etag, 1, 1);
+        *saved += len - gz_len;
+    }
+    free(body);
+    free(gz);
+    return 0;
+}
+
+/* 先写到同一目录的临时文件再 rename，服务器不会映射到写了一半的包 */
+static int write_pack(const char *out, const void *head, size_t head_len)
+{
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", out);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+    {
+        fprintf(stderr, "mkstemp %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    const char *parts[] = {head, blob};
+    size_t lens[] = {head_len, blob_len};
+    int ok = fchmod(fd, 0644) == 0;
+    for (int i = 0; i < 2 && ok; i++)
+    {
+        for (size_t done = 0; ok && done < lens[i];)
+        {
+            ssize_t n = write(fd, parts[i] + done, lens[i] - done);
+            ok = n > 0;
+            done += ok ? n : 0;
+        }
+    }
+    ok = ok && fsync(fd) == 0;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp, out) < 0)
+    {
+        fprintf(stderr, "write %s: %s\n", out, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", out);
+    fsync_dir(dirname(dir));
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s docroot pack\n", argv[0]);
+        return 2;
+    }
+    if (scan(argv[1], "") < 0)
+        return 1;
+    qsort(files, nfiles, sizeof(struct pack_file), cmp_file);
+
+    // 每个文件一个条目，含 index.html 的目录再加一个别名
+    size_t nindex = 0, idx_len = strlen("/index.html");
+    for (size_t i = 0; i < nfiles; i++)
+    {
+        size_t n = strlen(files[i].key);
+        nindex += n > idx_len && !strcmp(files[i].key + n - idx_len, "/index.html");
+    }
+    uint32_t nentries = nfiles + nindex, nslots = 2;
+    while (nslots < 2 * nentries)
+        nslots *= 2;
+    struct pack_entry *entries = (struct pack_entry *)calloc(nentries ? nentries : 1, sizeof(struct pack_entry));
+    uint32_t *slots = (uint32_t *)calloc(nslots, sizeof(uint32_t));
+    size_t total = 0, saved = 0, ngzip = 0;
+    uint32_t k = 0;
+    for (size_t i = 0; i < nfiles; i++)
+    {
+        if (pack_file_entry(&files[i], &entries[k], &saved) < 0)
+            return 1;
+        total += files[i].st.st_size;
+        ngzip += entries[k].variants[PACK_GZIP].head_len > 0;
+        k++;
+        size_t n = strlen(files[i].key);
+        if (n > idx_len && !strcmp(files[i].key + n - idx_len, "/index.html"))
+        {
+            entries[k] = entries[k - 1];
+            entries[k].path_len = n - idx_len;
+            entries[k].path_off = blob_add(files[i].key, entries[k].path_len);
+            entries[k].hash = hash_bytes(files[i].key, entries[k].path_len);
+            k++;
+        }
+    }
+
+    // 文件头、槽、条目表之后是数据区
+    struct pack_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, PACK_MAGIC, sizeof(hdr.magic));
+    hdr.version = PACK_VERSION;
+    hdr.nentries = nentries;
+    hdr.nslots = nslots;
+    hdr.slots_off = sizeof(hdr);
+    hdr.entries_off = (hdr.slots_off + nslots * sizeof(uint32_t) + 7) & ~(uint64_t)7;
+    uint64_t data_off = hdr.entries_off + (uint64_t)nentries * sizeof(struct pack_entry);
+    hdr.size = data_off + blob_len;
+    for (uint32_t i = 0; i < nentries; i++)
+    {
+        struct pack_entry *e = &entries[i];
+        e->path_off += data_off;
+        for (int v = 0; v < PACK_ENCODINGS; v++)
+        {
+            if (e->variants[v].head_len == 0)
+                continue;
+            e->variants[v].head_off += data_off;
+            e->variants[v].body_off += data_off;
+        }
+        uint32_t slot = e->hash & (nslots - 1);
+        while (slots[slot])
+            slot = (slot + 1) & (nslots - 1);
+        slots[slot] = i + 1;
+    }
+    size_t head_len = data_off;
+    char *head = (char *)calloc(1, head_len);
+    memcpy(head, &hdr, sizeof(hdr));
+    memcpy(head + hdr.slots_off, slots, nslots * sizeof(uint32_t));
+    memcpy(head + hdr.entries_off, entries, nentries * sizeof(struct pack_entry));
+    int ret = write_pack(argv[2], head, head_len);
+    free(head);
+    free(slots);
+    free(entries);
+    if (ret < 0)
+        return 1;
+    printf("%s: %zu files (%zu gzip, %zu bytes saved), %u entries, %llu bytes\n", argv[2], nfiles, ngzip, saved, nentries,
+           (unsigned long long)hdr.size);
+    return 0;
+}